@@ -0,0 +1,2215 @@
+/* bench.c -- time the connect engine against loopback listeners
+ *
+ * Usage: bench <mode> [arguments]
+ *   pollers [connects] [padfds]  select() vs epoll with padfds extra open
+ *                                descriptors in the process
+ *   reactor [connects] [inflight] connectbynamestart() races driven from
+ *                                one thread's epoll loop, with the
+ *                                default poller and with select()
+ *   batch [targets] [name]       connectbyname() in turn vs connectbynames()
+ *   dnscache [lookups] [name]    timeoutgetaddrinfo() with and without the
+ *                                name cache
+ *   happyeyeballs [trials]       time to connect to a dual-stack host with
+ *                                one address family blackholed, with and
+ *                                without the dead address table
+ *   pool [checkouts] [name]      connectbyname() per request vs checking
+ *                                sockets out of a connection pool
+ *   stubdns [lookups]            the built-in stub resolver against a
+ *                                fake DNS server on a loopback port, and
+ *                                the CPU used waiting for a late answer
+ *                                over TCP
+ *   streaming [trials]           connectbyname() to names with one
+ *                                address family's answer 300ms late,
+ *                                with and without a resolution delay
+ *   syscalls [connects]          system calls per connectbyaddrinfo() to
+ *                                a loopback listener, and connects/s.
+ *                                Counting needs tracefs and root (or
+ *                                perf_event_paranoid <= 1)
+ *   uring [connects]             connectbyaddrinfo() on select, epoll and
+ *                                io_uring, then accept() against
+ *                                accepturing(), in connects/s and system
+ *                                calls per connect or accept
+ *   sharded [seconds]            accepts/s from listenbyname_sharded()
+ *                                with 1, 2, 4... shards up to the number
+ *                                of CPUs
+ *   acceptor [accepts]           accept() and getpeernametext() against
+ *                                acceptorwait() batches, in accepts/s and
+ *                                system calls per accept
+ *   stats [connects]             connects/s from 1, 2, 4... threads at
+ *                                once and the connectstats() they add up
+ *                                to, with connect time percentiles
+ *   allocs [connects]            heap allocations per connectbyaddrinfo()
+ *                                on each poller, and per connectstep()
+ *                                race with and without an arena
+ *   faults [trials]              p50/p99/p999 time to connect and attempts
+ *                                per connection through loopback
+ *                                listeners which accept, refuse, drop
+ *                                SYNs or accept late, in various orders,
+ *                                by connectbyaddrinfo() and connectbyname()
+ *   resolver [lookups]           timeoutgetaddrinfo() through getaddrinfo_a()
+ *                                vs an in-memory and a hosts file resolver
+ *                                holding 1000 names, with heap allocations
+ *                                per lookup
+ *   numeric [connects]           connects/s and heap allocations to
+ *                                "127.0.0.1" looked up through
+ *                                getaddrinfo_a(), as before the numeric
+ *                                fast path, against timeoutgetaddrinfo()
+ *                                and connectbyname() with it
+ *   coalesce [threads]           threads looking the same slow name up
+ *                                at once through the stub resolver and a
+ *                                fake DNS server, and how many lookups
+ *                                that sends
+ *   simulate [races]             connectsimulate() of each stagger policy
+ *                                against dual-stack scenarios: time to
+ *                                connect and wasted attempts per race
+ */
+
+#define _GNU_SOURCE /* accept4, pthread_setaffinity_np */
+#include "easyv6.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h> /* exit, atoi */
+#include <unistd.h> /* close */
+#include <fcntl.h> /* open */
+#include <string.h> /* memset */
+#include <time.h> /* clock_gettime */
+#include <sys/socket.h>
+#include <sys/resource.h> /* setrlimit */
+#include <sys/epoll.h> /* epoll_wait */
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h> /* poll */
+#include <signal.h> /* kill */
+#include <sys/wait.h> /* waitpid */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/syscall.h> /* SYS_perf_event_open */
+#include <linux/perf_event.h> /* perf_event_attr */
+#include <pthread.h> /* pthread_create */
+#include <sched.h> /* cpu_set_t */
+
+int padfds (int count) {
+/* Open count descriptors so that the sockets under test get large fd
+ * numbers, like they would in a long-running proxy. A negative count only
+ * raises the descriptor limit to make room for -count more. */
+  struct rlimit rl;
+  int i, fd, room = count;
+
+  if (count<0) room = -count;
+  if (getrlimit(RLIMIT_NOFILE,&rl)==0) {
+    if (rl.rlim_cur < (rlim_t) (room+100)) {
+      rl.rlim_cur = (rlim_t) (room+100);
+      if (rl.rlim_max < rl.rlim_cur) rl.rlim_max = rl.rlim_cur;
+      if (setrlimit(RLIMIT_NOFILE,&rl)) {
+        printf ("setrlimit failed: %s\n",strerror(errno));
+        return -1;
+      }
+    }
+  }
+  if (count<0) return 0;
+  for (i=0; i<count; i++) {
+    fd = open("/dev/null",O_RDONLY);
+    if (fd<0) {
+      printf ("padding stopped at %d descriptors: %s\n",i,strerror(errno));
+      return i;
+    }
+  }
+  return count;
+}
+
+int loopbacklistener (
+/* Listen on an ephemeral 127.0.0.1 port. Return the listening socket and
+ * an addrinfo for connecting to it in *address. */
+  struct addrinfo **address
+, int backlog
+) {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  struct addrinfo hints;
+  char port[20];
+  int l;
+
+  l = socket (AF_INET,SOCK_STREAM,0);
+  if (l<0) return -1;
+  memset (&sin,0,sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(l,(struct sockaddr*) &sin,sizeof(sin)) || listen(l,backlog) ||
+      getsockname(l,(struct sockaddr*) &sin,&len)) {
+    close (l);
+    return -1;
+  }
+  snprintf (port,sizeof(port),"%d",(int) ntohs(sin.sin_port));
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  if (getaddrinfo("127.0.0.1",port,&hints,address)) {
+    close (l);
+    return -1;
+  }
+  return l;
+}
+
+void drainlistener (int l) {
+/* accept and close everything queued on non-blocking listener l */
+  int a;
+
+  while ((a=accept(l,NULL,NULL))>=0) close (a);
+}
+
+int familylistener (
+/* Listen on an ephemeral port of the family's loopback address. If
+ * blackhole, fill the accept queue so that further SYNs are dropped. Add
+ * an addrinfo for it to the end of *list. */
+  int family
+, int blackhole
+, struct addrinfo **list
+) {
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  struct addrinfo hints, *res, **tail;
+  char port[20];
+  int l, s;
+
+  l = socket (family,SOCK_STREAM,0);
+  if (l<0) return -1;
+  memset (&ss,0,sizeof(ss));
+  ss.ss_family = family;
+  if (family==AF_INET) 
+    ((struct sockaddr_in*) &ss)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  else ((struct sockaddr_in6*) &ss)->sin6_addr = in6addr_loopback;
+  if (bind(l,(struct sockaddr*) &ss,(family==AF_INET)?
+	sizeof(struct sockaddr_in):sizeof(struct sockaddr_in6)) ||
+      listen(l,blackhole?0:1024) ||
+      getsockname(l,(struct sockaddr*) &ss,&len)) {
+    close (l);
+    return -1;
+  }
+  snprintf (port,sizeof(port),"%d",(int) ntohs((family==AF_INET)?
+	((struct sockaddr_in*) &ss)->sin_port:
+	((struct sockaddr_in6*) &ss)->sin6_port));
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  if (getaddrinfo((family==AF_INET)?"127.0.0.1":"::1",port,&hints,&res)) {
+    close (l);
+    return -1;
+  }
+  if (blackhole) { /* one queued connection that's never accepted */
+    s = socket (family,SOCK_STREAM,0);
+    if ((s<0) || connect(s,res->ai_addr,res->ai_addrlen)) {
+      freeaddrinfo (res);
+      close (l);
+      return -1;
+    }
+  }
+  for (tail=list; *tail; tail=&((*tail)->ai_next)) ;
+  *tail = res;
+  return l;
+}
+
+long long connectloop (
+/* Connect and accept count times. Return elapsed microseconds or -1. */
+  int l
+, const struct addrinfo *address
+, int count
+, struct CONNECTOPTIONS *options
+) {
+  long long start;
+  int i, s, a;
+
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    s = connectbyaddrinfo (address,5000,options);
+    if (s<0) {
+      printf ("connect %d failed: %s\n",i,strerror(errno));
+      return -1;
+    }
+    a = accept (l,NULL,NULL);
+    if (a>=0) close (a);
+    close (s);
+  }
+  return microseconds() - start;
+}
+
+void report (const char *label, int count, long long elapsed) {
+  if (elapsed<=0) elapsed=1;
+  printf ("%-24s %8d ops %12.1f ops/s %9.2f us/op\n",
+	label,count,((double) count)*1000000.0/((double) elapsed),
+	((double) elapsed)/((double) count));
+}
+
+long long cputime (void) {
+/* CPU this process has used, in microseconds */
+  struct timespec ts;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID,&ts);
+  return ((long long) ts.tv_sec)*1000000LL + ts.tv_nsec/1000;
+}
+
+int benchpollers (int argc, char **argv) {
+  struct CONNECTOPTIONS options;
+  struct addrinfo *address;
+  int l, count=20000, pad=10000;
+  long long elapsed;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (argc>1) pad = atoi(argv[1]);
+  if (count<1) count=1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  pad = padfds (pad);
+  printf ("%d extra descriptors open\n",pad);
+
+  memset (&options,0,sizeof(options));
+  options.poller = CONNECTPOLLER_SELECT;
+  elapsed = connectloop (l,address,count,&options);
+  if (elapsed<0) return 1;
+  report ("select",count,elapsed);
+
+  memset (&options,0,sizeof(options));
+  options.poller = CONNECTPOLLER_EPOLL;
+  elapsed = connectloop (l,address,count,&options);
+  if (elapsed<0) return 1;
+  report ("epoll",count,elapsed);
+
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+void reactortrial (
+/* count connectbynamestart() races to port, inflight at a time, stepped
+ * from one epoll loop as connectpollfd() and connectdeadline() say */
+  const char *label
+, const char *port
+, int l /* the listener */
+, int count
+, int inflight
+, int poller /* CONNECTPOLLER_... */
+) {
+  struct CONNECTSTATE **races;
+  struct CONNECTOPTIONS *options;
+  long long *startedat;
+  char *ready;
+  struct epoll_event ev, events[64];
+  int ep, i, n, s, fd, started=0, done=0, failed=0;
+  long long start, wait, now, slowest=0;
+
+  races = (struct CONNECTSTATE**) calloc (inflight,sizeof(*races));
+  options = (struct CONNECTOPTIONS*) calloc (inflight,sizeof(*options));
+  startedat = (long long*) calloc (inflight,sizeof(*startedat));
+  ready = (char*) calloc (inflight,1);
+  ep = epoll_create1 (0);
+  memset (&ev,0,sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = (unsigned) inflight; /* the listener */
+  epoll_ctl (ep,EPOLL_CTL_ADD,l,&ev);
+
+  start = microseconds();
+  while (done<count) {
+    for (i=0; i<inflight; i++) { /* keep inflight races going */
+      if (races[i] || (started>=count)) continue;
+      memset (options+i,0,sizeof(options[i]));
+      options[i].poller = (char) poller;
+      startedat[i] = milliseconds();
+      races[i] = connectbynamestart ("127.0.0.1",port,5000,options+i);
+      started++;
+      if (!races[i]) {
+        failed++;
+        done++;
+        continue;
+      }
+      /* none with select(): connectdeadline() says when to look */
+      fd = connectpollfd (races[i]);
+      ev.data.u32 = (unsigned) i;
+      if (fd>=0) epoll_ctl (ep,EPOLL_CTL_ADD,fd,&ev);
+    }
+    now = milliseconds();
+    wait = 100;
+    for (i=0; i<inflight; i++) 
+      if (races[i] && (connectdeadline(races[i])-now<wait))
+        wait = connectdeadline(races[i])-now;
+    if (wait<0) wait=0;
+    n = epoll_wait (ep,events,64,(int) wait);
+    for (i=0; i<n; i++) {
+      if (events[i].data.u32 == (unsigned) inflight) {
+        drainlistener (l);
+        continue;
+      }
+      ready[events[i].data.u32] = 1;
+    }
+    now = milliseconds();
+    for (i=0; i<inflight; i++) { /* step the ready and the overdue */
+      if (!races[i]) continue;
+      if (!ready[i] && (connectdeadline(races[i])>now)) continue;
+      ready[i] = 0;
+      s = connectstep (races[i]);
+      if ((s<0) && (errno==EINPROGRESS)) continue;
+      if (s<0) failed++;
+      else close (s);
+      if (milliseconds()-startedat[i]>slowest) 
+        slowest = milliseconds()-startedat[i];
+      connectfree (races[i]);
+      races[i] = NULL;
+      done++;
+    }
+  }
+  report (label,count,microseconds()-start);
+  printf ("%d failed, slowest %lld ms, %d in flight at a time on one "
+	"thread\n",failed,slowest,inflight);
+  drainlistener (l);
+  free (ready);
+  free (startedat);
+  free (options);
+  free (races);
+  close (ep);
+}
+
+int benchreactor (int argc, char **argv) {
+  struct addrinfo *address;
+  char port[20];
+  int l, count=20000, inflight=1000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (argc>1) inflight = atoi(argv[1]);
+  if (count<1) count=1;
+  if (inflight<1) inflight=1;
+  if (padfds(-inflight*6)<0) return 1; /* just raise the limit */
+  l = loopbacklistener (&address,4096);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  snprintf (port,sizeof(port),"%d",
+	(int) ntohs(((struct sockaddr_in*) address->ai_addr)->sin_port));
+  fcntl (l,F_SETFL,fcntl(l,F_GETFL,0)|O_NONBLOCK);
+  reactortrial ("reactor",port,l,count,inflight,CONNECTPOLLER_DEFAULT);
+  reactortrial ("reactor, select",port,l,count,inflight,
+	CONNECTPOLLER_SELECT);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+int benchbatch (int argc, char **argv) {
+  struct CONNECTTARGET *targets;
+  struct addrinfo *address;
+  const char *name = "localhost";
+  char port[20];
+  int l, i, s, count=200, connected;
+  long long start;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (argc>1) name = argv[1];
+  if (count<1) count=1;
+  if (padfds(-count*2)<0) return 1;
+  l = loopbacklistener (&address,4096);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  snprintf (port,sizeof(port),"%d",
+	(int) ntohs(((struct sockaddr_in*) address->ai_addr)->sin_port));
+  fcntl (l,F_SETFL,fcntl(l,F_GETFL,0)|O_NONBLOCK);
+
+  start = microseconds();
+  for (connected=i=0; i<count; i++) {
+    s = connectbyname (name,port,5000,NULL);
+    if (s>=0) {
+      connected++;
+      close (s);
+    }
+    drainlistener (l);
+  }
+  report ("connectbyname in turn",count,microseconds()-start);
+  printf ("%d of %d connected\n",connected,count);
+
+  targets = (struct CONNECTTARGET*) calloc (count,sizeof(*targets));
+  for (i=0; i<count; i++) {
+    targets[i].name = name;
+    targets[i].service = port;
+  }
+  start = microseconds();
+  connected = connectbynames (targets,count,5000);
+  report ("connectbynames",count,microseconds()-start);
+  printf ("%d of %d connected\n",connected,count);
+  for (i=0; i<count; i++) {
+    if (targets[i].socket>=0) close (targets[i].socket);
+    if (targets[i].picked) freeaddrinfo (targets[i].picked);
+  }
+  drainlistener (l);
+  free (targets);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+long long lookuploop (const char *name, int count) {
+/* timeoutgetaddrinfo() count times. Return elapsed microseconds or -1. */
+  struct addrinfo hints, *res;
+  long long start, timeout;
+  int i, r;
+
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    timeout = 5000;
+    r = timeoutgetaddrinfo (name,"80",&hints,&res,&timeout);
+    if (r) {
+      printf ("lookup %d failed: %s\n",i,gai_strerror(r));
+      return -1;
+    }
+    freeaddrinfo (res);
+  }
+  return microseconds() - start;
+}
+
+int benchdnscache (int argc, char **argv) {
+  struct DNSCACHESTATS stats;
+  const char *name = "localhost";
+  int count = 2000;
+  long long elapsed;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (argc>1) name = argv[1];
+  if (count<1) count=1;
+  elapsed = lookuploop (name,count);
+  if (elapsed<0) return 1;
+  report ("uncached",count,elapsed);
+  dnscacheconfigure (60000,5000,300000,10000);
+  elapsed = lookuploop (name,count);
+  if (elapsed<0) return 1;
+  report ("cached",count,elapsed);
+  dnscachestats (&stats,0);
+  printf ("hits=%llu misses=%llu stale=%llu negative=%llu entries=%llu\n",
+	stats.hits,stats.misses,stats.stale,stats.negative,stats.entries);
+  dnscacheconfigure (0,0,0,0);
+  return 0;
+}
+
+void eyeballstrial (
+  const char *label
+, struct addrinfo *list
+, int l /* the listener which works */
+, int trials
+, struct CONNECTOPTIONS *model
+) {
+  struct CONNECTOPTIONS options;
+  long long start, total = 0;
+  int i, s, a;
+
+  fcntl (l,F_SETFL,fcntl(l,F_GETFL,0)|O_NONBLOCK);
+  for (i=0; i<trials; i++) {
+    options = *model;
+    start = microseconds();
+    s = connectbyaddrinfo (list,10000,&options);
+    total += microseconds() - start;
+    if (s<0) {
+      printf ("%s: connect failed: %s\n",label,strerror(errno));
+      return;
+    }
+    close (s);
+    while ((a=accept(l,NULL,NULL))>=0) close (a);
+  }
+  printf ("%-40s %8.1f ms to connect\n",label,
+	((double) total)/((double) trials)/1000.0);
+}
+
+int benchhappyeyeballs (int argc, char **argv) {
+  struct CONNECTOPTIONS options;
+  struct addrinfo *list, *warm;
+  int i, l, family, good, trials = 3;
+
+  if (argc>0) trials = atoi(argv[0]);
+  if (trials<1) trials=1;
+  for (family=AF_INET6; ; family=AF_INET) {
+    /* four dead addresses of one family ahead of a good one of the other */
+    list = NULL;
+    for (i=0; i<4; i++) 
+      if (familylistener(family,1,&list)<0) {
+        printf ("can't set up blackholed listeners: %s\n",strerror(errno));
+        return 1;
+      }
+    good = familylistener ((family==AF_INET6)?AF_INET:AF_INET6,0,&list);
+    if (good<0) {
+      printf ("can't listen on loopback: %s\n",strerror(errno));
+      return 1;
+    }
+    printf ("4 blackholed %s addresses ahead of a working %s one:\n",
+	(family==AF_INET6)?"IPv6":"IPv4",(family==AF_INET6)?"IPv4":"IPv6");
+    memset (&options,0,sizeof(options));
+    options.nointerleave = 1;
+    eyeballstrial ("  in getaddrinfo order",list,good,trials,&options);
+    memset (&options,0,sizeof(options));
+    eyeballstrial ("  RFC 8305 interleaved",list,good,trials,&options);
+    options.attemptdelay = 250;
+    eyeballstrial ("  interleaved, 250ms attempt delay",list,good,trials,
+	&options);
+    options.firstfamilycount = 2;
+    eyeballstrial ("  same, first address family count 2",list,good,trials,
+	&options);
+    memset (&options,0,sizeof(options));
+    options.firstwait = 2000LL; /* microseconds: a LAN's worth */
+    eyeballstrial ("  interleaved, 2ms first wait",list,good,trials,
+	&options);
+    /* let the adaptive stagger learn the blackholed family's loopback
+     * round trip time from a listener there which works */
+    warm = NULL;
+    l = familylistener (family,0,&warm);
+    if (l<0) {
+      printf ("can't listen on loopback: %s\n",strerror(errno));
+      return 1;
+    }
+    memset (&options,0,sizeof(options));
+    options.rttmultiple = 3;
+    eyeballstrial ("  (learning the RTT)",warm,l,20,&options);
+    close (l);
+    freeaddrinfo (warm);
+    eyeballstrial ("  interleaved, 3 x RTT adaptive",list,good,trials,
+	&options);
+    /* each race tries one more blackholed address and the dead address
+     * table keeps it out of the races after */
+    connectdeadconfigure (60000LL,600000LL);
+    memset (&options,0,sizeof(options));
+    eyeballstrial ("  (learning the dead addresses)",list,good,4,&options);
+    eyeballstrial ("  interleaved, dead addresses left out",list,good,trials,
+	&options);
+    connectdeadconfigure (0LL,0LL);
+    close (good);
+    freeaddrinfo (list);
+    if (family==AF_INET) break;
+  }
+  return 0;
+}
+
+int benchpool (int argc, char **argv) {
+  struct CONNECTPOOLOPTIONS poolopts;
+  struct CONNECTPOOL *pool;
+  struct addrinfo *address;
+  const char *name = "localhost";
+  char port[20];
+  int l, i, s, a, count=2000, failed=0, accepted=0;
+  long long start;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (argc>1) name = argv[1];
+  if (count<1) count=1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  snprintf (port,sizeof(port),"%d",
+	(int) ntohs(((struct sockaddr_in*) address->ai_addr)->sin_port));
+  fcntl (l,F_SETFL,fcntl(l,F_GETFL,0)|O_NONBLOCK);
+
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    s = connectbyname (name,port,5000,NULL);
+    if (s<0) failed++;
+    else close (s);
+    drainlistener (l);
+  }
+  report ("connectbyname each time",count,microseconds()-start);
+
+  /* the server side keeps pooled connections open, so don't drain */
+  memset (&poolopts,0,sizeof(poolopts));
+  poolopts.maxidle = 4;
+  poolopts.minidle = 2;
+  poolopts.idletimeout = 30000;
+  pool = connectpoolcreate (&poolopts);
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    s = connectpoolget (pool,name,port,5000,NULL);
+    if (s<0) {
+      failed++;
+      continue;
+    }
+    connectpoolput (pool,name,port,s);
+    while ((a=accept(l,NULL,NULL))>=0) accepted++; /* held open */
+  }
+  report ("connection pool",count,microseconds()-start);
+  connectpoolfree (pool);
+  printf ("%d failed, %d connections made for the pool\n",failed,accepted);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+size_t fakednsrecord (
+/* Put an A or AAAA record's type, class, TTL and address (127.0.0.last or
+ * ::last) at out, after its owner name. Returns the new end. */
+  unsigned char *m
+, size_t out
+, int type
+, int last
+) {
+  memcpy (m+out,"\0\0\0\1\0\0\1\x2c\0",9); /* IN, TTL 300 */
+  m[out+1] = (unsigned char) type;
+  out += 9;
+  if (type==1) {
+    m[out++] = 4;
+    m[out++] = 127;
+    m[out++] = 0;
+    m[out++] = 0;
+    m[out++] = (unsigned char) last;
+  } else {
+    m[out++] = 16;
+    memset (m+out,0,15);
+    m[out+15] = (unsigned char) last;
+    out += 16;
+  }
+  return out;
+}
+
+size_t fakednsanswer (
+/* Answer the query in m for the fake server. Names under "test":
+ * big.test has 40 A records, too many for UDP; nx.test doesn't exist;
+ * alias.test is a CNAME for target.test, with a stray address for
+ * other.test, 127.0.0.99 or ::99, in the answer too; everything else is
+ * 127.0.0.1 and ::1. TTL 300. The AAAA answer for slowaaaa.test and the
+ * A answer for slowa.test are to be held back FAKEDNS_SLOW ms, which
+ * *slow says. The A answer for slowtcp.test is truncated over UDP, and
+ * held back over TCP. */
+  unsigned char *m
+, size_t len
+, size_t size
+, int tcp
+, int *slow
+) {
+  unsigned char *p;
+  size_t qend, out;
+  char name[256];
+  int i, type, n, o = 0, owner = 12, extra = 0;
+
+  if ((len<12) || (m[2]&0x80)) return 0;
+  for (p=m+12; (p<m+len) && *p && (o+*p+2<(int) sizeof(name)); p+=*p+1) {
+    memcpy (name+o,p+1,*p);
+    o += *p;
+    name[o++] = '.';
+  }
+  if ((p>=m+len) || *p || (p+5>m+len)) return 0;
+  name[o?o-1:0] = 0;
+  qend = (p-m)+5;
+  type = (p[1]<<8) | p[2];
+  *slow = (!strcmp(name,"slowaaaa.test") && (type==28)) ||
+	(!strcmp(name,"slowa.test") && (type==1)) ||
+	(!strcmp(name,"slowtcp.test") && (type==1) && tcp);
+  m[2] = 0x84 | (m[2]&0x01); /* QR AA RD */
+  m[3] = 0x80;               /* RA */
+  m[6] = m[7] = m[8] = m[9] = m[10] = m[11] = 0;
+  out = qend;
+  if (!strcmp(name,"nx.test")) {
+    m[3] |= 3; /* NXDOMAIN */
+    return out;
+  }
+  n = 1;
+  if (!strcmp(name,"big.test") && (type==1)) {
+    if (!tcp) {
+      m[2] |= 0x02; /* TC */
+      return out;
+    }
+    n = 40;
+  }
+  if (!strcmp(name,"slowtcp.test") && (type==1) && !tcp) {
+    m[2] |= 0x02; /* TC */
+    return out;
+  }
+  if ((type!=1) && (type!=28)) return out;
+  if (!strcmp(name,"alias.test") && (out+40+12+16<=size)) {
+    /* a CNAME for target.test, whose addresses follow */
+    memcpy (m+out,"\xc0\x0c\0\5\0\1\0\0\1\x2c\0\x09",12);
+    out += 12;
+    owner = out;
+    memcpy (m+out,"\6target\xc0\x12",9); /* 18: the question's "test" */
+    out += 9;
+    extra = 1;
+  }
+  for (i=0; (i<n) && (out+12+16<=size); i++) {
+    m[out++] = 0xc0; /* pointer to the owner's name */
+    m[out++] = (unsigned char) owner;
+    out = fakednsrecord (m,out,type,i+1);
+  }
+  if (!strcmp(name,"alias.test") && (out+8+10+16<=size)) {
+    /* and an address for a name nobody asked about */
+    memcpy (m+out,"\5other\xc0\x12",8);
+    out = fakednsrecord (m,out+8,type,99);
+    extra++;
+  }
+  m[7] = (unsigned char) (i+extra); /* ANCOUNT */
+  return out;
+}
+
+#define FAKEDNS_SLOW 300
+#define FAKEDNS_HELD 64
+
+pid_t fakednsserver (
+/* Fork a DNS server listening on UDP and TCP on a 127.0.0.1 port. Fill
+ * in *sin with its address. */
+  struct sockaddr_in *sin
+) {
+  struct sockaddr_in from, heldto[FAKEDNS_HELD];
+  struct pollfd fds[2];
+  socklen_t len = sizeof(*sin);
+  unsigned char m[2+65535], held[FAKEDNS_HELD][512];
+  long long heldtill[FAKEDNS_HELD], now, wait;
+  size_t heldlen[FAKEDNS_HELD];
+  ssize_t n;
+  size_t got, want;
+  int u, t, a, i, slow;
+  pid_t pid;
+
+  u = socket (AF_INET,SOCK_DGRAM,0);
+  t = socket (AF_INET,SOCK_STREAM,0);
+  memset (sin,0,sizeof(*sin));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((u<0) || (t<0) || bind(u,(struct sockaddr*) sin,sizeof(*sin)) ||
+      getsockname(u,(struct sockaddr*) sin,&len) ||
+      bind(t,(struct sockaddr*) sin,sizeof(*sin)) || listen(t,16)) 
+    return -1;
+  pid = fork ();
+  if (pid) {
+    close (u);
+    close (t);
+    return pid;
+  }
+  fds[0].fd = u;
+  fds[1].fd = t;
+  fds[0].events = fds[1].events = POLLIN;
+  memset (heldtill,0,sizeof(heldtill));
+  for (;;) {
+    now = microseconds()/1000LL;
+    for (wait=-1, i=0; i<FAKEDNS_HELD; i++) { /* slow answers due */
+      if (!heldtill[i]) continue;
+      if (heldtill[i]<=now) {
+        sendto (u,held[i],heldlen[i],0,(struct sockaddr*) (heldto+i),
+		sizeof(heldto[i]));
+        heldtill[i] = 0;
+      } else if ((wait<0) || (heldtill[i]-now<wait)) wait = heldtill[i]-now;
+    }
+    if (poll (fds,2,(int) wait)<0) break;
+    if (fds[0].revents) {
+      len = sizeof(from);
+      n = recvfrom (u,m,512,0,(struct sockaddr*) &from,&len);
+      if (n>0) {
+        n = fakednsanswer (m,n,512,0,&slow);
+        for (i=0; slow && (n>0) && (i<FAKEDNS_HELD); i++) {
+          if (heldtill[i]) continue;
+          memcpy (held[i],m,n);
+          heldlen[i] = n;
+          heldto[i] = from;
+          heldtill[i] = now + FAKEDNS_SLOW;
+          n = 0;
+        }
+        if (n>0) sendto (u,m,n,0,(struct sockaddr*) &from,len);
+      }
+    }
+    if (fds[1].revents) {
+      a = accept (t,NULL,NULL);
+      for (got=0, want=2; (a>=0) && (got<want); got+=n) {
+        n = read (a,m+got,want-got);
+        if (n<=0) break;
+        if (got+n==2) want = 2 + ((m[0]<<8) | m[1]);
+      }
+      if ((a>=0) && (got==want) && (got>2)) {
+        n = fakednsanswer (m+2,got-2,sizeof(m)-2,1,&slow);
+        m[0] = (unsigned char) (n>>8);
+        m[1] = (unsigned char) (n&0xff);
+        if (slow) usleep (FAKEDNS_SLOW*1000); /* nothing else runs then */
+        if (n>0) write (a,m,n+2);
+      }
+      if (a>=0) close (a);
+    }
+  }
+  _exit (0);
+}
+
+int benchstubdns (int argc, char **argv) {
+  struct STUBRESOLVEROPTIONS stubopts;
+  struct sockaddr_in server;
+  struct addrinfo hints, *res, *a, *address;
+  struct CONNECTTARGET targets[20];
+  long long start, cpu, timeout;
+  unsigned ttl;
+  char port[20];
+  pid_t pid;
+  int i, r, n, l, s, count = 2000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  pid = fakednsserver (&server);
+  if (pid<0) {
+    printf ("can't start the fake DNS server: %s\n",strerror(errno));
+    return 1;
+  }
+  memset (&stubopts,0,sizeof(stubopts));
+  stubopts.hosts = "";
+  stubopts.nameserver = (struct sockaddr*) &server;
+  stubopts.nameserverlen = sizeof(server);
+  stubopts.retry = 1000; /* longer than the fake server's hold back */
+  stubresolverconfigure (&stubopts);
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    timeout = 5000;
+    r = stubgetaddrinfo ("www.test","80",&hints,&res,&timeout,&ttl);
+    if (r) {
+      printf ("lookup %d failed: %s\n",i,gai_strerror(r));
+      break;
+    }
+    freeaddrinfo (res);
+  }
+  report ("A+AAAA over UDP",i,microseconds()-start);
+
+  timeout = 5000;
+  r = stubgetaddrinfo ("big.test","80",&hints,&res,&timeout,&ttl);
+  for (n=0, a=res; !r && a; a=a->ai_next) n++;
+  printf ("big.test (truncated, then TCP): %s, %d addresses, ttl %u\n",
+	r?gai_strerror(r):"ok",n,ttl);
+  if (!r) freeaddrinfo (res);
+  timeout = 5000;
+  r = stubgetaddrinfo ("nx.test","80",&hints,&res,&timeout,&ttl);
+  printf ("nx.test: %s\n",r?gai_strerror(r):"unexpectedly found");
+  if (!r) freeaddrinfo (res);
+  timeout = 5000;
+  hints.ai_flags = AI_CANONNAME;
+  r = stubgetaddrinfo ("alias.test","80",&hints,&res,&timeout,&ttl);
+  for (n=0, a=res; !r && a; a=a->ai_next) n++;
+  printf ("alias.test (CNAME, and a stray address): %s, %d addresses, %s\n",
+	r?gai_strerror(r):"ok",n,
+	(!r && res->ai_canonname)?res->ai_canonname:"no canonical name");
+  if (!r) freeaddrinfo (res);
+  hints.ai_flags = 0;
+
+  /* waiting for a late answer over TCP should cost no CPU */
+  timeout = 5000;
+  start = microseconds();
+  cpu = cputime();
+  r = stubgetaddrinfo ("slowtcp.test","80",&hints,&res,&timeout,&ttl);
+  printf ("slowtcp.test (TCP answer %dms late): %s, %lldms CPU in %lldms\n",
+	FAKEDNS_SLOW,r?gai_strerror(r):"ok",(cputime()-cpu)/1000LL,
+	(microseconds()-start)/1000LL);
+  if (!r) freeaddrinfo (res);
+
+  /* the connect engine looks names up through it too */
+  l = loopbacklistener (&address,1024);
+  if (l>=0) {
+    snprintf (port,sizeof(port),"%d",
+	(int) ntohs(((struct sockaddr_in*) address->ai_addr)->sin_port));
+    fcntl (l,F_SETFL,fcntl(l,F_GETFL,0)|O_NONBLOCK);
+    memset (targets,0,sizeof(targets));
+    for (i=0; i<20; i++) {
+      targets[i].name = "www.test";
+      targets[i].service = port;
+    }
+    s = connectbyname ("www.test",port,5000,NULL);
+    printf ("connectbyname www.test: %s\n",(s<0)?strerror(errno):"connected");
+    if (s>=0) close (s);
+    start = microseconds();
+    cpu = cputime();
+    s = connectbyname ("slowtcp.test",port,5000,NULL);
+    printf ("connectbyname slowtcp.test: %s, %lldms CPU in %lldms\n",
+	(s<0)?strerror(errno):"connected",(cputime()-cpu)/1000LL,
+	(microseconds()-start)/1000LL);
+    if (s>=0) close (s);
+    n = connectbynames (targets,20,5000);
+    printf ("connectbynames: %d of 20 connected\n",n);
+    for (i=0; i<20; i++) {
+      if (targets[i].socket>=0) close (targets[i].socket);
+      if (targets[i].picked) freeaddrinfo (targets[i].picked);
+    }
+    drainlistener (l);
+    freeaddrinfo (address);
+    close (l);
+  }
+
+  stubresolverconfigure (NULL);
+  kill (pid,SIGTERM);
+  waitpid (pid,NULL,0);
+  return 0;
+}
+
+void streamingtrial (
+  const char *label
+, const char *name
+, const char *port
+, int l /* the listener */
+, int trials
+, long long resolutiondelay
+) {
+  struct CONNECTOPTIONS options;
+  long long start, total = 0;
+  int i, s;
+
+  for (i=0; i<trials; i++) {
+    memset (&options,0,sizeof(options));
+    options.resolutiondelay = resolutiondelay;
+    start = microseconds();
+    s = connectbyname (name,port,5000,&options);
+    total += microseconds() - start;
+    if (s<0) {
+      printf ("%s: connect failed: %s\n",label,strerror(errno));
+      return;
+    }
+    close (s);
+    drainlistener (l);
+  }
+  printf ("%-40s %8.1f ms to connect\n",label,
+	((double) total)/((double) trials)/1000.0);
+}
+
+int benchstreaming (int argc, char **argv) {
+  struct STUBRESOLVEROPTIONS stubopts;
+  struct sockaddr_in server;
+  struct addrinfo *address;
+  char port[20];
+  pid_t pid;
+  int l, trials = 5;
+
+  if (argc>0) trials = atoi(argv[0]);
+  if (trials<1) trials=1;
+  pid = fakednsserver (&server);
+  l = loopbacklistener (&address,1024);
+  if ((pid<0) || (l<0)) {
+    printf ("can't start the fake DNS server: %s\n",strerror(errno));
+    return 1;
+  }
+  memset (&stubopts,0,sizeof(stubopts));
+  stubopts.hosts = "";
+  stubopts.nameserver = (struct sockaddr*) &server;
+  stubopts.nameserverlen = sizeof(server);
+  stubopts.retry = 1000; /* longer than the fake server's hold back */
+  stubresolverconfigure (&stubopts);
+  snprintf (port,sizeof(port),"%d",
+	(int) ntohs(((struct sockaddr_in*) address->ai_addr)->sin_port));
+  fcntl (l,F_SETFL,fcntl(l,F_GETFL,0)|O_NONBLOCK);
+
+  /* only 127.0.0.1 listens: ::1 is refused */
+  printf ("AAAA answer %dms late, listening on 127.0.0.1:\n",FAKEDNS_SLOW);
+  streamingtrial ("  waiting for both families","slowaaaa.test",port,l,
+	trials,0LL);
+  streamingtrial ("  50ms resolution delay","slowaaaa.test",port,l,
+	trials,50LL);
+  streamingtrial ("  no resolution delay","slowaaaa.test",port,l,
+	trials,-1LL);
+  printf ("A answer %dms late, listening on 127.0.0.1:\n",FAKEDNS_SLOW);
+  streamingtrial ("  waiting for both families","slowa.test",port,l,
+	trials,0LL);
+  streamingtrial ("  IPv4 merged into the race","slowa.test",port,l,
+	trials,50LL);
+
+  stubresolverconfigure (NULL);
+  kill (pid,SIGTERM);
+  waitpid (pid,NULL,0);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+int syscallcounter (void) {
+/* A disabled perf counter of this thread's system calls: the
+ * raw_syscalls:sys_enter tracepoint. -1 if that isn't available. */
+  const char *paths[2] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" };
+  struct perf_event_attr attr;
+  FILE *f;
+  int i, id = -1;
+
+  for (i=0; (i<2) && (id<0); i++) {
+    f = fopen (paths[i],"r");
+    if (!f) continue;
+    if (fscanf (f,"%d",&id)!=1) id = -1;
+    fclose (f);
+  }
+  if (id<0) {
+    errno = ENOENT;
+    return -1;
+  }
+  memset (&attr,0,sizeof(attr));
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof(attr);
+  attr.config = (unsigned long long) id;
+  attr.disabled = 1;
+  return (int) syscall (SYS_perf_event_open,&attr,0,-1,-1,0);
+}
+
+void syscalltrial (
+  const char *label
+, int l
+, const struct addrinfo *address
+, int count
+, int counter
+, char poller
+) {
+  struct CONNECTOPTIONS options;
+  unsigned long long calls = 0;
+  long long elapsed;
+  int i, s, a;
+
+  memset (&options,0,sizeof(options));
+  options.poller = poller;
+  if (counter>=0) {
+    ioctl (counter,PERF_EVENT_IOC_RESET,0);
+    for (i=0; i<count; i++) {
+      ioctl (counter,PERF_EVENT_IOC_ENABLE,0);
+      s = connectbyaddrinfo (address,5000,&options);
+      ioctl (counter,PERF_EVENT_IOC_DISABLE,0);
+      if (s<0) {
+        printf ("connect %d failed: %s\n",i,strerror(errno));
+        return;
+      }
+      a = accept (l,NULL,NULL);
+      if (a>=0) close (a);
+      close (s);
+    }
+    if (read (counter,&calls,sizeof(calls))!=sizeof(calls)) calls = 0;
+    calls -= count; /* each DISABLE ioctl counts itself */
+  }
+  elapsed = connectloop (l,address,count,&options);
+  if (elapsed<0) return;
+  report (label,count,elapsed);
+  if (counter>=0) 
+    printf ("%-24s %8.2f system calls per connect\n","",
+	((double) calls)/((double) count));
+}
+
+int benchsyscalls (int argc, char **argv) {
+  struct addrinfo *address;
+  int l, counter, count = 20000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  counter = syscallcounter ();
+  if (counter<0) 
+    printf ("can't count system calls (raw_syscalls:sys_enter): %s\n",
+	strerror(errno));
+  syscalltrial ("epoll",l,address,count,counter,CONNECTPOLLER_EPOLL);
+  syscalltrial ("select",l,address,count,counter,CONNECTPOLLER_SELECT);
+  if (counter>=0) close (counter);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+#define ACCEPTBATCH 256
+
+#define ACCEPT_PLAIN    0 /* accept() */
+#define ACCEPT_PEERNAME 1 /* accept() and getpeernametext() */
+#define ACCEPT_URING    2 /* accepturing() */
+#define ACCEPT_ENGINE   3 /* acceptorwait() with peer addresses */
+
+void accepttrial (
+/* Accept count connections, queued ACCEPTBATCH at a time, the way how
+ * says, with engine the ACCEPTURING or ACCEPTOR if it needs one. Only the
+ * accepting is timed and counted. */
+  const char *label
+, int l
+, const struct addrinfo *address
+, int count
+, int counter
+, int how
+, void *engine
+) {
+  int clients[ACCEPTBATCH], accepted[ACCEPTBATCH];
+  struct ACCEPTED batch[ACCEPTBATCH];
+  char peers[ACCEPTBATCH][64];
+  unsigned long long calls = 0;
+  long long elapsed = 0, start;
+  int i, j, r, n, done, batches = 0;
+
+  for (i=0; i<ACCEPTBATCH; i++) {
+    batch[i].buf = peers[i];
+    batch[i].bytes = sizeof(peers[i]);
+  }
+  if (counter>=0) ioctl (counter,PERF_EVENT_IOC_RESET,0);
+  for (done=0; done<count; done+=n) {
+    n = count-done;
+    if (n>ACCEPTBATCH) n = ACCEPTBATCH;
+    for (i=0; i<n; i++) { /* loopback connects complete at once */
+      clients[i] = socket (AF_INET,SOCK_STREAM,0);
+      if ((clients[i]<0) || 
+          connect(clients[i],address->ai_addr,address->ai_addrlen)) {
+        printf ("connect %d failed: %s\n",done+i,strerror(errno));
+        return;
+      }
+    }
+    start = microseconds();
+    if (counter>=0) ioctl (counter,PERF_EVENT_IOC_ENABLE,0);
+    for (i=0; i<n; ) {
+      if (how==ACCEPT_ENGINE) {
+        r = acceptorwait ((struct ACCEPTOR*) engine,batch,n-i,5000);
+        if (r<=0) break;
+        for (j=0; j<r; j++) accepted[i++] = batch[j].socket;
+        continue;
+      }
+      if (how==ACCEPT_URING) 
+        accepted[i] = accepturing ((struct ACCEPTURING*) engine,5000);
+      else accepted[i] = accept (l,NULL,NULL);
+      if (accepted[i]<0) break;
+      if ((how==ACCEPT_PEERNAME) && 
+          !getpeernametext (accepted[i],peers[i],sizeof(peers[i]))) 
+        break;
+      i++;
+    }
+    if (counter>=0) ioctl (counter,PERF_EVENT_IOC_DISABLE,0);
+    elapsed += microseconds() - start;
+    batches ++;
+    if (i<n) {
+      printf ("accept %d failed: %s\n",done+i,strerror(errno));
+      return;
+    }
+    for (i=0; i<n; i++) {
+      close (accepted[i]);
+      close (clients[i]);
+    }
+  }
+  report (label,count,elapsed);
+  if (counter>=0) {
+    if (read (counter,&calls,sizeof(calls))!=sizeof(calls)) calls = 0;
+    calls -= batches; /* each DISABLE ioctl counts itself */
+    printf ("%-24s %8.2f system calls per accept\n","",
+	((double) calls)/((double) count));
+  }
+}
+
+int benchuring (int argc, char **argv) {
+  struct ACCEPTURING *acceptor;
+  struct addrinfo *address;
+  int l, counter, count = 20000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  counter = syscallcounter ();
+  if (counter<0) 
+    printf ("can't count system calls (raw_syscalls:sys_enter): %s\n",
+	strerror(errno));
+  syscalltrial ("connect, select",l,address,count,counter,
+	CONNECTPOLLER_SELECT);
+  syscalltrial ("connect, epoll",l,address,count,counter,CONNECTPOLLER_EPOLL);
+  syscalltrial ("connect, io_uring",l,address,count,counter,
+	CONNECTPOLLER_URING);
+  accepttrial ("accept()",l,address,count,counter,ACCEPT_PLAIN,NULL);
+  acceptor = accepturingstart (l);
+  if (!acceptor) printf ("accepturingstart: %s\n",strerror(errno));
+  else {
+    accepttrial ("accepturing()",l,address,count,counter,ACCEPT_URING,
+	acceptor);
+    accepturingfree (acceptor);
+  }
+  if (counter>=0) close (counter);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+int benchacceptor (int argc, char **argv) {
+  struct ACCEPTOR *acceptor;
+  struct addrinfo *address;
+  int listeners[2], counter, count = 100000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  listeners[0] = loopbacklistener (&address,1024);
+  listeners[1] = -1;
+  if (listeners[0]<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  counter = syscallcounter ();
+  if (counter<0) 
+    printf ("can't count system calls (raw_syscalls:sys_enter): %s\n",
+	strerror(errno));
+  accepttrial ("accept+getpeernametext",listeners[0],address,count,counter,
+	ACCEPT_PEERNAME,NULL);
+  acceptor = acceptorcreate (listeners);
+  if (!acceptor) printf ("acceptorcreate: %s\n",strerror(errno));
+  else {
+    accepttrial ("acceptorwait()",listeners[0],address,count,counter,
+	ACCEPT_ENGINE,acceptor);
+    acceptorfree (acceptor);
+  }
+  if (counter>=0) close (counter);
+  freeaddrinfo (address);
+  close (listeners[0]);
+  return 0;
+}
+
+struct SHARDWORKER {
+  int cpu;
+  int listener;           /* accept from this, or -1 to connect */
+  struct sockaddr_in6 to; /* where to connect */
+  volatile int *stop;
+  long long count;        /* accepts or connects made */
+  pthread_t thread;
+};
+
+void shardpin (int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu,&set);
+  pthread_setaffinity_np (pthread_self(),sizeof(set),&set);
+}
+
+void *shardacceptor (void *arg) {
+  struct SHARDWORKER *w = (struct SHARDWORKER*) arg;
+  struct pollfd p;
+  int a;
+
+  shardpin (w->cpu);
+  while (!*(w->stop)) {
+    p.fd = w->listener;
+    p.events = POLLIN;
+    if (poll (&p,1,100)<=0) continue;
+    a = accept4 (w->listener,NULL,NULL,SOCK_NONBLOCK);
+    if (a<0) continue;
+    close (a);
+    w->count ++;
+  }
+  return NULL;
+}
+
+void *shardclient (void *arg) {
+  struct SHARDWORKER *w = (struct SHARDWORKER*) arg;
+  struct linger reset = { 1, 0 };
+  int s;
+
+  shardpin (w->cpu);
+  while (!*(w->stop)) {
+    s = socket (AF_INET6,SOCK_STREAM,0);
+    if (s<0) continue;
+    /* close with RST so that millions of connects don't sit in TIME_WAIT
+     * and run the loopback out of ports */
+    setsockopt (s,SOL_SOCKET,SO_LINGER,&reset,sizeof(reset));
+    if (!connect (s,(struct sockaddr*) &(w->to),sizeof(w->to))) w->count ++;
+    close (s);
+  }
+  return NULL;
+}
+
+long long shardtrial (
+/* Accept for seconds on shards listeners, each with an acceptor and a
+ * client pinned to its CPU. Returns the number of accepts */
+  int shards
+, int seconds
+, int flags
+) {
+  struct SHARDWORKER *w;
+  struct sockaddr_in6 sin6;
+  socklen_t len = sizeof(sin6);
+  volatile int stop = 0;
+  long long accepts = 0;
+  int *listeners, i;
+
+  listeners = listenbyname_sharded ("0",SOCK_STREAM,1024,shards,flags);
+  if (!listeners) {
+    printf ("listenbyname_sharded: %s\n",strerror(errno));
+    return -1;
+  }
+  if (getsockname (listeners[0],(struct sockaddr*) &sin6,&len)) return -1;
+  sin6.sin6_addr = in6addr_loopback;
+  w = (struct SHARDWORKER*) calloc (2*shards,sizeof(struct SHARDWORKER));
+  for (i=0; i<2*shards; i++) {
+    w[i].cpu = i%shards;
+    w[i].listener = (i<shards)?listeners[i]:-1;
+    w[i].to = sin6;
+    w[i].stop = &stop;
+    pthread_create (&(w[i].thread),NULL,(i<shards)?shardacceptor:shardclient,
+	&(w[i]));
+  }
+  sleep (seconds);
+  stop = 1;
+  for (i=0; i<2*shards; i++) {
+    pthread_join (w[i].thread,NULL);
+    if (i<shards) accepts += w[i].count;
+  }
+  for (i=0; i<shards; i++) close (listeners[i]);
+  free (listeners);
+  free (w);
+  return accepts;
+}
+
+int benchsharded (int argc, char **argv) {
+  char label[40];
+  long long accepts;
+  int cpus, shards, seconds = 2;
+
+  if (argc>0) seconds = atoi(argv[0]);
+  if (seconds<1) seconds=1;
+  cpus = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (cpus<1) cpus = 1;
+  for (shards=1; ; shards*=2) {
+    if (shards>cpus) shards = cpus;
+    snprintf (label,sizeof(label),"%d shard%s",shards,(shards>1)?"s":"");
+    accepts = shardtrial (shards,seconds,LISTENSHARD_CPU);
+    if (accepts<0) return 1;
+    report (label,(int) accepts,((long long) seconds)*1000000LL);
+    if (shards>=cpus) break;
+  }
+  printf ("one acceptor and one client per shard, pinned to its CPU\n");
+  return 0;
+}
+
+struct STATSWORKER {
+  int count;
+  long long elapsed;
+  pthread_t thread;
+};
+
+void *statsworker (void *arg) {
+  struct STATSWORKER *w = (struct STATSWORKER*) arg;
+  struct addrinfo *address;
+  int l;
+
+  w->elapsed = -1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) return NULL;
+  w->elapsed = connectloop (l,address,w->count,NULL);
+  freeaddrinfo (address);
+  close (l);
+  return NULL;
+}
+
+int benchstats (int argc, char **argv) {
+  struct STATSWORKER w[8];
+  struct CONNECTSTATS stats;
+  char label[40];
+  long long start, elapsed;
+  int i, threads, count = 20000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  for (threads=1; threads<=8; threads*=2) {
+    connectstats (&stats,1);
+    start = microseconds();
+    for (i=0; i<threads; i++) {
+      w[i].count = count/threads;
+      pthread_create (&(w[i].thread),NULL,statsworker,&(w[i]));
+    }
+    for (i=0; i<threads; i++) {
+      pthread_join (w[i].thread,NULL);
+      if (w[i].elapsed<0) {
+        printf ("loopback connects failed\n");
+        return 1;
+      }
+    }
+    elapsed = microseconds() - start;
+    snprintf (label,sizeof(label),"%d thread%s",threads,(threads>1)?"s":"");
+    report (label,threads*(count/threads),elapsed);
+    connectstats (&stats,0);
+    printf ("  races=%llu connected=%llu ipv4=%llu ipv6=%llu attempts=%llu "
+	"timeouts=%llu\n",stats.races,stats.connected,stats.winsipv4,
+	stats.winsipv6,stats.attempts,stats.timeouts);
+    printf ("  connect p50=%lldus p99=%lldus p99.9=%lldus max=%lldus\n",
+	connectstatspercentile(&stats.connect,50.0),
+	connectstatspercentile(&stats.connect,99.0),
+	connectstatspercentile(&stats.connect,99.9),
+	connectstatspercentile(&stats.connect,100.0));
+  }
+  start = microseconds();
+  for (i=0; i<1000; i++) connectstats (&stats,0);
+  report ("connectstats()",1000,microseconds()-start);
+  return 0;
+}
+
+/* Count the heap allocations made while countallocs is set. Defining
+ * malloc() here interposes on the library's calls as well as ours. */
+void *__libc_malloc (size_t);
+void *__libc_calloc (size_t, size_t);
+void *__libc_realloc (void *, size_t);
+void __libc_free (void *);
+volatile int countallocs;
+long long allocations;
+
+void *malloc (size_t bytes) {
+  if (countallocs) allocations++;
+  return __libc_malloc (bytes);
+}
+
+void *calloc (size_t count, size_t bytes) {
+  if (countallocs) allocations++;
+  return __libc_calloc (count,bytes);
+}
+
+void *realloc (void *p, size_t bytes) {
+  if (countallocs) allocations++;
+  return __libc_realloc (p,bytes);
+}
+
+void free (void *p) {
+  __libc_free (p);
+}
+
+int allocsconnect (
+/* connectbyaddrinfo(), or the same as a connectstep() race if stepped */
+  const struct addrinfo *address
+, struct CONNECTOPTIONS *options
+, int stepped
+) {
+  struct CONNECTSTATE *race;
+  struct pollfd pfd;
+  long long wait;
+  int s;
+
+  if (!stepped) return connectbyaddrinfo (address,5000,options);
+  race = connectbyaddrinfostart (address,5000,options);
+  if (!race) return -1;
+  while (((s=connectstep(race))<0) && (errno==EINPROGRESS)) {
+    pfd.fd = connectpollfd (race);
+    pfd.events = POLLIN;
+    wait = connectdeadline (race) - milliseconds();
+    if (wait<0) wait = 0;
+    poll (&pfd,1,(int) wait);
+  }
+  connectfree (race);
+  return s;
+}
+
+void allocstrial (
+  const char *label
+, int l
+, const struct addrinfo *address
+, int count
+, char poller
+, int stepped
+, void *arena
+, size_t arenabytes
+) {
+  struct CONNECTOPTIONS options;
+  long long start;
+  int i, s, a;
+
+  memset (&options,0,sizeof(options));
+  options.poller = poller;
+  options.arena = arena;
+  options.arenabytes = arenabytes;
+  s = allocsconnect (address,&options,stepped); /* warm up per-thread state */
+  if (s>=0) close (s);
+  a = accept (l,NULL,NULL);
+  if (a>=0) close (a);
+  allocations = 0;
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    countallocs = 1;
+    s = allocsconnect (address,&options,stepped);
+    countallocs = 0;
+    if (s<0) {
+      printf ("connect %d failed: %s\n",i,strerror(errno));
+      return;
+    }
+    a = accept (l,NULL,NULL);
+    if (a>=0) close (a);
+    close (s);
+  }
+  report (label,count,microseconds()-start);
+  printf ("%-24s %8.2f allocations per connect\n","",
+	((double) allocations)/((double) count));
+}
+
+int benchallocs (int argc, char **argv) {
+  struct addrinfo *address;
+  char arena[CONNECTARENA_BYTES(4)];
+  int l, count = 20000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  allocstrial ("connect, select",l,address,count,CONNECTPOLLER_SELECT,0,
+	NULL,0);
+  allocstrial ("connect, epoll",l,address,count,CONNECTPOLLER_EPOLL,0,
+	NULL,0);
+  allocstrial ("connect, io_uring",l,address,count,CONNECTPOLLER_URING,0,
+	NULL,0);
+  allocstrial ("connectstep()",l,address,count,CONNECTPOLLER_DEFAULT,1,
+	NULL,0);
+  allocstrial ("connectstep(), arena",l,address,count,
+	CONNECTPOLLER_DEFAULT,1,arena,sizeof(arena));
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+/* Fault injection. Every address is 127.0.0.x on the same port, so the
+ * same addresses serve connectbyaddrinfo() and, through a hosts file fed
+ * to the stub resolver, connectbyname(). A scenario is a string with a
+ * letter for each address in the order they're handed out. */
+#define FAULT_ACCEPT    'a' /* accepts */
+#define FAULT_REFUSE    'r' /* nothing listening: refused */
+#define FAULT_BLACKHOLE 'b' /* accept queue full: SYNs are dropped */
+#define FAULT_SLOW      's' /* queue full until FAULTS_SLOWMS into each
+                             * trial, so it connects on the first SYN
+                             * retransmission, a second in */
+#define FAULTS_SLOWMS 100
+#define FAULTS_PERKIND 3    /* addresses of each kind */
+#define FAULTS_FIRSTWAIT 20000LL /* microseconds: a stagger short enough
+                             * that a trial costs at most a few of them */
+
+struct FAULTADDRESS {
+  char kind;
+  char ip[16];
+  int listener;             /* -1 for FAULT_REFUSE */
+  int filler;               /* connection holding the queue full, or -1 */
+};
+
+struct FAULTADDRESS faultaddresses[4*FAULTS_PERKIND];
+int faultcount = 0;
+const char *faultkinds = "arbs";
+
+int faultfill (
+/* Queue a connection nobody accepts on listener f, so that further SYNs
+ * are dropped */
+  struct FAULTADDRESS *f
+, const char *port
+) {
+  struct sockaddr_in sin;
+
+  memset (&sin,0,sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((unsigned short) atoi(port));
+  inet_pton (AF_INET,f->ip,&(sin.sin_addr));
+  f->filler = socket (AF_INET,SOCK_STREAM,0);
+  if ((f->filler<0) || connect (f->filler,(struct sockaddr*) &sin,sizeof(sin)))
+    return -1;
+  return 0;
+}
+
+int faultsetup (
+/* Listen on 127.0.0.2 and up, all on one port, which goes in port */
+  char *port
+, size_t portlen
+) {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  struct FAULTADDRESS *f;
+  int i, one = 1;
+
+  port[0] = 0;
+  for (i=0; i<4*FAULTS_PERKIND; i++) {
+    f = faultaddresses+i;
+    f->kind = faultkinds[i/FAULTS_PERKIND];
+    snprintf (f->ip,sizeof(f->ip),"127.0.0.%d",i+2);
+    f->listener = f->filler = -1;
+    if (f->kind==FAULT_REFUSE) continue;
+    memset (&sin,0,sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) atoi(port));
+    inet_pton (AF_INET,f->ip,&(sin.sin_addr));
+    f->listener = socket (AF_INET,SOCK_STREAM,0);
+    if (f->listener<0) return -1;
+    setsockopt (f->listener,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+    if (bind (f->listener,(struct sockaddr*) &sin,sizeof(sin)) ||
+        listen (f->listener,(f->kind==FAULT_ACCEPT)?1024:0))
+      return -1;
+    fcntl (f->listener,F_SETFL,fcntl(f->listener,F_GETFL,0)|O_NONBLOCK);
+    if (!port[0]) { /* the first listener picks the port for them all */
+      getsockname (f->listener,(struct sockaddr*) &sin,&len);
+      snprintf (port,portlen,"%d",(int) ntohs(sin.sin_port));
+    }
+    if ((f->kind!=FAULT_ACCEPT) && faultfill (f,port)) return -1;
+  }
+  faultcount = i;
+  return 0;
+}
+
+void *faultslowthread (void *arg) {
+/* Make room in the slow listeners' queues FAULTS_SLOWMS into a trial */
+  struct FAULTADDRESS *f;
+  int i;
+
+  (void) arg;
+  usleep (FAULTS_SLOWMS*1000);
+  for (i=0; i<faultcount; i++) {
+    f = faultaddresses+i;
+    if ((f->kind!=FAULT_SLOW) || (f->filler<0)) continue;
+    close (f->filler);
+    f->filler = -1;
+    drainlistener (f->listener);
+  }
+  return NULL;
+}
+
+void faultreset (
+/* Between trials: clear what connected and fill the slow queues again */
+  const char *port
+) {
+  struct FAULTADDRESS *f;
+  int i;
+
+  for (i=0; i<faultcount; i++) {
+    f = faultaddresses+i;
+    if (f->kind==FAULT_ACCEPT) drainlistener (f->listener);
+    if ((f->kind==FAULT_SLOW) && (f->filler<0)) {
+      drainlistener (f->listener);
+      faultfill (f,port);
+    }
+  }
+}
+
+struct addrinfo *faultlist (
+/* Addresses for scenario: the first unused address of each kind in turn */
+  const char *scenario
+, const char *port
+) {
+  struct addrinfo hints, *list = NULL, *res, **tail = &list;
+  int used[4], i, k;
+
+  memset (used,0,sizeof(used));
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  for (i=0; scenario[i]; i++) {
+    k = (int) (strchr(faultkinds,scenario[i]) - faultkinds);
+    if (getaddrinfo (faultaddresses[k*FAULTS_PERKIND+used[k]++].ip,port,
+	&hints,&res)) break;
+    *tail = res;
+    tail = &(res->ai_next);
+  }
+  return list;
+}
+
+int faulthosts (
+/* Write a hosts file with faultsN.test for scenario N of scenarios */
+  char *path
+, const char **scenarios
+, int count
+, const char *port
+) {
+  struct addrinfo *list, *a;
+  char text[64];
+  FILE *f;
+  int fd, i;
+
+  strcpy (path,"/tmp/benchhostsXXXXXX");
+  fd = mkstemp (path);
+  if ((fd<0) || !(f=fdopen(fd,"w"))) return -1;
+  for (i=0; i<count; i++) {
+    list = faultlist (scenarios[i],port);
+    for (a=list; a; a=a->ai_next) 
+      fprintf (f,"%s faults%d.test\n",addrinfototext(a,text,sizeof(text)),
+	i);
+    freeaddrinfo (list);
+  }
+  fclose (f);
+  return 0;
+}
+
+int comparelonglong (const void *a, const void *b) {
+  long long x = *(const long long*) a, y = *(const long long*) b;
+
+  return (x>y)-(x<y);
+}
+
+double faultpercentile (long long *samples, int n, double percent) {
+/* samples sorted, in microseconds. Returns milliseconds. */
+  double rank = percent*(double) n/100.0;
+  int i = (int) rank;
+
+  if (n<1) return 0.0;
+  if ((double) i<rank) i++; /* nearest rank: round up */
+  i--;
+  if (i<0) i = 0;
+  if (i>=n) i = n-1;
+  return ((double) samples[i])/1000.0;
+}
+
+void faulttrial (
+  const char *scenario
+, int index /* of the scenario, for its name */
+, const char *port
+, int trials
+, int byname
+) {
+  struct CONNECTOPTIONS options;
+  struct CONNECTSTATS stats;
+  struct addrinfo *list;
+  long long *samples, start;
+  pthread_t slow;
+  char name[32];
+  int i, s, n = 0, failed = 0, slowthread;
+
+  samples = (long long*) malloc (sizeof(long long)*trials);
+  if (!samples) return;
+  list = faultlist (scenario,port);
+  snprintf (name,sizeof(name),"faults%d.test",index);
+  slowthread = (strchr(scenario,FAULT_SLOW)!=NULL);
+  connectstats (&stats,1);
+  for (i=0; i<trials; i++) {
+    faultreset (port);
+    if (slowthread && pthread_create (&slow,NULL,faultslowthread,NULL))
+      slowthread = 0;
+    memset (&options,0,sizeof(options));
+    options.firstwait = FAULTS_FIRSTWAIT;
+    start = microseconds();
+    if (byname) s = connectbyname (name,port,5000,&options);
+    else s = connectbyaddrinfo (list,5000,&options);
+    if (s<0) failed++;
+    else {
+      samples[n++] = microseconds() - start;
+      close (s);
+    }
+    if (slowthread) pthread_join (slow,NULL);
+  }
+  connectstats (&stats,0);
+  qsort (samples,n,sizeof(long long),comparelonglong);
+  printf ("%-6s %-18s %8.2f %8.2f %8.2f",scenario,
+	byname?"connectbyname":"connectbyaddrinfo",
+	faultpercentile(samples,n,50.0),faultpercentile(samples,n,99.0),
+	faultpercentile(samples,n,99.9));
+  if (stats.connected) 
+    printf (" %8.2f",((double) stats.attempts)/((double) stats.connected));
+  else printf (" %8s","-");
+  if (failed) printf (" %d failed",failed);
+  printf ("\n");
+  freeaddrinfo (list);
+  free (samples);
+}
+
+int benchfaults (int argc, char **argv) {
+  /* orders a client meets: dead addresses ahead of live ones, a slow
+   * handshake ahead of a quick one, and nothing that works at all */
+  const char *scenarios[] = { "a", "aa", "ra", "rra", "ba", "bba", "bra",
+	"rba", "sa", "bs", "rr" };
+  int count = sizeof(scenarios)/sizeof(scenarios[0]);
+  struct STUBRESOLVEROPTIONS stubopts;
+  struct sockaddr_in nowhere;
+  char port[20], hosts[32];
+  int i, trials = 100;
+
+  if (argc>0) trials = atoi(argv[0]);
+  if (trials<1) trials=1;
+  if (faultsetup (port,sizeof(port)) || faulthosts (hosts,scenarios,count,
+	port)) {
+    printf ("can't set up the listeners: %s\n",strerror(errno));
+    return 1;
+  }
+  /* names come from the hosts file: the nameserver is never asked */
+  memset (&nowhere,0,sizeof(nowhere));
+  nowhere.sin_family = AF_INET;
+  nowhere.sin_port = htons(9);
+  nowhere.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  memset (&stubopts,0,sizeof(stubopts));
+  stubopts.hosts = hosts;
+  stubopts.nameserver = (struct sockaddr*) &nowhere;
+  stubopts.nameserverlen = sizeof(nowhere);
+  stubresolverconfigure (&stubopts);
+  printf ("a accepts, r refuses, b drops SYNs, s accepts %dms late; "
+	"%lldms stagger\n",FAULTS_SLOWMS,FAULTS_FIRSTWAIT/1000LL);
+  printf ("%-6s %-18s %8s %8s %8s %8s\n","order","","p50 ms","p99 ms",
+	"p999 ms","attempts");
+  for (i=0; i<count; i++) {
+    /* a slow address which has to win costs a second a trial */
+    int n = strcmp(scenarios[i],"bs")?trials:(trials+19)/20;
+
+    faulttrial (scenarios[i],i,port,n,0);
+    faulttrial (scenarios[i],i,port,n,1);
+  }
+  stubresolverconfigure (NULL);
+  unlink (hosts);
+  for (i=0; i<faultcount; i++) {
+    if (faultaddresses[i].listener>=0) close (faultaddresses[i].listener);
+    if (faultaddresses[i].filler>=0) close (faultaddresses[i].filler);
+  }
+  return 0;
+}
+
+long long resolverloop (
+/* lookuploop() counting heap allocations into *allocs */
+  const char *name
+, int count
+, long long *allocs
+) {
+  long long elapsed;
+
+  allocations = 0;
+  countallocs = 1;
+  elapsed = lookuploop (name,count);
+  countallocs = 0;
+  *allocs = allocations;
+  return elapsed;
+}
+
+int benchresolver (int argc, char **argv) {
+  struct CONNECTRESOLVER *map, *hosts;
+  char path[32], name[32], addresses[64];
+  long long elapsed, allocs;
+  int i, fd, count = 5000;
+  FILE *f;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  map = connectresolvermap ();
+  strcpy (path,"/tmp/benchhostsXXXXXX");
+  fd = mkstemp (path);
+  if (!map || (fd<0) || !(f=fdopen(fd,"w"))) {
+    printf ("can't set up the resolvers: %s\n",strerror(errno));
+    return 1;
+  }
+  for (i=0; i<1000; i++) {
+    snprintf (name,sizeof(name),"svc%d.test",i);
+    snprintf (addresses,sizeof(addresses),"10.%d.%d.1 fd00::%x",
+	i/256,i%256,i+1);
+    connectresolvermapset (map,name,addresses);
+    fprintf (f,"10.%d.%d.1 %s\nfd00::%x %s\n",i/256,i%256,name,i+1,name);
+  }
+  fclose (f);
+  hosts = connectresolverhosts (path);
+  if (!hosts) {
+    printf ("can't map %s: %s\n",path,strerror(errno));
+    unlink (path);
+    return 1;
+  }
+  elapsed = resolverloop ("localhost",count,&allocs);
+  if (elapsed<0) return 1;
+  report ("getaddrinfo_a",count,elapsed);
+  printf ("%-24s %8.1f allocations/lookup\n","",(double) allocs/count);
+  connectresolverset (map);
+  elapsed = resolverloop ("svc999.test",count,&allocs);
+  if (elapsed<0) return 1;
+  report ("map resolver",count,elapsed);
+  printf ("%-24s %8.1f allocations/lookup\n","",(double) allocs/count);
+  connectresolverset (hosts);
+  /* the last name in the file: the whole mapping is scanned */
+  elapsed = resolverloop ("svc999.test",count,&allocs);
+  if (elapsed<0) return 1;
+  report ("hosts resolver",count,elapsed);
+  printf ("%-24s %8.1f allocations/lookup\n","",(double) allocs/count);
+  connectresolverset (NULL);
+  connectresolverfree (map);
+  connectresolverfree (hosts);
+  unlink (path);
+  return 0;
+}
+
+/* timeoutgetaddrinfo() minus the resolvers and the name cache: every
+ * lookup goes to getaddrinfo_a() */
+int timeoutgetaddrinfolookup (const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res,
+	long long *timeout);
+
+void numerictrial (
+  const char *label
+, int l
+, const char *port
+, int count
+, int how             /* 0 getaddrinfo_a(), 1 timeoutgetaddrinfo(),
+                       * 2 connectbyname() */
+) {
+  struct addrinfo hints, *res;
+  long long start, timeout;
+  int i, s, a, r = 0;
+
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  allocations = 0;
+  start = microseconds();
+  for (i=0; i<count; i++) {
+    countallocs = 1;
+    timeout = 5000;
+    if (how==2) s = connectbyname ("127.0.0.1",port,5000,NULL);
+    else {
+      if (how==0) r = timeoutgetaddrinfolookup ("127.0.0.1",port,&hints,
+	&res,&timeout);
+      else r = timeoutgetaddrinfo ("127.0.0.1",port,&hints,&res,&timeout);
+      if (r) {
+        countallocs = 0;
+        printf ("lookup %d failed: %s\n",i,gai_strerror(r));
+        return;
+      }
+      s = connectbyaddrinfo (res,5000,NULL);
+      freeaddrinfo (res);
+    }
+    countallocs = 0;
+    if (s<0) {
+      printf ("connect %d failed: %s\n",i,strerror(errno));
+      return;
+    }
+    a = accept (l,NULL,NULL);
+    if (a>=0) close (a);
+    close (s);
+  }
+  report (label,count,microseconds()-start);
+  printf ("%-24s %8.2f allocations per connect\n","",
+	((double) allocations)/((double) count));
+}
+
+int benchnumeric (int argc, char **argv) {
+  struct addrinfo *address;
+  char port[20];
+  int l, count = 20000;
+
+  if (argc>0) count = atoi(argv[0]);
+  if (count<1) count=1;
+  l = loopbacklistener (&address,1024);
+  if (l<0) {
+    printf ("can't listen on loopback: %s\n",strerror(errno));
+    return 1;
+  }
+  snprintf (port,sizeof(port),"%d",
+	(int) ntohs(((struct sockaddr_in*) address->ai_addr)->sin_port));
+  numerictrial ("getaddrinfo_a()",l,port,count,0);
+  numerictrial ("timeoutgetaddrinfo()",l,port,count,1);
+  numerictrial ("connectbyname()",l,port,count,2);
+  freeaddrinfo (address);
+  close (l);
+  return 0;
+}
+
+struct COALESCEWORKER {
+  pthread_t thread;
+  const char *name;
+  int error;
+  long long elapsed;
+};
+
+pthread_barrier_t coalescebarrier;
+
+void *coalesceworker (void *arg) {
+  struct COALESCEWORKER *w = (struct COALESCEWORKER*) arg;
+  struct addrinfo hints, *res;
+  long long start, timeout = 5000;
+
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  pthread_barrier_wait (&coalescebarrier);
+  start = microseconds();
+  w->error = timeoutgetaddrinfo (w->name,"80",&hints,&res,&timeout);
+  w->elapsed = microseconds() - start;
+  if (!w->error) freeaddrinfo (res);
+  return NULL;
+}
+
+void coalescetrial (
+  const char *label
+, struct COALESCEWORKER *w
+, int threads
+) {
+  struct DNSCACHESTATS stats;
+  long long start, slowest = 0;
+  int i, failed = 0;
+
+  dnscachestats (&stats,1);
+  pthread_barrier_init (&coalescebarrier,NULL,(unsigned) threads);
+  start = microseconds();
+  for (i=0; i<threads; i++) 
+    pthread_create (&(w[i].thread),NULL,coalesceworker,w+i);
+  for (i=0; i<threads; i++) {
+    pthread_join (w[i].thread,NULL);
+    if (w[i].error) failed++;
+    if (w[i].elapsed>slowest) slowest = w[i].elapsed;
+  }
+  pthread_barrier_destroy (&coalescebarrier);
+  dnscachestats (&stats,0);
+  printf ("%-24s %5d threads %5llu lookups sent %5llu coalesced "
+	"%4d failed, slowest %.1f ms, all %.1f ms\n",label,threads,
+	threads-stats.coalesced,stats.coalesced,failed,slowest/1000.0,
+	(microseconds()-start)/1000.0);
+}
+
+int benchcoalesce (int argc, char **argv) {
+  struct STUBRESOLVEROPTIONS stubopts;
+  struct sockaddr_in server;
+  struct COALESCEWORKER *w;
+  char (*names)[32];
+  pid_t pid;
+  int i, threads = 100;
+
+  if (argc>0) threads = atoi(argv[0]);
+  if (threads<1) threads=1;
+  w = (struct COALESCEWORKER*) calloc (threads,sizeof(*w));
+  names = (char (*)[32]) calloc (threads,sizeof(*names));
+  pid = fakednsserver (&server);
+  if (!w || !names || (pid<0)) {
+    printf ("can't start the fake DNS server: %s\n",strerror(errno));
+    return 1;
+  }
+  memset (&stubopts,0,sizeof(stubopts));
+  stubopts.hosts = "";
+  stubopts.nameserver = (struct sockaddr*) &server;
+  stubopts.nameserverlen = sizeof(server);
+  stubopts.retry = 1000;
+  stubresolverconfigure (&stubopts);
+  printf ("slowa.test's A answer comes %dms after the query\n",
+	FAKEDNS_SLOW);
+  for (i=0; i<threads; i++) w[i].name = "slowa.test";
+  coalescetrial ("same name",w,threads);
+  for (i=0; i<threads; i++) { /* nothing to share */
+    snprintf (names[i],sizeof(names[i]),"host%d.test",i);
+    w[i].name = names[i];
+  }
+  coalescetrial ("different names",w,threads);
+  stubresolverconfigure (NULL);
+  kill (pid,SIGTERM);
+  waitpid (pid,NULL,0);
+  free (names);
+  free (w);
+  return 0;
+}
+
+struct SIMSCENARIO {
+  const char *label;
+  int count;
+  struct CONNECTSIMADDRESS addresses[3];
+};
+
+struct SIMPOLICY {
+  const char *label;
+  long long attemptdelay, firstwait, nextwait;
+  int rttmultiple;
+};
+
+int benchsimulate (int argc, char **argv) {
+  /* rtt and jitter in microseconds, then loss and refuse */
+  struct SIMSCENARIO scenarios[] = {
+    { "healthy dual-stack",2,{{AF_INET6,30000,5000,0.0,0.0},
+	{AF_INET,30000,5000,0.0,0.0}}},
+    { "IPv6 blackholed",2,{{AF_INET6,30000,5000,1.0,0.0},
+	{AF_INET,30000,5000,0.0,0.0}}},
+    { "IPv6 slow (300ms)",2,{{AF_INET6,300000,50000,0.0,0.0},
+	{AF_INET,30000,5000,0.0,0.0}}},
+    { "IPv6 loses 20% of SYNs",2,{{AF_INET6,30000,5000,0.2,0.0},
+	{AF_INET,30000,5000,0.0,0.0}}},
+    { "first address refuses",3,{{AF_INET6,20000,2000,0.0,1.0},
+	{AF_INET,20000,2000,0.0,0.0},{AF_INET6,20000,2000,0.0,0.0}}},
+    { "far and lossy (150ms, 2%)",2,{{AF_INET6,150000,50000,0.02,0.0},
+	{AF_INET,150000,50000,0.02,0.0}}}
+  };
+  struct SIMPOLICY policies[] = {
+    { "default",0,0,0,0 },
+    { "attemptdelay 250",250,0,0,0 },
+    { "attemptdelay 50",50,0,0,0 },
+    { "firstwait 100ms",0,100000,50000,0 },
+    { "rttmultiple 2",0,0,0,2 },
+    { "rttmultiple 4",0,0,0,4 }
+  };
+  int numscenarios = sizeof(scenarios)/sizeof(scenarios[0]);
+  int numpolicies = sizeof(policies)/sizeof(policies[0]);
+  struct CONNECTOPTIONS options;
+  struct CONNECTSIMRESULT result;
+  long long start, total = 0;
+  int i, j, races = 10000;
+
+  if (argc>0) races = atoi(argv[0]);
+  if (races<1) races=1;
+  printf ("%d races of each, 10 s timeout\n",races);
+  start = microseconds();
+  for (i=0; i<numscenarios; i++) {
+    printf ("%s\n  %-20s %8s %8s %8s %9s %8s %7s\n",scenarios[i].label,
+	"policy","mean ms","p50 ms","p99 ms","attempts","wasted","failed");
+    for (j=0; j<numpolicies; j++) {
+      memset (&options,0,sizeof(options));
+      options.attemptdelay = policies[j].attemptdelay;
+      options.firstwait = policies[j].firstwait;
+      options.nextwait = policies[j].nextwait;
+      options.rttmultiple = policies[j].rttmultiple;
+      if (connectsimulate (scenarios[i].addresses,scenarios[i].count,
+	  &options,10000,races,(unsigned long long) (i+1),&result)) {
+        printf ("connectsimulate: %s\n",strerror(errno));
+        return 1;
+      }
+      total += (long long) result.races;
+      printf ("  %-20s %8.1f %8.1f %8.1f %9.2f %8.2f %7llu\n",
+	policies[j].label,result.connect.count?
+	(double) result.connect.sum/(double) result.connect.count/1000.0:0.0,
+	connectstatspercentile(&result.connect,50.0)/1000.0,
+	connectstatspercentile(&result.connect,99.0)/1000.0,
+	(double) result.attempts/(double) result.races,
+	(double) result.wasted/(double) result.races,
+	result.races-result.connected);
+    }
+  }
+  report ("simulated races",(int) total,microseconds()-start);
+  return 0;
+}
+
+int main (int argc, char **argv) {
+  if ((argc>1) && !strcmp(argv[1],"pollers"))
+    return benchpollers (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"reactor"))
+    return benchreactor (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"batch"))
+    return benchbatch (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"dnscache"))
+    return benchdnscache (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"happyeyeballs"))
+    return benchhappyeyeballs (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"pool"))
+    return benchpool (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"stubdns"))
+    return benchstubdns (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"streaming"))
+    return benchstreaming (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"syscalls"))
+    return benchsyscalls (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"uring"))
+    return benchuring (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"sharded"))
+    return benchsharded (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"acceptor"))
+    return benchacceptor (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"stats"))
+    return benchstats (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"allocs"))
+    return benchallocs (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"faults"))
+    return benchfaults (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"resolver"))
+    return benchresolver (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"numeric"))
+    return benchnumeric (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"coalesce"))
+    return benchcoalesce (argc-2,argv+2);
+  if ((argc>1) && !strcmp(argv[1],"simulate"))
+    return benchsimulate (argc-2,argv+2);
+  fprintf (stderr,"usage: %s pollers [connects] [padfds]\n"
+	"       %s reactor [connects] [inflight]\n"
+	"       %s batch [targets] [name]\n"
+	"       %s dnscache [lookups] [name]\n"
+	"       %s happyeyeballs [trials]\n"
+	"       %s pool [checkouts] [name]\n"
+	"       %s stubdns [lookups]\n"
+	"       %s streaming [trials]\n"
+	"       %s syscalls [connects]\n"
+	"       %s uring [connects]\n"
+	"       %s sharded [seconds]\n"
+	"       %s acceptor [accepts]\n"
+	"       %s stats [connects]\n"
+	"       %s allocs [connects]\n"
+	"       %s faults [trials]\n"
+	"       %s resolver [lookups]\n"
+	"       %s numeric [connects]\n"
+	"       %s coalesce [threads]\n"
+	"       %s simulate [races]\n",
+	argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],
+	argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],argv[0],
+	argv[0],argv[0],argv[0]);
+  return 2;
+}
@@ -22,6 +22,32 @@
 #include <sys/types.h>      /* setsockopt */
 #include <sys/socket.h>     /* setsockopt */
 
+#ifdef __linux__
+#define EASYV6_EPOLL
+#include <sys/epoll.h>      /* epoll_create1, epoll_ctl, epoll_wait */
+#include <sys/eventfd.h>    /* eventfd */
+#include <linux/filter.h>   /* sock_filter, SKF_AD_CPU */
+#include <sys/syscall.h>    /* __NR_epoll_pwait2, __NR_io_uring_setup */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define EASYV6_URING
+#include <linux/io_uring.h> /* io_uring_params, io_uring_sqe */
+#endif
+#endif
+#endif
+#include <netinet/in.h>     /* IPPROTO_TCP */
+#include <netinet/tcp.h>    /* TCP_INFO */
+#include <signal.h>         /* SIGEV_THREAD */
+#include <poll.h>           /* poll */
+#include <limits.h>         /* INT_MAX */
+#include <ctype.h>          /* tolower */
+#include <strings.h>        /* strncasecmp */
+#include <sys/uio.h>        /* struct iovec */
+#include <sys/mman.h>       /* mmap */
+#include <sys/stat.h>       /* fstat */
+#include <stdint.h>         /* uint64_t */
+#include <semaphore.h>      /* sem_post */
+
 
 /*
            struct addrinfo {
@@ -44,42 +70,81 @@ struct SOCKETINPROGRESS {
   int socket;
   const struct addrinfo *address;
   int error;
+  int outcome;        /* CONNECTOUTCOME_... */
+  long long started;  /* microseconds() as the attempt began, 0 if never */
+  long long finished; /* and as it was decided */
+};
+
+struct CONNECTIO {
+/* What a race does to the world outside it. Real races have none and make
+ * the system calls themselves; connectsimulate() stands a virtual clock
+ * and network in for them. An attempt is known by its index in sockets[] */
+  void *context;
+  long long (*now) (void *context); /* microseconds */
+  int (*start) (void *context, int i, const struct addrinfo *address);
+                /* 0 once in flight, or an errno if it failed at once */
+  int (*wait) (void *context, long long wait, int *error);
+                /* up to wait microseconds for an attempt in flight to
+                 * finish. Its index with *error set (0 if it connected),
+                 * or -1 if none did */
+  void (*cancel) (void *context, int i); /* give up on one in flight */
+  uint64_t *rttslots;   /* the RTT table to learn in, CONNECTRTT_SLOTS
+                         * long, instead of the process wide one */
 };
 
 struct CONNECTIONPROGRESS {
   int topsocket; /* numerically largest socket number recorded in sockets */
   int nextsocket; /* index of the next socket to attempt a connect to */
   int totaladdresses;
-  long long finishby;
-  long long nextconnectafter;
+  long long finishby;  /* microseconds() by which the race is lost */
+  long long nextconnectafter; /* and when the next attempt is due */
   long long firstwait; /* how long to wait after starting the first connection
-                     * before starting the second */
+                     * before starting the second, in microseconds */
   long long nextwait;  /* how long to wait after starting later connections
 	             * before starting next one */
   struct CONNECTBYNAMEDETAILS *details;
+  int pollfd; /* epoll descriptor with each in-flight socket registered
+               * once, or -1 to build an fd_set for select() each time */
+  int pending; /* number of connect()s in flight */
+  uint32_t polltag; /* tells this race's sockets apart in a shared pollfd */
+  char sharedpoller; /* pollfd belongs to someone else; don't close it */
+  char wantepoll; /* make pollfd an epoll set once a second attempt is in
+                   * flight. Until then poll() the one socket */
+  char morecoming; /* a lookup still running may add addresses with
+                    * connectmerge(): don't give up when they run out */
   fd_set *writefds;
   size_t fdsetbytes;
   const struct addrinfo *addresslist;
+  char *historykey; /* name\0service\0 to learn from, or NULL */
+  int historykeylen;
+  long long calledat; /* microseconds() when the caller began, which may
+                       * have been before the name lookup */
+  long long begunat;  /* microseconds() when the race was set up */
+  char lookedup;      /* calledat was before a name lookup */
+  int rttmultiple;    /* options->rttmultiple: learn RTTs and stagger by
+                       * them */
+  long long rttminwait, rttmaxwait; /* bounds on that stagger */
+  char inplace;       /* lives in the caller's stack or arena: not to be
+                       * free()d */
+  int skipped;        /* addresses left out by skip or dnspinning */
+  int deadskipped;    /* left out as dead by connectdeadorder() */
+  int deadprobes;     /* dead addresses let back in to see if they recovered */
+  const struct CONNECTIO *io; /* or NULL for sockets and microseconds() */
   struct SOCKETINPROGRESS sockets[1];
 };
 
-char *getpeernametext (
-/* Return the IP address of the remote end of the connected socket.
- * Return the service name (normally a numeric port) of the remote socket
- * in *buf if buf is not NULL.
- * If buf is NULL, malloc memory for the IP address (caller must free)
- */
-  int socket
+char *sockaddrtext (
+/* getpeernametext() for a peer address already in hand, e.g. from
+ * accept() */
+  const struct sockaddr *address
+, socklen_t addrlen
 , char *buf
 , size_t bytes
 ) {
-  char sockaddrbuf[200];
-  socklen_t addrlen = 200, i;
-  struct sockaddr_in *si4 = (struct sockaddr_in *) sockaddrbuf;
-  struct sockaddr_in6 *si6 = (struct sockaddr_in6 *) sockaddrbuf;
+  const struct sockaddr_in *si4 = (const struct sockaddr_in *) address;
+  const struct sockaddr_in6 *si6 = (const struct sockaddr_in6 *) address;
+  socklen_t i;
 
-  if (getpeername(socket,(struct sockaddr *) &sockaddrbuf, &addrlen)) 
-    return NULL; /* errno contains error */
   if (addrlen>200) { /*unexpectedly large socket? Can't be one I know about.*/
     errno=ENOBUFS;
     return NULL;
@@ -118,6 +183,24 @@ char *getpeernametext (
   return buf;
 }
 
+char *getpeernametext (
+/* Return the IP address of the remote end of the connected socket.
+ * Return the service name (normally a numeric port) of the remote socket
+ * in *buf if buf is not NULL.
+ * If buf is NULL, malloc memory for the IP address (caller must free)
+ */
+  int socket
+, char *buf
+, size_t bytes
+) {
+  char sockaddrbuf[200];
+  socklen_t addrlen = 200;
+
+  if (getpeername(socket,(struct sockaddr *) &sockaddrbuf, &addrlen)) 
+    return NULL; /* errno contains error */
+  return sockaddrtext ((struct sockaddr *) sockaddrbuf,addrlen,buf,bytes);
+}
+
 char *addrinfototext (
 /* Return the IP address of the first addrinfo structure as a text
  * string */
@@ -174,13 +257,22 @@ long long milliseconds (void) {
   struct timespec now;
   long long dnow;
 
-  if (clock_gettime(CLOCK_REALTIME,&now)) return -1;
+  /* every use is an interval or a deadline, which a step in the date
+   * would stretch or cut short */
+  if (clock_gettime(CLOCK_MONOTONIC,&now)) return -1;
   dnow = ((long long) now.tv_nsec)/ 1000000LL;
   dnow += ((long long) now.tv_sec) * 1000LL;
 
   return dnow;
 }
 
+long long microseconds (void) {
+  struct timespec now;
+
+  if (clock_gettime(CLOCK_MONOTONIC,&now)) return -1;
+  return ((long long) now.tv_sec)*1000000LL + ((long long) now.tv_nsec)/1000LL;
+}
+
 
 int getsocketerrno (int sock) {
 /* per http://cr.yp.to/docs/connect.html 
@@ -203,11 +295,18 @@ int getsocketerrno (int sock) {
  * not connected, getpeername() will return ENOTCONN, and read(fd,&ch,1) will
  * produce the right errno through error slippage. This is a combination of
  * suggestions from Douglas C. Schmidt and Ken Keys. 
+ *
+ * Every system this builds on today has a working SO_ERROR, which answers
+ * in one call instead of two, so getpeername() and read() are only the
+ * fallback.
  */
   socklen_t addrlen = 100;
   char p[100];
-  int r;
+  int r, error;
 
+  addrlen = sizeof(error);
+  if (!getsockopt (sock,SOL_SOCKET,SO_ERROR,&error,&addrlen)) return error;
+  addrlen = 100;
   r = getpeername (sock,(struct sockaddr*) p,&addrlen);
   if (!r) return 0;
   if (errno!=ENOTCONN) return errno;
@@ -230,617 +329,6373 @@ int compareaddrinfo (const struct addrinfo *a, const struct addrinfo *b) {
   return 1;
 }
 
-struct CONNECTIONPROGRESS * allocconnectionstruct (
-  const struct addrinfo *addresses /* candidate addresses */
-, const struct addrinfo *like /* try these addresses first if present in
-                               * addresses */
-, const struct addrinfo *skip /* don't try these addresses even if present in
-                               * addresses */
-, long long timeout
-, char reportdetails
-, char dnspinning
+int rfc6724precedence (
+/* Destination precedence from the RFC 6724 default policy table. IPv4
+ * addresses count as their IPv4-mapped IPv6 equivalents. */
+  const struct addrinfo *a
 ) {
-/* Initialize the data structure for making my parallelize connects */
-/* Order by liked removing skip is not implemented. */
-/* Order by alternating protocol (v4/v6) is not implemented. */
-  struct CONNECTIONPROGRESS *c;
-  const struct addrinfo *a;
-  const struct addrinfo **candidates;
-  int numaddresses,slot,i;
-  size_t bytes;
-  long long firstwait;
+  const unsigned char *p;
 
-  for (numaddresses=0, a=addresses; a!=NULL; a=a->ai_next) numaddresses++;
-  if (numaddresses<1) return NULL;
-  bytes = sizeof(struct CONNECTIONPROGRESS) + 
-          (sizeof(struct SOCKETINPROGRESS)*numaddresses);
-  c = (struct CONNECTIONPROGRESS*) malloc (bytes);
-  if (!c) return NULL; /* critical failure */
-  candidates = malloc(sizeof(struct addrinfo *)*numaddresses);
-  if (!candidates) {
-    free (c);
-    return NULL; /* critical failure */
-  }
-  for (i=0, a=addresses; a!=NULL; a=a->ai_next,i++) {
-    candidates[i]=a;
-  }
-  memset ((void*) c, 0, bytes);
-  c->topsocket = -1;
-  c->addresslist = addresses;
-  while (skip) { /* Do not attempt to connect to these addresses */
-    for (i=0; i<numaddresses; i++) {
-      if (compareaddrinfo (candidates[i],skip)) candidates[i]=NULL;
-    }
-    skip = skip->ai_next;
-  }
-  slot=0;
-  while (like) {
-    for (i=0; i<numaddresses; i++) {
-      if (compareaddrinfo (candidates[i],like)) {
-        c->sockets[slot].address = candidates[i];
-        c->sockets[slot].socket = -1;
-        slot++;
-        candidates[i]=NULL;
-      }
-    }
-    like = like->ai_next;
+  if (a->ai_family==AF_INET) return 35; /* ::ffff:0:0/96 */
+  if ((a->ai_family!=AF_INET6) || !a->ai_addr) return 0;
+  p = ((const struct sockaddr_in6*) a->ai_addr)->sin6_addr.s6_addr;
+  if (IN6_IS_ADDR_LOOPBACK((const struct in6_addr*) p)) return 50;
+  if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr*) p)) return 35;
+  if ((p[0]==0x20) && (p[1]==0x02)) return 30;     /* 2002::/16 6to4 */
+  if ((p[0]==0x20) && (p[1]==0x01) && (p[2]==0) && (p[3]==0)) 
+    return 5;                                      /* 2001::/32 Teredo */
+  if ((p[0]&0xfe)==0xfc) return 3;                 /* fc00::/7 ULA */
+  if (IN6_IS_ADDR_V4COMPAT((const struct in6_addr*) p)) return 1;
+  if (IN6_IS_ADDR_SITELOCAL((const struct in6_addr*) p)) return 1;
+  if ((p[0]==0x3f) && (p[1]==0xfe)) return 1;      /* 3ffe::/16 6bone */
+  return 40;                                       /* ::/0 */
+}
+
+int rfc6724scope (
+/* RFC 6724 address scope: 2 link-local, 5 site-local, 14 global */
+  const struct addrinfo *a
+) {
+  const struct in6_addr *p6;
+  unsigned long v4;
+
+  if ((a->ai_family==AF_INET) && a->ai_addr) {
+    v4 = ntohl(((const struct sockaddr_in*) a->ai_addr)->sin_addr.s_addr);
+    if (((v4>>24)==127) || ((v4>>16)==0xa9fe)) return 2;
+    return 14;
   }
-  for (i=0; (i<numaddresses) && (!dnspinning); i++) {
-    if (candidates[i]) {
-      c->sockets[slot].address = candidates[i];
-      c->sockets[slot].socket = -1;
-      slot++;
+  if ((a->ai_family!=AF_INET6) || !a->ai_addr) return 14;
+  p6 = &(((const struct sockaddr_in6*) a->ai_addr)->sin6_addr);
+  if (IN6_IS_ADDR_MULTICAST(p6)) return p6->s6_addr[1] & 0x0f;
+  if (IN6_IS_ADDR_LINKLOCAL(p6) || IN6_IS_ADDR_LOOPBACK(p6)) return 2;
+  if (IN6_IS_ADDR_SITELOCAL(p6)) return 5;
+  return 14;
+}
+
+void sortrfc6724 (
+/* Stable sort by RFC 6724 destination rules 6 (higher precedence first)
+ * and 8 (smaller scope first). The rules which depend on the source
+ * address are left to getaddrinfo(). */
+  const struct addrinfo **list
+, int n
+) {
+  const struct addrinfo *a;
+  int i, j;
+
+  for (i=1; i<n; i++) { /* insertion sort: lists are short */
+    a = list[i];
+    for (j=i; j>0; j--) {
+      if (rfc6724precedence(list[j-1]) > rfc6724precedence(a)) break;
+      if ((rfc6724precedence(list[j-1]) == rfc6724precedence(a)) &&
+          (rfc6724scope(list[j-1]) <= rfc6724scope(a))) break;
+      list[j] = list[j-1];
     }
+    list[j] = a;
   }
-  free (candidates);
-  c->totaladdresses = slot;
-  if (slot<1) {
-    free(c);
-    return NULL;
-  }
-  if (reportdetails) { /* will tell the caller all about the addresses
-                        * we tried and the particular error on each */
-    c->details = (struct CONNECTBYNAMEDETAILS*) malloc (
-	sizeof(struct CONNECTBYNAMEDETAILS)+
-	(sizeof(struct CONNECTBYNAMERESULT)*c->totaladdresses));
-    if (!c->details) {
-      free(c);
-      return NULL;
+}
+
+void interleavefamilies (
+/* RFC 8305 section 4: starting with the family of the first address, take
+ * firstcount addresses of that family and then alternate with the other
+ * families, keeping the order within each. temp holds n pointers. */
+  const struct addrinfo **list
+, int n
+, int firstcount
+, const struct addrinfo **temp
+) {
+  int i, take, first, other, out, family;
+
+  if (n<2) return;
+  if (firstcount<1) firstcount = 1;
+  family = list[0]->ai_family;
+  memcpy (temp,list,sizeof(*list)*n);
+  first = other = out = 0;
+  while (out<n) {
+    /* next address of the first family, firstcount of them to begin */
+    take = (out==0)?firstcount:1;
+    for (i=0; (out<n) && (i<take); i++) {
+      while ((first<n) && (temp[first]->ai_family!=family)) first++;
+      if (first>=n) break;
+      list[out++] = temp[first++];
     }
-    c->details->addresslist = addresses;
+    /* then the next address of any other family */
+    while ((other<n) && (temp[other]->ai_family==family)) other++;
+    if (other<n) list[out++] = temp[other++];
+    else if (first>=n) break;
   }
+}
 
-  /* Set up the time outs */  
-  c->finishby = milliseconds()+timeout;
-  firstwait = timeout / ((long long)numaddresses);
-  if (firstwait > 1000LL) firstwait = 1000LL; /* 1 second */
-  if (firstwait < 100LL) firstwait = 100LL;   /* 0.1 seconds */
-  c->firstwait = firstwait;
-  c->nextwait = firstwait / 2LL;
+/* Connect history. When turned on by connecthistoryconfigure(), every race
+ * to a name:service records which address won, how long its handshake
+ * took and which addresses failed. The next race to the same name:service
+ * tries past winners first, fastest first, and recent failures last, so
+ * callers get the benefit of like without keeping their own records. */
+#define CONNECTHISTORY_SHARDS 16
+#define CONNECTHISTORY_BUCKETS 64
+#define CONNECTHISTORY_ADDRESSES 8 /* addresses remembered per name */
 
-  /* fprintf (stdout,"made connect struct at %f. finishby=%f, firstwait=%f, "
-	"nextwait=%f, addresses=%d\n", milliseconds(), c->finishby,
-	c->firstwait, c->nextwait, c->totaladdresses); */
-  return c;
+struct CONNECTHISTORYADDRESS {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;    /* 0: slot unused */
+  unsigned srtt;        /* smoothed handshake RTT in microseconds, 0 if
+                         * the kernel didn't say */
+  int wins;
+  int failures;         /* failed attempts since the last win */
+  long long lastused;   /* milliseconds() of the last outcome */
+};
+
+struct CONNECTHISTORYENTRY {
+  struct CONNECTHISTORYENTRY *next;
+  unsigned hash;
+  int keylen;
+  long long lastused;
+  struct CONNECTHISTORYADDRESS addresses[CONNECTHISTORY_ADDRESSES];
+  char key[2];          /* name and service, each \0 terminated */
+};
+
+struct CONNECTHISTORYSHARD {
+  pthread_rwlock_t lock;
+  struct CONNECTHISTORYENTRY *buckets[CONNECTHISTORY_BUCKETS];
+  int entries;
+};
+
+struct CONNECTHISTORYSHARD connecthistory_shards[CONNECTHISTORY_SHARDS];
+pthread_once_t connecthistory_once = PTHREAD_ONCE_INIT;
+long long connecthistory_maxage = 0LL; /* 0: history disabled */
+int connecthistory_maxentries = 0;
+
+void connecthistoryinit (void) {
+  int i;
+
+  memset (connecthistory_shards,0,sizeof(connecthistory_shards));
+  for (i=0; i<CONNECTHISTORY_SHARDS; i++) 
+    pthread_rwlock_init (&(connecthistory_shards[i].lock),NULL);
 }
 
-#define NEXTCONNECT_NOMORE	-1
-#define NEXTCONNECT_STARTED	-2
+unsigned connecthistoryhash (const char *key, int keylen) {
+  unsigned h = 2166136261U; /* FNV-1a */
+  int i;
 
-int nextconnect (struct CONNECTIONPROGRESS *c) {
-/* Start a non-blocking connect to the next address in the list */
-  int s, fcntlflags;
-  const struct addrinfo *ap;
-  /* char buf[200]; */
+  for (i=0; i<keylen; i++) h = (h^(unsigned char) key[i]) * 16777619U;
+  return h;
+}
 
-  if (c->nextsocket >= c->totaladdresses) return NEXTCONNECT_NOMORE;
-    /* in progress to all possible addresses */
-  ap = c->sockets[c->nextsocket].address;
-  /*fprintf (stdout,"Enter nextconnect: %d, %lld, %s\n",
-    c->nextsocket,milliseconds(),addrinfototext(ap,buf,200)); */
-  s = socket(ap->ai_family, ap->ai_socktype, ap->ai_protocol);
-  if (s<0) {
-    /* Can't seem to get a socket of that type! Move on to the next one. */
-    c->sockets[c->nextsocket].error = errno;
-    c->nextsocket ++;
-    /* fprintf (stdout,"nextconnect fail 1\n"); */
-    return nextconnect (c);
-  }
-  fcntlflags = fcntl(s,F_GETFL,0);
-  if (fcntlflags<0) {
-    /* Something weird wrong with the socket... Move on. */
-    c->sockets[c->nextsocket].error = errno;
-    c->nextsocket ++;
-    /* fprintf (stdout,"nextconnect fail 2\n"); */
-    return nextconnect (c);
-  }
-  /* put the socket in non-blocking mode */
-  if (fcntl(s,F_SETFL,fcntlflags|O_NONBLOCK)<0) {
-    /* Something weird wrong with the socket... Move on. */
-    c->sockets[c->nextsocket].error = errno;
-    c->nextsocket ++;
-    /* fprintf (stdout,"nextconnect fail 3\n"); */
-    return nextconnect (c);
-  }
-  c->sockets[c->nextsocket].socket = s;
-  if (c->topsocket<s) c->topsocket = s;
-  /* fprintf (stdout,"nextconnect have socket %d\n",s);
-     printaddrinfo (ap,1); */
-  if (connect(s,ap->ai_addr,ap->ai_addrlen)==0) {
-    /* Got an immediate connect. */
-    /* This really shouldn't happen, but just in case it does... */
-    /* fprintf (stdout,"nextconnect connected\n"); */
-    return c->nextsocket;
+struct CONNECTHISTORYENTRY *connecthistoryfind (
+/* Call with the shard locked */
+  struct CONNECTHISTORYSHARD *shard
+, unsigned hash
+, const char *key
+, int keylen
+) {
+  struct CONNECTHISTORYENTRY *e;
+
+  e = shard->buckets[(hash/CONNECTHISTORY_SHARDS)%CONNECTHISTORY_BUCKETS];
+  for (; e; e=e->next) {
+    if ((e->hash==hash) && (e->keylen==keylen) && !memcmp(e->key,key,keylen))
+      return e;
   }
-  if (errno == EINPROGRESS) {
-    /* started the connection attempt. */
-    c->nextsocket ++;
-    /* fprintf (stdout,"nextconnect done: started nonblocking\n"); */
-    return NEXTCONNECT_STARTED;
+  return NULL;
+}
+
+struct CONNECTHISTORYADDRESS *connecthistoryaddress (
+/* The record for address a in e, or NULL if there is none */
+  struct CONNECTHISTORYENTRY *e
+, const struct addrinfo *a
+) {
+  int i;
+
+  if (!a->ai_addr) return NULL;
+  for (i=0; i<CONNECTHISTORY_ADDRESSES; i++) {
+    if ((e->addresses[i].addrlen==a->ai_addrlen) &&
+        !memcmp(&(e->addresses[i].addr),a->ai_addr,a->ai_addrlen))
+      return e->addresses+i;
   }
-  /* unexpected error, cancel the socket and try the next one */
-  c->sockets[c->nextsocket].error = errno;
-  /* fprintf (stdout,"nextconnect fail 4: %d,%s\n",errno,strerror(errno)); */
-  shutdown (s, SHUT_RDWR);
-  close (s);
-  c->sockets[c->nextsocket].socket = -1;
-  c->nextsocket ++;
-  return nextconnect (c);
+  return NULL;
 }
 
-int connectdonetrying (
-  struct CONNECTIONPROGRESS *c
-, int sock /* connected socket or negative number */
-, int error /* error to assign to pending connect()s other than sock */
+long long connecthistoryscore (
+/* Sort key for address a: past winners by RTT, then addresses we know
+ * nothing about, then recent failures, fewest first. */
+  struct CONNECTHISTORYENTRY *e
+, const struct addrinfo *a
+, long long now
 ) {
-  int i, sockindex=-1;
+  struct CONNECTHISTORYADDRESS *h;
 
-  /* fprintf (stdout,"connectdonetrying enter\n"); */
-  if (sock<0) sock=-2;
-  for (i=0; i<c->totaladdresses; i++) {
-    if (c->sockets[i].socket == sock) {
-      sockindex = i;
-      continue;
-    }
-    if (c->sockets[i].socket>=0) {
-      shutdown (c->sockets[i].socket,SHUT_RDWR);
-      close (c->sockets[i].socket);
-      c->sockets[i].socket=-1;
-    }
-    if (c->sockets[i].error == 0)
-      c->sockets[i].error = error;
-    if (c->details) {
-      c->details->results[i].address = c->sockets[i].address;
-      c->details->results[i].error = c->sockets[i].error;
+  h = connecthistoryaddress (e,a);
+  if (!h || (h->lastused+connecthistory_maxage<=now)) return 1LL<<32;
+  if (h->failures) return (2LL<<32) + (long long) h->failures;
+  if (h->wins) return h->srtt?(long long) h->srtt:(1LL<<32)-1LL;
+  return 1LL<<32;
+}
+
+void connecthistoryorder (
+/* Reorder list by what history says about key. The order within each
+ * class is kept. */
+  const char *key
+, int keylen
+, const struct addrinfo **list
+, int n
+) {
+  struct CONNECTHISTORYSHARD *shard;
+  struct CONNECTHISTORYENTRY *e;
+  const struct addrinfo *a;
+  long long now, score;
+  unsigned hash;
+  int i, j;
+
+  if (!key || (n<2)) return;
+  now = milliseconds();
+  hash = connecthistoryhash (key,keylen);
+  shard = connecthistory_shards + (hash%CONNECTHISTORY_SHARDS);
+  pthread_rwlock_rdlock (&(shard->lock));
+  e = connecthistoryfind (shard,hash,key,keylen);
+  for (i=1; e && (i<n); i++) { /* insertion sort: lists are short */
+    a = list[i];
+    score = connecthistoryscore (e,a,now);
+    for (j=i; j>0; j--) {
+      if (connecthistoryscore (e,list[j-1],now) <= score) break;
+      list[j] = list[j-1];
     }
+    list[j] = a;
   }
-  if (c->writefds) {
-    /* fprintf (stdout,"connectdonetrying free writefds\n"); */
-    free (c->writefds);
-    c->writefds = NULL;
-    c->fdsetbytes = 0;
-  }
-  return sockindex;
+  pthread_rwlock_unlock (&(shard->lock));
 }
 
-fd_set *fdsetalloc (fd_set **set, size_t *bytes, int topsocket) {
-  size_t fdsbytes;
+unsigned connecthistoryrtt (
+/* The kernel's handshake RTT estimate for a just connected socket in
+ * microseconds, or 0 */
+  int sock
+) {
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
 
-  if (topsocket<0) return *set;
-  fdsbytes = (topsocket/8) + 2;
-  if (fdsbytes<sizeof(fd_set)) fdsbytes=sizeof(fd_set);
-  if (*bytes>=fdsbytes) { /* block is reusable */
-    memset (*set,0,*bytes);
-    return *set;
-  }
-  if (*set==NULL) { /* fetch or enlarge block */
-    *set = (fd_set *) malloc (fdsbytes);
-  } else {
-    *set = (fd_set *) realloc((void*) *set, fdsbytes);
-  }
-  if (! (*set)) return NULL;
-  memset (*set,0,fdsbytes);
-  *bytes = fdsbytes;
-  return *set;
+  memset (&info,0,sizeof(info));
+  if (!getsockopt (sock,IPPROTO_TCP,TCP_INFO,&info,&len)) 
+    return info.tcpi_rtt;
+#endif
+  return 0;
 }
 
-#define WAITFORCONNECT_NOMORE -1
-#define WAITFORCONNECT_DONEXT -3
-#define WAITFORCONNECT_CRITFAIL -4
+struct CONNECTHISTORYADDRESS *connecthistoryslot (
+/* The record for address a in e, recycling the least recently used slot
+ * if it has none */
+  struct CONNECTHISTORYENTRY *e
+, const struct addrinfo *a
+) {
+  struct CONNECTHISTORYADDRESS *h;
+  int i;
 
-int waitforconnect (
-/* Wait in a select for one of the pending sockets to connect or for
- * the time out until the next action to expire 
- * return WAITFORCONNECT_DONEXT or the index of the successfully
- * connected socket */
+  h = connecthistoryaddress (e,a);
+  if (h) return h;
+  if (!a->ai_addr || (a->ai_addrlen>sizeof(h->addr))) return NULL;
+  h = e->addresses;
+  for (i=1; i<CONNECTHISTORY_ADDRESSES; i++) 
+    if (e->addresses[i].lastused < h->lastused) h = e->addresses+i;
+  memset (h,0,sizeof(*h));
+  memcpy (&(h->addr),a->ai_addr,a->ai_addrlen);
+  h->addrlen = a->ai_addrlen;
+  return h;
+}
+
+void connecthistoryrecord (
+/* Learn from a finished race. sockindex is the winner or negative. Call
+ * after connectdonetrying() has assigned the losers their errors. */
   struct CONNECTIONPROGRESS *c
+, int sockindex
 ) {
-  long long now, wait;
-  int i, r, somethingfailed;
-  struct timeval selecttimeout;
+  struct CONNECTHISTORYSHARD *shard;
+  struct CONNECTHISTORYENTRY *e, **pe, **oldest;
+  struct CONNECTHISTORYADDRESS *h;
+  unsigned hash, rtt = 0;
+  long long now;
+  int i, timedout;
 
-  /* fprintf (stdout,"Enter waitforconnect at %f\n",milliseconds()); */
-  /* Figure out the longest we should wait before taking another action
-   * such as giving up or starting another connect() */
+  if (!c->historykey || !connecthistory_maxage) return;
   now = milliseconds();
-  wait = c->firstwait;
-  if (c->nextsocket>1) {
-    if (wait>c->nextwait) wait = c->nextwait;
-  } 
-  if (c->nextsocket>=c->totaladdresses) wait = c->finishby-now;
-  /* fprintf (stdout,"nextsocket=%d, total=%d, wait=%f\n", 
-     c->nextsocket,c->totaladdresses,wait);*/
-  while (wait>0LL) {
-    /* fetch memory for an fd_set and flag the pending sockets */
-    if (!fdsetalloc (&(c->writefds),&(c->fdsetbytes),c->topsocket)) 
-      return WAITFORCONNECT_CRITFAIL;
-    for (r=i=0; i<c->nextsocket; i++) 
-      if (c->sockets[i].socket>=0) {
-        FD_SET(c->sockets[i].socket,c->writefds);
-        r=1;
-      }
-    if ((!r)&&(c->nextsocket<c->totaladdresses)) return WAITFORCONNECT_DONEXT;
-    if (!r) return WAITFORCONNECT_NOMORE;
-
-    /* Stuff wait into a timeval structure for select */
-    selecttimeout.tv_sec = (time_t) (wait/1000LL);
-    selecttimeout.tv_usec = (suseconds_t) ((wait%1000LL)*1000LL);
-
-    /* wait until a socket connects or fails, or until the time out
-     * expires. */
-    r = select (c->topsocket+1, NULL, c->writefds, NULL, &selecttimeout);
-    if ((r<0)&&(errno!=EINTR)) return WAITFORCONNECT_CRITFAIL;
-
-    /* any sockets which are writable are either connected or failed */
-    for (somethingfailed=i=0; i<c->nextsocket; i++) {
-      if (!FD_ISSET(c->sockets[i].socket,c->writefds)) continue;
-      c->sockets[i].error = getsocketerrno (c->sockets[i].socket);
-      if (!c->sockets[i].error) { /* Connected! */
-        /*fprintf (stdout,"waitforconnect Connected! socket=%d, "
-	"index=%d\n", c->sockets[i].socket,i); */
-        return connectdonetrying (c,c->sockets[i].socket,0);
+  /* A race abandoned early says nothing against the attempts in flight */
+  timedout = (microseconds()>=c->finishby);
+  if (sockindex>=0) rtt = connecthistoryrtt (c->sockets[sockindex].socket);
+  hash = connecthistoryhash (c->historykey,c->historykeylen);
+  shard = connecthistory_shards + (hash%CONNECTHISTORY_SHARDS);
+  pthread_rwlock_wrlock (&(shard->lock));
+  e = connecthistoryfind (shard,hash,c->historykey,c->historykeylen);
+  if (!e) {
+    if (connecthistory_maxentries && (shard->entries >= 
+        (connecthistory_maxentries+CONNECTHISTORY_SHARDS-1)/
+	CONNECTHISTORY_SHARDS)) {
+      /* Shard is full: forget the name used least recently */
+      oldest = NULL;
+      for (i=0; i<CONNECTHISTORY_BUCKETS; i++) 
+        for (pe=&(shard->buckets[i]); *pe; pe=&((*pe)->next)) 
+          if (!oldest || ((*pe)->lastused < (*oldest)->lastused)) oldest = pe;
+      if (oldest) {
+        struct CONNECTHISTORYENTRY *victim = *oldest;
+        *oldest = victim->next;
+        free (victim);
+        shard->entries--;
       }
-        /*fprintf (stdout,"waitforconnect socket %d index %d failed "
-	"with %d(%s)\n", c->sockets[i].socket,i,c->sockets[i].error,
-	strerror(c->sockets[i].error));*/
-      somethingfailed = 1;
-      shutdown (c->sockets[i].socket,SHUT_RDWR);
-      close (c->sockets[i].socket);
-      c->sockets[i].socket=-1;
     }
-    if (somethingfailed) return WAITFORCONNECT_DONEXT;
-    wait -= milliseconds() - now;
+    e = (struct CONNECTHISTORYENTRY*) malloc (sizeof(*e)+c->historykeylen);
+    if (!e) {
+      pthread_rwlock_unlock (&(shard->lock));
+      return;
+    }
+    memset (e,0,sizeof(*e));
+    e->hash = hash;
+    e->keylen = c->historykeylen;
+    memcpy (e->key,c->historykey,c->historykeylen);
+    pe = &(shard->buckets[(hash/CONNECTHISTORY_SHARDS)%CONNECTHISTORY_BUCKETS]);
+    e->next = *pe;
+    *pe = e;
+    shard->entries++;
   }
-  return WAITFORCONNECT_DONEXT;
+  e->lastused = now;
+  for (i=0; i<c->nextsocket; i++) {
+    if (i==sockindex) {
+      h = connecthistoryslot (e,c->sockets[i].address);
+      if (!h) continue;
+      h->wins++;
+      h->failures = 0;
+      if (!h->srtt) h->srtt = rtt;
+      else if (rtt) h->srtt = (7U*h->srtt + rtt)/8U; /* as TCP smooths */
+      h->lastused = now;
+      continue;
+    }
+    /* 0: lost the race or was still trying when another won */
+    if (!c->sockets[i].error) continue;
+    if ((c->sockets[i].error==ETIMEDOUT) && !timedout) continue;
+    h = connecthistoryslot (e,c->sockets[i].address);
+    if (!h) continue;
+    h->failures++;
+    h->lastused = now;
+  }
+  pthread_rwlock_unlock (&(shard->lock));
 }
 
-int connectbyaddrinfo (
-  const struct addrinfo *addresses
-, long long timeout
-, struct CONNECTOPTIONS *options
+int connecthistoryconfigure (
+  long long maxage
+, int maxentries
 ) {
-  struct CONNECTIONPROGRESS *c;
-  int sockindex,i;
-  long long now;
-  struct CONNECTOPTIONS nooptions;
-
-  /* fprintf (stdout,"connectbyaddrinfo enter\n"); */
-  if (!options) {
-    options = &nooptions;
-    memset ((void*) options,0,sizeof(struct CONNECTOPTIONS));
-  }
-
-  if (timeout<100) timeout=100; /* give myself at least 100 ms to finish */
-  c = allocconnectionstruct(addresses,options->like,options->skip,timeout,
-	options->reportdetails,options->dnspinning);
-  if (!c) {
-    errno = ENOMEM;
+  pthread_once (&connecthistory_once,connecthistoryinit);
+  if ((maxage<0LL) || (maxentries<0)) {
+    errno = EINVAL;
     return -1;
   }
-  options->numaddresses=c->totaladdresses;
-  if (c->details) options->details = c->details;
-  now = milliseconds();
-  while (now<c->finishby) {
-    sockindex = nextconnect(c);
-    if (sockindex<0) sockindex = waitforconnect(c);
-    if (sockindex>=0) { /* connected */
-      int sock = c->sockets[sockindex].socket;
-      /* fprintf (stdout,"connectbyaddrinfo connected: %d(%d) ",
-	 sock,sockindex);
-         printaddrinfo (c->sockets[sockindex].address,1); */
-      errno=0;
-      if (options->reportpicked) 
-	options->picked= (struct addrinfo*) c->sockets[sockindex].address;
-      free(c);
-      return sock;
-    }
-    if (sockindex==WAITFORCONNECT_CRITFAIL) {
-      connectdonetrying(c,-1,ENOMEM);
-      options->picked=NULL;
-      errno = ENOMEM;
-      free(c);
-      return -1;
+  connecthistory_maxentries = maxentries;
+  connecthistory_maxage = maxage;
+  if (!maxage) connecthistoryflush();
+  return 0;
+}
+
+void connecthistoryflush (void) {
+  struct CONNECTHISTORYENTRY *e;
+  int i, j;
+
+  pthread_once (&connecthistory_once,connecthistoryinit);
+  for (i=0; i<CONNECTHISTORY_SHARDS; i++) {
+    pthread_rwlock_wrlock (&(connecthistory_shards[i].lock));
+    for (j=0; j<CONNECTHISTORY_BUCKETS; j++) {
+      while ((e=connecthistory_shards[i].buckets[j])) {
+        connecthistory_shards[i].buckets[j] = e->next;
+        free (e);
+      }
     }
-    if (sockindex==WAITFORCONNECT_NOMORE) {
-      /* Tried and failed on all candidate addresses */
-      errno=0;
-      connectdonetrying(c,-1,0);
-      for (i=0; i<c->totaladdresses; i++) 
-        if (c->sockets[i].error>errno) errno=c->sockets[i].error;
-      if (errno<=0) errno=EBADF;
-      options->picked=NULL;
-      free(c);
+    connecthistory_shards[i].entries = 0;
+    pthread_rwlock_unlock (&(connecthistory_shards[i].lock));
+  }
+}
+
+/* Handshake round trip times by destination prefix (/24 for IPv4, /64 for
+ * IPv6) for the adaptive stagger: options->rttmultiple. Each slot is one
+ * 64-bit word read and written whole, so there's no lock: 24 bits of tag
+ * from the prefix's hash, then the smoothed RTT and its mean deviation in
+ * microseconds, 20 bits each. A prefix whose slot another has taken just
+ * starts over. Concurrent samples of one prefix may lose one; it's an
+ * average. */
+#define CONNECTRTT_SLOTS 4096
+#define CONNECTRTT_MAX 0xfffffULL /* microseconds a field holds, ~1 s */
+#define CONNECTRTT_MINWAIT 1000LL /* default least adaptive wait, us */
+#define CONNECTRTT_TAG(hash) ((uint64_t) (((hash)>>8)|1U))
+
+uint64_t connectrtt_slots[CONNECTRTT_SLOTS];
+
+uint64_t *connectrtttable (
+/* The RTT table race c learns in: a simulation keeps its own */
+  const struct CONNECTIONPROGRESS *c
+) {
+  return c->io?c->io->rttslots:connectrtt_slots;
+}
+
+unsigned connectrtthash (
+/* Hash of the address's prefix, or 0 if it isn't IPv4 or IPv6 */
+  const struct addrinfo *a
+) {
+  const unsigned char *p;
+  unsigned hash = 2166136261U; /* FNV-1a */
+  int i, n;
+
+  if (a->ai_family==AF_INET) {
+    p = (const unsigned char*) &(((struct sockaddr_in*) a->ai_addr)->sin_addr);
+    n = 3;
+  } else if (a->ai_family==AF_INET6) {
+    p = (const unsigned char*)
+	&(((struct sockaddr_in6*) a->ai_addr)->sin6_addr);
+    n = 8;
+  } else return 0;
+  for (i=0; i<n; i++) hash = (hash ^ p[i]) * 16777619U;
+  hash = (hash ^ (unsigned) a->ai_family) * 16777619U;
+  return hash|1U; /* 0 means not IP */
+}
+
+int connectrttget (
+/* Smoothed RTT and deviation for the address's prefix in microseconds.
+ * Returns 0 if there are none */
+  const uint64_t *slots /* from connectrtttable() */
+, const struct addrinfo *a
+, long long *srtt
+, long long *rttvar
+) {
+  unsigned hash = connectrtthash (a);
+  uint64_t slot;
+
+  if (!hash) return 0;
+  slot = __atomic_load_n (slots+(hash%CONNECTRTT_SLOTS),__ATOMIC_RELAXED);
+  if ((slot>>40)!=CONNECTRTT_TAG(hash)) return 0;
+  *srtt = (long long) ((slot>>20)&CONNECTRTT_MAX);
+  *rttvar = (long long) (slot&CONNECTRTT_MAX);
+  return 1;
+}
+
+void connectrttsample (
+/* Fold one handshake time into the prefix's average, as RFC 6298 does
+ * for TCP's retransmission timer */
+  uint64_t *slots /* from connectrtttable() */
+, const struct addrinfo *a
+, long long rtt /* microseconds */
+) {
+  unsigned hash = connectrtthash (a);
+  uint64_t *slot, old, new, srtt, rttvar, r;
+
+  if (!hash || (rtt<0LL)) return;
+  r = ((uint64_t) rtt>CONNECTRTT_MAX)?CONNECTRTT_MAX:(uint64_t) rtt;
+  slot = slots+(hash%CONNECTRTT_SLOTS);
+  old = __atomic_load_n (slot,__ATOMIC_RELAXED);
+  if ((old>>40)!=CONNECTRTT_TAG(hash)) { /* first sample */
+    srtt = r;
+    rttvar = r/2;
+  } else {
+    srtt = (old>>20)&CONNECTRTT_MAX;
+    rttvar = old&CONNECTRTT_MAX;
+    rttvar = (3*rttvar + ((srtt>r)?srtt-r:r-srtt))/4;
+    srtt = (7*srtt + r)/8;
+  }
+  new = (CONNECTRTT_TAG(hash)<<40) | (srtt<<20) | rttvar;
+  /* if another thread got in first, its sample stands instead */
+  __atomic_compare_exchange_n (slot,&old,new,0,__ATOMIC_RELAXED,
+	__ATOMIC_RELAXED);
+}
+
+/* Dead addresses: a process wide negative cache of address:port pairs
+ * which failed recently, turned on by connectdeadconfigure(). A failure
+ * puts its destination in backoff for connectdead_backoff, doubling with
+ * each failure in a row up to connectdead_maxbackoff. Races leave the
+ * addresses in backoff out, so they cost neither a socket nor a stagger,
+ * unless there's nothing else to try. Once the backoff is over, one race
+ * gets the address back as a probe, after its other candidates, and a win
+ * clears it. The table is direct mapped: an address whose slot another
+ * has taken is just forgotten. Slot i is guarded by lock i%16. */
+#define CONNECTDEAD_SLOTS 1024
+#define CONNECTDEAD_LOCKS 16
+#define CONNECTDEAD_ALIVE   0
+#define CONNECTDEAD_PROBE   1 /* backoff over: try it once more, last */
+#define CONNECTDEAD_BACKOFF 2 /* leave it out */
+
+struct CONNECTDEADADDRESS {
+  unsigned char addr[16];
+  unsigned short port;
+  short family;         /* 0: slot unused */
+  int reason;           /* errno of the last failure */
+  int failures;         /* in a row */
+  long long until;      /* microseconds() when the backoff ends */
+};
+
+struct CONNECTDEADADDRESS connectdead_slots[CONNECTDEAD_SLOTS];
+pthread_mutex_t connectdead_locks[CONNECTDEAD_LOCKS];
+pthread_once_t connectdead_once = PTHREAD_ONCE_INIT;
+long long connectdead_backoff = 0LL; /* microseconds. 0: table off */
+long long connectdead_maxbackoff = 0LL;
+int connectdead_entries = 0; /* slots in use, so an empty table costs
+                              * races no locking */
+
+void connectdeadinit (void) {
+  int i;
+
+  for (i=0; i<CONNECTDEAD_LOCKS; i++) 
+    pthread_mutex_init (connectdead_locks+i,NULL);
+}
+
+unsigned connectdeadkey (
+/* Fill in key's address, port and family from sa and return their hash,
+ * or 0 if sa isn't IPv4 or IPv6 */
+  const struct sockaddr *sa
+, socklen_t len
+, struct CONNECTDEADADDRESS *key
+) {
+  unsigned hash = 2166136261U; /* FNV-1a */
+  int i;
+
+  memset (key,0,sizeof(*key));
+  if (!sa) return 0;
+  if ((sa->sa_family==AF_INET) && (len>=sizeof(struct sockaddr_in))) {
+    memcpy (key->addr,&(((struct sockaddr_in*) sa)->sin_addr),4);
+    key->port = ((struct sockaddr_in*) sa)->sin_port;
+  } else if ((sa->sa_family==AF_INET6) && 
+	     (len>=sizeof(struct sockaddr_in6))) {
+    memcpy (key->addr,&(((struct sockaddr_in6*) sa)->sin6_addr),16);
+    key->port = ((struct sockaddr_in6*) sa)->sin6_port;
+  } else return 0;
+  key->family = sa->sa_family;
+  for (i=0; i<16; i++) hash = (hash ^ key->addr[i]) * 16777619U;
+  hash = (hash ^ (key->port&0xffU)) * 16777619U;
+  hash = (hash ^ (key->port>>8)) * 16777619U;
+  hash = (hash ^ (unsigned) key->family) * 16777619U;
+  return hash|1U;
+}
+
+int connectdeadsame (
+  const struct CONNECTDEADADDRESS *d
+, const struct CONNECTDEADADDRESS *key
+) {
+  return (d->family==key->family) && (d->port==key->port) &&
+	!memcmp (d->addr,key->addr,16);
+}
+
+int connectdeadcheck (
+/* CONNECTDEAD_ALIVE, _PROBE or _BACKOFF for a race about to try a. A race
+ * told _PROBE has the probe to itself: the backoff starts again, so others
+ * see _BACKOFF until it's decided */
+  const struct addrinfo *a
+, long long now
+) {
+  struct CONNECTDEADADDRESS key, *d;
+  unsigned hash;
+  int state = CONNECTDEAD_ALIVE;
+
+  hash = connectdeadkey (a->ai_addr,a->ai_addrlen,&key);
+  if (!hash) return state;
+  d = connectdead_slots + (hash%CONNECTDEAD_SLOTS);
+  pthread_mutex_lock (connectdead_locks+(hash%CONNECTDEAD_LOCKS));
+  if (d->family && connectdeadsame (d,&key)) {
+    if (d->until>now) state = CONNECTDEAD_BACKOFF;
+    else {
+      state = CONNECTDEAD_PROBE;
+      d->until = now + connectdead_backoff;
+    }
+  }
+  pthread_mutex_unlock (connectdead_locks+(hash%CONNECTDEAD_LOCKS));
+  return state;
+}
+
+int connectdeadorder (
+/* Take the addresses in backoff out of list, and move those due a probe to
+ * the end. If that leaves nothing, and others says the race has nothing
+ * else to try either, the ones in backoff go at the end instead. Returns
+ * the new length */
+  const struct addrinfo **list
+, int n
+, int others /* addresses the race has besides list */
+, const struct addrinfo **scratch /* room for n */
+, int *probes /* add the number of probes here */
+) {
+  long long now;
+  int i, kept=0, probing=0, dead=0;
+
+  if (!connectdead_backoff || (n<1) ||
+      !__atomic_load_n (&connectdead_entries,__ATOMIC_RELAXED))
+    return n;
+  now = microseconds();
+  for (i=0; i<n; i++) {
+    switch (connectdeadcheck (list[i],now)) {
+      case CONNECTDEAD_ALIVE: list[kept++] = list[i]; break;
+      case CONNECTDEAD_PROBE: scratch[probing++] = list[i]; break;
+      default: scratch[n-1-(dead++)] = list[i]; /* from the far end */
+    }
+  }
+  for (i=0; i<probing; i++) list[kept++] = scratch[i];
+  *probes += probing;
+  if (kept+others>0) return kept;
+  for (i=0; i<dead; i++) list[kept++] = scratch[n-1-i];
+  return kept;
+}
+
+void connectdeadupdate (
+/* Record that an attempt to a failed with reason, or connected if reason
+ * is 0 */
+  const struct addrinfo *a
+, int reason
+, long long now
+) {
+  struct CONNECTDEADADDRESS key, *d;
+  long long backoff;
+  unsigned hash;
+  int i;
+
+  hash = connectdeadkey (a->ai_addr,a->ai_addrlen,&key);
+  if (!hash) return;
+  d = connectdead_slots + (hash%CONNECTDEAD_SLOTS);
+  pthread_mutex_lock (connectdead_locks+(hash%CONNECTDEAD_LOCKS));
+  if (!reason) {
+    if (d->family && connectdeadsame (d,&key)) {
+      memset (d,0,sizeof(*d));
+      __atomic_sub_fetch (&connectdead_entries,1,__ATOMIC_RELAXED);
+    }
+  } else {
+    if (!d->family) __atomic_add_fetch (&connectdead_entries,1,
+	__ATOMIC_RELAXED);
+    if (!d->family || !connectdeadsame (d,&key)) *d = key;
+    d->failures++;
+    d->reason = reason;
+    backoff = connectdead_backoff;
+    for (i=1; (i<d->failures) && (backoff<connectdead_maxbackoff); i++) 
+      backoff *= 2;
+    if (backoff>connectdead_maxbackoff) backoff = connectdead_maxbackoff;
+    d->until = now + backoff;
+  }
+  pthread_mutex_unlock (connectdead_locks+(hash%CONNECTDEAD_LOCKS));
+}
+
+void connectdeadrecord (
+/* Learn from a finished race which of its addresses are dead. sockindex
+ * is the winner or negative. Call after connectdonetrying(). */
+  struct CONNECTIONPROGRESS *c
+, int sockindex
+) {
+  struct SOCKETINPROGRESS *w = NULL;
+  long long now;
+  int i, timedout, reason;
+
+  if (!connectdead_backoff) return;
+  now = microseconds();
+  /* A race abandoned early says nothing against the attempts in flight */
+  timedout = (now>=c->finishby);
+  if (sockindex>=0) {
+    w = c->sockets+sockindex;
+    connectdeadupdate (w->address,0,now);
+  }
+  for (i=0; i<c->nextsocket; i++) {
+    if (i==sockindex) continue;
+    reason = c->sockets[i].error;
+    if ((reason==ETIMEDOUT) && !timedout) continue;
+    if (!reason) {
+      /* Still connecting when an address tried after it won, having had
+       * twice as long as the winner needed: likely a black hole */
+      if (!w || (c->sockets[i].outcome!=CONNECTOUTCOME_CANCELLED) ||
+          !c->sockets[i].started || (c->sockets[i].started>=w->started) ||
+          (w->finished-c->sockets[i].started < 2*(w->finished-w->started)))
+        continue;
+      reason = ETIMEDOUT;
+    }
+    connectdeadupdate (c->sockets[i].address,reason,now);
+  }
+}
+
+int connectdeadconfigure (
+  long long backoff
+, long long maxbackoff
+) {
+  pthread_once (&connectdead_once,connectdeadinit);
+  if ((backoff<0LL) || (maxbackoff<0LL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (maxbackoff<backoff) maxbackoff = backoff;
+  connectdead_maxbackoff = maxbackoff*1000LL;
+  connectdead_backoff = backoff*1000LL;
+  if (!backoff) connectdeadflush();
+  return 0;
+}
+
+void connectdeadflush (void) {
+  int i;
+
+  pthread_once (&connectdead_once,connectdeadinit);
+  for (i=0; i<CONNECTDEAD_LOCKS; i++) 
+    pthread_mutex_lock (connectdead_locks+i);
+  memset (connectdead_slots,0,sizeof(connectdead_slots));
+  __atomic_store_n (&connectdead_entries,0,__ATOMIC_RELAXED);
+  for (i=0; i<CONNECTDEAD_LOCKS; i++) 
+    pthread_mutex_unlock (connectdead_locks+i);
+}
+
+int connectdeadquery (
+  const struct sockaddr *address
+, socklen_t addresslen
+, int *reason
+, long long *until
+) {
+  struct CONNECTDEADADDRESS key, *d;
+  unsigned hash;
+  int failures = 0;
+
+  pthread_once (&connectdead_once,connectdeadinit);
+  hash = connectdeadkey (address,addresslen,&key);
+  if (!hash) return 0;
+  d = connectdead_slots + (hash%CONNECTDEAD_SLOTS);
+  pthread_mutex_lock (connectdead_locks+(hash%CONNECTDEAD_LOCKS));
+  if (d->family && connectdeadsame (d,&key)) {
+    failures = d->failures;
+    if (reason) *reason = d->reason;
+    /* microseconds() and milliseconds() share CLOCK_MONOTONIC */
+    if (until) *until = (d->until+999LL)/1000LL;
+  }
+  pthread_mutex_unlock (connectdead_locks+(hash%CONNECTDEAD_LOCKS));
+  return failures;
+}
+
+/* Connect telemetry. Each thread counts in its own CONNECTSTATSSLAB, found
+ * through a pthread key and written only by that thread, so an update is
+ * a plain load and store with no lock prefix and no cache line bouncing
+ * between CPUs. Slabs go on a list pushed with CAS and are never freed:
+ * when a thread exits its slab is handed to the next new thread, counts
+ * and all. Resetting can't zero another thread's counters under it, so
+ * connectstats() keeps the totals at the last reset and subtracts them. */
+struct CONNECTSTATSSLAB {
+  struct CONNECTSTATS counts;
+  struct CONNECTSTATSSLAB *next;
+  char inuse; /* a live thread owns it */
+};
+
+struct CONNECTSTATSSLAB *connectstats_slabs = NULL; /* pushed with CAS */
+pthread_key_t connectstats_key;
+pthread_once_t connectstats_keyonce = PTHREAD_ONCE_INIT;
+char connectstats_keyok;
+struct CONNECTSTATS connectstats_base; /* totals at the last reset */
+pthread_mutex_t connectstats_lock = PTHREAD_MUTEX_INITIALIZER; /* for
+                                       * connectstats_base. Readers only */
+unsigned long long nbgai_parkednow = 0ULL; /* see nbgai_cancellater() */
+
+void connectstatsthreadexit (void *slab) {
+  __atomic_store_n (&(((struct CONNECTSTATSSLAB*) slab)->inuse),0,
+	__ATOMIC_RELEASE);
+}
+
+void connectstatsmakekey (void) {
+  if (!pthread_key_create (&connectstats_key,connectstatsthreadexit))
+    connectstats_keyok = 1;
+}
+
+struct CONNECTSTATSSLAB *connectstatsslab (void) {
+/* This thread's counters, or NULL if there's no memory for them */
+  struct CONNECTSTATSSLAB *slab;
+  char unused;
+
+  pthread_once (&connectstats_keyonce,connectstatsmakekey);
+  if (!connectstats_keyok) return NULL;
+  slab = (struct CONNECTSTATSSLAB*) pthread_getspecific (connectstats_key);
+  if (slab) return slab;
+  /* first time on this thread: take over one left by a thread which
+   * exited, or make one */
+  for (slab=__atomic_load_n(&connectstats_slabs,__ATOMIC_ACQUIRE); slab;
+       slab=slab->next) {
+    unused = 0;
+    if (__atomic_compare_exchange_n (&(slab->inuse),&unused,1,0,
+	__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) break;
+  }
+  if (!slab) {
+    slab = (struct CONNECTSTATSSLAB*) calloc (1,sizeof(*slab));
+    if (!slab) return NULL;
+    slab->inuse = 1;
+    slab->next = __atomic_load_n (&connectstats_slabs,__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&connectstats_slabs,&(slab->next),
+	slab,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+  }
+  if (pthread_setspecific (connectstats_key,slab)) {
+    connectstatsthreadexit (slab);
+    return NULL;
+  }
+  return slab;
+}
+
+void connectstatsadd (
+/* Only the owning thread writes a counter. Atomic only so that
+ * connectstats() never sees half of one */
+  unsigned long long *counter
+, unsigned long long n
+) {
+  __atomic_store_n (counter,__atomic_load_n(counter,__ATOMIC_RELAXED)+n,
+	__ATOMIC_RELAXED);
+}
+
+int connectstatsbucket (unsigned long long value) {
+/* Histogram bucket for value microseconds. See easyv6.h */
+  int e;
+
+  if (value<16ULL) return (int) value;
+  if (value>=(1ULL<<40)) value = (1ULL<<40)-1ULL;
+  e = 63-__builtin_clzll(value); /* 4 to 39 */
+  return 16*(e-3) + (int) ((value>>(e-4))&15ULL);
+}
+
+void connectstatsrecord (
+  struct CONNECTSTATSHISTOGRAM *h
+, long long value /* microseconds */
+) {
+  if (value<0LL) value = 0LL; /* can't happen on a monotonic clock */
+  connectstatsadd (&(h->count),1ULL);
+  connectstatsadd (&(h->sum),(unsigned long long) value);
+  connectstatsadd (h->buckets+connectstatsbucket(value),1ULL);
+}
+
+void connectstats (
+  struct CONNECTSTATS *stats
+, int reset
+) {
+  /* every field is a counter, so add them up as an array */
+  unsigned long long *total = (unsigned long long*) stats;
+  unsigned long long *slabcount, *base;
+  struct CONNECTSTATSSLAB *slab;
+  size_t i, n = sizeof(*stats)/sizeof(unsigned long long);
+
+  memset (stats,0,sizeof(*stats));
+  for (slab=__atomic_load_n(&connectstats_slabs,__ATOMIC_ACQUIRE); slab;
+       slab=slab->next) {
+    slabcount = (unsigned long long*) &(slab->counts);
+    for (i=0; i<n; i++)
+      total[i] += __atomic_load_n (slabcount+i,__ATOMIC_RELAXED);
+  }
+  pthread_mutex_lock (&connectstats_lock);
+  base = (unsigned long long*) &connectstats_base;
+  for (i=0; i<n; i++) {
+    total[i] -= base[i];
+    if (reset) base[i] += total[i];
+  }
+  pthread_mutex_unlock (&connectstats_lock);
+  stats->parkednow = __atomic_load_n (&nbgai_parkednow,__ATOMIC_RELAXED);
+}
+
+long long connectstatspercentile (
+  const struct CONNECTSTATSHISTOGRAM *histogram
+, double percent
+) {
+  unsigned long long want, seen=0ULL;
+  int b;
+
+  if (!histogram->count) return -1LL;
+  if (percent<0.0) percent = 0.0;
+  if (percent>100.0) percent = 100.0;
+  want = (unsigned long long) ((double) histogram->count*percent/100.0);
+  if (want<1ULL) want = 1ULL;
+  for (b=0; b<CONNECTSTATS_BUCKETS; b++) {
+    seen += histogram->buckets[b];
+    if (seen>=want) break;
+  }
+  if (b>=CONNECTSTATS_BUCKETS) b = CONNECTSTATS_BUCKETS-1; /* torn copy */
+  if (b<16) return (long long) b;
+  /* the highest value in the bucket, as HdrHistogram reports it */
+  return (long long) (((unsigned long long) (17+b%16)<<(b/16-1))-1ULL);
+}
+
+size_t connectdetailsbytes (
+/* One block for the details: results[] then, unless the caller opted out,
+ * timing[] after it */
+  int total
+, const struct CONNECTOPTIONS *options
+) {
+  size_t bytes;
+
+  bytes = sizeof(struct CONNECTBYNAMEDETAILS) + 
+	(sizeof(struct CONNECTBYNAMERESULT)*total);
+  if (!options->notiming) bytes += sizeof(struct CONNECTBYNAMETIMING)*total;
+  return bytes;
+}
+
+void connectdetailstiming (
+/* Point details->timing past the last of total results. Only the pointer:
+ * it's filled in when the race ends */
+  struct CONNECTBYNAMEDETAILS *details
+, int total
+, const struct CONNECTOPTIONS *options
+) {
+  details->timing = NULL;
+  if (!options->notiming) 
+    details->timing = (struct CONNECTBYNAMETIMING*) (details->results+total);
+}
+
+/* Defaults for the CONNECTOPTIONS timing fields, in microseconds */
+#define CONNECT_MINWAIT 100000LL        /* bounds on the scaled stagger */
+#define CONNECT_MAXWAIT 1000000LL
+#define CONNECT_DNSFLOOR 50000LL        /* least time for a name lookup */
+#define CONNECT_RACEFLOOR 100000LL      /* least time for a connect race */
+#define CONNECT_AFTERDNSFLOOR 1000000LL /* and for one after a lookup */
+
+long long connectoption (
+/* A CONNECTOPTIONS timing field, or its default if unset. options may be
+ * NULL */
+  const struct CONNECTOPTIONS *options
+, long long value
+, long long fallback
+) {
+  if (options && (value>0LL)) return value;
+  return fallback;
+}
+
+long long connectfloorms (
+/* Raise a timeout in milliseconds to a floor in microseconds */
+  long long timeout
+, long long floor
+) {
+  if (timeout*1000LL < floor) return (floor+999LL)/1000LL;
+  return timeout;
+}
+
+/* Races of up to this many addresses keep their scratch lists on the
+ * stack, and connectbyaddrinfo() keeps the whole race there, so that the
+ * usual connect makes no malloc() at all */
+#define CONNECT_LOCALADDRESSES 32
+#define CONNECT_STACKBYTES 2048
+
+void *connectplace (
+/* Align space for a race, or give NULL if it won't hold bytes */
+  void *space
+, size_t spacebytes
+, size_t bytes
+) {
+  size_t skip;
+
+  if (!space) return NULL;
+  skip = (size_t) ((-(uintptr_t) space) & 15U);
+  if (spacebytes < skip+bytes) return NULL;
+  return (char*) space + skip;
+}
+
+long long connectnow (struct CONNECTIONPROGRESS *c) {
+/* The race's clock: microseconds(), or the simulation's */
+  if (c->io) return c->io->now (c->io->context);
+  return microseconds();
+}
+
+void connectclose (struct CONNECTIONPROGRESS *c, int i) {
+/* Abandon attempt i */
+  if (c->io) c->io->cancel (c->io->context,i);
+  else close (c->sockets[i].socket);
+}
+
+void connectracefree (struct CONNECTIONPROGRESS *c) {
+  if (!c->inplace) free (c);
+}
+
+struct CONNECTIONPROGRESS * allocconnectionstruct (
+  const struct addrinfo *addresses /* candidate addresses */
+, long long timeout /* microseconds */
+, const struct CONNECTOPTIONS *options /* like, skip, ordering, etc. */
+, const char *name /* name and service looked up, for the connect */
+, const char *service /* history, or NULL */
+, void *space /* somewhere to put the race instead of the heap, or NULL */
+, size_t spacebytes
+, const struct CONNECTIO *io /* NULL but in simulations */
+) {
+/* Initialize the data structure for making my parallelize connects.
+ * Liked addresses go first, in the order liked. The rest are ordered per
+ * RFC 8305 unless the options say otherwise, then by connect history. */
+  struct CONNECTIONPROGRESS *c, *placed;
+  const struct addrinfo *a;
+  const struct addrinfo **candidates;
+  const struct addrinfo *local[2*CONNECT_LOCALADDRESSES];
+  const struct addrinfo *like = options->like, *skip = options->skip;
+  int numaddresses,slot,i,n,keylen=0;
+  size_t bytes;
+  long long firstwait;
+
+  for (numaddresses=0, a=addresses; a!=NULL; a=a->ai_next) numaddresses++;
+  if (numaddresses<1) return NULL;
+  if (connecthistory_maxage && name && service) 
+    keylen = strlen(name) + strlen(service) + 2;
+  bytes = sizeof(struct CONNECTIONPROGRESS) + 
+          (sizeof(struct SOCKETINPROGRESS)*numaddresses) + keylen;
+  c = placed = (struct CONNECTIONPROGRESS*) 
+	connectplace (space,spacebytes,bytes);
+  if (!c) c = (struct CONNECTIONPROGRESS*) malloc (bytes);
+  if (!c) return NULL; /* critical failure */
+  /* second half is scratch space for interleavefamilies() */
+  candidates = local;
+  if (numaddresses>CONNECT_LOCALADDRESSES)
+    candidates = malloc(sizeof(struct addrinfo *)*numaddresses*2);
+  if (!candidates) {
+    if (c!=placed) free (c);
+    return NULL; /* critical failure */
+  }
+  for (i=0, a=addresses; a!=NULL; a=a->ai_next,i++) {
+    candidates[i]=a;
+  }
+  memset ((void*) c, 0, bytes);
+  c->inplace = (c==placed);
+  c->topsocket = -1;
+  c->pollfd = -1;
+  c->addresslist = addresses;
+  c->io = io;
+  c->begunat = c->calledat = connectnow (c);
+  if (keylen) { /* key goes after the last of the sockets */
+    c->historykey = (char*) (c->sockets+numaddresses);
+    c->historykeylen = keylen;
+    strcpy (c->historykey,name);
+    strcpy (c->historykey+strlen(name)+1,service);
+  }
+  while (skip) { /* Do not attempt to connect to these addresses */
+    for (i=0; i<numaddresses; i++) {
+      if (compareaddrinfo (candidates[i],skip)) candidates[i]=NULL;
+    }
+    skip = skip->ai_next;
+  }
+  slot=0;
+  while (like) {
+    for (i=0; i<numaddresses; i++) {
+      if (compareaddrinfo (candidates[i],like)) {
+        c->sockets[slot].address = candidates[i];
+        c->sockets[slot].socket = -1;
+        slot++;
+        candidates[i]=NULL;
+      }
+    }
+    like = like->ai_next;
+  }
+  for (n=i=0; (i<numaddresses) && (!options->dnspinning); i++) {
+    if (candidates[i]) candidates[n++] = candidates[i];
+  }
+  if (options->sortaddresses) sortrfc6724 (candidates,n);
+  if (!options->nointerleave) 
+    interleavefamilies (candidates,n,options->firstfamilycount,
+	candidates+numaddresses);
+  /* a simulation must not learn from, or be swayed by, real races */
+  if (!io) {
+    connecthistoryorder (c->historykey,c->historykeylen,candidates,n);
+    i = n;
+    n = connectdeadorder (candidates,n,slot,candidates+numaddresses,
+	&(c->deadprobes));
+    c->deadskipped = i - n;
+  }
+  for (i=0; i<n; i++) {
+    c->sockets[slot].address = candidates[i];
+    c->sockets[slot].socket = -1;
+    slot++;
+  }
+  if (candidates!=local) free (candidates);
+  c->totaladdresses = slot;
+  c->skipped = numaddresses - slot - c->deadskipped;
+  if (slot<1) {
+    connectracefree (c);
+    return NULL;
+  }
+  if (options->reportdetails) { /* will tell the caller all about the
+                                 * addresses we tried and the particular
+                                 * error on each */
+    c->details = (struct CONNECTBYNAMEDETAILS*) malloc (
+	connectdetailsbytes (c->totaladdresses,options));
+    if (!c->details) {
+      connectracefree (c);
+      return NULL;
+    }
+    memset ((void*) c->details,0,sizeof(struct CONNECTBYNAMEDETAILS));
+    c->details->addresslist = addresses;
+    connectdetailstiming (c->details,c->totaladdresses,options);
+  }
+#ifdef EASYV6_EPOLL
+  /* epoll has no FD_SETSIZE ceiling and costs O(ready) per wakeup instead
+   * of O(topsocket). It also costs two system calls to set up and tear
+   * down, which a race won by its first attempt doesn't need, so
+   * nextconnect() makes it when a second attempt starts. If the kernel
+   * won't give us one, quietly use select. */
+  if (options->poller!=CONNECTPOLLER_SELECT) c->wantepoll = 1;
+#endif
+
+  /* Set up the time outs */  
+  c->finishby = connectnow(c)+timeout;
+  if (options->firstwait>0LL) { /* caller knows best, e.g. on a LAN */
+    c->firstwait = options->firstwait;
+    c->nextwait = connectoption (options,options->nextwait,c->firstwait);
+  } else if (options->attemptdelay>0LL) { /* RFC 8305 Connection Attempt
+                                           * Delay */
+    firstwait = options->attemptdelay*1000LL;
+    if (firstwait < 10000LL) firstwait = 10000LL; /* RFC 8305 minimum */
+    c->firstwait = firstwait;
+    c->nextwait = connectoption (options,options->nextwait,firstwait);
+  } else {
+    firstwait = timeout / ((long long)numaddresses);
+    if (firstwait > connectoption (options,options->maxwait,CONNECT_MAXWAIT))
+      firstwait = connectoption (options,options->maxwait,CONNECT_MAXWAIT);
+    if (firstwait < connectoption (options,options->minwait,CONNECT_MINWAIT))
+      firstwait = connectoption (options,options->minwait,CONNECT_MINWAIT);
+    c->firstwait = firstwait;
+    c->nextwait = connectoption (options,options->nextwait,firstwait/2LL);
+  }
+  if (options->rttmultiple>0) { /* the above is for prefixes not seen yet */
+    c->rttmultiple = options->rttmultiple;
+    c->rttminwait = connectoption (options,options->minwait,
+	CONNECTRTT_MINWAIT);
+    c->rttmaxwait = connectoption (options,options->maxwait,CONNECT_MAXWAIT);
+  }
+
+  /* fprintf (stdout,"made connect struct at %f. finishby=%f, firstwait=%f, "
+	"nextwait=%f, addresses=%d\n", microseconds(), c->finishby,
+	c->firstwait, c->nextwait, c->totaladdresses); */
+  return c;
+}
+
+#define NEXTCONNECT_NOMORE	-1
+#define NEXTCONNECT_STARTED	-2
+
+/* Per-attempt timing for the details. An attempt which fails on the spot
+ * is decided as it starts. One in flight is provisionally cancelled; that
+ * stands if the race ends without hearing from it. */
+void connectattemptstart (struct CONNECTIONPROGRESS *c, int i) {
+  c->sockets[i].started = c->sockets[i].finished = connectnow (c);
+  c->sockets[i].outcome = CONNECTOUTCOME_FAILED;
+}
+
+void connectattemptpending (struct CONNECTIONPROGRESS *c, int i) {
+  c->sockets[i].finished = 0LL;
+  c->sockets[i].outcome = CONNECTOUTCOME_CANCELLED;
+}
+
+void connectattemptdone (struct CONNECTIONPROGRESS *c, int i, int outcome) {
+  c->sockets[i].finished = connectnow (c);
+  c->sockets[i].outcome = outcome;
+  /* a handshake, or a refusal, took one round trip */
+  if (c->rttmultiple && ((outcome==CONNECTOUTCOME_WON) || 
+      (c->sockets[i].error==ECONNREFUSED)))
+    connectrttsample (connectrtttable (c),c->sockets[i].address,
+	c->sockets[i].finished-c->sockets[i].started);
+}
+
+long long connectstagger (
+/* How long after starting attempt i to start the next one. Adaptively,
+ * rttmultiple times the smoothed RTT of i's prefix, but not before the
+ * handshake is overdue by RFC 6298's reckoning (SRTT + 4 RTTVAR) */
+  struct CONNECTIONPROGRESS *c
+, int i
+) {
+  long long srtt, rttvar, wait;
+
+  if (c->rttmultiple && 
+      connectrttget (connectrtttable (c),c->sockets[i].address,&srtt,
+	&rttvar)) {
+    wait = srtt*(long long) c->rttmultiple;
+    if (wait < srtt+4LL*rttvar) wait = srtt+4LL*rttvar;
+    if (wait < c->rttminwait) wait = c->rttminwait;
+    if (wait > c->rttmaxwait) wait = c->rttmaxwait;
+    return wait;
+  }
+  return (i>0)?c->nextwait:c->firstwait;
+}
+
+#ifdef EASYV6_EPOLL
+int connectepoll (
+/* Make c->pollfd an epoll set holding the attempts already in flight.
+ * Returns -1 and leaves the race on poll()/select() if it can't. */
+  struct CONNECTIONPROGRESS *c
+) {
+  struct epoll_event ev;
+  int i;
+
+  c->wantepoll = 0;
+  c->pollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (c->pollfd<0) return -1;
+  for (i=0; i<c->nextsocket; i++) {
+    if (c->sockets[i].socket<0) continue;
+    /* Register once, edge triggered. The socket becomes writable exactly
+     * once when the connect finishes one way or the other. */
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.u64 = (((uint64_t) c->polltag)<<32) | (uint64_t) i;
+    if (epoll_ctl (c->pollfd,EPOLL_CTL_ADD,c->sockets[i].socket,&ev)) {
+      close (c->pollfd);
+      c->pollfd = -1;
+      return -1;
+    }
+  }
+  return 0;
+}
+#endif
+
+int nextconnect (struct CONNECTIONPROGRESS *c);
+
+int nextconnectio (struct CONNECTIONPROGRESS *c) {
+/* nextconnect() through c->io. The attempt's index stands in for its
+ * socket, which is all connectdonetrying() needs. */
+  int i = c->nextsocket, r;
+
+  r = c->io->start (c->io->context,i,c->sockets[i].address);
+  if (r) {
+    c->sockets[i].error = r;
+    c->nextsocket ++;
+    return nextconnect (c);
+  }
+  c->sockets[i].socket = i;
+  connectattemptpending (c,i);
+  c->pending ++;
+  c->nextsocket ++;
+  c->nextconnectafter = connectnow(c) + connectstagger (c,i);
+  return NEXTCONNECT_STARTED;
+}
+
+int nextconnect (struct CONNECTIONPROGRESS *c) {
+/* Start a non-blocking connect to the next address in the list */
+  int s;
+  const struct addrinfo *ap;
+  /* char buf[200]; */
+
+  if (c->nextsocket >= c->totaladdresses) return NEXTCONNECT_NOMORE;
+    /* in progress to all possible addresses */
+  ap = c->sockets[c->nextsocket].address;
+  connectattemptstart (c,c->nextsocket);
+  if (c->io) return nextconnectio (c);
+  /*fprintf (stdout,"Enter nextconnect: %d, %lld, %s\n",
+    c->nextsocket,milliseconds(),addrinfototext(ap,buf,200)); */
+#ifdef SOCK_NONBLOCK
+  /* one system call instead of socket, fcntl(F_GETFL), fcntl(F_SETFL) */
+  s = socket(ap->ai_family, ap->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+	ap->ai_protocol);
+  if (s<0) {
+    /* Can't seem to get a socket of that type! Move on to the next one. */
+    c->sockets[c->nextsocket].error = errno;
+    c->nextsocket ++;
+    /* fprintf (stdout,"nextconnect fail 1\n"); */
+    return nextconnect (c);
+  }
+#else
+  {
+    int fcntlflags;
+
+    s = socket(ap->ai_family, ap->ai_socktype, ap->ai_protocol);
+    if (s<0) {
+      /* Can't seem to get a socket of that type! Move on to the next one. */
+      c->sockets[c->nextsocket].error = errno;
+      c->nextsocket ++;
+      /* fprintf (stdout,"nextconnect fail 1\n"); */
+      return nextconnect (c);
+    }
+    fcntlflags = fcntl(s,F_GETFL,0);
+    /* put the socket in non-blocking mode */
+    if ((fcntlflags<0) || (fcntl(s,F_SETFL,fcntlflags|O_NONBLOCK)<0)) {
+      /* Something weird wrong with the socket... Move on. */
+      c->sockets[c->nextsocket].error = errno;
+      close (s);
+      c->nextsocket ++;
+      /* fprintf (stdout,"nextconnect fail 2\n"); */
+      return nextconnect (c);
+    }
+  }
+#endif
+  c->sockets[c->nextsocket].socket = s;
+  if (c->topsocket<s) c->topsocket = s;
+  /* fprintf (stdout,"nextconnect have socket %d\n",s);
+     printaddrinfo (ap,1); */
+  if (connect(s,ap->ai_addr,ap->ai_addrlen)==0) {
+    /* Got an immediate connect. */
+    /* This really shouldn't happen, but just in case it does... */
+    /* fprintf (stdout,"nextconnect connected\n"); */
+    c->sockets[c->nextsocket].outcome = CONNECTOUTCOME_WON;
+    return c->nextsocket;
+  }
+  if (errno == EINPROGRESS) {
+    /* started the connection attempt. */
+    connectattemptpending (c,c->nextsocket);
+#ifdef EASYV6_EPOLL
+    if ((c->pollfd<0) && c->wantepoll && c->pending) connectepoll (c);
+    if (c->pollfd>=0) {
+      /* Register once, edge triggered. The socket becomes writable exactly
+       * once when the connect finishes one way or the other. */
+      struct epoll_event ev;
+      memset (&ev,0,sizeof(ev));
+      ev.events = EPOLLOUT | EPOLLET;
+      ev.data.u64 = (((uint64_t) c->polltag)<<32) | (uint64_t) c->nextsocket;
+      if (epoll_ctl (c->pollfd,EPOLL_CTL_ADD,s,&ev)) {
+        c->sockets[c->nextsocket].error = errno;
+        close (s);
+        c->sockets[c->nextsocket].socket = -1;
+        c->nextsocket ++;
+        return nextconnect (c);
+      }
+    }
+#endif
+    c->pending ++;
+    c->nextsocket ++;
+    c->nextconnectafter = connectnow(c) + 
+	connectstagger (c,c->nextsocket-1);
+    /* fprintf (stdout,"nextconnect done: started nonblocking\n"); */
+    return NEXTCONNECT_STARTED;
+  }
+  /* unexpected error, cancel the socket and try the next one. Nothing has
+   * been sent, so there is nothing to shutdown(). */
+  c->sockets[c->nextsocket].error = errno;
+  /* fprintf (stdout,"nextconnect fail 4: %d,%s\n",errno,strerror(errno)); */
+  close (s);
+  c->sockets[c->nextsocket].socket = -1;
+  c->nextsocket ++;
+  return nextconnect (c);
+}
+
+int connectdonetrying (
+  struct CONNECTIONPROGRESS *c
+, int sock /* connected socket or negative number */
+, int error /* error to assign to pending connect()s other than sock */
+) {
+  int i, sockindex=-1;
+
+  /* fprintf (stdout,"connectdonetrying enter\n"); */
+  if (sock<0) sock=-2;
+  for (i=0; i<c->totaladdresses; i++) {
+    if (c->sockets[i].socket == sock) {
+      sockindex = i;
+#ifdef EASYV6_EPOLL
+      /* the winner now belongs to the caller, not to the shared set */
+      if (c->sharedpoller) epoll_ctl (c->pollfd,EPOLL_CTL_DEL,sock,NULL);
+#endif
+    } else {
+      if (c->sockets[i].socket>=0) {
+        /* a loser never got past the handshake, so close() alone tears it
+         * down; shutdown() first would only cost another system call */
+        connectclose (c,i);
+        c->sockets[i].socket=-1;
+        /* still connecting: cancelled, unless it's the clock that ran out */
+        connectattemptdone (c,i,(error==ETIMEDOUT)?
+	  CONNECTOUTCOME_FAILED:CONNECTOUTCOME_CANCELLED);
+      }
+      if (c->sockets[i].error == 0)
+        c->sockets[i].error = error;
+    }
+    if (c->details) {
+      c->details->results[i].address = c->sockets[i].address;
+      c->details->results[i].error = c->sockets[i].error;
+      c->details->results[i].outcome = c->sockets[i].outcome;
+      if (c->details->timing) {
+        c->details->timing[i].started = c->sockets[i].started;
+        c->details->timing[i].finished = c->sockets[i].finished;
+      }
+    }
+  }
+  if (c->details) {
+    c->details->dnsmicroseconds = c->begunat - c->calledat;
+    c->details->elapsedmicroseconds = connectnow(c) - c->calledat;
+  }
+  c->pending = 0;
+  if (c->writefds) {
+    /* fprintf (stdout,"connectdonetrying free writefds\n"); */
+    free (c->writefds);
+    c->writefds = NULL;
+    c->fdsetbytes = 0;
+  }
+  if ((c->pollfd>=0) && !c->sharedpoller) close (c->pollfd);
+  c->pollfd = -1;
+  return sockindex;
+}
+
+fd_set *fdsetalloc (fd_set **set, size_t *bytes, int topsocket) {
+  size_t fdsbytes;
+
+  if (topsocket<0) return *set;
+  /* FD_SET() works a long at a time */
+  fdsbytes = ((topsocket/(8*sizeof(long))) + 1) * sizeof(long);
+  if (fdsbytes<sizeof(fd_set)) fdsbytes=sizeof(fd_set);
+  if (*bytes>=fdsbytes) { /* block is reusable */
+    memset (*set,0,*bytes);
+    return *set;
+  }
+  if (*set==NULL) { /* fetch or enlarge block */
+    *set = (fd_set *) malloc (fdsbytes);
+  } else {
+    *set = (fd_set *) realloc((void*) *set, fdsbytes);
+  }
+  if (! (*set)) return NULL;
+  memset (*set,0,fdsbytes);
+  *bytes = fdsbytes;
+  return *set;
+}
+
+#define WAITFORCONNECT_NOMORE -1
+#define WAITFORCONNECT_DONEXT -3
+#define WAITFORCONNECT_CRITFAIL -4
+
+int connectfinished (struct CONNECTIONPROGRESS *c, int i, int error);
+
+int connectcompleted (
+/* The socket at index i reported writable: it either connected or failed.
+ * Return the index of the connected socket, or -1 after closing a failed
+ * one. */
+  struct CONNECTIONPROGRESS *c
+, int i
+, int events /* poll() revents (epoll uses the same bits), or 0 if the
+              * poller didn't say why the socket is ready */
+) {
+  if ((i<0) || (i>=c->nextsocket) || (c->sockets[i].socket<0)) return -1;
+  /* A failed connect() always raises POLLERR, so writable without it
+   * means connected and there's no need to ask with getsockopt(). */
+  if ((events&POLLOUT) && !(events&(POLLERR|POLLHUP)))
+    return connectfinished (c,i,0);
+  return connectfinished (c,i,getsocketerrno (c->sockets[i].socket));
+}
+
+int connectfinished (
+/* Attempt i connected if error is 0 or else failed. Returns the same as
+ * connectcompleted() */
+  struct CONNECTIONPROGRESS *c
+, int i
+, int error
+) {
+  c->sockets[i].error = error;
+  if (!error) { /* Connected! */
+    /*fprintf (stdout,"waitforconnect Connected! socket=%d, "
+	"index=%d\n", c->sockets[i].socket,i); */
+    connectattemptdone (c,i,CONNECTOUTCOME_WON);
+    return connectdonetrying (c,c->sockets[i].socket,0);
+  }
+  connectattemptdone (c,i,CONNECTOUTCOME_FAILED);
+  /*fprintf (stdout,"waitforconnect socket %d index %d failed "
+	"with %d(%s)\n", c->sockets[i].socket,i,c->sockets[i].error,
+	strerror(c->sockets[i].error));*/
+  connectclose (c,i);
+  c->sockets[i].socket=-1;
+  c->pending --;
+  return -1;
+}
+
+int waitforconnectselect (
+/* One select() pass over the pending sockets. Return the index of a
+ * connected socket, WAITFORCONNECT_DONEXT if something failed, or 
+ * WAITFORCONNECT_NOMORE if nothing finished within wait. */
+  struct CONNECTIONPROGRESS *c
+, long long wait
+) {
+  int i, r, somethingfailed;
+  struct timeval selecttimeout;
+  fd_set local, *writefds = &local;
+
+  /* flag the pending sockets, in memory fetched for an fd_set only if the
+   * descriptors are too big for an ordinary one */
+  if (c->topsocket<FD_SETSIZE) FD_ZERO (writefds);
+  else if (!(writefds=fdsetalloc (&(c->writefds),&(c->fdsetbytes),
+      c->topsocket)))
+    return WAITFORCONNECT_CRITFAIL;
+  for (i=0; i<c->nextsocket; i++) 
+    if (c->sockets[i].socket>=0) FD_SET(c->sockets[i].socket,writefds);
+
+  /* Stuff wait into a timeval structure for select */
+  selecttimeout.tv_sec = (time_t) (wait/1000000LL);
+  selecttimeout.tv_usec = (suseconds_t) (wait%1000000LL);
+
+  /* wait until a socket connects or fails, or until the time out
+   * expires. */
+  r = select (c->topsocket+1, NULL, writefds, NULL, &selecttimeout);
+  if ((r<0)&&(errno!=EINTR)) return WAITFORCONNECT_CRITFAIL;
+  if (r<=0) return WAITFORCONNECT_NOMORE;
+
+  /* any sockets which are writable are either connected or failed */
+  for (somethingfailed=i=0; i<c->nextsocket; i++) {
+    if (c->sockets[i].socket<0) continue;
+    if (!FD_ISSET(c->sockets[i].socket,writefds)) continue;
+    r = connectcompleted (c,i,0);
+    if (r>=0) return r;
+    somethingfailed = 1;
+  }
+  if (somethingfailed) return WAITFORCONNECT_DONEXT;
+  return WAITFORCONNECT_NOMORE;
+}
+
+#ifdef EASYV6_EPOLL
+#define EPOLLBATCH 16
+
+char epoll_nopwait2 = 0; /* the kernel said ENOSYS */
+
+int epollwaitus (
+/* epoll_wait() for wait microseconds. epoll_pwait2() (Linux 5.11) takes
+ * them as they are; before that, round up to whole milliseconds so as
+ * never to wake before a deadline */
+  int pollfd
+, struct epoll_event *events
+, int max
+, long long wait
+) {
+#ifdef __NR_epoll_pwait2
+  struct timespec ts;
+  int n;
+
+  if (!epoll_nopwait2) {
+    ts.tv_sec = (time_t) (wait/1000000LL);
+    ts.tv_nsec = (long) ((wait%1000000LL)*1000LL);
+    n = (int) syscall (__NR_epoll_pwait2,pollfd,events,max,&ts,NULL,
+	(size_t) 0);
+    if ((n>=0) || (errno!=ENOSYS)) return n;
+    epoll_nopwait2 = 1;
+  }
+#endif
+  wait = (wait+999LL)/1000LL;
+  if (wait>(long long) INT_MAX) wait = (long long) INT_MAX;
+  return epoll_wait (pollfd,events,max,(int) wait);
+}
+
+int waitforconnectepoll (
+/* Same as waitforconnectselect() but only visits the sockets epoll says
+ * are ready. */
+  struct CONNECTIONPROGRESS *c
+, long long wait
+) {
+  struct epoll_event events[EPOLLBATCH];
+  int i, r, n, somethingfailed;
+
+  n = epollwaitus (c->pollfd,events,EPOLLBATCH,wait);
+  if ((n<0)&&(errno!=EINTR)) return WAITFORCONNECT_CRITFAIL;
+  for (somethingfailed=i=0; i<n; i++) {
+    r = connectcompleted (c,(int) (events[i].data.u64 & 0xffffffffULL),
+	(int) events[i].events);
+    if (r>=0) return r;
+    somethingfailed = 1;
+  }
+  if (somethingfailed) return WAITFORCONNECT_DONEXT;
+  return WAITFORCONNECT_NOMORE;
+}
+
+int waitforconnectone (
+/* While only one attempt is in flight and no epoll set has been made yet,
+ * poll() that one socket. */
+  struct CONNECTIONPROGRESS *c
+, long long wait
+) {
+  struct pollfd p;
+  struct timespec ts;
+  int i, r;
+
+  for (i=0; (i<c->nextsocket) && (c->sockets[i].socket<0); i++);
+  /* with nothing in flight ppoll() just sleeps, like select() with an
+   * empty set does */
+  p.fd = (i<c->nextsocket)?c->sockets[i].socket:-1;
+  p.events = POLLOUT;
+  p.revents = 0;
+  ts.tv_sec = (time_t) (wait/1000000LL);
+  ts.tv_nsec = (long) ((wait%1000000LL)*1000LL);
+  r = ppoll (&p,1,&ts,NULL);
+  if ((r<0)&&(errno!=EINTR)) return WAITFORCONNECT_CRITFAIL;
+  if (r<=0) return WAITFORCONNECT_NOMORE;
+  r = connectcompleted (c,i,(int) p.revents);
+  if (r>=0) return r;
+  return WAITFORCONNECT_DONEXT;
+}
+#endif
+
+int waitforconnectio (
+/* Same as waitforconnectselect() through c->io */
+  struct CONNECTIONPROGRESS *c
+, long long wait
+) {
+  int i, error, r;
+
+  i = c->io->wait (c->io->context,wait,&error);
+  if ((i<0) || (i>=c->nextsocket) || (c->sockets[i].socket<0)) 
+    return WAITFORCONNECT_NOMORE;
+  r = connectfinished (c,i,error);
+  if (r>=0) return r;
+  return WAITFORCONNECT_DONEXT;
+}
+
+int waitforconnect (
+/* Wait up to wait microseconds for one of the pending sockets to connect
+ * or fail. Return the index of the successfully connected socket,
+ * WAITFORCONNECT_DONEXT if an attempt failed, WAITFORCONNECT_NOMORE if
+ * nothing finished or WAITFORCONNECT_CRITFAIL */
+  struct CONNECTIONPROGRESS *c
+, long long wait
+) {
+  if (wait<0LL) wait=0LL;
+  if (c->io) return waitforconnectio (c,wait);
+#ifdef EASYV6_EPOLL
+  if (c->pollfd>=0) return waitforconnectepoll (c,wait);
+  if (c->wantepoll && (c->pending<=1)) return waitforconnectone (c,wait);
+#endif
+  return waitforconnectselect (c,wait);
+}
+
+long long connectnextdeadline (
+/* When the race next needs attention: the next staggered connect() or
+ * giving up, whichever is sooner, on the microseconds() clock. */
+  struct CONNECTIONPROGRESS *c
+) {
+  if ((c->nextsocket<c->totaladdresses) && (c->nextconnectafter<c->finishby))
+    return c->nextconnectafter;
+  return c->finishby;
+}
+
+long long connectnextdeadlinems (
+/* The same on the milliseconds() clock, rounded up */
+  struct CONNECTIONPROGRESS *c
+) {
+  return (connectnextdeadline(c)+999LL)/1000LL;
+}
+
+#define CONNECTADVANCE_PENDING -5
+#define CONNECTADVANCE_TIMEDOUT -6
+
+int connectschedule (struct CONNECTIONPROGRESS *c, int startnext);
+
+int connectadvance (
+/* One turn of the connect race: wait up to wait microseconds (but no later
+ * than the next deadline) for a pending attempt to finish, then start the
+ * next attempt if it is due. Return the index of the connected socket,
+ * CONNECTADVANCE_PENDING if the race goes on, or WAITFORCONNECT_NOMORE,
+ * WAITFORCONNECT_CRITFAIL or CONNECTADVANCE_TIMEDOUT if it is lost. */
+  struct CONNECTIONPROGRESS *c
+, long long wait
+) {
+  long long now;
+  int r, startnext = 0;
+
+  now = connectnow (c);
+  if (c->pending) {
+    if (wait > connectnextdeadline(c)-now) wait = connectnextdeadline(c)-now;
+    r = waitforconnect (c,wait);
+    if ((r>=0) || (r==WAITFORCONNECT_CRITFAIL)) return r;
+    if (r==WAITFORCONNECT_DONEXT) startnext = 1;
+  }
+  return connectschedule (c,startnext);
+}
+
+int connectschedule (
+/* Give up if the race is out of time. Otherwise start the next attempt if
+ * it is due, if nothing is pending or if startnext says one just failed.
+ * Returns the same values as connectadvance(). */
+  struct CONNECTIONPROGRESS *c
+, int startnext
+) {
+  long long now;
+  int r;
+
+  now = connectnow (c);
+  if (now>=c->finishby) return CONNECTADVANCE_TIMEDOUT;
+  if ((c->nextsocket<c->totaladdresses) && 
+      (startnext || (!c->pending) || (now>=c->nextconnectafter))) {
+    r = nextconnect (c);
+    if (r>=0) /* immediate connect: release the others */
+      return connectdonetrying (c,c->sockets[r].socket,0);
+  }
+  if ((!c->pending) && (c->nextsocket>=c->totaladdresses) && 
+      !c->morecoming) 
+    return WAITFORCONNECT_NOMORE;
+  return CONNECTADVANCE_PENDING;
+}
+
+struct CONNECTIONPROGRESS *connectbegin (
+/* Set up a connect race to addresses. Returns NULL if there is nothing
+ * to try or no memory. */
+  const struct addrinfo *addresses
+, long long timeout
+, struct CONNECTOPTIONS *options
+, const char *name /* what addresses came from, to use and update the */
+, const char *service /* connect history. NULL if unknown */
+, long long calledat /* microseconds() when the caller started looking up
+                     * the addresses, or 0 if it didn't */
+, void *space /* where to keep the race if it fits, or NULL for the heap */
+, size_t spacebytes
+) {
+  struct CONNECTIONPROGRESS *c;
+
+  /* give myself at least 100 ms (or as the options say) to finish */
+  timeout *= 1000LL;
+  if (timeout < connectoption (options,options->connectfloor,
+      CONNECT_RACEFLOOR))
+    timeout = connectoption (options,options->connectfloor,
+	CONNECT_RACEFLOOR);
+  c = allocconnectionstruct(addresses,timeout,options,name,service,space,
+	spacebytes,NULL);
+  if (!c) return NULL;
+  if (calledat>0LL) {
+    c->calledat = calledat;
+    c->lookedup = 1;
+  }
+  options->numaddresses=c->totaladdresses;
+  if (c->details) options->details = c->details;
+  return c;
+}
+
+struct CONNECTIONPROGRESS *connectmerge (
+/* RFC 8305 section 3: addresses from a lookup which answered after the
+ * race began join the attempts not yet started, alternating families with
+ * them from the family not tried last. more must stay allocated until the
+ * race ends. Returns the race, which may have moved, or NULL if out of
+ * memory, leaving c as it was. */
+  struct CONNECTIONPROGRESS *c
+, const struct addrinfo *more
+, struct CONNECTOPTIONS *options
+) {
+  struct CONNECTIONPROGRESS *grown;
+  struct CONNECTBYNAMEDETAILS *details;
+  const struct addrinfo *a, *like, *skip, **candidates;
+  const struct addrinfo *local[2*CONNECT_LOCALADDRESSES];
+  int numnew, remaining, total, slot, i, n, dead;
+  size_t bytes;
+
+  for (numnew=0, a=more; a!=NULL; a=a->ai_next) numnew++;
+  if (numnew<1) return c;
+  remaining = c->totaladdresses - c->nextsocket;
+  total = remaining + numnew;
+  /* second half is scratch space for interleavefamilies() */
+  candidates = local;
+  if (total>CONNECT_LOCALADDRESSES)
+    candidates = malloc (sizeof(struct addrinfo *)*total*2);
+  if (!candidates) return NULL;
+  for (i=0, a=more; a!=NULL; a=a->ai_next,i++) candidates[i] = a;
+  for (skip=options->skip; skip; skip=skip->ai_next) {
+    for (i=0; i<numnew; i++) 
+      if (compareaddrinfo (candidates[i],skip)) candidates[i]=NULL;
+  }
+  /* liked newcomers go ahead of everything not started yet */
+  slot = 0;
+  for (like=options->like; like; like=like->ai_next) {
+    for (i=slot; i<numnew; i++) {
+      if (compareaddrinfo (candidates[i],like)) {
+        a = candidates[i];
+        memmove (candidates+slot+1,candidates+slot,
+		sizeof(*candidates)*(i-slot));
+        candidates[slot++] = a;
+      }
+    }
+  }
+  for (n=i=slot; i<numnew; i++) {
+    if (candidates[i] && !options->dnspinning) candidates[n++]=candidates[i];
+  }
+  dead = n - slot;
+  n = slot + connectdeadorder (candidates+slot,n-slot,
+	slot+remaining+c->pending,candidates+total,&(c->deadprobes));
+  dead -= n - slot;
+  c->deadskipped += dead;
+  if (n<1) {
+    if (candidates!=local) free (candidates);
+    c->skipped += numnew - dead;
+    return c;
+  }
+  if (options->sortaddresses) sortrfc6724 (candidates+slot,n-slot);
+  /* then the newcomers and the rest, starting with the family which
+   * wasn't tried last */
+  if ((c->nextsocket>0) && (n>slot) &&
+      (c->sockets[c->nextsocket-1].address->ai_family == 
+       candidates[slot]->ai_family)) {
+    memmove (candidates+slot+remaining,candidates+slot,
+	sizeof(*candidates)*(n-slot));
+    for (i=0; i<remaining; i++) 
+      candidates[slot+i] = c->sockets[c->nextsocket+i].address;
+  } else {
+    for (i=0; i<remaining; i++) 
+      candidates[n+i] = c->sockets[c->nextsocket+i].address;
+  }
+  total = n + remaining;
+  if (!options->nointerleave) 
+    interleavefamilies (candidates+slot,total-slot,1,candidates+total);
+  connecthistoryorder (c->historykey,c->historykeylen,candidates+slot,
+	total-slot);
+
+  total += c->nextsocket;
+  if (c->details) {
+    details = (struct CONNECTBYNAMEDETAILS*) realloc (c->details,
+	connectdetailsbytes (total,options));
+    if (!details) {
+      if (candidates!=local) free (candidates);
+      return NULL;
+    }
+    connectdetailstiming (details,total,options);
+    c->details = options->details = details;
+  }
+  bytes = sizeof(struct CONNECTIONPROGRESS) + 
+          (sizeof(struct SOCKETINPROGRESS)*total) + c->historykeylen;
+  if (c->inplace) { /* outgrowing the caller's space: move to the heap */
+    grown = (struct CONNECTIONPROGRESS*) malloc (bytes);
+    if (grown) {
+      memcpy (grown,c,sizeof(struct CONNECTIONPROGRESS) + 
+	(sizeof(struct SOCKETINPROGRESS)*c->totaladdresses) + 
+	c->historykeylen);
+      grown->inplace = 0;
+    }
+  } else grown = (struct CONNECTIONPROGRESS*) realloc (c,bytes);
+  if (!grown) {
+    if (candidates!=local) free (candidates);
+    return NULL;
+  }
+  c = grown;
+  if (c->historykeylen) { /* key still goes after the last of the sockets */
+    memmove (c->sockets+total,c->sockets+c->totaladdresses,
+	c->historykeylen);
+    c->historykey = (char*) (c->sockets+total);
+  }
+  for (i=c->nextsocket; i<total; i++) {
+    c->sockets[i].address = candidates[i-c->nextsocket];
+    c->sockets[i].socket = -1;
+    c->sockets[i].error = 0;
+    c->sockets[i].outcome = CONNECTOUTCOME_NOTSTARTED;
+    c->sockets[i].started = c->sockets[i].finished = 0LL;
+  }
+  if (candidates!=local) free (candidates);
+  c->skipped += numnew - n - dead;
+  c->totaladdresses = total;
+  options->numaddresses = total;
+  return c;
+}
+
+void connectsharepoller (
+/* Register this race's attempts in the caller's epoll set instead of its
+ * own, with tag in the upper 32 bits of each event's data. Call before the
+ * first connectschedule(). */
+  struct CONNECTIONPROGRESS *c
+, int pollfd
+, uint32_t tag
+) {
+  if (pollfd<0) return;
+  if ((c->pollfd>=0) && !c->sharedpoller) close (c->pollfd);
+  c->pollfd = pollfd;
+  c->polltag = tag;
+  c->sharedpoller = 1;
+}
+
+void connectstatsrace (
+/* Count a race connectend() is wrapping up. The totals are taken from
+ * what the race already recorded, so nothing is counted per attempt */
+  struct CONNECTIONPROGRESS *c
+, int sockindex /* winner, or WAITFORCONNECT_... */
+) {
+  struct CONNECTSTATSSLAB *slab = connectstatsslab ();
+  struct CONNECTSTATS *s;
+  int i, attempts=0, cancelled=0;
+
+  if (!slab) return;
+  s = &(slab->counts);
+  for (i=0; i<c->totaladdresses; i++) {
+    if (c->sockets[i].started) attempts++;
+    if (c->sockets[i].outcome==CONNECTOUTCOME_CANCELLED) cancelled++;
+  }
+  connectstatsadd (&(s->races),1ULL);
+  connectstatsadd (&(s->attempts),(unsigned long long) attempts);
+  if (cancelled)
+    connectstatsadd (&(s->cancelled),(unsigned long long) cancelled);
+  if (c->skipped)
+    connectstatsadd (&(s->skipped),(unsigned long long) c->skipped);
+  if (c->deadskipped)
+    connectstatsadd (&(s->deadskipped),(unsigned long long) c->deadskipped);
+  if (c->deadprobes)
+    connectstatsadd (&(s->deadprobes),(unsigned long long) c->deadprobes);
+  if (c->lookedup) connectstatsrecord (&(s->dns),c->begunat-c->calledat);
+  if (sockindex>=0) {
+    connectstatsadd (&(s->connected),1ULL);
+    if (c->sockets[sockindex].address->ai_family==AF_INET)
+      connectstatsadd (&(s->winsipv4),1ULL);
+    else if (c->sockets[sockindex].address->ai_family==AF_INET6)
+      connectstatsadd (&(s->winsipv6),1ULL);
+    connectstatsrecord (&(s->connect),
+	c->sockets[sockindex].finished-c->begunat);
+  } else if (sockindex==WAITFORCONNECT_NOMORE) {
+    connectstatsadd (&(s->failures),1ULL);
+  } else if (sockindex!=WAITFORCONNECT_CRITFAIL) {
+    connectstatsadd (&(s->timeouts),1ULL);
+  }
+}
+
+int connectend (
+/* Wrap up a connect race which connectadvance() says is over and free it.
+ * Return the connected socket or -1 and set errno. */
+  struct CONNECTIONPROGRESS *c
+, int sockindex
+, struct CONNECTOPTIONS *options
+) {
+  int i;
+
+  if (sockindex>=0) { /* connected */
+    int sock = c->sockets[sockindex].socket;
+    /* fprintf (stdout,"connectbyaddrinfo connected: %d(%d) ",
+       sock,sockindex);
+       printaddrinfo (c->sockets[sockindex].address,1); */
+    errno=0;
+    if (options->reportpicked) 
+      options->picked= (struct addrinfo*) c->sockets[sockindex].address;
+    connecthistoryrecord (c,sockindex);
+    connectdeadrecord (c,sockindex);
+    connectstatsrace (c,sockindex);
+    connectracefree (c);
+    return sock;
+  }
+  if (sockindex==WAITFORCONNECT_CRITFAIL) {
+    connectdonetrying(c,-1,ENOMEM);
+    connectstatsrace (c,sockindex);
+    options->picked=NULL;
+    errno = ENOMEM;
+    connectracefree (c);
+    return -1;
+  }
+  if (sockindex==WAITFORCONNECT_NOMORE) {
+    /* Tried and failed on all candidate addresses */
+    errno=0;
+    connectdonetrying(c,-1,0);
+    connecthistoryrecord (c,-1);
+    connectdeadrecord (c,-1);
+    connectstatsrace (c,sockindex);
+    for (i=0; i<c->totaladdresses; i++) 
+      if (c->sockets[i].error>errno) errno=c->sockets[i].error;
+    if (errno<=0) errno=EBADF;
+    options->picked=NULL;
+    connectracefree (c);
+    return -1;
+  }
+  /* No connection within the allotted timeout (or abandoned) */
+  connectdonetrying(c,-1,ETIMEDOUT);
+  connecthistoryrecord (c,-1);
+  connectdeadrecord (c,-1);
+  connectstatsrace (c,sockindex);
+  errno=0;
+  for (i=0; i<c->totaladdresses; i++)
+    if (c->sockets[i].error>errno) errno=c->sockets[i].error;
+  if (errno<=0) errno=ETIMEDOUT;
+  options->picked=NULL;
+  connectracefree (c);
+  return -1;
+}
+
+#ifdef EASYV6_URING
+/* io_uring without liburing: the three system calls and the shared rings
+ * as <linux/io_uring.h> lays them out. Only the thread which owns a ring
+ * touches it, and nothing uses SQPOLL, so the kernel reads submissions
+ * only inside io_uring_enter(). */
+struct URING {
+  int fd;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqring, *cqring;
+  size_t sqringbytes, cqringbytes, sqesbytes;
+  unsigned sqentries;
+  unsigned features;  /* IORING_FEAT_... from io_uring_setup() */
+  unsigned tosubmit;  /* sqes filled in but not handed to the kernel yet */
+  unsigned inflight;  /* operations whose last cqe hasn't been reaped */
+};
+
+#define URINGENTRIES 64
+
+void uringclose (struct URING *u) {
+  if (!u) return;
+  if (u->sqes) munmap (u->sqes,u->sqesbytes);
+  if (u->cqring && (u->cqring!=u->sqring)) munmap (u->cqring,u->cqringbytes);
+  if (u->sqring) munmap (u->sqring,u->sqringbytes);
+  if (u->fd>=0) close (u->fd);
+  free (u);
+}
+
+struct URING *uringopen (
+/* Set up a ring with room for entries submissions. Returns NULL and sets
+ * errno if the kernel has no io_uring (ENOSYS), forbids it (EPERM) or
+ * lacks an operation the connect race needs (EOPNOTSUPP). */
+  unsigned entries
+) {
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  struct URING *u;
+  size_t probebytes;
+  int fd, i, ops[5] = { IORING_OP_CONNECT, IORING_OP_LINK_TIMEOUT,
+    IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE, IORING_OP_ASYNC_CANCEL };
+
+  memset (&p,0,sizeof(p));
+  fd = (int) syscall (__NR_io_uring_setup,entries,&p);
+  if (fd<0) return NULL;
+  u = (struct URING*) calloc (1,sizeof(struct URING));
+  if (!u) {
+    close (fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  u->fd = fd;
+  u->sqentries = p.sq_entries;
+  u->features = p.features;
+
+  /* a kernel too old to probe is too old to connect */
+  probebytes = sizeof(struct io_uring_probe) + 
+	256*sizeof(struct io_uring_probe_op);
+  probe = (struct io_uring_probe*) calloc (1,probebytes);
+  if (!probe) {
+    uringclose (u);
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (syscall (__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256)) {
+    free (probe);
+    uringclose (u);
+    errno = EOPNOTSUPP;
+    return NULL;
+  }
+  for (i=0; i<5; i++) {
+    if ((ops[i]>probe->last_op) || 
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      free (probe);
+      uringclose (u);
+      errno = EOPNOTSUPP;
+      return NULL;
+    }
+  }
+  free (probe);
+
+  u->sqringbytes = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  u->cqringbytes = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cqringbytes>u->sqringbytes) u->sqringbytes = u->cqringbytes;
+    u->cqringbytes = u->sqringbytes;
+  }
+  u->sqring = mmap (NULL,u->sqringbytes,PROT_READ|PROT_WRITE,
+	MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+  if (u->sqring==MAP_FAILED) {
+    u->sqring = NULL;
+    uringclose (u);
+    return NULL;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) u->cqring = u->sqring;
+  else {
+    u->cqring = mmap (NULL,u->cqringbytes,PROT_READ|PROT_WRITE,
+	MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+    if (u->cqring==MAP_FAILED) {
+      u->cqring = NULL;
+      uringclose (u);
+      return NULL;
+    }
+  }
+  u->sqesbytes = p.sq_entries*sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe*) mmap (NULL,u->sqesbytes,
+	PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+  if (u->sqes==MAP_FAILED) {
+    u->sqes = NULL;
+    uringclose (u);
+    return NULL;
+  }
+  u->sqhead = (unsigned*) ((char*) u->sqring + p.sq_off.head);
+  u->sqtail = (unsigned*) ((char*) u->sqring + p.sq_off.tail);
+  u->sqmask = (unsigned*) ((char*) u->sqring + p.sq_off.ring_mask);
+  u->sqarray = (unsigned*) ((char*) u->sqring + p.sq_off.array);
+  u->cqhead = (unsigned*) ((char*) u->cqring + p.cq_off.head);
+  u->cqtail = (unsigned*) ((char*) u->cqring + p.cq_off.tail);
+  u->cqmask = (unsigned*) ((char*) u->cqring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*) ((char*) u->cqring + p.cq_off.cqes);
+  return u;
+}
+
+int uringenter (
+/* Hand the queued sqes to the kernel and, if waitfor, wait for that many
+ * completions or for wait milliseconds (negative waits as long as it
+ * takes). Returns 0, or -1 and sets errno. Timing out isn't an error. */
+  struct URING *u
+, unsigned waitfor
+, long long wait
+) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = 0;
+  void *argp = NULL;
+  size_t argbytes = 0;
+  int r;
+
+  if (waitfor) flags |= IORING_ENTER_GETEVENTS;
+  if (waitfor && (wait>=0LL) && (u->features & IORING_FEAT_EXT_ARG)) {
+    memset (&arg,0,sizeof(arg));
+    ts.tv_sec = wait/1000LL;
+    ts.tv_nsec = (wait%1000LL)*1000000LL;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+    argp = &arg;
+    argbytes = sizeof(arg);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  r = (int) syscall (__NR_io_uring_enter,u->fd,u->tosubmit,waitfor,flags,
+	argp,argbytes);
+  if (r<0) {
+    if ((errno==ETIME) || (errno==EINTR) || (errno==EBUSY)) return 0;
+    return -1;
+  }
+  if ((unsigned) r>u->tosubmit) r = (int) u->tosubmit;
+  u->tosubmit -= (unsigned) r;
+  return 0;
+}
+
+struct io_uring_sqe *uringsqe (
+/* A cleared sqe to fill in, with at least room-1 more free after it, so
+ * that linked sqes go to the kernel together. Submits what's queued if
+ * the ring is too full. NULL if it stays full. */
+  struct URING *u
+, unsigned room
+) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  tail = *u->sqtail;
+  if (tail+room-__atomic_load_n(u->sqhead,__ATOMIC_ACQUIRE)>u->sqentries) {
+    if (uringenter (u,0,-1LL)) return NULL;
+    if (tail+room-__atomic_load_n(u->sqhead,__ATOMIC_ACQUIRE)>u->sqentries)
+      return NULL;
+  }
+  index = tail & *u->sqmask;
+  sqe = &(u->sqes[index]);
+  memset (sqe,0,sizeof(struct io_uring_sqe));
+  u->sqarray[index] = index;
+  /* Safe to publish before it's filled in: the kernel only looks inside
+   * io_uring_enter() */
+  __atomic_store_n (u->sqtail,tail+1,__ATOMIC_RELEASE);
+  u->tosubmit ++;
+  u->inflight ++;
+  return sqe;
+}
+
+int uringcqe (
+/* Take the next completion, if there is one. Returns 0 if there isn't */
+  struct URING *u
+, uint64_t *data
+, int *res
+, unsigned *flags
+) {
+  struct io_uring_cqe *cqe;
+  unsigned head;
+
+  head = *u->cqhead;
+  if (head==__atomic_load_n(u->cqtail,__ATOMIC_ACQUIRE)) return 0;
+  cqe = &(u->cqes[head & *u->cqmask]);
+  *data = cqe->user_data;
+  *res = cqe->res;
+  *flags = cqe->flags;
+  __atomic_store_n (u->cqhead,head+1,__ATOMIC_RELEASE);
+  /* a multishot operation keeps going while it says there's more */
+  if (!(*flags & IORING_CQE_F_MORE)) u->inflight --;
+  return 1;
+}
+
+/* One ring per thread for connectbyaddrinfo(), made on first use and
+ * closed when the thread exits. Every race leaves it with nothing in
+ * flight. */
+pthread_key_t uring_key;
+pthread_once_t uring_keyonce = PTHREAD_ONCE_INIT;
+char uring_unavailable; /* the kernel said no once; don't keep asking */
+
+void uringthreadexit (void *u) {
+  uringclose ((struct URING*) u);
+}
+
+void uringmakekey (void) {
+  if (pthread_key_create (&uring_key,uringthreadexit)) 
+    uring_unavailable = 1;
+}
+
+struct URING *uringthread (void) {
+/* This thread's ring, or NULL to use epoll or select instead */
+  struct URING *u;
+
+  if (uring_unavailable) return NULL;
+  pthread_once (&uring_keyonce,uringmakekey);
+  if (uring_unavailable) return NULL;
+  u = (struct URING*) pthread_getspecific (uring_key);
+  if (u) return u;
+  u = uringopen (URINGENTRIES);
+  if (!u) {
+    if ((errno==ENOSYS) || (errno==EPERM) || (errno==EOPNOTSUPP) ||
+        (errno==EINVAL)) 
+      uring_unavailable = 1;
+    return NULL;
+  }
+  if (pthread_setspecific (uring_key,u)) {
+    uringclose (u);
+    return NULL;
+  }
+  return u;
+}
+
+/* what a cqe's user_data is about: kind in the upper 32 bits, socket
+ * index in the lower */
+#define URING_CONNECT     1ULL
+#define URING_LINKTIMEOUT 2ULL
+#define URING_TIMER       3ULL
+#define URING_CANCEL      4ULL
+#define URINGDATA(kind,i) (((kind)<<32) | (uint64_t) (uint32_t) (i))
+
+void uringtimespec (struct __kernel_timespec *ts, long long us) {
+  if (us<0LL) us = 0LL;
+  ts->tv_sec = us/1000000LL;
+  ts->tv_nsec = (us%1000000LL)*1000LL;
+}
+
+int uringnextconnect (
+/* nextconnect() for the ring: queue an IORING_OP_CONNECT to the next
+ * address, linked to a timeout which cancels it at c->finishby. ts must
+ * stay put until the next uringenter(). */
+  struct CONNECTIONPROGRESS *c
+, struct URING *u
+, struct __kernel_timespec *ts
+) {
+  struct io_uring_sqe *sqe;
+  const struct addrinfo *ap;
+  int s;
+
+  while (c->nextsocket < c->totaladdresses) {
+    ap = c->sockets[c->nextsocket].address;
+    connectattemptstart (c,c->nextsocket);
+    s = socket(ap->ai_family, ap->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+	ap->ai_protocol);
+    if (s<0) {
+      c->sockets[c->nextsocket].error = errno;
+      c->nextsocket ++;
+      continue;
+    }
+    sqe = uringsqe (u,2);
+    if (!sqe) {
+      close (s);
+      return WAITFORCONNECT_CRITFAIL;
+    }
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = s;
+    sqe->addr = (uint64_t) (uintptr_t) ap->ai_addr;
+    sqe->off = (uint64_t) ap->ai_addrlen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URINGDATA(URING_CONNECT,c->nextsocket);
+    uringtimespec (ts,c->finishby-microseconds());
+    sqe = uringsqe (u,1);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) ts;
+    sqe->len = 1;
+    sqe->user_data = URINGDATA(URING_LINKTIMEOUT,c->nextsocket);
+
+    c->sockets[c->nextsocket].socket = s;
+    if (c->topsocket<s) c->topsocket = s;
+    connectattemptpending (c,c->nextsocket);
+    c->pending ++;
+    c->nextsocket ++;
+    c->nextconnectafter = microseconds() + 
+	connectstagger (c,c->nextsocket-1);
+    return NEXTCONNECT_STARTED;
+  }
+  return NEXTCONNECT_NOMORE;
+}
+
+int connecturing (
+/* The connectadvance() loop on io_uring. Attempts are IORING_OP_CONNECTs,
+ * each linked to a timeout at c->finishby, and an IORING_OP_TIMEOUT wakes
+ * the loop when the next attempt is due, so the only system calls are
+ * socket() and io_uring_enter(). Losers are cancelled through the ring
+ * and their completions reaped before returning. Returns what
+ * connectadvance() would once the race is over. */
+  struct CONNECTIONPROGRESS *c
+, struct URING *u
+) {
+  struct __kernel_timespec linkts, timerts;
+  struct io_uring_sqe *sqe;
+  uint64_t data;
+  unsigned flags;
+  long long now;
+  int i, res, timer = 0, startnext = 1, winner = -1;
+  int r = CONNECTADVANCE_TIMEDOUT;
+
+  for (;;) {
+    now = microseconds();
+    if (now>=c->finishby) {
+      r = CONNECTADVANCE_TIMEDOUT;
+      break;
+    }
+    if ((c->nextsocket<c->totaladdresses) && 
+        (startnext || (!c->pending) || (now>=c->nextconnectafter))) {
+      r = uringnextconnect (c,u,&linkts);
+      if (r==WAITFORCONNECT_CRITFAIL) break;
+      startnext = 0;
+    }
+    if (!c->pending) {
+      r = WAITFORCONNECT_NOMORE;
+      break;
+    }
+    if ((!timer) && (c->nextsocket<c->totaladdresses)) {
+      sqe = uringsqe (u,1);
+      if (!sqe) {
+        r = WAITFORCONNECT_CRITFAIL;
+        break;
+      }
+      uringtimespec (&timerts,connectnextdeadline(c)-now);
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = (uint64_t) (uintptr_t) &timerts;
+      sqe->len = 1;
+      sqe->user_data = URINGDATA(URING_TIMER,0);
+      timer = 1;
+    }
+    if (uringenter (u,1,-1LL)) {
+      r = WAITFORCONNECT_CRITFAIL;
+      break;
+    }
+    while (uringcqe (u,&data,&res,&flags)) {
+      i = (int) (data & 0xffffffffULL);
+      if ((data>>32)==URING_TIMER) timer = 0;
+      if ((data>>32)!=URING_CONNECT) continue;
+      if ((i<0) || (i>=c->nextsocket) || (c->sockets[i].socket<0)) continue;
+      if (!res && (winner<0)) { /* Connected! */
+        winner = i;
+        connectattemptdone (c,i,CONNECTOUTCOME_WON);
+        continue;
+      }
+      /* the linked timeout cancels what's still connecting at finishby.
+       * A second connection in the same batch came too late to win, but
+       * wasn't cancelled either: it's a failure with no error */
+      c->sockets[i].error = (res==-ECANCELED)?ETIMEDOUT:-res;
+      connectattemptdone (c,i,CONNECTOUTCOME_FAILED);
+      close (c->sockets[i].socket);
+      c->sockets[i].socket = -1;
+      c->pending --;
+      startnext = 1;
+    }
+    if (winner>=0) break;
+  }
+
+  /* Cancel the losers and the timer, then wait for everything to come
+   * back so that the next race on this thread starts with an empty ring */
+  for (i=0; i<c->nextsocket; i++) {
+    if ((i==winner) || (c->sockets[i].socket<0)) continue;
+    sqe = uringsqe (u,1);
+    if (!sqe) break;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URINGDATA(URING_CONNECT,i);
+    sqe->user_data = URINGDATA(URING_CANCEL,i);
+  }
+  if (timer && (sqe=uringsqe (u,1))) {
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = URINGDATA(URING_TIMER,0);
+    sqe->user_data = URINGDATA(URING_CANCEL,-1);
+  }
+  while (u->inflight) {
+    if (uringenter (u,1,-1LL)) break;
+    while (uringcqe (u,&data,&res,&flags)) {
+      i = (int) (data & 0xffffffffULL);
+      if (((data>>32)==URING_CONNECT) && (res<0) && (res!=-ECANCELED) &&
+          (i>=0) && (i<c->nextsocket) && (i!=winner))
+        c->sockets[i].error = -res;
+    }
+  }
+  if (winner>=0) return connectdonetrying (c,c->sockets[winner].socket,0);
+  return r;
+}
+#endif
+
+int connectrace (
+/* connectbyaddrinfo(), learning from the race if name and service say
+ * where the addresses came from */
+  const struct addrinfo *addresses
+, long long timeout
+, struct CONNECTOPTIONS *options
+, const char *name
+, const char *service
+, long long calledat /* microseconds() before the name lookup, or 0 */
+) {
+  struct CONNECTIONPROGRESS *c;
+  int sockindex;
+  struct CONNECTOPTIONS nooptions;
+  union { /* room for a race to a few addresses without malloc() */
+    struct CONNECTIONPROGRESS c;
+    char bytes[CONNECT_STACKBYTES];
+  } local;
+  void *space = &local;
+  size_t spacebytes = sizeof(local);
+
+  /* fprintf (stdout,"connectbyaddrinfo enter\n"); */
+  if (!options) {
+    options = &nooptions;
+    memset ((void*) options,0,sizeof(struct CONNECTOPTIONS));
+  }
+  if (options->arena && (options->arenabytes>spacebytes)) {
+    space = options->arena;
+    spacebytes = options->arenabytes;
+  }
+
+  c = connectbegin (addresses,timeout,options,name,service,calledat,space,
+	spacebytes);
+  if (!c) {
+    errno = ENOMEM;
+    return -1;
+  }
+#ifdef EASYV6_URING
+  if (options->poller==CONNECTPOLLER_URING) {
+    struct URING *u = uringthread ();
+
+    /* without io_uring this is an ordinary epoll race */
+    if (u) return connectend (c,connecturing (c,u),options);
+  }
+#endif
+  sockindex = connectadvance (c,0LL);
+  while (sockindex==CONNECTADVANCE_PENDING)
+    sockindex = connectadvance (c,connectnextdeadline(c)-microseconds());
+  return connectend (c,sockindex,options);
+}
+
+int connectbyaddrinfo (
+  const struct addrinfo *addresses
+, long long timeout
+, struct CONNECTOPTIONS *options
+) {
+  return connectrace (addresses,timeout,options,NULL,NULL,0LL);
+}
+
+/* Race simulation. connectsimulate() runs the real scheduling code above
+ * through a CONNECTIO whose clock only moves when the race waits, against
+ * addresses whose every attempt is decided, from the seed, as it starts.
+ * SYNs that are lost go again after 1, 3, 7... seconds, as Linux resends
+ * them. The addresses are in the benchmarking prefixes, 198.18.0.0/15 and
+ * 2001:2::/48, each in a prefix of its own for the simulation's own RTT
+ * table, so nothing it does reaches real races. */
+#define CONNECTSIM_MAXADDRESSES 256
+#define CONNECTSIM_NEVER 0x7fffffffffffffffLL
+#define CONNECTSIM_SYNRTO 1000000LL /* first SYN retransmission, us */
+
+struct CONNECTSIM {
+  const struct CONNECTSIMADDRESS *addresses;
+  struct addrinfo *nodes; /* the same, as a race sees them */
+  int count;
+  long long now;          /* the virtual clock, microseconds */
+  uint64_t random;
+  long long *finish;      /* by attempt: when it's decided, or NEVER */
+  uint64_t *rttslots;     /* what the races learn, CONNECTRTT_SLOTS long */
+  int *error;             /* and how */
+};
+
+double connectsimrandom (struct CONNECTSIM *sim) {
+/* Uniform in [0,1): xorshift64* */
+  sim->random ^= sim->random >> 12;
+  sim->random ^= sim->random << 25;
+  sim->random ^= sim->random >> 27;
+  return (double) ((sim->random*2685821657736338717ULL)>>11) / 
+	9007199254740992.0;
+}
+
+long long connectsimnow (void *context) {
+  return ((struct CONNECTSIM*) context)->now;
+}
+
+int connectsimstart (
+/* Decide now how attempt i will end */
+  void *context
+, int i
+, const struct addrinfo *address
+) {
+  struct CONNECTSIM *sim = (struct CONNECTSIM*) context;
+  const struct CONNECTSIMADDRESS *a = sim->addresses + (address-sim->nodes);
+  long long rtt, sent, rto;
+
+  rtt = a->rtt;
+  if (a->jitter>0LL) 
+    rtt += (long long) ((2.0*connectsimrandom(sim)-1.0)*(double) a->jitter);
+  if (rtt<1LL) rtt = 1LL;
+  sim->error[i] = 0;
+  if (connectsimrandom(sim) < a->refuse) {
+    sim->error[i] = ECONNREFUSED;
+    sim->finish[i] = sim->now + rtt;
+    return 0;
+  }
+  for (sent=0LL, rto=CONNECTSIM_SYNRTO; connectsimrandom(sim) < a->loss;
+       sent+=rto, rto*=2LL) {
+    if (rto>CONNECTSIM_NEVER/4LL) { /* a blackhole */
+      sim->finish[i] = CONNECTSIM_NEVER;
+      return 0;
+    }
+  }
+  sim->finish[i] = sim->now + sent + rtt;
+  return 0;
+}
+
+int connectsimwait (
+/* Move the clock on to the first attempt to finish, or by wait */
+  void *context
+, long long wait
+, int *error
+) {
+  struct CONNECTSIM *sim = (struct CONNECTSIM*) context;
+  int i, first = -1;
+
+  for (i=0; i<sim->count; i++) {
+    if (sim->finish[i]==CONNECTSIM_NEVER) continue;
+    if ((first<0) || (sim->finish[i]<sim->finish[first])) first = i;
+  }
+  if ((first<0) || (sim->finish[first]>sim->now+wait)) {
+    sim->now += wait;
+    return -1;
+  }
+  if (sim->finish[first]>sim->now) sim->now = sim->finish[first];
+  sim->finish[first] = CONNECTSIM_NEVER; /* reported */
+  *error = sim->error[first];
+  return first;
+}
+
+void connectsimcancel (void *context, int i) {
+  ((struct CONNECTSIM*) context)->finish[i] = CONNECTSIM_NEVER;
+}
+
+int connectsimulate (
+  const struct CONNECTSIMADDRESS *addresses
+, int count
+, const struct CONNECTOPTIONS *options
+, long long timeout
+, int races
+, unsigned long long seed
+, struct CONNECTSIMRESULT *result
+) {
+  struct CONNECTSIM sim;
+  struct CONNECTIO io;
+  struct CONNECTOPTIONS simoptions;
+  struct CONNECTIONPROGRESS *c;
+  struct sockaddr_in *sin;
+  struct sockaddr_in6 *sin6;
+  struct sockaddr_storage *sas;
+  union { /* as connectrace() keeps its race */
+    struct CONNECTIONPROGRESS c;
+    char bytes[CONNECT_STACKBYTES];
+  } local;
+  int i, n, r;
+
+  if (!addresses || (count<1) || (count>CONNECTSIM_MAXADDRESSES) || 
+      (races<0) || !result) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i=0; i<count; i++) {
+    if ((addresses[i].family!=AF_INET) && (addresses[i].family!=AF_INET6)) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  memset (result,0,sizeof(*result));
+  memset (&sim,0,sizeof(sim));
+  sim.nodes = (struct addrinfo*) malloc (count*(sizeof(struct addrinfo)+
+	sizeof(struct sockaddr_storage)) + 
+	count*(sizeof(long long)+sizeof(int)) + 
+	CONNECTRTT_SLOTS*sizeof(uint64_t));
+  if (!sim.nodes) return -1;
+  sas = (struct sockaddr_storage*) (sim.nodes+count);
+  sim.finish = (long long*) (sas+count);
+  sim.rttslots = (uint64_t*) (sim.finish+count);
+  sim.error = (int*) (sim.rttslots+CONNECTRTT_SLOTS);
+  memset (sim.rttslots,0,CONNECTRTT_SLOTS*sizeof(uint64_t));
+  sim.addresses = addresses;
+  sim.count = count;
+  sim.now = 1000000LL; /* started times of 0 mean never started */
+  sim.random = seed?seed:0x9e3779b97f4a7c15ULL;
+  memset (sim.nodes,0,count*(sizeof(struct addrinfo)+
+	sizeof(struct sockaddr_storage)));
+  for (i=0; i<count; i++) {
+    sim.nodes[i].ai_family = addresses[i].family;
+    sim.nodes[i].ai_socktype = SOCK_STREAM;
+    sim.nodes[i].ai_protocol = IPPROTO_TCP;
+    sim.nodes[i].ai_addr = (struct sockaddr*) (sas+i);
+    sim.nodes[i].ai_next = (i+1<count)?sim.nodes+i+1:NULL;
+    if (addresses[i].family==AF_INET) {
+      sin = (struct sockaddr_in*) (sas+i);
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(9);
+      sin->sin_addr.s_addr = htonl(0xc6120001U | ((unsigned) i<<8));
+      sim.nodes[i].ai_addrlen = sizeof(*sin);
+    } else {
+      sin6 = (struct sockaddr_in6*) (sas+i);
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(9);
+      sin6->sin6_addr.s6_addr[0] = 0x20;
+      sin6->sin6_addr.s6_addr[1] = 0x01;
+      sin6->sin6_addr.s6_addr[3] = 0x02;
+      sin6->sin6_addr.s6_addr[7] = (unsigned char) i;
+      sin6->sin6_addr.s6_addr[15] = 1;
+      sim.nodes[i].ai_addrlen = sizeof(*sin6);
+    }
+  }
+  for (i=0; i<count; i++) sim.finish[i] = CONNECTSIM_NEVER;
+  io.context = &sim;
+  io.now = connectsimnow;
+  io.start = connectsimstart;
+  io.wait = connectsimwait;
+  io.cancel = connectsimcancel;
+  io.rttslots = sim.rttslots;
+
+  /* the timing and ordering options; none that need real sockets */
+  memset (&simoptions,0,sizeof(simoptions));
+  if (options) simoptions = *options;
+  simoptions.like = simoptions.skip = NULL;
+  simoptions.dnspinning = 0; /* with no like, it would leave nothing */
+  simoptions.reportdetails = 0;
+  simoptions.poller = CONNECTPOLLER_SELECT;
+  timeout *= 1000LL;
+  if (timeout < connectoption (&simoptions,simoptions.connectfloor,
+      CONNECT_RACEFLOOR))
+    timeout = connectoption (&simoptions,simoptions.connectfloor,
+	CONNECT_RACEFLOOR);
+
+  for (n=0; n<races; n++) {
+    c = allocconnectionstruct (sim.nodes,timeout,&simoptions,NULL,NULL,
+	&local,sizeof(local),&io);
+    if (!c) {
+      free (sim.nodes);
+      errno = ENOMEM;
+      return -1;
+    }
+    r = connectadvance (c,0LL);
+    while (r==CONNECTADVANCE_PENDING)
+      r = connectadvance (c,connectnextdeadline(c)-connectnow(c));
+    if (r<0) connectdonetrying (c,-1,(r==WAITFORCONNECT_NOMORE)?0:ETIMEDOUT);
+    result->races++;
+    for (i=0; i<c->totaladdresses; i++) {
+      if (c->sockets[i].started) result->attempts++;
+      if (c->sockets[i].outcome==CONNECTOUTCOME_CANCELLED) result->wasted++;
+    }
+    if (r>=0) {
+      result->connected++;
+      connectstatsrecord (&(result->connect),
+	c->sockets[r].finished-c->begunat);
+    }
+    connectracefree (c);
+  }
+  free (sim.nodes);
+  return 0;
+}
+
+/* GNU libc's gai_cancel() looks to see if the thread finished. If so,
+ * it accepts the cancellation. If not, it rejects. If it rejects, we
+ * must free the request once it does finish or else leak it. So, we push
+ * it on nbgai_pleasecancelme without taking a lock, and a reaper thread,
+ * started the first time that happens, frees each one after it completes.
+ * The reaper looks every NBGAI_REAPWAIT ms rather than gai_suspend()ing:
+ * glibc sets a request's result before taking its lock to notify the
+ * waiters, so a gai_suspend() which times out in between leaves its
+ * stack behind in the request's wait list. */
+struct NBGAI_PENDING {
+  struct gaicb *req;
+  struct NBGAI_PENDING *next;
+};
+
+struct NBGAI_PENDING *nbgai_pleasecancelme = NULL; /* pushed with CAS,
+                                                    * taken whole */
+sem_t nbgai_reaperwake; /* posted after each push */
+pthread_once_t nbgai_reaperonce = PTHREAD_ONCE_INIT;
+char nbgai_reaperrunning;
+
+#define NBGAI_REAPWAIT 100LL /* ms between looks at unfinished requests */
+
+void nbgai_free (
+/* release the memory of a getaddrinfo_a() request from nbgai_alloc() that
+ * glibc is done with */
+  struct gaicb *req
+, int freeresult
+) {
+  if (req->ar_name) free ((void*) req->ar_name);
+  if (req->ar_service) free ((void*) req->ar_service);
+  if (req->ar_request) free ((void*) req->ar_request);
+  if (req->ar_result && freeresult) freeaddrinfo (req->ar_result);
+  free (req);
+}
+
+void *nbgai_reaper (
+/* Free uncancellable requests once they complete. Only this thread walks
+ * the list of them. */
+  void *arg
+) {
+  struct NBGAI_PENDING *waiting = NULL, *thisone, *next, **parent;
+  struct timespec to;
+
+  to.tv_sec = (time_t) (NBGAI_REAPWAIT/1000LL);
+  to.tv_nsec = (long) ((NBGAI_REAPWAIT%1000LL)*1000000LL);
+  for (;;) {
+    if (!waiting) { /* nothing to wait for until something is pushed */
+      while (sem_wait (&nbgai_reaperwake) && (errno==EINTR));
+    } else nanosleep (&to,NULL);
+    thisone = __atomic_exchange_n (&nbgai_pleasecancelme,NULL,
+	__ATOMIC_ACQUIRE);
+    for (; thisone; thisone=next) {
+      next = thisone->next;
+      thisone->next = waiting;
+      waiting = thisone;
+    }
+    parent = &waiting;
+    while ((thisone=*parent)) {
+      /* gai_error() doesn't lock: only gai_cancel() the finished ones */
+      if ((gai_error(thisone->req)==EAI_INPROGRESS) ||
+          (gai_cancel(thisone->req)==EAI_NOTCANCELED)) {
+        parent = &(thisone->next);
+        continue;
+      }
+      /* fprintf (stdout,"Cancel later: %s:%s\n",
+         thisone->req->ar_name,thisone->req->ar_service); */
+      nbgai_free (thisone->req,1);
+      *parent = thisone->next;
+      free (thisone);
+      __atomic_fetch_sub (&nbgai_parkednow,1ULL,__ATOMIC_RELAXED);
+    }
+  }
+  return arg;
+}
+
+void nbgai_startreaper (void) {
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if (sem_init (&nbgai_reaperwake,0,0)) return;
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr,PTHREAD_CREATE_DETACHED);
+  if (!pthread_create (&tid,&attr,nbgai_reaper,NULL)) 
+    nbgai_reaperrunning = 1;
+  pthread_attr_destroy (&attr);
+}
+
+void nbgai_cancellater (
+/* We failed to gai_cancel() a getaddrinfo_a() request, so hand it to the
+ * reaper to free when it completes */
+  struct gaicb *req
+) {
+  struct NBGAI_PENDING *p;
+  struct CONNECTSTATSSLAB *slab;
+
+  pthread_once (&nbgai_reaperonce,nbgai_startreaper);
+  if (!nbgai_reaperrunning) return; /* no thread: leak it */
+  p = malloc (sizeof(*p));
+  if (!p) return;
+  p->req = req;
+  slab = connectstatsslab ();
+  if (slab) connectstatsadd (&(slab->counts.parked),1ULL);
+  __atomic_fetch_add (&nbgai_parkednow,1ULL,__ATOMIC_RELAXED);
+  p->next = __atomic_load_n (&nbgai_pleasecancelme,__ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&nbgai_pleasecancelme,&(p->next),p,
+	1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+  sem_post (&nbgai_reaperwake);
+  return;
+}
+
+
+int nbgai_freeandreturn (
+/* cancel and release the memory for a pending or recently completed
+ * getaddrinfo_a() request and then pass through rcode. */
+  struct gaicb *reqs[]
+, int rcode
+) {
+  int r;
+  if (reqs[0]) {
+    r = gai_cancel(reqs[0]);
+    if (r!=EAI_NOTCANCELED) {
+      nbgai_free (reqs[0],r==EAI_CANCELED);
+    } else {
+      nbgai_cancellater (reqs[0]);
+      /* fprintf (stdout,"getaddrinfo could not cancel %s:%s\n",
+         reqs[0]->ar_name,reqs[0]->ar_service);*/
+    }
+  }
+  return rcode;
+}
+
+struct gaicb *nbgai_alloc (
+/* Allocate a getaddrinfo_a() request the way nbgai_freeandreturn() and
+ * the reaper expect to free it. NULL if out of memory. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+) {
+  struct gaicb *reqs[1];
+  struct addrinfo *hintsm;
+
+  reqs[0] = malloc(sizeof(*reqs[0]));
+  if (reqs[0]==NULL) return NULL;
+  memset(reqs[0], 0, sizeof(*reqs[0]));
+  /*       struct gaicb {
+   *           const char            *ar_name;
+   *           const char            *ar_service;
+   *           const struct addrinfo *ar_request;
+   *           struct addrinfo       *ar_result;
+   *       };
+   */
+  if (node) reqs[0]->ar_name = strdup (node);
+  if (service) reqs[0]->ar_service = strdup (service);
+  hintsm = (struct addrinfo*) malloc (sizeof (struct addrinfo));
+  if (!hintsm) {
+    nbgai_freeandreturn (reqs,EAI_MEMORY);
+    return NULL;
+  }
+  if (hints) {
+    memcpy (hintsm,hints,sizeof(struct addrinfo));
+    hintsm->ai_addr = NULL;
+    hintsm->ai_canonname = NULL;
+    hintsm->ai_next = NULL;
+  } else {
+    memset (hintsm,0,sizeof(struct addrinfo));
+  }
+  reqs[0]->ar_request = hintsm;
+  if ((node && !reqs[0]->ar_name) || (service && !reqs[0]->ar_service)) {
+    nbgai_freeandreturn (reqs,EAI_MEMORY);
+    return NULL;
+  }
+  return reqs[0];
+}
+
+int timeoutgetaddrinfolookup (const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res,
+	long long *timeout);
+
+struct addrinfo *copyaddrinfolist (
+/* Duplicate a whole addrinfo chain, laid out the way GNU libc's
+ * freeaddrinfo() expects: each sockaddr in the same block as its addrinfo.
+ * NULL if out of memory. */
+  const struct addrinfo *list
+) {
+  struct addrinfo *head = NULL, **tail = &head, *a;
+
+  for (; list; list=list->ai_next) {
+    a = (struct addrinfo*) malloc (sizeof(*a)+list->ai_addrlen);
+    if (!a) {
+      if (head) freeaddrinfo (head);
+      return NULL;
+    }
+    memcpy (a,list,sizeof(*a));
+    a->ai_addr = NULL;
+    if (list->ai_addr && list->ai_addrlen) {
+      a->ai_addr = (struct sockaddr*) (a+1);
+      memcpy (a->ai_addr,list->ai_addr,list->ai_addrlen);
+    }
+    a->ai_canonname = NULL;
+    a->ai_next = NULL;
+    *tail = a;
+    tail = &(a->ai_next);
+    if (list->ai_canonname) {
+      a->ai_canonname = strdup (list->ai_canonname);
+      if (!a->ai_canonname) {
+        freeaddrinfo (head);
+        return NULL;
+      }
+    }
+  }
+  return head;
+}
+
+/* Name cache for timeoutgetaddrinfo(). Entries are spread over
+ * DNSCACHE_SHARDS independently locked hash tables so that lookups of
+ * different names don't contend, and readers of the same shard share
+ * a read lock. getaddrinfo() doesn't tell us record TTLs so the caller
+ * configures one. */
+#define DNSCACHE_SHARDS 64
+#define DNSCACHE_BUCKETS 64
+
+struct DNSCACHEENTRY {
+  struct DNSCACHEENTRY *next;
+  unsigned hash;
+  int family, socktype, protocol, flags; /* from the hints */
+  int error;            /* 0 or a cached EAI_NONAME */
+  long long expires;    /* milliseconds() after which it's stale */
+  struct addrinfo *addresses;
+  char key[2];          /* node and service, each \0 terminated */
+};
+
+struct DNSFLIGHT {
+/* A lookup under way which identical ones wait for instead of repeating */
+  struct DNSFLIGHT *next;
+  unsigned hash;
+  int family, socktype, protocol, flags; /* from the hints */
+  int refs;             /* the caller looking it up and those waiting */
+  int done;             /* error and addresses are filled in */
+  int error;
+  struct addrinfo *addresses; /* each waiter takes a copy */
+  pthread_cond_t landed;
+  char key[2];          /* node and service, each \0 terminated */
+};
+
+struct DNSCACHESHARD {
+  pthread_rwlock_t lock;
+  struct DNSCACHEENTRY *buckets[DNSCACHE_BUCKETS];
+  int entries;
+  unsigned long long hits, misses, stale, negative; /* atomic */
+  pthread_mutex_t flightlock;
+  struct DNSFLIGHT *flights; /* few at once, so a list will do */
+  unsigned long long coalesced; /* atomic */
+};
+
+struct DNSCACHESHARD dnscache_shards[DNSCACHE_SHARDS];
+pthread_once_t dnscache_once = PTHREAD_ONCE_INIT;
+long long dnscache_ttl = 0LL;  /* 0: cache disabled */
+long long dnscache_negativettl = 0LL;
+long long dnscache_maxstale = 0LL;
+int dnscache_maxentries = 0;
+
+void dnscacheinit (void) {
+  int i;
+
+  memset (dnscache_shards,0,sizeof(dnscache_shards));
+  for (i=0; i<DNSCACHE_SHARDS; i++) {
+    pthread_rwlock_init (&(dnscache_shards[i].lock),NULL);
+    pthread_mutex_init (&(dnscache_shards[i].flightlock),NULL);
+  }
+}
+
+unsigned dnscachehash (
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+) {
+  unsigned h = 2166136261U; /* FNV-1a */
+  const unsigned char *p;
+
+  for (p=(const unsigned char*) node; *p; p++) h = (h^*p) * 16777619U;
+  h = (h^'\0') * 16777619U;
+  for (p=(const unsigned char*) service; *p; p++) h = (h^*p) * 16777619U;
+  h = (h^(unsigned) hints->ai_family) * 16777619U;
+  h = (h^(unsigned) hints->ai_socktype) * 16777619U;
+  h = (h^(unsigned) hints->ai_protocol) * 16777619U;
+  h = (h^(unsigned) hints->ai_flags) * 16777619U;
+  return h;
+}
+
+struct DNSCACHEENTRY *dnscachefind (
+/* Call with the shard locked */
+  struct DNSCACHESHARD *shard
+, unsigned hash
+, const char *node
+, const char *service
+, const struct addrinfo *hints
+) {
+  struct DNSCACHEENTRY *e;
+
+  for (e=shard->buckets[(hash/DNSCACHE_SHARDS)%DNSCACHE_BUCKETS]; e; e=e->next){
+    if ((e->hash!=hash) || (e->family!=hints->ai_family) ||
+        (e->socktype!=hints->ai_socktype) ||
+        (e->protocol!=hints->ai_protocol) || (e->flags!=hints->ai_flags))
+      continue;
+    if (strcmp(e->key,node)) continue;
+    if (strcmp(e->key+strlen(e->key)+1,service)) continue;
+    return e;
+  }
+  return NULL;
+}
+
+#define DNSCACHE_MISS 0
+#define DNSCACHE_FRESH 1
+#define DNSCACHE_STALE 2
+
+int dnscacheread (
+/* Copy a cached answer into *res, or its error into *error. Returns
+ * DNSCACHE_FRESH, DNSCACHE_STALE (expired but within maxstale) or
+ * DNSCACHE_MISS. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+, int *error
+, struct DNSCACHESHARD **shardp /* output: the shard, for its counters */
+) {
+  struct addrinfo nohints;
+  struct DNSCACHESHARD *shard;
+  struct DNSCACHEENTRY *e;
+  unsigned hash;
+  long long now;
+  int r = DNSCACHE_MISS;
+
+  if (!hints) {
+    memset (&nohints,0,sizeof(nohints));
+    hints = &nohints;
+  }
+  hash = dnscachehash (node,service,hints);
+  *shardp = shard = dnscache_shards + (hash%DNSCACHE_SHARDS);
+  now = milliseconds();
+  pthread_rwlock_rdlock (&(shard->lock));
+  e = dnscachefind (shard,hash,node,service,hints);
+  if (e && (e->expires>now)) r = DNSCACHE_FRESH;
+  else if (e && (e->expires+dnscache_maxstale>now)) r = DNSCACHE_STALE;
+  if (r!=DNSCACHE_MISS) {
+    *error = e->error;
+    *res = NULL;
+    if (!e->error) {
+      *res = copyaddrinfolist (e->addresses);
+      if (!*res) r = DNSCACHE_MISS;
+    }
+  }
+  pthread_rwlock_unlock (&(shard->lock));
+  return r;
+}
+
+void dnscachewrite (
+/* Cache a lookup's answer or its EAI_NONAME */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, const struct addrinfo *addresses
+, int error
+, long long ttl /* ms the resolver says the answer is good for, or 0 */
+) {
+  struct addrinfo nohints;
+  struct DNSCACHESHARD *shard;
+  struct DNSCACHEENTRY *e, **pe, **oldest;
+  size_t nodelen, servicelen;
+  unsigned hash;
+  int i;
+
+  if (!dnscache_ttl || !node || !service) return;
+  if (error && !dnscache_negativettl) return;
+  if (!hints) {
+    memset (&nohints,0,sizeof(nohints));
+    hints = &nohints;
+  }
+  nodelen = strlen(node);
+  servicelen = strlen(service);
+  e = (struct DNSCACHEENTRY*) malloc (sizeof(*e)+nodelen+servicelen);
+  if (!e) return;
+  memset (e,0,sizeof(*e));
+  if (!error) {
+    e->addresses = copyaddrinfolist (addresses);
+    if (!e->addresses) {
+      free (e);
+      return;
+    }
+  }
+  memcpy (e->key,node,nodelen+1);
+  memcpy (e->key+nodelen+1,service,servicelen+1);
+  e->hash = hash = dnscachehash (node,service,hints);
+  e->family = hints->ai_family;
+  e->socktype = hints->ai_socktype;
+  e->protocol = hints->ai_protocol;
+  e->flags = hints->ai_flags;
+  e->error = error;
+  if (error) ttl = dnscache_negativettl;
+  else if (!ttl || (ttl>dnscache_ttl)) ttl = dnscache_ttl;
+  e->expires = milliseconds() + ttl;
+
+  shard = dnscache_shards + (hash%DNSCACHE_SHARDS);
+  pthread_rwlock_wrlock (&(shard->lock));
+  pe = &(shard->buckets[(hash/DNSCACHE_SHARDS)%DNSCACHE_BUCKETS]);
+  for (; *pe; pe=&((*pe)->next)) { /* replace an existing entry */
+    if (((*pe)->hash!=hash) || ((*pe)->family!=e->family) ||
+        ((*pe)->socktype!=e->socktype) || ((*pe)->protocol!=e->protocol) ||
+        ((*pe)->flags!=e->flags) || strcmp((*pe)->key,node) ||
+        strcmp((*pe)->key+nodelen+1,service)) continue;
+    e->next = (*pe)->next;
+    if ((*pe)->addresses) freeaddrinfo ((*pe)->addresses);
+    free (*pe);
+    *pe = e;
+    pthread_rwlock_unlock (&(shard->lock));
+    return;
+  }
+  if (dnscache_maxentries && (shard->entries >= 
+      (dnscache_maxentries+DNSCACHE_SHARDS-1)/DNSCACHE_SHARDS)) {
+    /* Shard is full: evict whichever entry expires first */
+    oldest = NULL;
+    for (i=0; i<DNSCACHE_BUCKETS; i++) 
+      for (pe=&(shard->buckets[i]); *pe; pe=&((*pe)->next)) 
+        if (!oldest || ((*pe)->expires < (*oldest)->expires)) oldest = pe;
+    if (oldest) {
+      struct DNSCACHEENTRY *victim = *oldest;
+      *oldest = victim->next;
+      if (victim->addresses) freeaddrinfo (victim->addresses);
+      free (victim);
+      shard->entries--;
+    }
+  }
+  pe = &(shard->buckets[(hash/DNSCACHE_SHARDS)%DNSCACHE_BUCKETS]);
+  e->next = *pe;
+  *pe = e;
+  shard->entries++;
+  pthread_rwlock_unlock (&(shard->lock));
+}
+
+int dnscacheget (
+/* Look for a fresh cached answer. Returns 1 and fills in *res and *error
+ * on a hit, 0 on a miss. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+, int *error
+) {
+  struct DNSCACHESHARD *shard;
+  struct addrinfo *cached = NULL;
+
+  if (!dnscache_ttl || !node || !service) return 0;
+  if (dnscacheread (node,service,hints,&cached,error,&shard)==DNSCACHE_FRESH){
+    __atomic_fetch_add ((*error)?&(shard->negative):&(shard->hits),1ULL,
+	__ATOMIC_RELAXED);
+    *res = cached;
+    return 1;
+  }
+  if (cached) freeaddrinfo (cached);
+  __atomic_fetch_add (&(shard->misses),1ULL,__ATOMIC_RELAXED);
+  return 0;
+}
+
+int dnscacheresolved (
+/* Record the outcome r of a lookup which missed the cache. If it failed
+ * for a reason other than the name not existing and an expired answer is
+ * still within maxstale, serve that instead. Returns the error to report,
+ * with *res filled in when it's 0. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, int r
+, struct addrinfo **res
+, long long ttl /* ms the answer is good for if the resolver said, or 0 */
+) {
+  struct DNSCACHESHARD *shard;
+  struct addrinfo *cached = NULL;
+  int error;
+
+  if (!dnscache_ttl || !node || !service) return r;
+  if (!r) {
+    dnscachewrite (node,service,hints,*res,0,ttl);
+    return 0;
+  }
+  if (r==EAI_NONAME) {
+    dnscachewrite (node,service,hints,NULL,EAI_NONAME,0LL);
+    return r;
+  }
+  if (dnscacheread (node,service,hints,&cached,&error,&shard)==DNSCACHE_MISS) 
+    return r;
+  __atomic_fetch_add (&(shard->stale),1ULL,__ATOMIC_RELAXED);
+  *res = cached;
+  return error;
+}
+
+void dnsflightfree (struct DNSFLIGHT *f) {
+  if (f->addresses) freeaddrinfo (f->addresses);
+  pthread_cond_destroy (&(f->landed));
+  free (f);
+}
+
+int dnsflightjoin (
+/* Wait for an identical lookup which is already under way, or else start
+ * one for others to wait for. Returns 1 with *res and *error filled in
+ * if waiting got an answer, or the time ran out. Otherwise returns 0 and
+ * sets *flight (NULL if it can't be shared) for the caller to look the
+ * name up and pass to dnsflightland(). If the lookup waited for times
+ * out while this caller still has time, it takes over. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+, int *error
+, long long *timeout
+, struct DNSFLIGHT **flight
+) {
+  struct addrinfo nohints;
+  struct DNSCACHESHARD *shard;
+  struct DNSFLIGHT *f;
+  pthread_condattr_t attr;
+  struct timespec until;
+  size_t nodelen, servicelen;
+  long long startat, wait;
+  unsigned hash;
+  int done, last;
+
+  *flight = NULL;
+  if (!node || !service) return 0;
+  if (!hints) {
+    memset (&nohints,0,sizeof(nohints));
+    hints = &nohints;
+  }
+  pthread_once (&dnscache_once,dnscacheinit);
+  hash = dnscachehash (node,service,hints);
+  shard = dnscache_shards + (hash%DNSCACHE_SHARDS);
+  nodelen = strlen(node);
+  servicelen = strlen(service);
+  startat = milliseconds();
+  /* the condition variable runs on CLOCK_MONOTONIC, like milliseconds() */
+  clock_gettime (CLOCK_MONOTONIC,&until);
+  wait = (*timeout>0LL)?*timeout:0LL;
+  until.tv_sec += (time_t) (wait/1000LL);
+  until.tv_nsec += (long) ((wait%1000LL)*1000000LL);
+  if (until.tv_nsec>=1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock (&(shard->flightlock));
+  for (;;) {
+    for (f=shard->flights; f; f=f->next) {
+      if ((f->hash!=hash) || (f->family!=hints->ai_family) ||
+          (f->socktype!=hints->ai_socktype) ||
+          (f->protocol!=hints->ai_protocol) || (f->flags!=hints->ai_flags) ||
+          strcmp(f->key,node) || strcmp(f->key+nodelen+1,service)) continue;
+      break;
+    }
+    if (!f) { /* the first to ask looks it up */
+      f = (struct DNSFLIGHT*) malloc (sizeof(*f)+nodelen+servicelen);
+      if (f) {
+        memset (f,0,sizeof(*f));
+        f->hash = hash;
+        f->family = hints->ai_family;
+        f->socktype = hints->ai_socktype;
+        f->protocol = hints->ai_protocol;
+        f->flags = hints->ai_flags;
+        f->refs = 1;
+        memcpy (f->key,node,nodelen+1);
+        memcpy (f->key+nodelen+1,service,servicelen+1);
+        pthread_condattr_init (&attr);
+        pthread_condattr_setclock (&attr,CLOCK_MONOTONIC);
+        pthread_cond_init (&(f->landed),&attr);
+        pthread_condattr_destroy (&attr);
+        f->next = shard->flights;
+        shard->flights = f;
+      }
+      pthread_mutex_unlock (&(shard->flightlock));
+      *flight = f;
+      *timeout -= milliseconds()-startat; /* any spent waiting to retry */
+      return 0;
+    }
+    f->refs++;
+    __atomic_fetch_add (&(shard->coalesced),1ULL,__ATOMIC_RELAXED);
+    while (!f->done && 
+	(pthread_cond_timedwait (&(f->landed),&(shard->flightlock),&until)
+	!=ETIMEDOUT)) ;
+    done = f->done;
+    if (done && (f->error==EAI_AGAIN) && (milliseconds()-startat<*timeout)) {
+      /* it ran out of time before this caller did: try again */
+      if (!--f->refs) dnsflightfree (f);
+      continue;
+    }
+    break;
+  }
+  pthread_mutex_unlock (&(shard->flightlock));
+  /* the reference keeps f's answer until the copy is made */
+  *res = NULL;
+  *error = done?f->error:EAI_AGAIN;
+  if (done && !f->error) {
+    *res = copyaddrinfolist (f->addresses);
+    if (!*res) *error = EAI_MEMORY;
+  }
+  pthread_mutex_lock (&(shard->flightlock));
+  last = !--f->refs;
+  pthread_mutex_unlock (&(shard->flightlock));
+  if (last) dnsflightfree (f);
+  *timeout -= milliseconds()-startat;
+  return 1;
+}
+
+void dnsflightland (
+/* Give the outcome of a lookup started by dnsflightjoin() to whoever
+ * waited for it */
+  struct DNSFLIGHT *f
+, int r
+, const struct addrinfo *res
+) {
+  struct DNSCACHESHARD *shard;
+  struct DNSFLIGHT **pf;
+  struct addrinfo *copy = NULL;
+  int waiters, last;
+
+  if (!f) return;
+  shard = dnscache_shards + (f->hash%DNSCACHE_SHARDS);
+  pthread_mutex_lock (&(shard->flightlock));
+  for (pf=&(shard->flights); *pf; pf=&((*pf)->next)) {
+    if (*pf!=f) continue;
+    *pf = f->next; /* later callers start a lookup of their own */
+    break;
+  }
+  waiters = f->refs-1;
+  pthread_mutex_unlock (&(shard->flightlock));
+  /* nobody new can join, so copy outside the lock if anyone's waiting */
+  if (waiters && !r) {
+    copy = copyaddrinfolist (res);
+    if (!copy) r = EAI_MEMORY;
+  }
+  pthread_mutex_lock (&(shard->flightlock));
+  f->error = r;
+  f->addresses = copy;
+  f->done = 1;
+  pthread_cond_broadcast (&(f->landed));
+  last = !--f->refs;
+  pthread_mutex_unlock (&(shard->flightlock));
+  if (last) dnsflightfree (f);
+}
+
+int dnscacheconfigure (
+  long long ttl
+, long long negativettl
+, long long maxstale
+, int maxentries
+) {
+  pthread_once (&dnscache_once,dnscacheinit);
+  if ((ttl<0LL) || (negativettl<0LL) || (maxstale<0LL) || (maxentries<0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  dnscache_negativettl = negativettl;
+  dnscache_maxstale = maxstale;
+  dnscache_maxentries = maxentries;
+  dnscache_ttl = ttl;
+  if (!ttl) dnscacheflush();
+  return 0;
+}
+
+void dnscacheflush (void) {
+  struct DNSCACHEENTRY *e;
+  int i, j;
+
+  pthread_once (&dnscache_once,dnscacheinit);
+  for (i=0; i<DNSCACHE_SHARDS; i++) {
+    pthread_rwlock_wrlock (&(dnscache_shards[i].lock));
+    for (j=0; j<DNSCACHE_BUCKETS; j++) {
+      while ((e=dnscache_shards[i].buckets[j])) {
+        dnscache_shards[i].buckets[j] = e->next;
+        if (e->addresses) freeaddrinfo (e->addresses);
+        free (e);
+      }
+    }
+    dnscache_shards[i].entries = 0;
+    pthread_rwlock_unlock (&(dnscache_shards[i].lock));
+  }
+}
+
+void dnscachestats (
+  struct DNSCACHESTATS *stats
+, int reset
+) {
+  struct DNSCACHESHARD *shard;
+  int i;
+
+  pthread_once (&dnscache_once,dnscacheinit);
+  memset (stats,0,sizeof(*stats));
+  for (i=0; i<DNSCACHE_SHARDS; i++) {
+    shard = dnscache_shards+i;
+    if (reset) {
+      stats->hits += __atomic_exchange_n (&(shard->hits),0ULL,__ATOMIC_RELAXED);
+      stats->misses += 
+	__atomic_exchange_n (&(shard->misses),0ULL,__ATOMIC_RELAXED);
+      stats->stale += 
+	__atomic_exchange_n (&(shard->stale),0ULL,__ATOMIC_RELAXED);
+      stats->negative += 
+	__atomic_exchange_n (&(shard->negative),0ULL,__ATOMIC_RELAXED);
+      stats->coalesced += 
+	__atomic_exchange_n (&(shard->coalesced),0ULL,__ATOMIC_RELAXED);
+    } else {
+      stats->hits += __atomic_load_n (&(shard->hits),__ATOMIC_RELAXED);
+      stats->misses += __atomic_load_n (&(shard->misses),__ATOMIC_RELAXED);
+      stats->stale += __atomic_load_n (&(shard->stale),__ATOMIC_RELAXED);
+      stats->negative += 
+	__atomic_load_n (&(shard->negative),__ATOMIC_RELAXED);
+      stats->coalesced += 
+	__atomic_load_n (&(shard->coalesced),__ATOMIC_RELAXED);
+    }
+    pthread_rwlock_rdlock (&(shard->lock));
+    stats->entries += (unsigned long long) shard->entries;
+    pthread_rwlock_unlock (&(shard->lock));
+  }
+}
+
+/* Built-in stub resolver. An alternative to getaddrinfo_a() which needs
+ * no threads: the A and AAAA questions go out together over one
+ * non-blocking UDP socket to the nameservers in resolv.conf, answers are
+ * parsed in place, truncated answers are asked again over TCP and the
+ * record TTLs are kept. /etc/hosts is consulted first. Turned on by
+ * stubresolverconfigure(). */
+#define STUB_MAXSERVERS 3       /* MAXNS in resolv.h */
+#define STUB_MAXSEARCH 6
+#define STUB_MAXADDRESSES 16    /* per address family */
+#define STUB_TYPEA 1
+#define STUB_TYPECNAME 5
+#define STUB_TYPEAAAA 28
+#define STUB_TYPEOPT 41
+#define STUB_UDPSIZE 1232       /* EDNS0 buffer size, per DNS flag day 2020 */
+
+struct STUBCONFIG {
+  struct sockaddr_storage servers[STUB_MAXSERVERS];
+  socklen_t serverlens[STUB_MAXSERVERS];
+  int numservers;
+  char search[STUB_MAXSEARCH][256];
+  int numsearch;
+  int ndots;
+  int attempts;
+  long long retry;      /* ms before asking the next server */
+  char *hosts;          /* contents of the hosts file, \0 terminated */
+};
+
+struct STUBCONFIG stub_config;
+pthread_rwlock_t stub_lock = PTHREAD_RWLOCK_INITIALIZER;
+int stub_configured = 0;
+int stub_enabled = 0;   /* timeoutgetaddrinfo() and friends use it */
+
+#define STUBQ_UDP 0         /* waiting for an answer over UDP */
+#define STUBQ_TCPCONNECT 1  /* truncated: connecting to ask over TCP */
+#define STUBQ_TCPREAD 2     /* asked over TCP, reading the answer */
+#define STUBQ_DONE 3
+
+struct STUBQUESTION {
+  int type;             /* STUB_TYPEA or STUB_TYPEAAAA */
+  int state;            /* STUBQ_... */
+  int error;            /* once done: 0, EAI_NONAME or EAI_AGAIN */
+  int server;           /* index of the server last asked */
+  int sends;            /* times asked about the current name */
+  uint16_t id;
+  int tcpfd;
+  unsigned char *tcpbuf; /* 2 byte length then the answer */
+  size_t tcphave;
+  unsigned char query[300];
+  size_t querylen;
+};
+
+struct STUBQUERY {
+  struct STUBQUESTION questions[2];
+  int numquestions;
+  int udpfd;
+  int udpfamily;        /* AF_INET6 (dual stack) or AF_INET */
+  int pollfd;           /* epoll set with udpfd and any TCP sockets */
+  struct sockaddr_storage servers[STUB_MAXSERVERS];
+  socklen_t serverlens[STUB_MAXSERVERS];
+  int numservers;
+  int attempts;
+  long long retry;
+  long long resendat;   /* ask the next server if nothing by then */
+  char names[STUB_MAXSEARCH+1][256]; /* the name with search domains */
+  int numnames;
+  int nameindex;        /* the one being asked about */
+  struct in6_addr v6[STUB_MAXADDRESSES];
+  int numv6;
+  struct in_addr v4[STUB_MAXADDRESSES];
+  int numv4;
+  unsigned ttl;         /* lowest TTL seen, seconds */
+  int family, socktype, protocol, flags; /* from the hints */
+  int port;             /* network byte order */
+  int done;
+  int error;
+  char node[256];
+  char service[32];
+  char canon[256];
+};
+
+int stubparseresolvconf (
+/* Read nameserver, search, domain and options lines from path into cfg */
+  struct STUBCONFIG *cfg
+, const char *path
+) {
+  FILE *f;
+  char line[1024], *p, *word, *save;
+  struct sockaddr_in *si4;
+  struct sockaddr_in6 *si6;
+
+  f = fopen (path,"r");
+  if (!f) return -1;
+  while (fgets (line,sizeof(line),f)) {
+    p = strpbrk (line,"#;\n");
+    if (p) *p = 0;
+    word = strtok_r (line," \t",&save);
+    if (!word) continue;
+    if (!strcmp(word,"nameserver")) {
+      word = strtok_r (NULL," \t",&save);
+      if (!word || (cfg->numservers>=STUB_MAXSERVERS)) continue;
+      memset (cfg->servers+cfg->numservers,0,sizeof(cfg->servers[0]));
+      si4 = (struct sockaddr_in*) (cfg->servers+cfg->numservers);
+      si6 = (struct sockaddr_in6*) (cfg->servers+cfg->numservers);
+      if (inet_pton (AF_INET,word,&(si4->sin_addr))==1) {
+        si4->sin_family = AF_INET;
+        si4->sin_port = htons(53);
+        cfg->serverlens[cfg->numservers++] = sizeof(*si4);
+      } else if (inet_pton (AF_INET6,word,&(si6->sin6_addr))==1) {
+        si6->sin6_family = AF_INET6;
+        si6->sin6_port = htons(53);
+        cfg->serverlens[cfg->numservers++] = sizeof(*si6);
+      }
+    } else if (!strcmp(word,"search") || !strcmp(word,"domain")) {
+      /* the last of these lines wins, as in glibc */
+      cfg->numsearch = 0;
+      while ((word=strtok_r (NULL," \t",&save)) && 
+	     (cfg->numsearch<STUB_MAXSEARCH)) {
+        if (strlen(word)>=sizeof(cfg->search[0])-1) continue;
+        strcpy (cfg->search[cfg->numsearch++],word);
+      }
+    } else if (!strcmp(word,"options")) {
+      while ((word=strtok_r (NULL," \t",&save))) {
+        if (!strncmp(word,"ndots:",6)) cfg->ndots = atoi(word+6);
+        else if (!strncmp(word,"timeout:",8)) 
+          cfg->retry = 1000LL*atoi(word+8);
+        else if (!strncmp(word,"attempts:",9)) cfg->attempts = atoi(word+9);
+      }
+    }
+  }
+  fclose (f);
+  return 0;
+}
+
+char *stubreadfile (
+/* The whole of a smallish file, \0 terminated, or NULL */
+  const char *path
+) {
+  FILE *f;
+  char *buf, *bigger;
+  size_t have = 0, size = 4096, n;
+
+  f = fopen (path,"r");
+  if (!f) return NULL;
+  buf = (char*) malloc (size);
+  while (buf && (n=fread (buf+have,1,size-have-1,f))>0) {
+    have += n;
+    if (size-have-1 > 0) continue;
+    if (size>=(1<<24)) break; /* 16 MB of hosts is plenty */
+    size *= 2;
+    bigger = (char*) realloc (buf,size);
+    if (!bigger) free (buf);
+    buf = bigger;
+  }
+  fclose (f);
+  if (buf) buf[have] = 0;
+  return buf;
+}
+
+int stubresolverload (
+/* Read the configuration options asks for into cfg, without installing
+ * it. Returns -1 with errno EINVAL for a bad nameserver. */
+  const struct STUBRESOLVEROPTIONS *options
+, struct STUBCONFIG *cfg
+) {
+  const char *path;
+  struct sockaddr_in *si4;
+
+  if (options->nameserver && ((options->nameserverlen<=0) ||
+      (options->nameserverlen>sizeof(cfg->servers[0])) ||
+      ((options->nameserver->sa_family!=AF_INET) && 
+       (options->nameserver->sa_family!=AF_INET6)))) {
+    errno = EINVAL;
+    return -1;
+  }
+  memset (cfg,0,sizeof(*cfg));
+  cfg->ndots = 1;
+  cfg->attempts = 2;
+  cfg->retry = 5000LL;
+  path = options->resolvconf?options->resolvconf:"/etc/resolv.conf";
+  stubparseresolvconf (cfg,path); /* missing is fine: use defaults */
+  if (options->nameserver) {
+    memcpy (cfg->servers,options->nameserver,options->nameserverlen);
+    cfg->serverlens[0] = options->nameserverlen;
+    cfg->numservers = 1;
+  }
+  if (!cfg->numservers) { /* no nameserver lines: the local host */
+    si4 = (struct sockaddr_in*) cfg->servers;
+    si4->sin_family = AF_INET;
+    si4->sin_port = htons(53);
+    si4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cfg->serverlens[0] = sizeof(*si4);
+    cfg->numservers = 1;
+  }
+  if (options->retry>0LL) cfg->retry = options->retry;
+  if (cfg->retry<10LL) cfg->retry = 10LL;
+  if (cfg->attempts<1) cfg->attempts = 1;
+  if (cfg->ndots<0) cfg->ndots = 0;
+  path = options->hosts?options->hosts:"/etc/hosts";
+  if (*path) cfg->hosts = stubreadfile (path);
+  return 0;
+}
+
+int stubresolverconfigure (
+  const struct STUBRESOLVEROPTIONS *options
+) {
+  struct STUBCONFIG cfg;
+
+  if (!options) { /* back to getaddrinfo_a() */
+    __atomic_store_n (&stub_enabled,0,__ATOMIC_RELEASE);
+    return 0;
+  }
+  if (stubresolverload (options,&cfg)) return -1;
+
+  pthread_rwlock_wrlock (&stub_lock);
+  if (stub_config.hosts) free (stub_config.hosts);
+  stub_config = cfg;
+  stub_configured = 1;
+  __atomic_store_n (&stub_enabled,1,__ATOMIC_RELEASE);
+  pthread_rwlock_unlock (&stub_lock);
+  return 0;
+}
+
+pthread_once_t stub_defaultonce = PTHREAD_ONCE_INIT;
+
+void stubresolverdefault (void) {
+/* The system's configuration, for stubgetaddrinfo() before any
+ * stubresolverconfigure(). Leaves stub_enabled alone: calling the stub
+ * directly doesn't route anyone else's lookups through it. */
+  struct STUBRESOLVEROPTIONS defaults;
+  struct STUBCONFIG cfg;
+
+  memset (&defaults,0,sizeof(defaults));
+  if (stubresolverload (&defaults,&cfg)) return;
+  pthread_rwlock_wrlock (&stub_lock);
+  if (stub_configured) { /* configured meanwhile: that wins */
+    pthread_rwlock_unlock (&stub_lock);
+    if (cfg.hosts) free (cfg.hosts);
+    return;
+  }
+  stub_config = cfg;
+  stub_configured = 1;
+  pthread_rwlock_unlock (&stub_lock);
+}
+
+uint32_t stub_idstate = 0;
+
+uint16_t stubqueryid (void) {
+/* An unpredictable message ID makes forged answers harder to land */
+  uint32_t x;
+  struct timespec now;
+
+  clock_gettime (CLOCK_REALTIME,&now);
+  x = __atomic_add_fetch (&stub_idstate,(uint32_t) now.tv_nsec|1U,__ATOMIC_RELAXED);
+  x ^= ((uint32_t) getpid())<<16;
+  x ^= x >> 15; /* mix */
+  x *= 0x2c1b3c6dU;
+  x ^= x >> 12;
+  x *= 0x297a2d39U;
+  x ^= x >> 15;
+  return (uint16_t) x;
+}
+
+size_t stubbuildquery (
+/* Write a recursive query for name to buf. Returns its length or 0 if the
+ * name won't fit. */
+  unsigned char *buf
+, size_t size
+, const char *name
+, int type
+, uint16_t id
+) {
+  size_t i, label, out;
+
+  if (size<12+strlen(name)+2+4+11) return 0;
+  memset (buf,0,12);
+  buf[0] = id>>8;
+  buf[1] = id&0xff;
+  buf[2] = 0x01;        /* RD */
+  buf[5] = 1;           /* QDCOUNT */
+  buf[11] = 1;          /* ARCOUNT: the OPT record */
+  out = 12;
+  for (i=0; name[i]; ) {
+    for (label=0; name[i+label] && (name[i+label]!='.'); label++) ;
+    if ((label<1) || (label>63)) return 0;
+    buf[out++] = (unsigned char) label;
+    memcpy (buf+out,name+i,label);
+    out += label;
+    i += label;
+    if (name[i]=='.') i++;
+  }
+  buf[out++] = 0;
+  if (out-12>255) return 0;
+  buf[out++] = 0;
+  buf[out++] = (unsigned char) type;
+  buf[out++] = 0;
+  buf[out++] = 1;       /* IN */
+  /* EDNS0 OPT: root name, type, UDP payload size, ext rcode/flags, rdlen */
+  buf[out++] = 0;
+  buf[out++] = 0;
+  buf[out++] = STUB_TYPEOPT;
+  buf[out++] = STUB_UDPSIZE>>8;
+  buf[out++] = STUB_UDPSIZE&0xff;
+  memset (buf+out,0,6);
+  out += 6;
+  return out;
+}
+
+size_t stubskipname (
+/* Offset just past the (possibly compressed) name at off, or 0 */
+  const unsigned char *m
+, size_t len
+, size_t off
+) {
+  while (off<len) {
+    if (!m[off]) return off+1;
+    if ((m[off]&0xc0)==0xc0) return (off+2<=len)?off+2:0;
+    if (m[off]&0xc0) return 0;
+    off += m[off]+1;
+  }
+  return 0;
+}
+
+int stubreadname (
+/* Decompress the name at off into out as dotted text. 0 or -1 */
+  const unsigned char *m
+, size_t len
+, size_t off
+, char *out
+, size_t size
+) {
+  size_t o = 0;
+  int hops = 0;
+
+  while (off<len) {
+    if (!m[off]) {
+      if (o) o--; /* no trailing dot */
+      out[o] = 0;
+      return 0;
+    }
+    if ((m[off]&0xc0)==0xc0) {
+      if ((off+2>len) || (++hops>32)) return -1;
+      off = ((m[off]&0x3f)<<8) | m[off+1];
+      continue;
+    }
+    if ((m[off]&0xc0) || (off+1+m[off]>len) || (o+m[off]+2>size)) return -1;
+    memcpy (out+o,m+off+1,m[off]);
+    o += m[off];
+    out[o++] = '.';
+    off += m[off]+1;
+  }
+  return -1;
+}
+
+#define STUBPARSE_BOGUS -1      /* not an answer to this question */
+#define STUBPARSE_ANSWER 0      /* records (maybe none) were taken */
+#define STUBPARSE_NXDOMAIN 1
+#define STUBPARSE_RETRY 2       /* server failure: ask another */
+#define STUBPARSE_TRUNCATED 3
+
+int stubparse (
+/* Check that m answers question s and take its addresses and TTLs into q.
+ * Only records owned by the name asked about, or by the next alias down
+ * its CNAME chain, are taken: anything else could be a forged address.
+ * Nothing is allocated: the addresses go into q's fixed arrays. */
+  struct STUBQUERY *q
+, struct STUBQUESTION *s
+, const unsigned char *m
+, size_t len
+) {
+  size_t off, qend, i, rdlen, owner;
+  int ancount, type, class;
+  unsigned ttl;
+  char want[256], name[256];
+
+  if (len<12) return STUBPARSE_BOGUS;
+  if ((m[0]!=s->query[0]) || (m[1]!=s->query[1])) return STUBPARSE_BOGUS;
+  if (!(m[2]&0x80) || (m[2]&0x78)) return STUBPARSE_BOGUS; /* QR, QUERY */
+  if ((m[4]!=0) || (m[5]!=1)) return STUBPARSE_BOGUS;
+  /* The question must be the one asked, ignoring case (0x20 hack safe) */
+  qend = stubskipname (s->query,s->querylen,12) + 4;
+  if ((qend<16) || (len<qend)) return STUBPARSE_BOGUS;
+  for (i=12; i<qend; i++) 
+    if (tolower(m[i])!=tolower(s->query[i])) return STUBPARSE_BOGUS;
+  if (m[2]&0x02) return STUBPARSE_TRUNCATED;
+  switch (m[3]&0x0f) { /* RCODE */
+    case 0: break;
+    case 3: return STUBPARSE_NXDOMAIN;
+    default: return STUBPARSE_RETRY; /* SERVFAIL, REFUSED, ... */
+  }
+  if (stubreadname (m,len,12,want,sizeof(want))) return STUBPARSE_BOGUS;
+  ancount = (m[6]<<8) | m[7];
+  for (off=qend; ancount>0; ancount--) {
+    owner = off;
+    off = stubskipname (m,len,off);
+    if (!off || (off+10>len)) return STUBPARSE_BOGUS;
+    type = (m[off]<<8) | m[off+1];
+    class = (m[off+2]<<8) | m[off+3];
+    ttl = ((unsigned) m[off+4]<<24) | ((unsigned) m[off+5]<<16) |
+	((unsigned) m[off+6]<<8) | (unsigned) m[off+7];
+    rdlen = (m[off+8]<<8) | m[off+9];
+    off += 10;
+    if (off+rdlen>len) return STUBPARSE_BOGUS;
+    if ((class==1) && !stubreadname (m,len,owner,name,sizeof(name)) &&
+        !strcasecmp (name,want)) {
+      if (ttl&0x80000000U) ttl = 0; /* RFC 2181 section 8 */
+      if ((type==STUB_TYPEA) && (type==s->type) && (rdlen==4) &&
+          (q->numv4<STUB_MAXADDRESSES)) {
+        for (i=0; i<(size_t) q->numv4; i++) 
+          if (!memcmp(q->v4+i,m+off,4)) break;
+        if (i==(size_t) q->numv4) memcpy (q->v4+q->numv4++,m+off,4);
+        if (ttl<q->ttl) q->ttl = ttl;
+      } else if ((type==STUB_TYPEAAAA) && (type==s->type) && (rdlen==16) &&
+	  (q->numv6<STUB_MAXADDRESSES)) {
+        for (i=0; i<(size_t) q->numv6; i++) 
+          if (!memcmp(q->v6+i,m+off,16)) break;
+        if (i==(size_t) q->numv6) memcpy (q->v6+q->numv6++,m+off,16);
+        if (ttl<q->ttl) q->ttl = ttl;
+      } else if (type==STUB_TYPECNAME) {
+        /* follow the chain: the last alias in it is the canonical name */
+        if (!stubreadname (m,len,off,name,sizeof(name))) {
+          strcpy (want,name);
+          strcpy (q->canon,name);
+          if (ttl<q->ttl) q->ttl = ttl;
+        }
+      }
+    }
+    off += rdlen;
+  }
+  return STUBPARSE_ANSWER;
+}
+
+void stubserveraddr (
+/* Server i's address the way q's UDP socket needs it */
+  struct STUBQUERY *q
+, int i
+, struct sockaddr_storage *ss
+, socklen_t *len
+) {
+  struct sockaddr_in *si4 = (struct sockaddr_in*) (q->servers+i);
+  struct sockaddr_in6 *si6 = (struct sockaddr_in6*) ss;
+
+  if ((q->udpfamily==AF_INET6) && (si4->sin_family==AF_INET)) {
+    /* IPv4 server from a dual stack socket: ::ffff:a.b.c.d */
+    memset (si6,0,sizeof(*si6));
+    si6->sin6_family = AF_INET6;
+    si6->sin6_port = si4->sin_port;
+    si6->sin6_addr.s6_addr[10] = 0xff;
+    si6->sin6_addr.s6_addr[11] = 0xff;
+    memcpy (si6->sin6_addr.s6_addr+12,&(si4->sin_addr),4);
+    *len = sizeof(*si6);
+    return;
+  }
+  memcpy (ss,q->servers+i,q->serverlens[i]);
+  *len = q->serverlens[i];
+}
+
+void stubclosetcp (
+  struct STUBQUERY *q
+, struct STUBQUESTION *s
+) {
+  if (s->tcpfd>=0) {
+#ifdef EASYV6_EPOLL
+    if (q->pollfd>=0) epoll_ctl (q->pollfd,EPOLL_CTL_DEL,s->tcpfd,NULL);
+#endif
+    close (s->tcpfd);
+  }
+  s->tcpfd = -1;
+  s->tcphave = 0;
+}
+
+void stubsend (
+/* Ask question s about the current name over UDP, of the next server if
+ * next is non-zero. Marks s failed when out of attempts. */
+  struct STUBQUERY *q
+, struct STUBQUESTION *s
+, int next
+) {
+  struct sockaddr_storage ss;
+  socklen_t len;
+  int tries;
+
+  stubclosetcp (q,s);
+  if (s->sends >= q->attempts*q->numservers) {
+    s->state = STUBQ_DONE;
+    s->error = EAI_AGAIN;
+    return;
+  }
+  if (next) s->server = (s->server+1) % q->numservers;
+  s->id = stubqueryid ();
+  s->querylen = stubbuildquery (s->query,sizeof(s->query),
+	q->names[q->nameindex],s->type,s->id);
+  if (!s->querylen) {
+    s->state = STUBQ_DONE;
+    s->error = EAI_NONAME;
+    return;
+  }
+  s->state = STUBQ_UDP;
+  s->sends++;
+  /* a server the socket can't reach (IPv6 from an IPv4 socket) counts as
+   * an attempt that failed */
+  for (tries=0; tries<q->numservers; tries++) {
+    stubserveraddr (q,s->server,&ss,&len);
+    if (sendto (q->udpfd,s->query,s->querylen,MSG_NOSIGNAL,
+	(struct sockaddr*) &ss,len)==(ssize_t) s->querylen) return;
+    s->server = (s->server+1) % q->numservers;
+  }
+}
+
+void stubstarttcp (
+/* The answer to s was truncated: ask the same server again over TCP */
+  struct STUBQUERY *q
+, struct STUBQUESTION *s
+) {
+  struct sockaddr *sa = (struct sockaddr*) (q->servers+s->server);
+
+  if (!s->tcpbuf) s->tcpbuf = (unsigned char*) malloc (2+65535);
+  if (!s->tcpbuf) {
+    s->state = STUBQ_DONE;
+    s->error = EAI_MEMORY;
+    return;
+  }
+  s->tcpfd = socket (sa->sa_family,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+  if ((s->tcpfd<0) || ((connect (s->tcpfd,sa,q->serverlens[s->server])<0) &&
+      (errno!=EINPROGRESS))) {
+    stubsend (q,s,1);
+    return;
+  }
+  s->tcphave = 0;
+  s->state = STUBQ_TCPCONNECT;
+#ifdef EASYV6_EPOLL
+  if (q->pollfd>=0) {
+    struct epoll_event ev;
+
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLOUT; /* until connected: then only the answer */
+    epoll_ctl (q->pollfd,EPOLL_CTL_ADD,s->tcpfd,&ev);
+  }
+#endif
+}
+
+void stubanswer (
+/* Act on what stubparse() said about an answer to s */
+  struct STUBQUERY *q
+, struct STUBQUESTION *s
+, int r
+) {
+  switch (r) {
+    case STUBPARSE_ANSWER:
+      stubclosetcp (q,s);
+      s->state = STUBQ_DONE;
+      s->error = 0;
+      break;
+    case STUBPARSE_NXDOMAIN:
+      stubclosetcp (q,s);
+      s->state = STUBQ_DONE;
+      s->error = EAI_NONAME;
+      break;
+    case STUBPARSE_RETRY:
+      stubsend (q,s,1);
+      break;
+    case STUBPARSE_TRUNCATED:
+      if (s->state==STUBQ_UDP) stubstarttcp (q,s);
+      else stubsend (q,s,1); /* truncated over TCP: nonsense */
+      break;
+  }
+}
+
+void stubtcp (
+/* Move s's TCP exchange along without blocking */
+  struct STUBQUERY *q
+, struct STUBQUESTION *s
+) {
+  unsigned char len[2];
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct pollfd p;
+  size_t need;
+  ssize_t n;
+
+  if (s->state==STUBQ_TCPCONNECT) {
+    p.fd = s->tcpfd;
+    p.events = POLLOUT;
+    if (poll (&p,1,0)==0) return; /* still connecting */
+    if (getsocketerrno (s->tcpfd)) {
+      stubsend (q,s,1);
+      return;
+    }
+    len[0] = (unsigned char) (s->querylen>>8);
+    len[1] = (unsigned char) (s->querylen&0xff);
+    iov[0].iov_base = len;
+    iov[0].iov_len = 2;
+    iov[1].iov_base = s->query;
+    iov[1].iov_len = s->querylen;
+    memset (&msg,0,sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    /* A few hundred bytes on a fresh connection always fit */
+    if (sendmsg (s->tcpfd,&msg,MSG_NOSIGNAL)!=(ssize_t) (s->querylen+2)) {
+      stubsend (q,s,1);
+      return;
+    }
+    s->state = STUBQ_TCPREAD;
+#ifdef EASYV6_EPOLL
+    /* A connected socket is always writable: level triggered EPOLLOUT
+     * would wake the caller until the answer came */
+    if (q->pollfd>=0) {
+      struct epoll_event ev;
+
+      memset (&ev,0,sizeof(ev));
+      ev.events = EPOLLIN;
+      epoll_ctl (q->pollfd,EPOLL_CTL_MOD,s->tcpfd,&ev);
+    }
+#endif
+  }
+  while (1) {
+    need = 2;
+    if (s->tcphave>=2) need = 2 + ((s->tcpbuf[0]<<8) | s->tcpbuf[1]);
+    if (s->tcphave>=need) break;
+    n = recv (s->tcpfd,s->tcpbuf+s->tcphave,need-s->tcphave,MSG_DONTWAIT);
+    if ((n<0) && ((errno==EAGAIN) || (errno==EWOULDBLOCK))) return;
+    if (n<=0) {
+      stubsend (q,s,1);
+      return;
+    }
+    s->tcphave += n;
+  }
+  n = stubparse (q,s,s->tcpbuf+2,s->tcphave-2);
+  if (n==STUBPARSE_BOGUS) n = STUBPARSE_RETRY;
+  stubanswer (q,s,(int) n);
+}
+
+void stubudp (
+/* Read every datagram waiting on q's UDP socket */
+  struct STUBQUERY *q
+) {
+  unsigned char m[STUB_UDPSIZE+1];
+  struct sockaddr_storage from, ss;
+  socklen_t fromlen, len;
+  ssize_t n;
+  int i, r;
+
+  while (1) {
+    fromlen = sizeof(from);
+    n = recvfrom (q->udpfd,m,sizeof(m),MSG_DONTWAIT,
+	(struct sockaddr*) &from,&fromlen);
+    if (n<0) {
+      if (errno==EINTR) continue;
+      return; /* EAGAIN, or ICMP errors we'll time out on anyway */
+    }
+    for (i=0; i<q->numquestions; i++) {
+      struct STUBQUESTION *s = q->questions+i;
+
+      if (s->state!=STUBQ_UDP) continue;
+      /* only from the server asked */
+      stubserveraddr (q,s->server,&ss,&len);
+      if ((fromlen!=len) || 
+          ((ss.ss_family==AF_INET) && memcmp(
+	   &(((struct sockaddr_in*) &ss)->sin_addr),
+	   &(((struct sockaddr_in*) &from)->sin_addr),4)) ||
+          ((ss.ss_family==AF_INET6) && memcmp(
+	   &(((struct sockaddr_in6*) &ss)->sin6_addr),
+	   &(((struct sockaddr_in6*) &from)->sin6_addr),16)) ||
+          (((struct sockaddr_in*) &ss)->sin_port!=
+	   ((struct sockaddr_in*) &from)->sin_port)) continue;
+      if (n > STUB_UDPSIZE) continue; /* oversized: not ours */
+      r = stubparse (q,s,m,(size_t) n);
+      if (r==STUBPARSE_BOGUS) continue;
+      stubanswer (q,s,r);
+      break;
+    }
+  }
+}
+
+int stubhosts (
+/* Look q->node up in the hosts file. Returns 1 if found. Call with
+ * stub_lock held. */
+  struct STUBQUERY *q
+, const char *hosts
+) {
+  const char *p, *end, *tok, *next, *canon;
+  char address[64];
+  size_t len, canonlen;
+  int found = 0;
+
+  for (p=hosts; p && *p; p=end) {
+    end = strchr (p,'\n');
+    if (end) end++;
+    else end = p+strlen(p);
+    address[0] = 0;
+    canon = NULL;
+    canonlen = 0;
+    for (tok=p; tok<end; tok=next) {
+      while ((tok<end) && ((*tok==' ') || (*tok=='\t'))) tok++;
+      if ((tok>=end) || strchr("#\r\n",*tok)) break;
+      for (next=tok; (next<end) && !strchr(" \t\r\n#",*next); next++) ;
+      len = next-tok;
+      if (!address[0]) { /* the address, then its names */
+        if (len>=sizeof(address)) break;
+        memcpy (address,tok,len);
+        address[len] = 0;
+        continue;
+      }
+      if (!canon) { /* the first name is the canonical one */
+        canon = tok;
+        canonlen = len;
+      }
+      if ((len!=strlen(q->node)) || strncasecmp(tok,q->node,len)) continue;
+      if ((q->numv4<STUB_MAXADDRESSES) && 
+          (inet_pton (AF_INET,address,q->v4+q->numv4)==1)) q->numv4++;
+      else if ((q->numv6<STUB_MAXADDRESSES) &&
+          (inet_pton (AF_INET6,address,q->v6+q->numv6)==1)) q->numv6++;
+      else break;
+      if (!found && (canonlen<sizeof(q->canon))) {
+        memcpy (q->canon,canon,canonlen);
+        q->canon[canonlen] = 0;
+      }
+      found = 1;
+      break;
+    }
+  }
+  return found;
+}
+
+void stubbegin (
+/* Start asking about q->names[q->nameindex] */
+  struct STUBQUERY *q
+) {
+  int i;
+
+  for (i=0; i<q->numquestions; i++) {
+    q->questions[i].sends = 0;
+    stubsend (q,q->questions+i,0);
+  }
+  q->resendat = milliseconds() + q->retry;
+}
+
+struct addrinfo *stubresult (
+/* Turn the addresses collected in q into an addrinfo chain the way
+ * getaddrinfo() lays it out. NULL if out of memory. */
+  struct STUBQUERY *q
+, int family /* only this family, or AF_UNSPEC for what the hints said */
+) {
+  struct addrinfo *head = NULL, **tail = &head, *a;
+  struct sockaddr_in *si4;
+  struct sockaddr_in6 *si6;
+  int socktypes[2], protocols[2], numtypes, i, t, v4mapped;
+
+  if (q->socktype) {
+    socktypes[0] = q->socktype;
+    protocols[0] = q->protocol;
+    numtypes = 1;
+  } else { /* like getaddrinfo(): one of each */
+    socktypes[0] = SOCK_STREAM;
+    protocols[0] = IPPROTO_TCP;
+    socktypes[1] = SOCK_DGRAM;
+    protocols[1] = IPPROTO_UDP;
+    numtypes = 2;
+  }
+  v4mapped = (q->family==AF_INET6) && (q->flags&AI_V4MAPPED) && 
+	(!q->numv6 || (q->flags&AI_ALL));
+  for (i=0; i<q->numv6+q->numv4; i++) {
+    if ((i<q->numv6) && (q->family==AF_INET)) continue;
+    if ((i>=q->numv6) && (q->family==AF_INET6) && !v4mapped) continue;
+    if ((i<q->numv6) && (family==AF_INET)) continue;
+    if ((i>=q->numv6) && (family==AF_INET6)) continue;
+    for (t=0; t<numtypes; t++) {
+      if ((i<q->numv6) || v4mapped) {
+        a = (struct addrinfo*) malloc (sizeof(*a)+sizeof(*si6));
+        if (!a) break;
+        memset (a,0,sizeof(*a)+sizeof(*si6));
+        si6 = (struct sockaddr_in6*) (a+1);
+        si6->sin6_family = AF_INET6;
+        si6->sin6_port = q->port;
+        if (i<q->numv6) si6->sin6_addr = q->v6[i];
+        else {
+          si6->sin6_addr.s6_addr[10] = 0xff;
+          si6->sin6_addr.s6_addr[11] = 0xff;
+          memcpy (si6->sin6_addr.s6_addr+12,q->v4+(i-q->numv6),4);
+        }
+        a->ai_family = AF_INET6;
+        a->ai_addrlen = sizeof(*si6);
+      } else {
+        a = (struct addrinfo*) malloc (sizeof(*a)+sizeof(*si4));
+        if (!a) break;
+        memset (a,0,sizeof(*a)+sizeof(*si4));
+        si4 = (struct sockaddr_in*) (a+1);
+        si4->sin_family = AF_INET;
+        si4->sin_port = q->port;
+        si4->sin_addr = q->v4[i-q->numv6];
+        a->ai_family = AF_INET;
+        a->ai_addrlen = sizeof(*si4);
+      }
+      a->ai_addr = (struct sockaddr*) (a+1);
+      a->ai_socktype = socktypes[t];
+      a->ai_protocol = protocols[t];
+      *tail = a;
+      tail = &(a->ai_next);
+    }
+    if (t<numtypes) {
+      if (head) freeaddrinfo (head);
+      return NULL;
+    }
+  }
+  if (head && (q->flags&AI_CANONNAME)) {
+    head->ai_canonname = strdup (q->canon[0]?q->canon:
+	q->names[q->nameindex]);
+    if (!head->ai_canonname) {
+      freeaddrinfo (head);
+      return NULL;
+    }
+  }
+  return head;
+}
+
+void stubfinish (
+/* q has its answer, or error */
+  struct STUBQUERY *q
+, int error
+) {
+  int i;
+
+  q->done = 1;
+  q->error = error;
+  for (i=0; i<q->numquestions; i++) {
+    stubclosetcp (q,q->questions+i);
+    q->questions[i].state = STUBQ_DONE;
+  }
+  if (q->udpfd>=0) close (q->udpfd);
+  q->udpfd = -1;
+}
+
+int stubport (
+/* The port for service in network byte order in *port, 0 for none. Returns
+ * 0 or EAI_SERVICE. */
+  const char *service
+, int socktype
+, int flags
+, int *port
+) {
+  struct servent se, *sep;
+  char buf[1024], *end;
+  long n;
+
+  *port = 0;
+  if (!service || !*service) return 0;
+  n = strtol (service,&end,10);
+  if (*end) {
+    sep = NULL;
+    if (!(flags&AI_NUMERICSERV)) 
+      getservbyname_r (service,(socktype==SOCK_DGRAM)?"udp":"tcp",
+	&se,buf,sizeof(buf),&sep);
+    if (!sep) return EAI_SERVICE;
+    *port = sep->s_port;
+  } else if ((n<0) || (n>65535)) return EAI_SERVICE;
+  else *port = htons ((uint16_t) n);
+  return 0;
+}
+
+struct STUBQUERY *stubquerystart (
+/* Begin looking up node and service. Never blocks. Returns NULL and sets
+ * *error to an EAI_ code on failure. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, int *error
+) {
+  struct STUBQUERY *q;
+  int i, dots, r;
+
+  if (!node || !*node) { /* nothing to look up; let libc do the rest */
+    *error = EAI_NONAME;
+    return NULL;
+  }
+  if ((strlen(node)>=sizeof(q->node)) || 
+      (service && (strlen(service)>=sizeof(q->service)))) {
+    *error = EAI_OVERFLOW;
+    return NULL;
+  }
+  q = (struct STUBQUERY*) malloc (sizeof(*q));
+  if (!q) {
+    *error = EAI_MEMORY;
+    return NULL;
+  }
+  memset (q,0,sizeof(*q));
+  q->udpfd = q->pollfd = -1;
+  q->questions[0].tcpfd = q->questions[1].tcpfd = -1;
+  q->ttl = 0xffffffffU;
+  strcpy (q->node,node);
+  if (service) strcpy (q->service,service);
+  if (hints) {
+    q->family = hints->ai_family;
+    q->socktype = hints->ai_socktype;
+    q->protocol = hints->ai_protocol;
+    q->flags = hints->ai_flags;
+  }
+  if ((q->family!=AF_UNSPEC) && (q->family!=AF_INET) && 
+      (q->family!=AF_INET6)) {
+    free (q);
+    *error = EAI_FAMILY;
+    return NULL;
+  }
+
+  /* the port */
+  r = stubport (service,q->socktype,q->flags,&(q->port));
+  if (r) {
+    free (q);
+    *error = r;
+    return NULL;
+  }
+
+  /* numeric addresses need no lookup */
+  if (inet_pton (AF_INET,node,q->v4)==1) q->numv4 = 1;
+  else if (inet_pton (AF_INET6,node,q->v6)==1) q->numv6 = 1;
+  if (q->numv4 || q->numv6 || (q->flags&AI_NUMERICHOST)) {
+    strcpy (q->names[0],node);
+    stubfinish (q,(q->numv4 || q->numv6)?0:EAI_NONAME);
+    return q;
+  }
+
+  pthread_once (&stub_defaultonce,stubresolverdefault);
+  pthread_rwlock_rdlock (&stub_lock);
+  if (stub_config.hosts && stubhosts (q,stub_config.hosts)) {
+    pthread_rwlock_unlock (&stub_lock);
+    strcpy (q->names[0],node);
+    stubfinish (q,0);
+    return q;
+  }
+  memcpy (q->servers,stub_config.servers,sizeof(q->servers));
+  memcpy (q->serverlens,stub_config.serverlens,sizeof(q->serverlens));
+  q->numservers = stub_config.numservers;
+  q->attempts = stub_config.attempts;
+  q->retry = stub_config.retry;
+  /* names to try: with the search domains first if the name has fewer
+   * than ndots dots, as itself first otherwise. A trailing dot means
+   * exactly this name. */
+  for (dots=i=0; node[i]; i++) if (node[i]=='.') dots++;
+  if (node[strlen(node)-1]=='.') {
+    strcpy (q->names[q->numnames],node);
+    q->names[q->numnames++][strlen(node)-1] = 0;
+  } else {
+    if (dots>=stub_config.ndots) strcpy (q->names[q->numnames++],node);
+    for (i=0; i<stub_config.numsearch; i++) {
+      if (strlen(node)+strlen(stub_config.search[i])+2>sizeof(q->names[0]))
+        continue;
+      sprintf (q->names[q->numnames++],"%s.%s",node,stub_config.search[i]);
+    }
+    if (dots<stub_config.ndots) strcpy (q->names[q->numnames++],node);
+  }
+  pthread_rwlock_unlock (&stub_lock);
+
+  /* one socket for every question to every server */
+  q->udpfamily = AF_INET6;
+  q->udpfd = socket (AF_INET6,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+  if (q->udpfd>=0) {
+    i = 0;
+    setsockopt (q->udpfd,IPPROTO_IPV6,IPV6_V6ONLY,&i,sizeof(i));
+  } else { /* no IPv6 on this host */
+    q->udpfamily = AF_INET;
+    q->udpfd = socket (AF_INET,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+  }
+  if (q->udpfd<0) {
+    free (q);
+    *error = EAI_SYSTEM;
+    return NULL;
+  }
+#ifdef EASYV6_EPOLL
+  q->pollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (q->pollfd>=0) {
+    struct epoll_event ev;
+
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl (q->pollfd,EPOLL_CTL_ADD,q->udpfd,&ev)) {
+      close (q->pollfd);
+      q->pollfd = -1;
+    }
+  }
+#endif
+  /* AAAA first: getaddrinfo() would sort IPv6 ahead of IPv4 anyway */
+  if (q->family!=AF_INET) 
+    q->questions[q->numquestions++].type = STUB_TYPEAAAA;
+  if ((q->family!=AF_INET6) || (q->flags&AI_V4MAPPED)) 
+    q->questions[q->numquestions++].type = STUB_TYPEA;
+  stubbegin (q);
+  return q;
+}
+
+void stubqueryadvance (
+/* Read answers, resend if due, move on down the search list */
+  struct STUBQUERY *q
+) {
+  long long now;
+  int i, pending, again;
+
+  if (!q->done) {
+    stubudp (q);
+    for (i=0; i<q->numquestions; i++) {
+      if ((q->questions[i].state==STUBQ_TCPCONNECT) || 
+          (q->questions[i].state==STUBQ_TCPREAD)) 
+        stubtcp (q,q->questions+i);
+    }
+    now = milliseconds();
+    for (pending=again=i=0; i<q->numquestions; i++) {
+      if ((q->questions[i].state!=STUBQ_DONE) && (now>=q->resendat)) 
+        stubsend (q,q->questions+i,1);
+      if (q->questions[i].state!=STUBQ_DONE) pending++;
+      else if (q->questions[i].error && 
+	       (q->questions[i].error!=EAI_NONAME)) again = 1;
+    }
+    if (now>=q->resendat) q->resendat = now + q->retry;
+    if (!pending) {
+      if (q->numv4 || q->numv6) stubfinish (q,0);
+      else if (again) stubfinish (q,q->questions[0].error==EAI_NONAME?
+	q->questions[1].error:q->questions[0].error);
+      else if (q->nameindex+1<q->numnames) { /* no such name: search on */
+        q->nameindex++;
+        stubbegin (q);
+      } else stubfinish (q,EAI_NONAME);
+    }
+  }
+}
+
+int stubquerystep (
+/* Read answers, resend if due. Returns EAI_INPROGRESS until done, then 0
+ * with the addresses in *res and their TTL in *ttl, or an EAI_ error. */
+  struct STUBQUERY *q
+, struct addrinfo **res
+, unsigned *ttl
+) {
+  stubqueryadvance (q);
+  if (!q->done) return EAI_INPROGRESS;
+  if (q->error) return q->error;
+  *res = stubresult (q,AF_UNSPEC);
+  if (!*res) return (q->numv4 || q->numv6)?EAI_MEMORY:EAI_NONAME;
+  if (ttl) *ttl = q->ttl;
+  return 0;
+}
+
+int stubquerypartial (
+/* stubquerystep() for one address family: 0 with its addresses in *res as
+ * soon as they are in, even while the other family's question is still
+ * out. EAI_INPROGRESS until then, or an EAI_ error if the lookup failed or
+ * found none of that family. */
+  struct STUBQUERY *q
+, int family
+, struct addrinfo **res
+, unsigned *ttl
+) {
+  int i, type, n;
+
+  stubqueryadvance (q);
+  type = (family==AF_INET6)?STUB_TYPEAAAA:STUB_TYPEA;
+  n = (family==AF_INET6)?q->numv6:q->numv4;
+  if (!q->done) {
+    /* addresses for this name mean the search list stops here */
+    for (i=0; i<q->numquestions; i++) if (q->questions[i].type==type) break;
+    if ((i>=q->numquestions) || (q->questions[i].state!=STUBQ_DONE) || !n)
+      return EAI_INPROGRESS;
+  } else if (q->error) return q->error;
+  if (!n) return EAI_NONAME;
+  *res = stubresult (q,family);
+  if (!*res) return EAI_MEMORY;
+  if (ttl) *ttl = q->ttl;
+  return 0;
+}
+
+int stubquerypollfd (
+/* Descriptor which polls readable when stubquerystep() has work */
+  struct STUBQUERY *q
+) {
+  if (q->pollfd>=0) return q->pollfd;
+  return q->udpfd;
+}
+
+long long stubquerydeadline (
+/* When stubquerystep() must be called even if nothing arrives */
+  struct STUBQUERY *q
+) {
+  if (q->done) return 0LL;
+  /* TCP sockets aren't in the set without epoll */
+  if ((q->pollfd<0) && ((q->questions[0].tcpfd>=0) || 
+      (q->questions[1].tcpfd>=0))) return milliseconds()+10LL;
+  return q->resendat;
+}
+
+void stubqueryfree (
+  struct STUBQUERY *q
+) {
+  int i;
+
+  if (!q) return;
+  stubfinish (q,q->error);
+  for (i=0; i<2; i++) if (q->questions[i].tcpbuf) free (q->questions[i].tcpbuf);
+  if (q->pollfd>=0) close (q->pollfd);
+  free (q);
+}
+
+int stubgetaddrinfolookup (const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res,
+	long long *timeout, unsigned *ttl);
+
+int stubgetaddrinfo (
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+, long long *timeout
+, unsigned *ttl
+) {
+  if (!timeout) return EAI_SYSTEM;
+  /* like timeoutgetaddrinfo() */
+  *timeout = connectfloorms (*timeout,CONNECT_DNSFLOOR);
+  return stubgetaddrinfolookup (node,service,hints,res,timeout,ttl);
+}
+
+int stubgetaddrinfolookup (
+/* stubgetaddrinfo() without the least time it allows */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+, long long *timeout
+, unsigned *ttl
+) {
+  struct STUBQUERY *q;
+  struct pollfd fds[3];
+  long long startat, now, wait;
+  int r, n, i;
+
+  if (!timeout) return EAI_SYSTEM;
+  startat = milliseconds();
+  if (ttl) *ttl = 0xffffffffU;
+  q = stubquerystart (node,service,hints,&r);
+  if (!q) {
+    if (r!=EAI_NONAME || (node && *node)) return r;
+    r = getaddrinfo (node,service,hints,res); /* no name: no DNS */
+    return r;
+  }
+  while ((r=stubquerystep (q,res,ttl))==EAI_INPROGRESS) {
+    now = milliseconds();
+    if (now-startat >= *timeout) {
+      r = EAI_AGAIN;
+      break;
+    }
+    wait = stubquerydeadline (q) - now;
+    if (wait > *timeout-(now-startat)) wait = *timeout-(now-startat);
+    if (wait<0LL) wait = 0LL;
+    n = 0;
+    fds[n].fd = q->udpfd;
+    fds[n++].events = POLLIN;
+    for (i=0; i<q->numquestions; i++) {
+      if (q->questions[i].tcpfd<0) continue;
+      fds[n].fd = q->questions[i].tcpfd;
+      fds[n++].events = 
+	(q->questions[i].state==STUBQ_TCPCONNECT)?POLLOUT:POLLIN;
+    }
+    poll (fds,n,(int) wait);
+  }
+  stubqueryfree (q);
+  *timeout -= milliseconds()-startat;
+  return r;
+}
+
+/* Pluggable resolvers. connectresolve() asks one and builds the addrinfo
+ * list; the two bundled ones follow it. */
+#define CONNECTRESOLVE_PASS 1 /* not an EAI_ code, which are negative */
+#define CONNECTRESOLVERMAP_BUCKETS 256
+
+const struct CONNECTRESOLVER *connect_resolver = NULL; /* process default */
+
+struct CONNECTRESOLVERNAME {
+  struct CONNECTRESOLVERNAME *next;
+  char *name;           /* after the addresses */
+  int numaddresses;
+  struct sockaddr_storage addresses[1];
+};
+
+struct CONNECTRESOLVERMAP {
+  pthread_rwlock_t lock;
+  struct CONNECTRESOLVERNAME *buckets[CONNECTRESOLVERMAP_BUCKETS];
+};
+
+struct CONNECTRESOLVERHOSTS {
+  const char *text;     /* the mapping */
+  size_t len;
+};
+
+int connectresolverset (
+  const struct CONNECTRESOLVER *resolver
+) {
+  __atomic_store_n (&connect_resolver,resolver,__ATOMIC_RELEASE);
+  return 0;
+}
+
+const struct CONNECTRESOLVER *connectresolverfor (
+/* The resolver the options ask for, or else the default */
+  const struct CONNECTOPTIONS *options
+) {
+  if (options && options->resolver) return options->resolver;
+  return __atomic_load_n (&connect_resolver,__ATOMIC_ACQUIRE);
+}
+
+int connectresolveraddress (
+/* Parse numeric address text into *ss. Returns 1 if it is one. */
+  const char *text
+, struct sockaddr_storage *ss
+) {
+  memset (ss,0,sizeof(*ss));
+  if (inet_pton (AF_INET,text,&(((struct sockaddr_in*) ss)->sin_addr))==1) {
+    ss->ss_family = AF_INET;
+    return 1;
+  }
+  if (inet_pton (AF_INET6,text,
+	&(((struct sockaddr_in6*) ss)->sin6_addr))==1) {
+    ss->ss_family = AF_INET6;
+    return 1;
+  }
+  return 0;
+}
+
+int connectresolve (
+/* Look node up with resolver, laying the answer out as getaddrinfo() does.
+ * Numeric addresses are answered here, resolver or not, so a literal
+ * never costs a getaddrinfo_a() thread. Returns 0, an EAI_ code, or
+ * CONNECTRESOLVE_PASS if there's no resolver or it passes the name on to
+ * the usual lookup. */
+  const struct CONNECTRESOLVER *resolver
+, const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+) {
+  struct sockaddr_storage addresses[CONNECTRESOLVER_MAXADDRESSES];
+  struct addrinfo *head = NULL, **tail = &head, *a;
+  int family = AF_UNSPEC, socktypes[3], protocols[3], flags = 0;
+  int numtypes, numeric, n, i, t, port, r;
+  socklen_t len;
+
+  if (!node || !*node) return CONNECTRESOLVE_PASS;
+  numeric = connectresolveraddress (node,addresses);
+  if (!numeric && hints && (hints->ai_flags&AI_NUMERICHOST)) 
+    return EAI_NONAME;
+  if (!numeric && (!resolver || !resolver->lookup)) 
+    return CONNECTRESOLVE_PASS;
+  socktypes[0] = SOCK_STREAM;
+  protocols[0] = IPPROTO_TCP;
+  socktypes[1] = SOCK_DGRAM;
+  protocols[1] = IPPROTO_UDP;
+  socktypes[2] = SOCK_RAW; /* as getaddrinfo() does */
+  protocols[2] = 0;
+  numtypes = 3;
+  if (hints) {
+    family = hints->ai_family;
+    flags = hints->ai_flags;
+    if (hints->ai_socktype) {
+      socktypes[0] = hints->ai_socktype;
+      protocols[0] = hints->ai_protocol;
+      if (!protocols[0] && (socktypes[0]==SOCK_STREAM)) 
+        protocols[0] = IPPROTO_TCP;
+      else if (!protocols[0] && (socktypes[0]==SOCK_DGRAM)) 
+        protocols[0] = IPPROTO_UDP;
+      numtypes = 1;
+    }
+  }
+  if ((family!=AF_UNSPEC) && (family!=AF_INET) && (family!=AF_INET6))
+    return EAI_FAMILY;
+  /* a literal of the other family: libc knows the AI_V4MAPPED rules */
+  if (numeric && (family!=AF_UNSPEC) && (family!=addresses[0].ss_family))
+    return CONNECTRESOLVE_PASS;
+  r = stubport (service,socktypes[0],flags,&port);
+  if (r) return numeric?CONNECTRESOLVE_PASS:r; /* libc's error for a literal */
+  if (numeric) n = 1;
+  else n = resolver->lookup (resolver->context,node,family,addresses,
+	CONNECTRESOLVER_MAXADDRESSES);
+  if (n<0) return EAI_SYSTEM;
+  if (n==0) return resolver->fallback?CONNECTRESOLVE_PASS:EAI_NONAME;
+  if (n>CONNECTRESOLVER_MAXADDRESSES) n = CONNECTRESOLVER_MAXADDRESSES;
+  for (i=0; i<n; i++) {
+    if (addresses[i].ss_family==AF_INET) len = sizeof(struct sockaddr_in);
+    else if (addresses[i].ss_family==AF_INET6) 
+      len = sizeof(struct sockaddr_in6);
+    else continue;
+    if ((family!=AF_UNSPEC) && (family!=addresses[i].ss_family)) continue;
+    for (t=0; t<numtypes; t++) {
+      /* one block, address and all, as freeaddrinfo() expects */
+      a = (struct addrinfo*) malloc (sizeof(*a)+len);
+      if (!a) {
+        if (head) freeaddrinfo (head);
+        return EAI_MEMORY;
+      }
+      memset (a,0,sizeof(*a));
+      memcpy (a+1,addresses+i,len);
+      a->ai_addr = (struct sockaddr*) (a+1);
+      a->ai_addrlen = len;
+      a->ai_family = addresses[i].ss_family;
+      if (a->ai_family==AF_INET) 
+        ((struct sockaddr_in*) a->ai_addr)->sin_port = (uint16_t) port;
+      else ((struct sockaddr_in6*) a->ai_addr)->sin6_port = (uint16_t) port;
+      a->ai_flags = flags;
+      a->ai_socktype = socktypes[t];
+      a->ai_protocol = protocols[t];
+      *tail = a;
+      tail = &(a->ai_next);
+    }
+  }
+  if (!head) return EAI_NONAME; /* none of the family asked for */
+  if (flags&AI_CANONNAME) {
+    head->ai_canonname = strdup (node);
+    if (!head->ai_canonname) {
+      freeaddrinfo (head);
+      return EAI_MEMORY;
+    }
+  }
+  *res = head;
+  return 0;
+}
+
+unsigned connectresolverhash (const char *name) {
+  unsigned h = 2166136261U; /* FNV-1a, ignoring case as DNS does */
+
+  for (; *name; name++) h = (h^(unsigned char) tolower(*name)) * 16777619U;
+  return h;
+}
+
+int connectresolvermaplookup (
+  void *context
+, const char *name
+, int family
+, struct sockaddr_storage *addresses
+, int max
+) {
+  struct CONNECTRESOLVERMAP *map = (struct CONNECTRESOLVERMAP*) context;
+  struct CONNECTRESOLVERNAME *e;
+  int i, n = 0;
+
+  pthread_rwlock_rdlock (&(map->lock));
+  e = map->buckets[connectresolverhash(name)%CONNECTRESOLVERMAP_BUCKETS];
+  for (; e; e=e->next) if (!strcasecmp (e->name,name)) break;
+  for (i=0; e && (i<e->numaddresses) && (n<max); i++) {
+    if ((family!=AF_UNSPEC) && (family!=e->addresses[i].ss_family)) continue;
+    addresses[n++] = e->addresses[i];
+  }
+  pthread_rwlock_unlock (&(map->lock));
+  return n;
+}
+
+struct CONNECTRESOLVER *connectresolvermap (void) {
+  struct CONNECTRESOLVER *resolver;
+  struct CONNECTRESOLVERMAP *map;
+
+  resolver = (struct CONNECTRESOLVER*) malloc (sizeof(*resolver)+
+	sizeof(*map));
+  if (!resolver) return NULL;
+  memset (resolver,0,sizeof(*resolver)+sizeof(*map));
+  map = (struct CONNECTRESOLVERMAP*) (resolver+1);
+  pthread_rwlock_init (&(map->lock),NULL);
+  resolver->lookup = connectresolvermaplookup;
+  resolver->context = map;
+  return resolver;
+}
+
+int connectresolvermapset (
+  struct CONNECTRESOLVER *resolver
+, const char *name
+, const char *addresses
+) {
+  struct CONNECTRESOLVERMAP *map;
+  struct CONNECTRESOLVERNAME *e = NULL, **pe, *old;
+  struct sockaddr_storage parsed[CONNECTRESOLVER_MAXADDRESSES];
+  char text[INET6_ADDRSTRLEN];
+  const char *p, *end;
+  size_t len;
+  int n = 0;
+
+  if (!resolver || (resolver->lookup!=connectresolvermaplookup) || !name) {
+    errno = EINVAL;
+    return -1;
+  }
+  map = (struct CONNECTRESOLVERMAP*) resolver->context;
+  for (p=addresses; p && *p; p=end) { /* parse before taking the lock */
+    while (*p && strchr(" \t\r\n,",*p)) p++;
+    for (end=p; *end && !strchr(" \t\r\n,",*end); end++) ;
+    if (end==p) break;
+    len = end-p;
+    if ((len>=sizeof(text)) || (n>=CONNECTRESOLVER_MAXADDRESSES)) {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy (text,p,len);
+    text[len] = 0;
+    if (!connectresolveraddress (text,parsed+n)) {
+      errno = EINVAL;
+      return -1;
+    }
+    n++;
+  }
+  if (n>0) {
+    e = (struct CONNECTRESOLVERNAME*) malloc (sizeof(*e)+
+	sizeof(struct sockaddr_storage)*(n-1)+strlen(name)+1);
+    if (!e) return -1;
+    e->next = NULL;
+    e->numaddresses = n;
+    memcpy (e->addresses,parsed,sizeof(struct sockaddr_storage)*n);
+    e->name = (char*) (e->addresses+n);
+    strcpy (e->name,name);
+  }
+  pthread_rwlock_wrlock (&(map->lock));
+  pe = &(map->buckets[connectresolverhash(name)%CONNECTRESOLVERMAP_BUCKETS]);
+  for (; *pe; pe=&((*pe)->next)) if (!strcasecmp ((*pe)->name,name)) break;
+  old = *pe;
+  if (e) {
+    e->next = old?old->next:NULL;
+    *pe = e;
+  } else if (old) *pe = old->next;
+  pthread_rwlock_unlock (&(map->lock));
+  if (old) free (old);
+  return 0;
+}
+
+int connectresolverhostslookup (
+/* Scan the mapped hosts file the way stubhosts() scans its copy */
+  void *context
+, const char *name
+, int family
+, struct sockaddr_storage *addresses
+, int max
+) {
+  struct CONNECTRESOLVERHOSTS *h = (struct CONNECTRESOLVERHOSTS*) context;
+  const char *p, *line, *end, *tok, *next, *address = NULL;
+  char text[INET6_ADDRSTRLEN];
+  size_t len, addresslen = 0, namelen = strlen(name);
+  int n = 0;
+
+  end = h->text + h->len;
+  for (line=h->text; (line<end) && (n<max); line=p) {
+    p = (const char*) memchr (line,'\n',(size_t) (end-line));
+    p = p?p+1:end;
+    address = NULL;
+    for (tok=line; tok<p; tok=next) {
+      while ((tok<p) && ((*tok==' ') || (*tok=='\t'))) tok++;
+      if ((tok>=p) || (*tok=='#') || (*tok=='\r') || (*tok=='\n')) break;
+      for (next=tok; (next<p) && (*next!=' ') && (*next!='\t') &&
+	(*next!='\r') && (*next!='\n') && (*next!='#'); next++) ;
+      len = next-tok;
+      if (!address) { /* the address, then its names */
+        if (len>=sizeof(text)) break;
+        address = tok;
+        addresslen = len;
+        continue;
+      }
+      if ((len!=namelen) || strncasecmp (tok,name,len)) continue;
+      memcpy (text,address,addresslen); /* only for the lines that match */
+      text[addresslen] = 0;
+      if (connectresolveraddress (text,addresses+n) &&
+          ((family==AF_UNSPEC) || (family==addresses[n].ss_family))) n++;
+      break;
+    }
+  }
+  return n;
+}
+
+struct CONNECTRESOLVER *connectresolverhosts (
+  const char *path
+) {
+  struct CONNECTRESOLVER *resolver;
+  struct CONNECTRESOLVERHOSTS *h;
+  struct stat st;
+  void *text = NULL;
+  int fd, e;
+
+  fd = open (path,O_RDONLY|O_CLOEXEC);
+  if (fd<0) return NULL;
+  if (fstat (fd,&st)) {
+    e = errno;
+    close (fd);
+    errno = e;
+    return NULL;
+  }
+  if (st.st_size>0) {
+    text = mmap (NULL,(size_t) st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (text==MAP_FAILED) {
+      e = errno;
+      close (fd);
+      errno = e;
+      return NULL;
+    }
+  }
+  close (fd); /* the mapping keeps the file */
+  resolver = (struct CONNECTRESOLVER*) malloc (sizeof(*resolver)+sizeof(*h));
+  if (!resolver) {
+    if (text) munmap (text,(size_t) st.st_size);
+    return NULL;
+  }
+  memset (resolver,0,sizeof(*resolver)+sizeof(*h));
+  h = (struct CONNECTRESOLVERHOSTS*) (resolver+1);
+  h->text = (const char*) text;
+  h->len = text?(size_t) st.st_size:0;
+  resolver->lookup = connectresolverhostslookup;
+  resolver->context = h;
+  return resolver;
+}
+
+void connectresolverfree (
+  struct CONNECTRESOLVER *resolver
+) {
+  struct CONNECTRESOLVERMAP *map;
+  struct CONNECTRESOLVERHOSTS *h;
+  struct CONNECTRESOLVERNAME *e;
+  int i;
+
+  if (!resolver) return;
+  if (resolver->lookup==connectresolvermaplookup) {
+    map = (struct CONNECTRESOLVERMAP*) resolver->context;
+    for (i=0; i<CONNECTRESOLVERMAP_BUCKETS; i++) {
+      while ((e=map->buckets[i])) {
+        map->buckets[i] = e->next;
+        free (e);
+      }
+    }
+    pthread_rwlock_destroy (&(map->lock));
+  } else if (resolver->lookup==connectresolverhostslookup) {
+    h = (struct CONNECTRESOLVERHOSTS*) resolver->context;
+    if (h->text) munmap ((void*) h->text,h->len);
+  }
+  free (resolver);
+}
+
+/* TTL in seconds from stubgetaddrinfo() as dnscacheresolved() wants it */
+#define STUBTTLMS(ttl) (((ttl)==0xffffffffU)?0LL:1000LL*(long long) (ttl)+1LL)
+
+int timeoutgetaddrinfofloor (const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res,
+	long long *timeout, long long floor);
+
+int timeoutgetaddrinfo (
+/* See header */
+  const char *node,
+  const char *service,
+  const struct addrinfo *hints,
+  struct addrinfo **res,
+  long long *timeout
+) {
+  int r;
+
+  r = connectresolve (connectresolverfor (NULL),node,service,hints,res);
+  if (r!=CONNECTRESOLVE_PASS) return r;
+  return timeoutgetaddrinfofloor (node,service,hints,res,timeout,
+	CONNECT_DNSFLOOR);
+}
+
+int timeoutgetaddrinfofloor (
+/* timeoutgetaddrinfo() giving itself at least floor microseconds rather
+ * than 50 ms */
+  const char *node,
+  const char *service,
+  const struct addrinfo *hints,
+  struct addrinfo **res,
+  long long *timeout,
+  long long floor
+) {
+  struct DNSFLIGHT *flight;
+  unsigned ttl;
+  int r;
+
+  if (!timeout) return EAI_SYSTEM;
+  *timeout = connectfloorms (*timeout,floor);
+  if (dnscacheget (node,service,hints,res,&r)) return r;
+  /* a lookup of the same name already under way answers this one too */
+  if (dnsflightjoin (node,service,hints,res,&r,timeout,&flight)) return r;
+  if (__atomic_load_n (&stub_enabled,__ATOMIC_ACQUIRE) && node) {
+    r = stubgetaddrinfolookup (node,service,hints,res,timeout,&ttl);
+    r = dnscacheresolved (node,service,hints,r,res,STUBTTLMS(ttl));
+  } else {
+    r = timeoutgetaddrinfolookup (node,service,hints,res,timeout);
+    r = dnscacheresolved (node,service,hints,r,res,0LL);
+  }
+  dnsflightland (flight,r,r?NULL:*res);
+  return r;
+}
+
+int timeoutgetaddrinfolookup (
+/* timeoutgetaddrinfo() without the cache */
+  const char *node,
+  const char *service,
+  const struct addrinfo *hints,
+  struct addrinfo **res,
+  long long *timeout
+) {
+  long long dstartat,dendat;
+  int r;
+  struct gaicb *reqs[1];
+  struct timespec to;
+
+  if (!timeout) return EAI_SYSTEM;
+
+  /* When did I start? */
+  if ((dstartat = milliseconds()) < 0LL) return EAI_SYSTEM;
+
+  reqs[0] = nbgai_alloc (node,service,hints);
+  if (reqs[0]==NULL) return EAI_MEMORY;
+
+  /* Would not use getaddrinfo here but will come back to that problem
+   * later on. */
+  /* fprintf (stdout,"About to call getaddrinfo on %s:%s at %lld\n",
+	node,service,dstartat);
+     fflush (stdout);  */
+  r = getaddrinfo_a(GAI_NOWAIT,reqs,1,NULL);
+  if (r) return nbgai_freeandreturn (reqs,r);
+  while (1) {
+    to.tv_sec = (time_t) ((*timeout)/1000LL);
+    to.tv_nsec = (suseconds_t) (((*timeout)%1000LL)*1000000LL);
+    r = gai_suspend ((const struct gaicb * const*)reqs,1,&to);
+    if ((dendat = milliseconds()) < 0)
+      return nbgai_freeandreturn (reqs,EAI_SYSTEM);
+    (*timeout) -= (dendat - dstartat);
+    dstartat = dendat;
+    if (r==EAI_AGAIN) return nbgai_freeandreturn (reqs,r); /* timeout */
+    /* glibc says EAI_ALLDONE if the lookup finished before gai_suspend()
+     * was called, which is common for names in /etc/hosts. */
+    if (r && (r!=EAI_ALLDONE)) {
+      if (*timeout<=0LL) return nbgai_freeandreturn (reqs,EAI_AGAIN);
+      continue;
+    }
+    r=gai_error(reqs[0]);
+    if (r) return nbgai_freeandreturn (reqs,r); /* failed request */
+    *res = reqs[0]->ar_result;
+    /* The result is the caller's now. gai_cancel() can still see the
+     * request as running, and then the reaper would free it. */
+    reqs[0]->ar_result = NULL;
+    /* printaddrinfo (*res,0); */
+    return nbgai_freeandreturn (reqs,0); /* finished lookup on time */
+  }
+
+  /* not reached */
+  return EAI_SYSTEM;
+}
+
+struct NBGAI_ASYNC {
+/* A getaddrinfo_a() request which reports its completion through a
+ * SIGEV_THREAD notification that pokes notifyfd. If the caller abandons
+ * the request before it completes, the notification frees it. */
+  struct gaicb req;
+  struct addrinfo hints;
+  pthread_mutex_t mutex;
+  int notifyfd;   /* eventfd to write on completion or -1 */
+  char done;      /* the notification has run */
+  char abandoned; /* the caller no longer wants the answer */
+  char strings[2]; /* node and service, each \0 terminated */
+};
+
+void nbgai_asyncfree (struct NBGAI_ASYNC *a) {
+  if (a->req.ar_result) freeaddrinfo (a->req.ar_result);
+  pthread_mutex_destroy (&(a->mutex));
+  free (a);
+}
+
+void nbgai_asyncnotify (union sigval sv) {
+/* Runs in a thread of glibc's choosing once the lookup completes */
+  struct NBGAI_ASYNC *a = (struct NBGAI_ASYNC*) sv.sival_ptr;
+  uint64_t one = 1;
+
+  pthread_mutex_lock (&(a->mutex));
+  a->done = 1;
+  if (a->abandoned) {
+    pthread_mutex_unlock (&(a->mutex));
+    nbgai_asyncfree (a);
+    return;
+  }
+  if (a->notifyfd>=0) {
+    if (write (a->notifyfd,&one,sizeof(one))<0) {
+      /* eventfd counter is saturated; it's readable regardless */
+    }
+  }
+  pthread_mutex_unlock (&(a->mutex));
+}
+
+struct NBGAI_ASYNC *nbgai_asyncstart (
+/* Start a getaddrinfo_a() lookup without waiting for it. Returns NULL
+ * and sets *error on failure. */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, int notifyfd /* written to when the lookup completes, or -1 */
+, int *error
+) {
+  struct NBGAI_ASYNC *a;
+  struct gaicb *reqs[1];
+  struct sigevent sev;
+  size_t nodelen, servicelen;
+  int r;
+
+  if (!node || !service) {
+    *error = EAI_NONAME;
+    return NULL;
+  }
+  nodelen = strlen(node);
+  servicelen = strlen(service);
+  a = (struct NBGAI_ASYNC*) malloc (sizeof(*a)+nodelen+servicelen);
+  if (!a) {
+    *error = EAI_MEMORY;
+    return NULL;
+  }
+  memset (a,0,sizeof(*a));
+  memcpy (a->strings,node,nodelen+1);
+  memcpy (a->strings+nodelen+1,service,servicelen+1);
+  if (hints) {
+    memcpy (&(a->hints),hints,sizeof(struct addrinfo));
+    a->hints.ai_addr = NULL;
+    a->hints.ai_canonname = NULL;
+    a->hints.ai_next = NULL;
+  }
+  a->req.ar_name = a->strings;
+  a->req.ar_service = a->strings+nodelen+1;
+  a->req.ar_request = &(a->hints);
+  a->notifyfd = notifyfd;
+  pthread_mutex_init (&(a->mutex),NULL);
+
+  memset (&sev,0,sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD;
+  sev.sigev_notify_function = nbgai_asyncnotify;
+  sev.sigev_value.sival_ptr = a;
+  reqs[0] = &(a->req);
+  r = getaddrinfo_a(GAI_NOWAIT,reqs,1,&sev);
+  if (r) {
+    nbgai_asyncfree (a);
+    *error = r;
+    return NULL;
+  }
+  return a;
+}
+
+int nbgai_asyncresult (
+/* EAI_INPROGRESS while the lookup runs, otherwise its getaddrinfo()
+ * result. On success the caller takes ownership of *res. */
+  struct NBGAI_ASYNC *a
+, struct addrinfo **res
+) {
+  int r;
+
+  r = gai_error (&(a->req));
+  if (r) return r;
+  *res = a->req.ar_result;
+  a->req.ar_result = NULL;
+  return 0;
+}
+
+void nbgai_asyncrelease (
+/* The caller is done with the lookup, finished or not. */
+  struct NBGAI_ASYNC *a
+) {
+  pthread_mutex_lock (&(a->mutex));
+  if (a->done || (gai_cancel(&(a->req))==EAI_CANCELED)) {
+    /* No notification is coming; nobody else will touch it. */
+    pthread_mutex_unlock (&(a->mutex));
+    nbgai_asyncfree (a);
+    return;
+  }
+  a->abandoned = 1;
+  a->notifyfd = -1;
+  pthread_mutex_unlock (&(a->mutex));
+}
+
+struct addrinfo *dupeaddrinfo (const struct addrinfo *address) {
+/* duplicate the first entry in *address */
+  struct addrinfo *a;
+  void *p1, *p2;
+
+
+  if (!address || !address->ai_addr) return NULL;
+  if (address->ai_addrlen<=0) return NULL;
+  p1 = (void*) address;
+  p2 = (void*) address->ai_addr;
+  
+  if ( (size_t) (((void*)address->ai_addr) - ((void*) address)) ==
+	sizeof(*address) ) { /* GNU libc mallocs one block of memory
+                              * for address and address->ai_addr, pointing
+			      * ai_addr just beyond the addrinfo structure.
+                              * Does everybody else? */
+    a = (struct addrinfo*) malloc (sizeof(*a)+address->ai_addrlen);
+    if (!a) return NULL;
+    memcpy (a,address,sizeof(*a)+address->ai_addrlen);
+    a->ai_addr=(struct sockaddr*) (a+1);
+  } else { /* I hope they haven't composed the addrinfo struct in a way
+            * that causes this to leak in freeaddrinfo() like it would in
+            * GNU libc... */
+    a = (struct addrinfo*) malloc (sizeof(*a));
+    if (!a) return NULL;
+    memcpy (a,address,sizeof(*a));
+    a->ai_addr = (struct sockaddr*) malloc (address->ai_addrlen);
+    if (a->ai_addr==NULL) {
+      free (a);
+      return NULL;
+    }
+    memcpy (a->ai_addr,address->ai_addr,address->ai_addrlen);
+  }
+  a->ai_next=NULL;
+  /* fprintf (stdout,"Pointers: a=%X,\n a->ai_addr=%X,\n a->ai_cannonname=%x,\n"
+	" sizeof(a)=%X\n",
+	(unsigned)address, (unsigned)address->ai_addr, 
+	(unsigned)address->ai_canonname,sizeof(*address));
+     fprintf (stdout,"Pointers: a=%X,\n a->ai_addr=%X,\n a->ai_cannonname=%x,\n"
+	" sizeof(a)=%X\n",
+	(unsigned)a, (unsigned)a->ai_addr, 
+	(unsigned)a->ai_canonname,sizeof(*a)); */
+  if (address->ai_canonname) a->ai_canonname = strdup (a->ai_canonname);
+  return a;
+}
+
+int connectbynamestreaming (const char *name, const char *service, 
+	long long timeout, struct CONNECTOPTIONS *options);
+
+int connectbyname (
+  const char *name
+, const char *service
+, long long timeout
+, struct CONNECTOPTIONS *options
+) {
+  struct addrinfo *addresses;
+  struct addrinfo hints;
+  long long calledat;
+  int r;
+
+  /* fprintf (stdout,"Enter connectbyname %s:%s(%lld)\n",
+     name,service,timeout); */
+  /* Fetch candidate IP addresses from the name + service */
+  calledat = microseconds();
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_flags |= AI_ADDRCONFIG;
+  hints.ai_flags &= (~AI_V4MAPPED);
+  r = connectresolve (connectresolverfor (options),name,service,&hints,
+	&addresses);
+#ifdef EASYV6_EPOLL
+  /* a resolver answers at once, so there's nothing to stream */
+  if ((r==CONNECTRESOLVE_PASS) && options && options->resolutiondelay && 
+      (options->poller!=CONNECTPOLLER_SELECT))
+    return connectbynamestreaming (name,service,timeout,options);
+#endif
+  if (r==CONNECTRESOLVE_PASS)
+    r = timeoutgetaddrinfofloor (name,service,&hints,&addresses,&timeout,
+	connectoption (options,options?options->dnsfloor:0LL,
+	CONNECT_DNSFLOOR));
+  if (options) options->getaddrinfoerror = r;
+  if (r) { /* if I couldn't get addresses, fail */
+    errno = EFAULT; /* Bad address (POSIX.1) */
+    return -1;
+  }
+
+  /* give myself at least a second to connect, even if getaddrinfo ate
+   * too much of my timeout. */
+  timeout = connectfloorms (timeout,connectoption (options,
+	options?options->connectfloor:0LL,CONNECT_AFTERDNSFLOOR));
+
+  /*fprintf (stdout,"connectbyaddrinfo (%lld)\n",timeout);*/
+  /* Try to connect with the retrieved addresses */
+  r = connectrace (addresses,timeout,options,name,service,calledat);
+
+  /* One way or another, done. */
+  if (options && options->picked) 
+    options->picked = dupeaddrinfo (options->picked);
+
+  /* If addresses is not consumed by the details option, free their RAM. */
+  if (!options || !options->details) freeaddrinfo (addresses);
+
+  return r;
+}
+
+struct CONNECTSTATE {
+/* A connectbyname() or connectbyaddrinfo() driven from the caller's event
+ * loop through connectstep() */
+  struct CONNECTIONPROGRESS *c; /* NULL until the name lookup finishes */
+  struct CONNECTOPTIONS *options;
+  struct NBGAI_ASYNC *lookup;   /* pending name lookup */
+  struct STUBQUERY *stub;       /* or the same with the stub resolver */
+  struct addrinfo *addresses;   /* result of our own name lookup */
+  /* Streaming (options->resolutiondelay): IPv6 then IPv4 */
+  struct NBGAI_ASYNC *lookups[2]; /* each family's getaddrinfo_a() */
+  int lookuperrors[2];
+  char resolved[2];             /* that family has answered or failed */
+  struct addrinfo **tail;       /* where the next family's addresses go */
+  struct addrinfo hints;        /* as both families were asked for */
+  long long startby;            /* start the race with IPv4 alone then */
+  unsigned ttl;                 /* from the stub resolver */
+  char streaming;
+  long long finishby;           /* give up on the name lookup */
+  long long timeout;            /* total time allotted */
+  long long startedat;
+  long long calledat;           /* startedat on the microseconds() clock */
+  long long recheckat;          /* with nothing to poll, when to step
+                                 * again: 10 ms after the last step */
+  int pollfd;   /* epoll set watching notifyfd and then c->pollfd */
+  int notifyfd; /* eventfd poked when the name lookup completes */
+  int sock;     /* connected socket once the race is won */
+  int error;    /* errno once the race is lost */
+  char finished;
+  char inarena;                 /* lives in options->arena, not the heap */
+  void *space;                  /* rest of the arena, for the race */
+  size_t spacebytes;
+  struct CONNECTOPTIONS nooptions;
+};
+
+struct CONNECTSTATE *connectstatealloc (
+  struct CONNECTOPTIONS *options
+) {
+  struct CONNECTSTATE *s = NULL;
+  char inarena = 0;
+
+  if (options) 
+    s = (struct CONNECTSTATE*) connectplace (options->arena,
+	options->arenabytes,sizeof(*s));
+  if (s) inarena = 1;
+  else s = (struct CONNECTSTATE*) malloc (sizeof(*s));
+  if (!s) return NULL;
+  memset ((void*) s,0,sizeof(*s));
+  s->inarena = inarena;
+  if (inarena) {
+    s->space = (char*) (s+1);
+    s->spacebytes = options->arenabytes - 
+      (size_t) ((char*) s->space - (char*) options->arena);
+  }
+  s->options = options?options:&(s->nooptions);
+  s->pollfd = -1;
+  s->notifyfd = -1;
+  s->sock = -1;
+  s->tail = &(s->addresses);
+  return s;
+}
+
+int connectstatedone (
+/* Record the outcome of the race so repeated connectstep()s report it */
+  struct CONNECTSTATE *s
+, int sock
+) {
+  s->finished = 1;
+  s->sock = sock;
+  s->error = (sock<0)?errno:0;
+  if ((sock>=0) && s->addresses && s->options->reportpicked &&
+      s->options->picked)
+    s->options->picked = dupeaddrinfo (s->options->picked);
+  errno = s->error;
+  return sock;
+}
+
+int connectstateresolved (
+/* The name lookup finished with r. Set up the connect race to
+ * s->addresses. Returns non-zero and sets errno if the race is lost
+ * already. */
+  struct CONNECTSTATE *s
+, int r
+, const char *name
+, const char *service
+) {
+  long long timeout;
+
+  s->options->getaddrinfoerror = r;
+  if (r) { /* if I couldn't get addresses, fail */
+    errno = EFAULT;
+    connectstatedone (s,-1);
+    return -1;
+  }
+  /* give myself at least a second to connect, even if getaddrinfo ate
+   * too much of my timeout. */
+  timeout = s->timeout - (milliseconds() - s->startedat);
+  timeout = connectfloorms (timeout,connectoption (s->options,
+	s->options->connectfloor,CONNECT_AFTERDNSFLOOR));
+  s->c = connectbegin (s->addresses,timeout,s->options,name,service,
+	s->calledat,s->space,s->spacebytes);
+  if (!s->c) {
+    errno = ENOMEM;
+    connectstatedone (s,-1);
+    return -1;
+  }
+#ifdef EASYV6_EPOLL
+  /* the caller polls on one descriptor, so the attempts need their epoll
+   * set from the start rather than from the second attempt on */
+  if (s->c->wantepoll) connectepoll (s->c);
+  if ((s->pollfd>=0) && (s->c->pollfd>=0)) {
+    struct epoll_event ev;
+
+    /* an epoll descriptor is itself pollable: it reads ready whenever
+     * one of the connect attempts inside it does */
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    epoll_ctl (s->pollfd,EPOLL_CTL_ADD,s->c->pollfd,&ev);
+  }
+#endif
+  return 0;
+}
+
+void connectstatestreams (
+/* Start separate IPv6 and IPv4 lookups for a streaming connect */
+  struct CONNECTSTATE *s
+, const char *name
+, const char *service
+) {
+  struct addrinfo familyhints;
+  int f, r = 0;
+
+  memcpy (&familyhints,&(s->hints),sizeof(familyhints));
+  for (f=0; f<2; f++) {
+    familyhints.ai_family = f?AF_INET:AF_INET6;
+    s->lookups[f] = nbgai_asyncstart (name,service,&familyhints,
+	s->notifyfd,&r);
+    if (s->lookups[f]) continue;
+    s->resolved[f] = 1;
+    s->lookuperrors[f] = r;
+  }
+  if (s->lookups[0] || s->lookups[1]) return;
+  s->options->getaddrinfoerror = r;
+  errno = EFAULT; /* Bad address (POSIX.1) */
+  connectstatedone (s,-1);
+}
+
+/* a family's lookup found nothing, as opposed to failing */
+#define NBGAI_NOADDRESSES(r) (((r)==EAI_NONAME) || ((r)==EAI_NODATA) || \
+	((r)==EAI_ADDRFAMILY))
+
+int connectstatelookups (
+/* Collect whichever families have answered. Start the race with the
+ * first, waiting up to the resolution delay for IPv6 if IPv4 came first,
+ * and merge the other into it when it arrives. Returns 0 once there is a
+ * race to advance, otherwise -1 with errno EINPROGRESS or the failure. */
+  struct CONNECTSTATE *s
+) {
+  struct CONNECTIONPROGRESS *c;
+  struct addrinfo *res, *fresh[2];
+  const char *name, *service;
+  long long now;
+  int f, r, both;
+#ifdef EASYV6_EPOLL
+  uint64_t count;
+
+  if (s->notifyfd>=0) {
+    if (read (s->notifyfd,&count,sizeof(count))<0) {
+      /* EAGAIN: no completion yet */
+    }
+  }
+#endif
+  if (s->resolved[0] && s->resolved[1]) return 0; /* merged already */
+  if (s->stub) {
+    name = s->stub->node;
+    service = s->stub->service;
+  } else {
+    f = s->lookups[0]?0:1;
+    name = s->lookups[f]->req.ar_name;
+    service = s->lookups[f]->req.ar_service;
+  }
+  now = milliseconds();
+  for (f=0; f<2; f++) {
+    fresh[f] = NULL;
+    if (s->resolved[f]) continue;
+    res = NULL;
+    if (s->stub) 
+      r = stubquerypartial (s->stub,f?AF_INET:AF_INET6,&res,&(s->ttl));
+    else r = nbgai_asyncresult (s->lookups[f],&res);
+    if ((r==EAI_INPROGRESS) && (now>=s->finishby)) r=EAI_AGAIN;
+    if (r==EAI_INPROGRESS) continue;
+    s->resolved[f] = 1;
+    s->lookuperrors[f] = r;
+    if (r || !res) continue;
+    fresh[f] = *(s->tail) = res;
+    while (*(s->tail)) s->tail = &((*(s->tail))->ai_next);
+  }
+  both = s->resolved[0] && s->resolved[1];
+  r = 0;
+  if (both) { /* the whole answer: cache it unless a family failed */
+    for (r=EAI_NONAME, f=0; f<2; f++) 
+      if (s->lookuperrors[f] && !NBGAI_NOADDRESSES(s->lookuperrors[f])) 
+        r = s->lookuperrors[f];
+    if (!s->addresses) 
+      r = dnscacheresolved (name,service,&(s->hints),r,&(s->addresses),0LL);
+    else {
+      if (r==EAI_NONAME) dnscachewrite (name,service,&(s->hints),
+	  s->addresses,0,s->stub?STUBTTLMS(s->ttl):0LL);
+      r = 0;
+    }
+  }
+  if (!s->c) {
+    if (fresh[1] && !s->resolved[0]) /* RFC 8305 Resolution Delay */
+      s->startby = now + ((s->options->resolutiondelay>0LL)?
+	s->options->resolutiondelay:0LL);
+    if ((!s->addresses && !both) || 
+        (!s->resolved[0] && (now<s->startby))) {
+      errno = EINPROGRESS;
       return -1;
     }
-    now = milliseconds();
+    if (connectstateresolved (s,r,name,service)) {
+      errno = s->error;
+      return -1;
+    }
+    s->c->morecoming = 1;
+  } else {
+    for (f=0; f<2; f++) {
+      if (!fresh[f]) continue;
+      c = connectmerge (s->c,fresh[f],s->options);
+      if (c) s->c = c;
+    }
+  }
+  if (both) {
+    s->c->morecoming = 0;
+    for (f=0; f<2; f++) {
+      if (s->lookups[f]) nbgai_asyncrelease (s->lookups[f]);
+      s->lookups[f] = NULL;
+    }
+    if (s->stub) stubqueryfree (s->stub);
+    s->stub = NULL;
+  }
+  return 0;
+}
+
+struct CONNECTSTATE *connectbyaddrinfostart (
+  const struct addrinfo *addresses
+, long long timeout
+, struct CONNECTOPTIONS *options
+) {
+  struct CONNECTSTATE *s;
+
+  s = connectstatealloc (options);
+  if (!s) {
+    errno = ENOMEM;
+    return NULL;
   }
-  /* No connection within the allotted timeout */
-  connectdonetrying(c,-1,ETIMEDOUT);
-  errno=0;
-  for (i=0; i<c->totaladdresses; i++)
-    if (c->sockets[i].error>errno) errno=c->sockets[i].error;
-  if (errno<=0) errno=ETIMEDOUT;
-  options->picked=NULL;
-  free(c);
-  return -1;
+  s->c = connectbegin (addresses,timeout,s->options,NULL,NULL,0LL,
+	s->space,s->spacebytes);
+  if (!s->c) {
+    if (!s->inarena) free (s);
+    errno = ENOMEM;
+    return NULL;
+  }
+#ifdef EASYV6_EPOLL
+  /* connectpollfd() hands out s->c->pollfd, so it has to exist now */
+  if (s->c->wantepoll) connectepoll (s->c);
+#endif
+  return s;
 }
 
-/* GNU libc's gai_cancel() looks to see if the thread finished. If so,
- * it accepts the cancellation. If not, it rejects. If it rejects, we
- * must try again later to recover the memory or else leak it. So, we
- * stash the knowledge in nbgai_pleasecancelme and try again the next
- * time a timeoutgetaddrinfo() is called. */
-struct NBGAI_PENDING {
-  struct gaicb *req;
-  struct NBGAI_PENDING *next;
-};
+struct CONNECTSTATE *connectbynamestart (
+  const char *name
+, const char *service
+, long long timeout
+, struct CONNECTOPTIONS *options
+) {
+  struct CONNECTSTATE *s;
+  struct addrinfo hints;
+  int r;
+
+  s = connectstatealloc (options);
+  if (!s) {
+    errno = ENOMEM;
+    return NULL;
+  }
+#ifdef EASYV6_EPOLL
+  s->pollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (s->pollfd>=0) {
+    struct epoll_event ev;
+
+    s->notifyfd = eventfd (0,EFD_NONBLOCK|EFD_CLOEXEC);
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    if ((s->notifyfd<0) || 
+        epoll_ctl (s->pollfd,EPOLL_CTL_ADD,s->notifyfd,&ev)) {
+      r = errno;
+      connectfree (s);
+      errno = r;
+      return NULL;
+    }
+  }
+#endif
+  /* like timeoutgetaddrinfo() */
+  timeout = connectfloorms (timeout,connectoption (s->options,
+	s->options->dnsfloor,CONNECT_DNSFLOOR));
+  s->timeout = timeout;
+  s->startedat = milliseconds();
+  s->calledat = microseconds();
+  s->finishby = s->startedat + timeout;
+
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_flags |= AI_ADDRCONFIG;
+  hints.ai_flags &= (~AI_V4MAPPED);
+  r = connectresolve (connectresolverfor (s->options),name,service,&hints,
+	&(s->addresses));
+  if ((r!=CONNECTRESOLVE_PASS) ||
+      dnscacheget (name,service,&hints,&(s->addresses),&r)) {
+    connectstateresolved (s,r,name,service);
+    return s;
+  }
+  /* streaming needs a descriptor which wakes for either family */
+  s->streaming = (s->options->resolutiondelay!=0LL) && (s->pollfd>=0) &&
+	(s->options->poller!=CONNECTPOLLER_SELECT);
+  memcpy (&(s->hints),&hints,sizeof(hints));
+  if (__atomic_load_n (&stub_enabled,__ATOMIC_ACQUIRE) && name) {
+    s->stub = stubquerystart (name,service,&hints,&r);
+#ifdef EASYV6_EPOLL
+    if (s->stub && (s->pollfd>=0)) {
+      struct epoll_event ev;
 
-struct NBGAI_PENDING *nbgai_pleasecancelme = NULL;
-pthread_mutex_t nbgai_pleasecancelme_mutex = PTHREAD_MUTEX_INITIALIZER;
+      memset (&ev,0,sizeof(ev));
+      ev.events = EPOLLIN;
+      epoll_ctl (s->pollfd,EPOLL_CTL_ADD,stubquerypollfd(s->stub),&ev);
+    }
+#endif
+    if (s->stub) return s;
+    s->options->getaddrinfoerror = r;
+    errno = EFAULT;
+    connectstatedone (s,-1);
+    return s;
+  }
+  if (s->streaming) {
+    connectstatestreams (s,name,service);
+    return s;
+  }
+  s->lookup = nbgai_asyncstart (name,service,&hints,s->notifyfd,&r);
+  if (!s->lookup) {
+    s->options->getaddrinfoerror = r;
+    errno = EFAULT; /* Bad address (POSIX.1) */
+    connectstatedone (s,-1);
+  }
+  return s;
+}
 
-void nbgai_cancelagain (void) {
-/* Try again to cancel the no-longer-useful getaddrinfo_a()'s that we failed
- * to cancel before. */
+int connectstep (
+  struct CONNECTSTATE *s
+) {
   int r;
 
-  struct NBGAI_PENDING *thisone, **parent;
+  if (s->finished) {
+    errno = s->error;
+    return s->sock;
+  }
+  s->recheckat = milliseconds() + 10LL;
+  if (s->streaming) { /* either family may still be on its way */
+    if (connectstatelookups (s)) return -1;
+  } else if (s->stub) { /* still waiting on the name, without threads */
+    struct STUBQUERY *q = s->stub;
+    struct addrinfo hints;
+    unsigned ttl;
 
-  pthread_mutex_lock (&nbgai_pleasecancelme_mutex);
-  parent=&nbgai_pleasecancelme;
-  thisone = nbgai_pleasecancelme;
-  while (thisone) {
-    r = gai_cancel(thisone->req);
-    if (r!=EAI_NOTCANCELED) {
-      /* fprintf (stdout,"Cancel later: %s:%s\n",
-         thisone->req->ar_name,thisone->req->ar_service); */
-      if (thisone->req->ar_name) free ((void*) thisone->req->ar_name);
-      if (thisone->req->ar_service) free ((void*) thisone->req->ar_service);
-      if (thisone->req->ar_request) free ((void*) thisone->req->ar_request);
-      if (thisone->req->ar_result) freeaddrinfo (thisone->req->ar_result);
-      free (thisone->req);
-      *parent=thisone->next;
-      free (thisone);
-      thisone=*parent;
-      continue;
+    r = stubquerystep (q,&(s->addresses),&ttl);
+    if ((r==EAI_INPROGRESS) && (milliseconds()>=s->finishby)) r=EAI_AGAIN;
+    if (r==EAI_INPROGRESS) {
+      errno = EINPROGRESS;
+      return -1;
+    }
+    memset (&hints,0,sizeof(hints));
+    hints.ai_family = q->family;
+    hints.ai_socktype = q->socktype;
+    hints.ai_protocol = q->protocol;
+    hints.ai_flags = q->flags;
+    r = dnscacheresolved (q->node,q->service,&hints,r,&(s->addresses),
+	(r==0)?STUBTTLMS(ttl):0LL);
+    r = connectstateresolved (s,r,q->node,q->service);
+    s->stub = NULL;
+    stubqueryfree (q);
+    if (r) {
+      errno = s->error;
+      return -1;
+    }
+  }
+  if (s->lookup) { /* still waiting on the name */
+#ifdef EASYV6_EPOLL
+    uint64_t count;
+
+    if (s->notifyfd>=0) {
+      if (read (s->notifyfd,&count,sizeof(count))<0) {
+        /* EAGAIN: no completion yet */
+      }
+    }
+#endif
+    r = nbgai_asyncresult (s->lookup,&(s->addresses));
+    if ((r==EAI_INPROGRESS) && (milliseconds()>=s->finishby)) r=EAI_AGAIN;
+    if (r==EAI_INPROGRESS) {
+      errno = EINPROGRESS;
+      return -1;
+    }
+    r = dnscacheresolved (s->lookup->req.ar_name,s->lookup->req.ar_service,
+	&(s->lookup->hints),r,&(s->addresses),0LL);
+    r = connectstateresolved (s,r,s->lookup->req.ar_name,
+	s->lookup->req.ar_service);
+    nbgai_asyncrelease (s->lookup);
+    s->lookup = NULL;
+    if (r) {
+      errno = s->error;
+      return -1;
     }
-    /* fprintf (stdout,"Still can't cancel: %s:%s\n",
-       thisone->req->ar_name,thisone->req->ar_service); */
-    parent=&(thisone->next);
-    thisone=thisone->next;
   }
-  pthread_mutex_unlock (&nbgai_pleasecancelme_mutex);
+  r = connectadvance (s->c,0LL);
+  if (r==CONNECTADVANCE_PENDING) {
+    errno = EINPROGRESS;
+    return -1;
+  }
+  r = connectend (s->c,r,s->options);
+  s->c = NULL;
+  return connectstatedone (s,r);
 }
 
-void nbgai_cancellater (
-/* We failed to gai_cancel() a getaddrinfo_a() request, so queue it for a
- * later cancellation attempt */
-  struct gaicb *req
+int connectstateunwatched (
+/* Nothing polls readable when s has work: select() was asked for, or
+ * attempts are in flight outside any epoll set */
+  struct CONNECTSTATE *s
 ) {
-  struct NBGAI_PENDING *p;
+  if (s->options->poller==CONNECTPOLLER_SELECT) return 1;
+  return s->c && (s->c->pollfd<0) && s->c->pending;
+}
 
-  p = malloc (sizeof(*p));
-  if (!p) return;
-  pthread_mutex_lock (&nbgai_pleasecancelme_mutex);
-  p->next = nbgai_pleasecancelme;
-  p->req= req;
-  nbgai_pleasecancelme = p;
-  pthread_mutex_unlock (&nbgai_pleasecancelme_mutex);
-  return;
+int connectpollfd (
+  struct CONNECTSTATE *s
+) {
+  if (connectstateunwatched (s)) return -1;
+  if (s->pollfd>=0) return s->pollfd;
+  if (s->c) return s->c->pollfd;
+  return -1;
 }
 
+long long connectstatedeadline (
+/* connectdeadline() going by the lookup and the stagger alone */
+  struct CONNECTSTATE *s
+) {
+  if (s->streaming) {
+    long long deadline;
 
-int nbgai_freeandreturn (
-/* cancel and release the memory for a pending or recently completed
- * getaddrinfo_a() request and then pass through rcode. */
-  struct gaicb *reqs[]
-, int rcode
+    deadline = s->c?connectnextdeadlinems(s->c):s->finishby;
+    if (!(s->resolved[0] && s->resolved[1]) && (s->finishby<deadline))
+      deadline = s->finishby;
+    if (!s->c && s->startby && (s->startby<deadline)) deadline = s->startby;
+    if (s->stub && (stubquerydeadline(s->stub)<deadline)) 
+      deadline = stubquerydeadline(s->stub);
+    return deadline;
+  }
+  if (s->stub && (s->pollfd>=0)) {
+    if (stubquerydeadline(s->stub) < s->finishby) 
+      return stubquerydeadline(s->stub);
+    return s->finishby;
+  }
+  if (!s->c) {
+    /* No descriptor to wake us without epoll: check back soon. */
+    if ((s->notifyfd<0) && (s->recheckat<s->finishby)) return s->recheckat;
+    return s->finishby;
+  }
+  return connectnextdeadlinems (s->c);
+}
+
+long long connectdeadline (
+  struct CONNECTSTATE *s
+) {
+  long long deadline;
+
+  if (s->finished) return 0LL;
+  deadline = connectstatedeadline (s);
+  /* No descriptor to wake the caller when an attempt finishes: check back
+   * soon, as while looking up without one. A fixed time, so a caller
+   * comparing it with the clock sees it pass */
+  if (connectstateunwatched (s) && (s->recheckat<deadline)) 
+    deadline = s->recheckat;
+  return deadline;
+}
+
+void connectfree (
+  struct CONNECTSTATE *s
+) {
+  int e = errno;
+
+  if (!s) return;
+  if (s->lookup) nbgai_asyncrelease (s->lookup);
+  if (s->lookups[0]) nbgai_asyncrelease (s->lookups[0]);
+  if (s->lookups[1]) nbgai_asyncrelease (s->lookups[1]);
+  if (s->stub) stubqueryfree (s->stub);
+  if (s->c) connectend (s->c,CONNECTADVANCE_TIMEDOUT,s->options);
+  if (s->addresses && !s->options->details) freeaddrinfo (s->addresses);
+  if (s->pollfd>=0) close (s->pollfd);
+  if (s->notifyfd>=0) close (s->notifyfd);
+  if (!s->inarena) free (s);
+  errno = e;
+}
+
+int connectbynamestreaming (
+/* connectbyname() which starts connecting as soon as either address
+ * family resolves: the state machine, waited on here */
+  const char *name
+, const char *service
+, long long timeout
+, struct CONNECTOPTIONS *options
 ) {
+  struct CONNECTSTATE *s;
+  struct pollfd fds[1];
+  long long wait;
   int r;
-  if (reqs[0]) {
-    r = gai_cancel(reqs[0]);
-    if (r!=EAI_NOTCANCELED) {
-      if (reqs[0]->ar_name) free ((void*) reqs[0]->ar_name);
-      if (reqs[0]->ar_service) free ((void*) reqs[0]->ar_service);
-      if (reqs[0]->ar_request) free ((void*) reqs[0]->ar_request);
-      if (reqs[0]->ar_result && (r==EAI_CANCELED))
-	freeaddrinfo (reqs[0]->ar_result);
-      free (reqs[0]);
-    } else {
-      nbgai_cancellater (reqs[0]);
-      /* fprintf (stdout,"getaddrinfo could not cancel %s:%s\n",
-         reqs[0]->ar_name,reqs[0]->ar_service);*/
+
+  s = connectbynamestart (name,service,timeout,options);
+  if (!s) return -1;
+  while (((r=connectstep (s))<0) && (errno==EINPROGRESS)) {
+    fds[0].fd = connectpollfd (s);
+    fds[0].events = POLLIN;
+    wait = connectdeadline (s) - milliseconds();
+    if (wait<0LL) wait = 0LL;
+    if (wait>(long long) INT_MAX) wait = (long long) INT_MAX;
+    poll (fds,1,(int) wait);
+  }
+  connectfree (s);
+  return r;
+}
+
+#define CONNECTBATCH_DNSTICK 5LL /* ms between checks on pending lookups */
+
+struct CONNECTBATCHENTRY {
+/* connectbynames() bookkeeping for one target */
+  struct gaicb *req;             /* name lookup until it finishes */
+  struct STUBQUERY *stub;        /* or the same with the stub resolver */
+  struct addrinfo *addresses;    /* its result */
+  struct CONNECTIONPROGRESS *c;  /* connect race once addresses arrive */
+  struct CONNECTOPTIONS options;
+  char startnext;                /* an attempt just failed */
+  char cached;                   /* answered from the name cache */
+};
+
+void connectbatchdone (
+/* Record target's outcome from a finished race and release the entry */
+  struct CONNECTBATCHENTRY *e
+, struct CONNECTTARGET *target
+, int sockindex
+) {
+  target->socket = connectend (e->c,sockindex,&(e->options));
+  target->error = (target->socket<0)?errno:0;
+  e->c = NULL;
+  if ((target->socket>=0) && e->options.picked)
+    target->picked = dupeaddrinfo (e->options.picked);
+  freeaddrinfo (e->addresses);
+  e->addresses = NULL;
+}
+
+int connectbynames (
+  struct CONNECTTARGET *targets
+, int count
+, long long timeout
+) {
+  struct CONNECTBATCHENTRY *entries;
+  struct gaicb **reqs;
+  struct addrinfo hints;
+  long long now, dnsfinishby, connecttimeout, wait, calledat;
+  int i, r, pollfd = -1, active = 0, lookups = 0, connected = 0;
+#ifdef EASYV6_EPOLL
+  struct epoll_event events[EPOLLBATCH];
+  int n;
+#endif
+
+  if (count<=0) return 0;
+  entries = (struct CONNECTBATCHENTRY*) calloc (count,sizeof(*entries));
+  reqs = (struct gaicb**) calloc (count,sizeof(*reqs));
+  if (!entries || !reqs) {
+    if (entries) free (entries);
+    if (reqs) free (reqs);
+    errno = ENOMEM;
+    return -1;
+  }
+  /* like timeoutgetaddrinfo() */
+  timeout = connectfloorms (timeout,CONNECT_DNSFLOOR);
+  calledat = microseconds();
+  now = milliseconds();
+  dnsfinishby = now + timeout;
+
+  /* One getaddrinfo_a() batch for every name */
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_flags |= AI_ADDRCONFIG;
+  hints.ai_flags &= (~AI_V4MAPPED);
+  for (i=0; i<count; i++) {
+    targets[i].socket = -1;
+    targets[i].error = 0;
+    targets[i].getaddrinfoerror = 0;
+    targets[i].picked = NULL;
+    entries[i].options.reportpicked = 1;
+    active++;
+    r = connectresolve (connectresolverfor (NULL),targets[i].name,
+	targets[i].service,&hints,&(entries[i].addresses));
+    if (r!=CONNECTRESOLVE_PASS) {
+      targets[i].getaddrinfoerror = r;
+      entries[i].cached = 1; /* answered already */
+      continue;
+    }
+    if (dnscacheget (targets[i].name,targets[i].service,&hints,
+	&(entries[i].addresses),&(targets[i].getaddrinfoerror))) {
+      entries[i].cached = 1; /* no lookup needed */
+      continue;
     }
+    if (__atomic_load_n (&stub_enabled,__ATOMIC_ACQUIRE) && 
+        targets[i].name) {
+      entries[i].stub = stubquerystart (targets[i].name,targets[i].service,
+	&hints,&(targets[i].getaddrinfoerror));
+      if (!entries[i].stub) {
+        targets[i].error = EFAULT;
+        active--;
+      }
+      continue;
+    }
+    entries[i].req = nbgai_alloc (targets[i].name,targets[i].service,&hints);
+    if (!entries[i].req) {
+      targets[i].getaddrinfoerror = EAI_MEMORY;
+      targets[i].error = EFAULT;
+      active--;
+      continue;
+    }
+    reqs[lookups++] = entries[i].req;
   }
-  return rcode;
+  r = lookups?getaddrinfo_a(GAI_NOWAIT,reqs,lookups,NULL):0;
+  /* On failure some requests may still have been queued. gai_error()
+   * sorts them out below; an unqueued request reads as finished with no
+   * result. */
+
+  /* Every connect attempt for every target shares one epoll set */
+#ifdef EASYV6_EPOLL
+  pollfd = epoll_create1 (EPOLL_CLOEXEC);
+  for (i=0; (pollfd>=0) && (i<count); i++) {
+    struct epoll_event ev;
+
+    if (!entries[i].stub) continue;
+    /* an index no race uses: just wakes the loop to collect the answer */
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (((uint64_t) i)<<32) | 0xffffffffULL;
+    epoll_ctl (pollfd,EPOLL_CTL_ADD,stubquerypollfd(entries[i].stub),&ev);
+  }
+#endif
+
+  while (active>0) {
+    now = milliseconds();
+    lookups = 0;
+    for (i=0; i<count; i++) { /* collect finished lookups */
+      struct CONNECTBATCHENTRY *e = entries+i;
+      int gr;
+
+      if (e->cached) {
+        gr = targets[i].getaddrinfoerror;
+        e->cached = 0;
+      } else if (e->stub) {
+        unsigned ttl;
+
+        gr = stubquerystep (e->stub,&(e->addresses),&ttl);
+        if ((gr==EAI_INPROGRESS) && (now>=dnsfinishby)) gr=EAI_AGAIN;
+        if (gr==EAI_INPROGRESS) {
+          lookups++;
+          continue;
+        }
+        gr = dnscacheresolved (targets[i].name,targets[i].service,&hints,gr,
+	  &(e->addresses),(gr==0)?STUBTTLMS(ttl):0LL);
+        stubqueryfree (e->stub);
+        e->stub = NULL;
+      } else {
+        if (!e->req) continue;
+        gr = gai_error (e->req);
+        if ((gr==EAI_INPROGRESS) && (now>=dnsfinishby)) gr=EAI_AGAIN;
+        if (gr==EAI_INPROGRESS) {
+          lookups++;
+          continue;
+        }
+        if (!gr && !e->req->ar_result) gr = r?r:EAI_SYSTEM; /* never queued */
+        if (!gr) {
+          e->addresses = e->req->ar_result;
+          e->req->ar_result = NULL;
+        }
+        gr = dnscacheresolved (targets[i].name,targets[i].service,&hints,gr,
+	  &(e->addresses),0LL);
+        nbgai_freeandreturn (&(e->req),0);
+        e->req = NULL;
+      }
+      targets[i].getaddrinfoerror = gr;
+      if (!gr) {
+        /* at least a second to connect, like connectbyname() */
+        connecttimeout = connectfloorms (dnsfinishby-now,
+	  CONNECT_AFTERDNSFLOOR);
+        e->c = connectbegin (e->addresses,connecttimeout,&(e->options),
+	  targets[i].name,targets[i].service,calledat,NULL,0);
+      }
+      if (!e->c) {
+        targets[i].error = gr?EFAULT:ENOMEM;
+        if (e->addresses) freeaddrinfo (e->addresses);
+        e->addresses = NULL;
+        active--;
+        continue;
+      }
+      connectsharepoller (e->c,pollfd,(uint32_t) i);
+      e->startnext = 1;
+    }
+
+    /* start attempts which are due; retire races which are over */
+    wait = CONNECTBATCH_DNSTICK*200LL;
+    for (i=0; i<count; i++) {
+      struct CONNECTBATCHENTRY *e = entries+i;
+
+      if (!e->c) continue;
+      if (pollfd<0) { /* select() fallback: each race polls on its own */
+        r = e->c->pending?waitforconnect (e->c,0LL):WAITFORCONNECT_NOMORE;
+        if (r==WAITFORCONNECT_DONEXT) e->startnext = 1;
+        else if (r!=WAITFORCONNECT_NOMORE) {
+          connectbatchdone (e,targets+i,r);
+          if (targets[i].socket>=0) connected++;
+          active--;
+          continue;
+        }
+      }
+      r = connectschedule (e->c,e->startnext);
+      e->startnext = 0;
+      if (r!=CONNECTADVANCE_PENDING) {
+        connectbatchdone (e,targets+i,r);
+        if (targets[i].socket>=0) connected++;
+        active--;
+        continue;
+      }
+      if (connectnextdeadlinems(e->c)-now < wait) 
+        wait = connectnextdeadlinems(e->c)-now;
+    }
+    if (active<=0) break;
+    if (lookups) {
+      if (wait > CONNECTBATCH_DNSTICK) wait = CONNECTBATCH_DNSTICK;
+      if (wait > dnsfinishby-now) wait = dnsfinishby-now;
+    }
+    if (pollfd<0) {
+      if (wait > CONNECTBATCH_DNSTICK) wait = CONNECTBATCH_DNSTICK;
+      if (wait>0LL) {
+        struct timespec ts;
+        ts.tv_sec = (time_t) (wait/1000LL);
+        ts.tv_nsec = (long) ((wait%1000LL)*1000000LL);
+        nanosleep (&ts,NULL);
+      }
+      continue;
+    }
+#ifdef EASYV6_EPOLL
+    if (wait<0LL) wait=0LL;
+    n = epoll_wait (pollfd,events,EPOLLBATCH,(int) wait);
+    for (i=0; i<n; i++) { /* dispatch each event to its target's race */
+      uint32_t target = (uint32_t) (events[i].data.u64>>32);
+      struct CONNECTBATCHENTRY *e = entries+target;
+
+      if ((target>=(uint32_t) count) || !e->c) continue;
+      r = connectcompleted (e->c,(int) (events[i].data.u64&0xffffffffULL),
+	  (int) events[i].events);
+      if (r<0) {
+        e->startnext = 1;
+        continue;
+      }
+      connectbatchdone (e,targets+target,r);
+      connected++;
+      active--;
+    }
+#endif
+  }
+
+  if (pollfd>=0) close (pollfd);
+  free (reqs);
+  free (entries);
+  return connected;
 }
 
-int timeoutgetaddrinfo (
-/* See header */
-  const char *node,
-  const char *service,
-  const struct addrinfo *hints,
-  struct addrinfo **res,
-  long long *timeout
+/* Connection pool. Idle connected sockets are kept per name:service in a
+ * small hash table under one mutex. Checkout pops the most recently
+ * returned socket which is still alive. If minidle is set, a thread tops
+ * each name:service back up with connectbynames() so that checkouts
+ * rarely have to wait for a connect. */
+#define CONNECTPOOL_BUCKETS 64
+#define CONNECTPOOL_RETRY 1000LL /* ms before refilling again after a
+                                  * refill failed */
+
+struct CONNECTPOOLIDLE {
+  int socket;
+  long long since;      /* milliseconds() when it went idle */
+};
+
+struct CONNECTPOOLKEY {
+  struct CONNECTPOOLKEY *next;
+  unsigned hash;
+  const char *service;  /* points into key */
+  int idle;             /* sockets in idlesockets[] */
+  int checkedout;       /* sockets handed out and not yet put back */
+  int refilling;        /* background connects in flight */
+  long long retryafter; /* no background connects before this time */
+  long long lastused;   /* milliseconds() of the last checkout */
+  struct CONNECTPOOLIDLE *idlesockets; /* maxidle of them, oldest first */
+  char key[2];          /* name and service, each \0 terminated */
+};
+
+struct CONNECTPOOL {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  /* tells the refill thread there's work */
+  pthread_t refiller;
+  char running;         /* refiller was started */
+  char stopping;        /* connectpoolfree() wants the refiller to exit */
+  struct CONNECTPOOLOPTIONS options;
+  struct CONNECTPOOLKEY *buckets[CONNECTPOOL_BUCKETS];
+};
+
+int connectpoolalive (
+/* Is an idle socket still fit to hand out? It mustn't have failed, been
+ * closed by the other end or have unread data left from its last use. */
+  int sock
 ) {
-  long long dstartat,dendat;
-  struct addrinfo *hintsm;
-  int r;
-  struct gaicb *reqs[1];
-  struct timespec to;
+  char c;
+  ssize_t r;
+  int e = errno;
 
-  if (!timeout) return EAI_SYSTEM;
-  if (*timeout < 50) *timeout = 50; /* give myself at least 50 ms */
+  if (getsocketerrno (sock)) {
+    errno = e;
+    return 0;
+  }
+  r = recv (sock,&c,1,MSG_PEEK|MSG_DONTWAIT);
+  r = ((r<0) && ((errno==EAGAIN) || (errno==EWOULDBLOCK)));
+  errno = e;
+  return (int) r;
+}
 
-  /* When did I start? */
-  if ((dstartat = milliseconds()) < 0LL) return EAI_SYSTEM;
+struct CONNECTPOOLKEY *connectpoolkey (
+/* Find name:service in the pool, adding it if create is non-zero. Call
+ * with the pool locked. */
+  struct CONNECTPOOL *pool
+, const char *name
+, const char *service
+, int create
+) {
+  struct CONNECTPOOLKEY *k, **pk;
+  const unsigned char *p;
+  unsigned hash = 2166136261U; /* FNV-1a */
+  int namelen, keylen;
 
-  reqs[0] = malloc(sizeof(*reqs[0]));
-  if (reqs[0]==NULL) return EAI_MEMORY;
-  memset(reqs[0], 0, sizeof(*reqs[0]));
-  /*       struct gaicb {
-   *           const char            *ar_name;
-   *           const char            *ar_service;
-   *           const struct addrinfo *ar_request;
-   *           struct addrinfo       *ar_result;
-   *       };
-   */
-  reqs[0]->ar_name = strdup (node);
-  reqs[0]->ar_service = strdup (service);
-  hintsm = (struct addrinfo*) malloc (sizeof (struct addrinfo));
-  if (!hintsm) return nbgai_freeandreturn (reqs,EAI_MEMORY);
-  if (hints) {
-    memcpy (hintsm,hints,sizeof(struct addrinfo));
-    hintsm->ai_addr = NULL;
-    hintsm->ai_canonname = NULL;
-    hintsm->ai_next = NULL;
-  } else {
-    memset (hintsm,0,sizeof(struct addrinfo));
+  for (p=(const unsigned char*) name; *p; p++) hash = (hash^*p) * 16777619U;
+  hash = (hash^'\0') * 16777619U;
+  for (p=(const unsigned char*) service; *p; p++) hash = (hash^*p)*16777619U;
+  pk = &(pool->buckets[hash%CONNECTPOOL_BUCKETS]);
+  for (; *pk; pk=&((*pk)->next)) {
+    if (((*pk)->hash==hash) && !strcmp((*pk)->key,name) && 
+        !strcmp((*pk)->service,service)) return *pk;
   }
-  reqs[0]->ar_request = hintsm;
-  if (!reqs[0]->ar_name || !reqs[0]->ar_service || !reqs[0]->ar_request) 
-    return nbgai_freeandreturn (reqs,EAI_MEMORY);
+  if (!create) return NULL;
+  namelen = strlen(name);
+  keylen = namelen + strlen(service) + 2;
+  k = (struct CONNECTPOOLKEY*) malloc (sizeof(*k)+keylen);
+  if (!k) return NULL;
+  memset (k,0,sizeof(*k));
+  k->idlesockets = (struct CONNECTPOOLIDLE*) malloc (
+	sizeof(struct CONNECTPOOLIDLE)*pool->options.maxidle);
+  if (!k->idlesockets) {
+    free (k);
+    return NULL;
+  }
+  k->hash = hash;
+  memcpy (k->key,name,namelen+1);
+  k->service = k->key+namelen+1;
+  strcpy (k->key+namelen+1,service);
+  *pk = k;
+  return k;
+}
 
-  /* Would not use getaddrinfo here but will come back to that problem
-   * later on. */
-  /* fprintf (stdout,"About to call getaddrinfo on %s:%s at %lld\n",
-	node,service,dstartat);
-     fflush (stdout);  */
-  nbgai_cancelagain();
-  r = getaddrinfo_a(GAI_NOWAIT,reqs,1,NULL);
-  if (r) return nbgai_freeandreturn (reqs,r);
-  while (1) {
-    to.tv_sec = (time_t) ((*timeout)/1000LL);
-    to.tv_nsec = (suseconds_t) (((*timeout)%1000LL)*1000000LL);
-    r = gai_suspend ((const struct gaicb * const*)reqs,1,&to);
-    if ((dendat = milliseconds()) < 0)
-      return nbgai_freeandreturn (reqs,EAI_SYSTEM);
-    (*timeout) -= (dendat - dstartat);
-    dstartat = dendat;
-    if (r==EAI_AGAIN) return nbgai_freeandreturn (reqs,r); /* timeout */
-    if (r) continue;
-    r=gai_error(reqs[0]);
-    if (r) return nbgai_freeandreturn (reqs,r); /* failed request */
-    *res = reqs[0]->ar_result;
-    /* printaddrinfo (*res,0); */
-    return nbgai_freeandreturn (reqs,0); /* finished lookup on time */
+void connectpoolexpire (
+/* Close k's sockets which have been idle too long. Call with the pool
+ * locked. */
+  struct CONNECTPOOL *pool
+, struct CONNECTPOOLKEY *k
+, long long now
+) {
+  int i, n;
+
+  if (!pool->options.idletimeout) return;
+  for (n=0; n<k->idle; n++) /* oldest first */
+    if (k->idlesockets[n].since+pool->options.idletimeout > now) break;
+  if (!n) return;
+  for (i=0; i<n; i++) close (k->idlesockets[i].socket);
+  memmove (k->idlesockets,k->idlesockets+n,
+	sizeof(struct CONNECTPOOLIDLE)*(k->idle-n));
+  k->idle -= n;
+}
+
+int connectpoolwanted (
+/* How many more sockets the refiller should open for k. Call with the
+ * pool locked. */
+  struct CONNECTPOOL *pool
+, struct CONNECTPOOLKEY *k
+, long long now
+) {
+  int n;
+
+  if (k->retryafter>now) return 0;
+  /* stop keeping sockets ready for a name:service nobody uses anymore */
+  if (pool->options.idletimeout && 
+      (k->lastused+pool->options.idletimeout<=now)) return 0;
+  n = pool->options.minidle - k->idle - k->refilling;
+  if (pool->options.maxperkey && 
+      (n > pool->options.maxperkey-k->idle-k->refilling-k->checkedout))
+    n = pool->options.maxperkey-k->idle-k->refilling-k->checkedout;
+  return (n>0)?n:0;
+}
+
+void *connectpoolrefill (
+/* The refill thread: expire idle sockets, then race connects to every
+ * name:service which is below minidle */
+  void *arg
+) {
+  struct CONNECTPOOL *pool = (struct CONNECTPOOL*) arg;
+  struct CONNECTPOOLKEY *k, **keys = NULL;
+  struct CONNECTTARGET *targets = NULL;
+  struct timespec until;
+  long long now, next;
+  int i, j, n, count, allocated = 0;
+
+  pthread_mutex_lock (&(pool->lock));
+  while (!pool->stopping) {
+    now = milliseconds();
+    next = now + 60000LL;
+    for (count=i=0; i<CONNECTPOOL_BUCKETS; i++) {
+      for (k=pool->buckets[i]; k; k=k->next) {
+        connectpoolexpire (pool,k,now);
+        if (k->idle && pool->options.idletimeout && 
+            (k->idlesockets[0].since+pool->options.idletimeout < next))
+          next = k->idlesockets[0].since+pool->options.idletimeout;
+        if (k->retryafter>now) {
+          if (k->retryafter<next) next = k->retryafter;
+          continue;
+        }
+        count += connectpoolwanted (pool,k,now);
+      }
+    }
+    if (!count) { /* nothing to do until woken or something expires */
+      /* the condition variable times out on CLOCK_REALTIME */
+      clock_gettime (CLOCK_REALTIME,&until);
+      next -= now;
+      until.tv_sec += (time_t) (next/1000LL);
+      until.tv_nsec += (long) ((next%1000LL)*1000000LL);
+      if (until.tv_nsec>=1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait (&(pool->wake),&(pool->lock),&until);
+      continue;
+    }
+    if (count>allocated) {
+      free (targets);
+      free (keys);
+      targets = (struct CONNECTTARGET*) malloc (sizeof(*targets)*count);
+      keys = (struct CONNECTPOOLKEY**) malloc (sizeof(*keys)*count);
+      allocated = count;
+      if (!targets || !keys) {
+        allocated = 0;
+        pthread_mutex_unlock (&(pool->lock));
+        sleep (1);
+        pthread_mutex_lock (&(pool->lock));
+        continue;
+      }
+    }
+    for (count=i=0; i<CONNECTPOOL_BUCKETS; i++) {
+      for (k=pool->buckets[i]; k; k=k->next) {
+        n = connectpoolwanted (pool,k,now);
+        for (j=0; j<n; j++) {
+          memset (targets+count,0,sizeof(*targets));
+          targets[count].name = k->key;
+          targets[count].service = k->service;
+          keys[count++] = k;
+        }
+        k->refilling += n;
+      }
+    }
+    /* keys are never freed before the thread exits, so their names stay
+     * put while unlocked */
+    pthread_mutex_unlock (&(pool->lock));
+    connectbynames (targets,count,pool->options.connecttimeout);
+    pthread_mutex_lock (&(pool->lock));
+    now = milliseconds();
+    for (i=0; i<count; i++) {
+      k = keys[i];
+      k->refilling--;
+      if (targets[i].picked) freeaddrinfo (targets[i].picked);
+      if (targets[i].socket<0) {
+        k->retryafter = now + CONNECTPOOL_RETRY;
+        continue;
+      }
+      if (pool->stopping || (k->idle>=pool->options.maxidle)) {
+        close (targets[i].socket);
+        continue;
+      }
+      k->idlesockets[k->idle].socket = targets[i].socket;
+      k->idlesockets[k->idle].since = now;
+      k->idle++;
+    }
   }
-
-  /* not reached */
-  return EAI_SYSTEM;
+  pthread_mutex_unlock (&(pool->lock));
+  free (targets);
+  free (keys);
+  return NULL;
 }
 
-struct addrinfo *dupeaddrinfo (const struct addrinfo *address) {
-/* duplicate the first entry in *address */
-  struct addrinfo *a;
-  void *p1, *p2;
-
+struct CONNECTPOOL *connectpoolcreate (
+  const struct CONNECTPOOLOPTIONS *options
+) {
+  struct CONNECTPOOL *pool;
 
-  if (!address || !address->ai_addr) return NULL;
-  if (address->ai_addrlen<=0) return NULL;
-  p1 = (void*) address;
-  p2 = (void*) address->ai_addr;
-  
-  if ( (size_t) (((void*)address->ai_addr) - ((void*) address)) ==
-	sizeof(*address) ) { /* GNU libc mallocs one block of memory
-                              * for address and address->ai_addr, pointing
-			      * ai_addr just beyond the addrinfo structure.
-                              * Does everybody else? */
-    a = (struct addrinfo*) malloc (sizeof(*a)+address->ai_addrlen);
-    if (!a) return NULL;
-    memcpy (a,address,sizeof(*a)+address->ai_addrlen);
-    a->ai_addr=(struct sockaddr*) (a+1);
-  } else { /* I hope they haven't composed the addrinfo struct in a way
-            * that causes this to leak in freeaddrinfo() like it would in
-            * GNU libc... */
-    a = (struct addrinfo*) malloc (sizeof(*a));
-    if (!a) return NULL;
-    memcpy (a,address,sizeof(*a));
-    a->ai_addr = (struct sockaddr*) malloc (address->ai_addrlen);
-    if (a->ai_addr==NULL) {
-      free (a);
-      return NULL;
-    }
-    memcpy (a->ai_addr,address->ai_addr,address->ai_addrlen);
+  if (options && ((options->maxidle<0) || (options->minidle<0) ||
+      (options->maxperkey<0) || (options->idletimeout<0LL))) {
+    errno = EINVAL;
+    return NULL;
   }
-  a->ai_next=NULL;
-  /* fprintf (stdout,"Pointers: a=%X,\n a->ai_addr=%X,\n a->ai_cannonname=%x,\n"
-	" sizeof(a)=%X\n",
-	(unsigned)address, (unsigned)address->ai_addr, 
-	(unsigned)address->ai_canonname,sizeof(*address));
-     fprintf (stdout,"Pointers: a=%X,\n a->ai_addr=%X,\n a->ai_cannonname=%x,\n"
-	" sizeof(a)=%X\n",
-	(unsigned)a, (unsigned)a->ai_addr, 
-	(unsigned)a->ai_canonname,sizeof(*a)); */
-  if (address->ai_canonname) a->ai_canonname = strdup (a->ai_canonname);
-  return a;
+  pool = (struct CONNECTPOOL*) malloc (sizeof(*pool));
+  if (!pool) return NULL;
+  memset (pool,0,sizeof(*pool));
+  if (options) pool->options = *options;
+  if (!pool->options.maxidle) pool->options.maxidle = 8;
+  if (pool->options.minidle > pool->options.maxidle) 
+    pool->options.minidle = pool->options.maxidle;
+  if (pool->options.connecttimeout<=0LL) 
+    pool->options.connecttimeout = 10000LL;
+  pthread_mutex_init (&(pool->lock),NULL);
+  pthread_cond_init (&(pool->wake),NULL);
+  return pool;
 }
 
-int connectbyname (
-  const char *name
+int connectpoolget (
+  struct CONNECTPOOL *pool
+, const char *name
 , const char *service
 , long long timeout
 , struct CONNECTOPTIONS *options
 ) {
-  struct addrinfo *addresses;
-  struct addrinfo hints;
-  int r;
+  struct CONNECTPOOLKEY *k;
+  int sock, e;
 
-  /* fprintf (stdout,"Enter connectbyname %s:%s(%lld)\n",
-     name,service,timeout); */
-  /* Fetch candidate IP addresses from the name + service */
-  memset (&hints,0,sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype=SOCK_STREAM;
-  hints.ai_flags |= AI_ADDRCONFIG;
-  hints.ai_flags &= (~AI_V4MAPPED);
-  r = timeoutgetaddrinfo (name,service,&hints,&addresses,&timeout);
-  if (options) options->getaddrinfoerror = r;
-  if (r) { /* if I couldn't get addresses, fail */
-    errno = EFAULT; /* Bad address (POSIX.1) */
+  pthread_mutex_lock (&(pool->lock));
+  k = connectpoolkey (pool,name,service,1);
+  if (!k) {
+    pthread_mutex_unlock (&(pool->lock));
+    errno = ENOMEM;
+    return -1;
+  }
+  k->lastused = milliseconds();
+  connectpoolexpire (pool,k,k->lastused);
+  while (k->idle) { /* newest first: least likely to have been dropped */
+    k->idle--;
+    sock = k->idlesockets[k->idle].socket;
+    if (connectpoolalive (sock)) {
+      k->checkedout++;
+      if (pool->options.minidle && (k->idle<pool->options.minidle)) {
+        if (!pool->running && !pthread_create (&(pool->refiller),NULL,
+	    connectpoolrefill,pool)) pool->running = 1;
+        pthread_cond_signal (&(pool->wake));
+      }
+      pthread_mutex_unlock (&(pool->lock));
+      if (options) options->numaddresses = 0; /* no race was run */
+      errno = 0;
+      return sock;
+    }
+    close (sock);
+  }
+  if (pool->options.maxperkey && 
+      (k->checkedout+k->refilling >= pool->options.maxperkey)) {
+    pthread_mutex_unlock (&(pool->lock));
+    errno = EAGAIN;
     return -1;
   }
+  k->checkedout++; /* hold the place while connecting unlocked */
+  if (pool->options.minidle) {
+    if (!pool->running && !pthread_create (&(pool->refiller),NULL,
+	connectpoolrefill,pool)) pool->running = 1;
+    pthread_cond_signal (&(pool->wake));
+  }
+  pthread_mutex_unlock (&(pool->lock));
 
-  /* give myself at least a second to connect, even if getaddrinfo ate
-   * too much of my timeout. */
-  if (timeout<1000LL) timeout=1000LL; 
+  sock = connectbyname (name,service,timeout,options);
+  if (sock>=0) return sock;
+  e = errno;
+  pthread_mutex_lock (&(pool->lock));
+  k->checkedout--;
+  pthread_mutex_unlock (&(pool->lock));
+  errno = e;
+  return -1;
+}
 
-  /*fprintf (stdout,"connectbyaddrinfo (%lld)\n",timeout);*/
-  /* Try to connect with the retrieved addresses */
-  r = connectbyaddrinfo (addresses,timeout,options);
+void connectpoolput (
+  struct CONNECTPOOL *pool
+, const char *name
+, const char *service
+, int sock
+) {
+  struct CONNECTPOOLKEY *k;
+  int e = errno;
 
-  /* One way or another, done. */
-  if (options && options->picked) 
-    options->picked = dupeaddrinfo (options->picked);
+  pthread_mutex_lock (&(pool->lock));
+  k = connectpoolkey (pool,name,service,0);
+  if (k && (k->checkedout>0)) k->checkedout--;
+  if (sock>=0) {
+    if (k && (k->idle<pool->options.maxidle) && connectpoolalive (sock)) {
+      k->idlesockets[k->idle].socket = sock;
+      k->idlesockets[k->idle].since = milliseconds();
+      k->idle++;
+    } else close (sock);
+  }
+  pthread_mutex_unlock (&(pool->lock));
+  errno = e;
+}
 
-  /* If addresses is not consumed by the details option, free their RAM. */
-  if (!options || !options->details) freeaddrinfo (addresses);
+void connectpoolfree (
+  struct CONNECTPOOL *pool
+) {
+  struct CONNECTPOOLKEY *k;
+  int i, j;
 
-  return r;
+  if (!pool) return;
+  pthread_mutex_lock (&(pool->lock));
+  pool->stopping = 1;
+  pthread_cond_signal (&(pool->wake));
+  pthread_mutex_unlock (&(pool->lock));
+  if (pool->running) pthread_join (pool->refiller,NULL);
+  for (i=0; i<CONNECTPOOL_BUCKETS; i++) {
+    while ((k=pool->buckets[i])) {
+      pool->buckets[i] = k->next;
+      for (j=0; j<k->idle; j++) close (k->idlesockets[j].socket);
+      free (k->idlesockets);
+      free (k);
+    }
+  }
+  pthread_cond_destroy (&(pool->wake));
+  pthread_mutex_destroy (&(pool->lock));
+  free (pool);
 }
 
-int listenbyaddrinfo (
+int listenreuseport (
+/* listenbyaddrinfo(), but if reuseport the socket may share its port with
+ * others which also set SO_REUSEPORT, the kernel spreading incoming
+ * connections among them */
   struct addrinfo *address
 , int backlog
+, int reuseport
 ) {
   int s;
   int reuseaddr=1;
@@ -874,6 +6729,20 @@ int listenbyaddrinfo (
     /* close (s);
     return -1; */
   }
+#ifdef SO_REUSEPORT
+  if (reuseport && 
+      setsockopt(s,SOL_SOCKET,SO_REUSEPORT,&reuseport,sizeof(reuseport))) {
+    /* without it, the second bind() would fail anyway */
+    close (s);
+    return -1;
+  }
+#else
+  if (reuseport) {
+    close (s);
+    errno = ENOPROTOOPT;
+    return -1;
+  }
+#endif
 
   if (bind(s,address->ai_addr,address->ai_addrlen)) {
     /* That port is not available */
@@ -888,11 +6757,17 @@ int listenbyaddrinfo (
   return s;
 }
 
+int listenbyaddrinfo (
+  struct addrinfo *address
+, int backlog
+) {
+  return listenreuseport (address,backlog,0);
+}
+
 
 int listenbyname (
-/* Open listener sockets for all address families supporting *service
- * and return them as a -1 terminated array. Will listen on the wildcard
- * address for all of the protocol famlies.
+/* Open a listener socket for *service and return it. It listens on the
+ * IPv6 wildcard address, which accepts IPv4 connections as well.
  */
   const char *service
 , int socktype  /* SOCK_STREAM or SOCK_SEQPACKET */
@@ -916,3 +6791,486 @@ int listenbyname (
   return -1;
 }
 
+int listensharedport (
+/* If address asks for port 0, make it ask for the port the kernel gave
+ * socket s, so that the rest of the shards join s on it. */
+  struct addrinfo *address
+, int s
+) {
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+
+  if (getsockname(s,(struct sockaddr*) &ss,&len)) return -1;
+  if ((address->ai_family==AF_INET6) && (ss.ss_family==AF_INET6)) {
+    if (!((struct sockaddr_in6*) address->ai_addr)->sin6_port)
+      ((struct sockaddr_in6*) address->ai_addr)->sin6_port = 
+	((struct sockaddr_in6*) &ss)->sin6_port;
+  } else if ((address->ai_family==AF_INET) && (ss.ss_family==AF_INET)) {
+    if (!((struct sockaddr_in*) address->ai_addr)->sin_port)
+      ((struct sockaddr_in*) address->ai_addr)->sin_port = 
+	((struct sockaddr_in*) &ss)->sin_port;
+  }
+  return 0;
+}
+
+int listenshardbycpu (
+/* Make the kernel hand each connection to the shard whose index is the
+ * CPU that received it, modulo the number of shards. A classic BPF
+ * reuseport program does that in one step (Linux 4.5); before that, ask
+ * each shard to prefer its own CPU with SO_INCOMING_CPU. */
+  int *listeners
+, int count
+) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+  {
+    struct sock_filter code[3] = {
+      { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) (SKF_AD_OFF+SKF_AD_CPU) },
+      { BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0 },
+      { BPF_RET | BPF_A, 0, 0, 0 } };
+    struct sock_fprog prog;
+
+    code[1].k = (uint32_t) count;
+    prog.len = 3;
+    prog.filter = code;
+    /* the program belongs to the whole group, whichever shard it's set on */
+    if (!setsockopt(listeners[0],SOL_SOCKET,SO_ATTACH_REUSEPORT_CBPF,
+        &prog,sizeof(prog)))
+      return 0;
+  }
+#endif
+#ifdef SO_INCOMING_CPU
+  {
+    int i;
+
+    for (i=0; i<count; i++)
+      if (setsockopt(listeners[i],SOL_SOCKET,SO_INCOMING_CPU,&i,sizeof(i)))
+        return -1;
+    return 0;
+  }
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+int *listenbyname_sharded (
+/* count listeners sharing service through SO_REUSEPORT, as a malloc()ed
+ * -1 terminated array */
+  const char *service
+, int socktype
+, int backlog
+, int count
+, int flags
+) {
+  struct addrinfo hints, *res;
+  int *listeners;
+  int i, r;
+
+  if (count<=0) {
+    count = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    if (count<1) count = 1;
+  }
+  listeners = (int*) malloc ((count+1)*sizeof(int));
+  if (!listeners) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset (&hints,0,sizeof(hints));
+  hints.ai_family = AF_INET6; /* accepts IPv4 *and* IPv6 connections */
+  hints.ai_socktype = socktype;
+  hints.ai_flags = AI_PASSIVE;
+  r=getaddrinfo (NULL,service,&hints,&res);
+  if (r) {
+    free (listeners);
+    errno = EFAULT; /* Bad address (POSIX.1) */
+    return NULL;
+  }
+  for (i=0; i<count; i++) {
+    listeners[i] = listenreuseport (res,backlog,1);
+    if ((listeners[i]<0) || ((i==0) && listensharedport (res,listeners[0])))
+      break;
+  }
+  freeaddrinfo (res);
+  if ((i<count) || 
+      ((flags & LISTENSHARD_CPU) && listenshardbycpu (listeners,count))) {
+    r = errno;
+    if (i<count) i++;
+    while (i--) if (listeners[i]>=0) close (listeners[i]);
+    free (listeners);
+    errno = r;
+    return NULL;
+  }
+  listeners[count] = -1;
+  return listeners;
+}
+
+
+/* what accepturing() does without a ring: wait with poll(), take one with
+ * accept4() */
+struct ACCEPTURING {
+  int listener;
+#ifdef EASYV6_URING
+  struct URING *u;  /* NULL to poll() and accept4() */
+  char armed;       /* the multishot accept is still in flight */
+  char accepted;    /* it has produced a socket, so it's supported */
+#endif
+};
+
+#ifdef EASYV6_URING
+#define URING_ACCEPT 5ULL
+
+int accepturingarm (
+/* Queue one IORING_OP_ACCEPT which keeps accepting, each new socket
+ * arriving as a cqe, until it is cancelled or fails */
+  struct ACCEPTURING *a
+) {
+  struct io_uring_sqe *sqe;
+
+  sqe = uringsqe (a->u,1);
+  if (!sqe) return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = a->listener;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = URINGDATA(URING_ACCEPT,0);
+  a->armed = 1;
+  return 0;
+}
+
+void accepturingdrain (
+/* Cancel the multishot accept and wait for the ring to empty, closing
+ * sockets accepted meanwhile. */
+  struct ACCEPTURING *a
+) {
+  struct io_uring_sqe *sqe;
+  uint64_t data;
+  unsigned flags;
+  int res;
+
+  if (a->armed && (sqe=uringsqe (a->u,1))) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URINGDATA(URING_ACCEPT,0);
+    sqe->user_data = URINGDATA(URING_CANCEL,0);
+  }
+  while (a->u->inflight) {
+    if (uringenter (a->u,1,-1LL)) break;
+    while (uringcqe (a->u,&data,&res,&flags))
+      if (((data>>32)==URING_ACCEPT) && (res>=0)) close (res);
+  }
+  a->armed = 0;
+}
+#endif
+
+struct ACCEPTURING *accepturingstart (
+  int listener
+) {
+  struct ACCEPTURING *a;
+
+  if (listener<0) {
+    errno = EBADF;
+    return NULL;
+  }
+  a = (struct ACCEPTURING*) calloc (1,sizeof(struct ACCEPTURING));
+  if (!a) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  a->listener = listener;
+#ifdef EASYV6_URING
+  /* accepturing() waits with a timeout through IORING_ENTER_EXT_ARG,
+   * which is older than multishot accept anyway */
+  if (!uring_unavailable) {
+    a->u = uringopen (URINGENTRIES);
+    if (a->u && !(a->u->features & IORING_FEAT_EXT_ARG)) {
+      uringclose (a->u);
+      a->u = NULL;
+    }
+    if (a->u && accepturingarm (a)) {
+      uringclose (a->u);
+      a->u = NULL;
+    }
+  }
+#endif
+  return a;
+}
+
+int accepturing (
+  struct ACCEPTURING *a
+, long long timeout
+) {
+  struct pollfd p;
+  long long deadline = -1LL, wait = -1LL;
+  int r;
+
+  if (timeout>=0LL) deadline = milliseconds() + timeout;
+#ifdef EASYV6_URING
+  while (a->u) {
+    uint64_t data;
+    unsigned flags;
+    int res;
+
+    while (uringcqe (a->u,&data,&res,&flags)) {
+      if ((data>>32)!=URING_ACCEPT) continue;
+      if (!(flags & IORING_CQE_F_MORE)) a->armed = 0;
+      if (res>=0) {
+        a->accepted = 1;
+        return res;
+      }
+      if ((res==-EINVAL) && !a->accepted) { 
+        /* no multishot accept before Linux 5.19: use accept4() */
+        accepturingdrain (a);
+        uringclose (a->u);
+        a->u = NULL;
+        break;
+      }
+      if (res==-ECONNABORTED) continue;
+      if (res==-ECANCELED) continue;
+      errno = -res;
+      return -1;
+    }
+    if (!a->u) break;
+    if ((!a->armed) && accepturingarm (a)) {
+      errno = ENOMEM;
+      return -1;
+    }
+    if (deadline>=0LL) {
+      wait = deadline - milliseconds();
+      if (wait<0LL) wait = 0LL;
+    }
+    if (uringenter (a->u,1,wait)) return -1;
+    if ((deadline>=0LL) && (milliseconds()>=deadline) &&
+        (*a->u->cqhead==__atomic_load_n(a->u->cqtail,__ATOMIC_ACQUIRE))) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+#endif
+  for (;;) {
+    p.fd = a->listener;
+    p.events = POLLIN;
+    p.revents = 0;
+    if (deadline>=0LL) {
+      wait = deadline - milliseconds();
+      if (wait<0LL) wait = 0LL;
+      if (wait>(long long) INT_MAX) wait = (long long) INT_MAX;
+    }
+    r = poll (&p,1,(int) wait);
+    if ((r<0) && (errno!=EINTR)) return -1;
+    if (r>0) {
+#ifdef SOCK_NONBLOCK
+      r = accept4 (a->listener,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+      r = accept (a->listener,NULL,NULL);
+      if (r>=0) fcntl (r,F_SETFL,fcntl(r,F_GETFL,0)|O_NONBLOCK);
+#endif
+      if (r>=0) return r;
+      if ((errno!=EAGAIN) && (errno!=EWOULDBLOCK) && (errno!=EINTR) &&
+          (errno!=ECONNABORTED)) 
+        return -1;
+    }
+    if ((deadline>=0LL) && (milliseconds()>=deadline)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
+void accepturingfree (
+  struct ACCEPTURING *a
+) {
+  if (!a) return;
+#ifdef EASYV6_URING
+  if (a->u) {
+    accepturingdrain (a);
+    uringclose (a->u);
+  }
+#endif
+  free (a);
+}
+
+/* Accept engine: epoll over the listeners, each readiness drained with
+ * accept4() and the new sockets handed out in batches with their peer
+ * addresses already formatted from what accept4() returned, which saves
+ * the getpeername() of getpeernametext(). */
+struct ACCEPTOR {
+  int pollfd;      /* epoll set of the listeners, or -1 to poll() them */
+  int count;       /* listeners */
+  int ready;       /* entries in readylist */
+  int *readylist;  /* indexes of listeners said to be readable and not yet
+                    * drained to EAGAIN */
+  int listeners[1];
+};
+
+struct ACCEPTOR *acceptorcreate (
+  const int *listeners
+) {
+  struct ACCEPTOR *a;
+  int i, count, flags;
+
+  for (count=0; listeners && (listeners[count]>=0); count++) ;
+  if (!count) {
+    errno = EBADF;
+    return NULL;
+  }
+  a = (struct ACCEPTOR*) malloc (sizeof(struct ACCEPTOR) + 
+	2*count*sizeof(int));
+  if (!a) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  a->count = count;
+  a->ready = 0;
+  a->readylist = a->listeners + count;
+  a->pollfd = -1;
+  for (i=0; i<count; i++) {
+    a->listeners[i] = listeners[i];
+    /* draining stops at EAGAIN, so the listeners must not block */
+    flags = fcntl (listeners[i],F_GETFL,0);
+    if ((flags<0) || 
+        (!(flags & O_NONBLOCK) && fcntl(listeners[i],F_SETFL,flags|O_NONBLOCK))) {
+      free (a);
+      return NULL;
+    }
+  }
+#ifdef EASYV6_EPOLL
+  a->pollfd = epoll_create1 (EPOLL_CLOEXEC);
+  for (i=0; (a->pollfd>=0) && (i<count); i++) {
+    struct epoll_event ev;
+
+    /* level triggered: a listener left undrained when a batch fills up
+     * reports again */
+    memset (&ev,0,sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t) i;
+    if (epoll_ctl (a->pollfd,EPOLL_CTL_ADD,listeners[i],&ev)) {
+      close (a->pollfd);
+      a->pollfd = -1;
+    }
+  }
+#endif
+  return a;
+}
+
+void acceptorready (
+/* Put listener i on the ready list unless it's there already, so the
+ * list never holds more than count entries */
+  struct ACCEPTOR *a
+, int i
+) {
+  int j;
+
+  for (j=0; j<a->ready; j++) if (a->readylist[j]==i) return;
+  if (a->ready<a->count) a->readylist[a->ready++] = i;
+}
+
+int acceptorpoll (
+/* Wait up to wait milliseconds for listeners to become readable and put
+ * them on the ready list. Returns -1 on failure */
+  struct ACCEPTOR *a
+, long long wait
+) {
+  struct pollfd *fds;
+  int i, r;
+
+  if (wait>(long long) INT_MAX) wait = (long long) INT_MAX;
+#ifdef EASYV6_EPOLL
+  if (a->pollfd>=0) {
+    struct epoll_event events[EPOLLBATCH];
+
+    r = epoll_wait (a->pollfd,events,EPOLLBATCH,(int) wait);
+    if (r<0) return (errno==EINTR)?0:-1;
+    for (i=0; i<r; i++) acceptorready (a,(int) events[i].data.u64);
+    return 0;
+  }
+#endif
+  fds = (struct pollfd*) malloc (a->count*sizeof(struct pollfd));
+  if (!fds) {
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i=0; i<a->count; i++) {
+    fds[i].fd = a->listeners[i];
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  r = poll (fds,a->count,(int) wait);
+  if (r<0) {
+    free (fds);
+    return (errno==EINTR)?0:-1;
+  }
+  for (i=0; i<a->count; i++)
+    if (fds[i].revents) acceptorready (a,i);
+  free (fds);
+  return 0;
+}
+
+int acceptorwait (
+  struct ACCEPTOR *a
+, struct ACCEPTED *accepted
+, int max
+, long long timeout
+) {
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  long long deadline = -1LL, wait = -1LL;
+  int n = 0, s, l;
+
+  if (max<=0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (timeout>=0LL) deadline = milliseconds() + timeout;
+  for (;;) {
+    /* drain the listeners known to be readable, oldest first */
+    while (a->ready && (n<max)) {
+      l = a->listeners[a->readylist[0]];
+      peerlen = sizeof(peer);
+#ifdef SOCK_NONBLOCK
+      s = accept4 (l,(struct sockaddr*) &peer,&peerlen,
+	SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+      s = accept (l,(struct sockaddr*) &peer,&peerlen);
+      if (s>=0) fcntl (s,F_SETFL,fcntl(s,F_GETFL,0)|O_NONBLOCK);
+#endif
+      if (s<0) {
+        if ((errno==ECONNABORTED) || (errno==EINTR)) continue;
+        if ((errno!=EAGAIN) && (errno!=EWOULDBLOCK) && !n) return -1;
+        /* drained (or out of descriptors, which the caller hears about
+         * next time if it lasts) */
+        a->ready --;
+        memmove (a->readylist,a->readylist+1,a->ready*sizeof(int));
+        continue;
+      }
+      accepted[n].socket = s;
+      accepted[n].listener = l;
+      accepted[n].address = NULL;
+      if (accepted[n].buf) 
+        accepted[n].address = sockaddrtext ((struct sockaddr*) &peer,
+	  peerlen,accepted[n].buf,accepted[n].bytes);
+      n++;
+    }
+    if (n) return n;
+    if (deadline>=0LL) {
+      wait = deadline - milliseconds();
+      if (wait<0LL) return 0;
+    }
+    if (acceptorpoll (a,wait)) return -1;
+    if ((!a->ready) && (deadline>=0LL) && (milliseconds()>=deadline))
+      return 0;
+  }
+}
+
+int acceptorpollfd (
+  struct ACCEPTOR *a
+) {
+  return a->pollfd;
+}
+
+void acceptorfree (
+  struct ACCEPTOR *a
+) {
+  if (!a) return;
+  if (a->pollfd>=0) close (a->pollfd);
+  free (a);
+}
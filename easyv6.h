@@ -11,10 +11,29 @@
 struct CONNECTBYNAMERESULT {
   const struct addrinfo *address; /* addrinfo component */
   int error;                      /* errno from connect() to this address */
+  int outcome;                    /* CONNECTOUTCOME_... */
+};
+
+#define CONNECTOUTCOME_NOTSTARTED 0 /* the race ended first */
+#define CONNECTOUTCOME_WON        1
+#define CONNECTOUTCOME_FAILED     2 /* see error. ETIMEDOUT if still
+                                     * connecting when time ran out, 0
+                                     * if it connected just after the
+                                     * winner */
+#define CONNECTOUTCOME_CANCELLED  3 /* still connecting when another won */
+
+struct CONNECTBYNAMETIMING {
+  long long started;  /* microseconds() as the attempt began. 0 if never */
+  long long finished; /* microseconds() as it won, failed or was cancelled */
 };
 
 struct CONNECTBYNAMEDETAILS {
   const struct addrinfo *addresslist;
+  struct CONNECTBYNAMETIMING *timing; /* one per results[] entry, in the
+                                       * same block. NULL with notiming */
+  long long dnsmicroseconds;          /* spent looking up the name */
+  long long elapsedmicroseconds;      /* from the call to the end of the
+                                       * race */
   struct CONNECTBYNAMERESULT results[1];
 };
 
@@ -41,8 +60,82 @@ struct CONNECTOPTIONS {
                                 */
   char reportpicked;           /* Supply an addrinfo in picked */
   char reportdetails;          /* Fill in the details structure if non-zero */
+  char notiming;               /* Leave the per-attempt timing out of the
+                                * details to save memory */
+  char poller;                 /* CONNECTPOLLER_... readiness mechanism used
+                                * to wait on the parallel connects */
+  char nointerleave;           /* Try addresses in the order given instead
+                                * of alternating address families */
+  char sortaddresses;          /* Sort by RFC 6724 destination precedence
+                                * and scope before interleaving. 
+                                * getaddrinfo() already sorts, so this is
+                                * for lists from elsewhere */
+  int firstfamilycount;        /* RFC 8305 First Address Family Count: how
+                                * many addresses of the first family to try
+                                * before alternating. 0 means 1 */
+  long long attemptdelay;      /* RFC 8305 Connection Attempt Delay in
+                                * milliseconds (at least 10). 0 scales the
+                                * delay by the timeout */
+  long long firstwait;         /* microseconds from starting the first
+                                * attempt to starting the second, with no
+                                * lower limit. Overrides attemptdelay. 0
+                                * for the default: the timeout divided by
+                                * the number of addresses, kept between
+                                * minwait and maxwait */
+  long long nextwait;          /* microseconds between later attempts. 0
+                                * for half the scaled firstwait, or the
+                                * same as firstwait or attemptdelay if
+                                * either is given */
+  long long minwait;           /* least the scaled firstwait may be, in
+                                * microseconds. 0 means 100 ms */
+  long long maxwait;           /* most it may be. 0 means 1 s */
+  long long dnsfloor;          /* microseconds the name lookup gets however
+                                * short the timeout. 0 means 50 ms */
+  long long connectfloor;      /* microseconds the connect attempts get
+                                * however short the timeout or however
+                                * much of it the name lookup used. 0 means
+                                * 100 ms, or 1 s after a name lookup */
+  int rttmultiple;             /* Adaptive stagger: learn the handshake
+                                * round trip time to each /24 or /64 from
+                                * the attempts which complete, and start
+                                * the next attempt once one has taken this
+                                * many times its prefix's smoothed RTT
+                                * (2 or 3 is good), bounded by minwait
+                                * (default 1 ms) and maxwait. Prefixes not
+                                * seen yet get the usual stagger. 0 is off */
+  void *arena;                 /* Memory the race may live in instead of
+                                * the heap, while connectbyaddrinfo() or a
+                                * connectstep() race runs. Races bigger
+                                * than arenabytes, or which grow out of it,
+                                * fall back to malloc(). Never share one
+                                * arena between races in flight */
+  size_t arenabytes;
+  long long resolutiondelay;   /* RFC 8305 Resolution Delay: look up IPv6
+                                * and IPv4 addresses separately and start
+                                * connecting as soon as either answers,
+                                * waiting this many milliseconds (50 is
+                                * the RFC's suggestion) for IPv6 when IPv4
+                                * answers first. Addresses which arrive
+                                * later join the race. Negative starts
+                                * without waiting. 0 waits for both */
+  const struct CONNECTRESOLVER *resolver; /* Look names up with this
+                                * instead of the process default from
+                                * connectresolverset(), getaddrinfo_a() or
+                                * the stub resolver. NULL for the default */
 };
 
+/* Plenty of arena for a connectbyname() to n addresses */
+#define CONNECTARENA_BYTES(n) (2048 + 64*(n))
+
+#define CONNECTPOLLER_DEFAULT 0 /* best available (epoll on Linux) */
+#define CONNECTPOLLER_SELECT  1 /* select(), the portable fallback */
+#define CONNECTPOLLER_EPOLL   2 /* epoll; falls back to select if unavailable */
+#define CONNECTPOLLER_URING   3 /* io_uring for connectbyname() and
+                                 * connectbyaddrinfo(), which then make no
+                                 * readiness system calls at all. Falls
+                                 * back to epoll if the kernel lacks it.
+                                 * Elsewhere the same as DEFAULT */
+
 /* Note: to free *details: 
  * freeaddrinfo(details->addresslist);
  * free(details);
@@ -70,6 +163,16 @@ char *getpeernametext (
 , size_t bytes
 );
 
+char *sockaddrtext (
+/* getpeernametext() for a peer address already in hand, such as the one
+ * accept() returns.
+ */
+  const struct sockaddr *address
+, socklen_t addrlen
+, char *buf
+, size_t bytes
+);
+
 
 int timeoutgetaddrinfo (
 /* getaddrinfo with *any* Internet address family and protocol of type
@@ -84,6 +187,285 @@ int timeoutgetaddrinfo (
   long long *timeout /* milliseconds */
 );
 
+struct DNSCACHESTATS {
+  unsigned long long hits;     /* fresh answers served from the cache */
+  unsigned long long misses;   /* lookups which went to the resolver */
+  unsigned long long stale;    /* expired answers served because the
+                                * refresh failed or timed out */
+  unsigned long long negative; /* hits on a cached EAI_NONAME */
+  unsigned long long entries;  /* names in the cache right now */
+  unsigned long long coalesced; /* lookups which waited for an identical
+                                * one already under way instead of asking
+                                * the resolver themselves */
+};
+
+int dnscacheconfigure (
+/* Turn on the name cache used by timeoutgetaddrinfo(), connectbyname()
+ * and friends. The cache is keyed by node, service and hints and is off
+ * until this is called with a non-zero ttl.
+ * Return value: 0 or -1 and set errno.
+ */
+  long long ttl         /* milliseconds an answer stays fresh. 0 turns the
+                         * cache off and empties it */
+, long long negativettl /* milliseconds to remember EAI_NONAME. 0 doesn't */
+, long long maxstale    /* milliseconds past ttl that an answer may still
+                         * be served if looking it up again fails */
+, int maxentries        /* approximate size limit, 0 for none */
+);
+
+void dnscachestats (
+/* Fill in the cache counters. If reset is non-zero, zero them. */
+  struct DNSCACHESTATS *stats
+, int reset
+);
+
+void dnscacheflush (void);
+/* Empty the name cache */
+
+struct STUBRESOLVEROPTIONS {
+  const char *resolvconf;  /* NULL for /etc/resolv.conf */
+  const char *hosts;       /* NULL for /etc/hosts, "" for none */
+  const struct sockaddr *nameserver; /* ask only this server, e.g. a test
+                            * server on a loopback port. NULL to use the
+                            * nameservers in resolvconf */
+  socklen_t nameserverlen;
+  long long retry;         /* milliseconds before asking the next server.
+                            * 0 for the resolvconf timeout (5 s default) */
+};
+
+int stubresolverconfigure (
+/* Use the built-in stub resolver instead of getaddrinfo_a() in
+ * timeoutgetaddrinfo(), connectbyname() and friends. It reads
+ * resolv.conf and the hosts file now (call again to reread them) and
+ * needs no threads: A and AAAA queries go out in parallel on one UDP
+ * socket and truncated answers are asked again over TCP. NULL goes back
+ * to getaddrinfo_a().
+ * Return value: 0 or -1 and set errno.
+ */
+  const struct STUBRESOLVEROPTIONS *options
+);
+
+int stubgetaddrinfo (
+/* timeoutgetaddrinfo() with the built-in stub resolver whether or not it
+ * is turned on, reporting in *ttl (if not NULL) the lowest TTL in seconds
+ * of the records used, or 0xffffffff if the answer didn't come from DNS.
+ * AI_ADDRCONFIG is ignored.
+ */
+  const char *node
+, const char *service
+, const struct addrinfo *hints
+, struct addrinfo **res
+, long long *timeout /* milliseconds */
+, unsigned *ttl
+);
+
+/* Pluggable name lookup. A CONNECTRESOLVER answers names from wherever
+ * the caller keeps them, e.g. a service mesh's own list of backends,
+ * without getaddrinfo_a()'s threads or DNS. lookup() runs on the calling
+ * thread, so it must not block. The library adds the port from the
+ * service and builds the addrinfo list.
+ */
+#define CONNECTRESOLVER_MAXADDRESSES 32 /* most one lookup may return */
+
+struct CONNECTRESOLVER {
+  int (*lookup) (
+  /* Put name's addresses of family (AF_INET, AF_INET6 or AF_UNSPEC for
+   * both) in addresses, in the order to try them, and return how many.
+   * Ports are ignored. 0 means the name is unknown, -1 that the lookup
+   * failed (EAI_SYSTEM with errno) */
+    void *context
+  , const char *name
+  , int family
+  , struct sockaddr_storage *addresses
+  , int max
+  );
+  void *context;
+  int fallback;   /* non-zero: names it doesn't know are looked up the
+                   * usual way instead of failing with EAI_NONAME */
+};
+
+int connectresolverset (
+/* Make resolver the default for timeoutgetaddrinfo(), connectbyname() and
+ * friends, or go back to the usual lookup if it is NULL. The resolver has
+ * to stay valid until it is replaced.
+ * Return value: 0
+ */
+  const struct CONNECTRESOLVER *resolver
+);
+
+struct CONNECTRESOLVER *connectresolvermap (void);
+/* An empty in-memory resolver which connectresolvermapset() fills in, for
+ * addresses pushed by service discovery or set up by a test. NULL and
+ * errno if out of memory. */
+
+int connectresolvermapset (
+/* Give name these addresses in this order, replacing any it had. Lookups
+ * may run in other threads meanwhile.
+ * Return value: 0 or -1 and set errno (EINVAL for an address which isn't
+ * an IPv4 or IPv6 one, or a resolver which isn't a map)
+ */
+  struct CONNECTRESOLVER *map
+, const char *name
+, const char *addresses /* numeric, separated by spaces or commas. NULL
+                         * or "" forgets the name */
+);
+
+struct CONNECTRESOLVER *connectresolverhosts (
+/* A resolver answering from a file laid out like /etc/hosts, which it
+ * maps into memory. Lookups scan the mapping: no allocation, no threads,
+ * no copy of the file. To pick up changes, make a new resolver, and
+ * replace the file (rename() over it) rather than truncating it while it
+ * is mapped. NULL and errno on failure. */
+  const char *path
+);
+
+void connectresolverfree (struct CONNECTRESOLVER *resolver);
+/* Free a resolver from connectresolvermap() or connectresolverhosts().
+ * It must not be in use. */
+
+int connecthistoryconfigure (
+/* Turn on the connect history used by connectbyname(), 
+ * connectbynamestart() and connectbynames(). Each race to a name:service
+ * records the address which won, its handshake round trip time and the
+ * addresses which failed. Later races to the same name:service try the
+ * past winners first, fastest first, and the recent failures last, after
+ * any addresses the caller likes. History is off until this is called
+ * with a non-zero maxage.
+ * Return value: 0 or -1 and set errno.
+ */
+  long long maxage      /* milliseconds an outcome is remembered. 0 turns
+                         * the history off and empties it */
+, int maxentries        /* approximate number of name:service pairs to
+                         * remember, 0 for no limit */
+);
+
+void connecthistoryflush (void);
+/* Forget all connect history */
+
+int connectdeadconfigure (
+/* Turn on the process wide table of dead addresses. An address and port
+ * which fails to connect, or which is overtaken by a later attempt while
+ * still connecting, is left out of every race for backoff milliseconds,
+ * doubling with each failure in a row up to maxbackoff, unless there is
+ * nothing else to try. Then one race tries it again after its other
+ * addresses, and a connection clears it. Off until called with a non-zero
+ * backoff.
+ * Return value: 0 or -1 and set errno.
+ */
+  long long backoff     /* milliseconds. 0 turns the table off and
+                         * empties it */
+, long long maxbackoff  /* milliseconds the backoff grows to */
+);
+
+void connectdeadflush (void);
+/* Forget all dead addresses */
+
+int connectdeadquery (
+/* What the table knows about address (and port): the number of failures
+ * in a row, or 0 if it isn't dead. Then *reason, if not NULL, gets the
+ * errno of the last failure and *until, if not NULL, the time on the
+ * milliseconds() clock the backoff ends.
+ */
+  const struct sockaddr *address
+, socklen_t addresslen
+, int *reason
+, long long *until
+);
+
+/* Process-wide connect telemetry. Every connect race counts itself in a
+ * block of counters private to its thread, so the counting takes no
+ * locks and shares no cache lines. connectstats() adds the blocks up.
+ * Latencies go in log-linear histograms, HDR style: values under 16
+ * microseconds have a bucket each, and above that each power of two is
+ * split into 16 buckets, so any value is known to within 1/16th. Bucket
+ * b >= 16 holds values from (16+b%16)<<(b/16-1) up to the next bucket's.
+ */
+#define CONNECTSTATS_BUCKETS 592 /* up to 2^40 microseconds, 12 days */
+
+struct CONNECTSTATSHISTOGRAM {
+  unsigned long long count;
+  unsigned long long sum;  /* microseconds */
+  unsigned long long buckets[CONNECTSTATS_BUCKETS];
+};
+
+struct CONNECTSTATS {
+  unsigned long long races;     /* connect races run */
+  unsigned long long connected; /* races won */
+  unsigned long long winsipv4;  /* of those, won over IPv4 */
+  unsigned long long winsipv6;  /* and over IPv6 */
+  unsigned long long failures;  /* races lost because every address failed */
+  unsigned long long timeouts;  /* races which ran out of time or were
+                                 * abandoned with connectfree() */
+  unsigned long long attempts;  /* connect()s started */
+  unsigned long long cancelled; /* attempts still connecting when another
+                                 * won */
+  unsigned long long skipped;   /* addresses left out by the skip or
+                                 * dnspinning options */
+  unsigned long long deadskipped; /* left out as recently failed, see
+                                 * connectdeadconfigure() */
+  unsigned long long deadprobes; /* recently failed addresses tried again
+                                 * once their backoff was over */
+  unsigned long long parked;    /* getaddrinfo_a() requests which couldn't
+                                 * be cancelled and were put on the list
+                                 * to free once they finish */
+  unsigned long long parkednow; /* requests on that list right now */
+  struct CONNECTSTATSHISTOGRAM dns;     /* name lookup: from the call to
+                                         * the start of the race */
+  struct CONNECTSTATSHISTOGRAM connect; /* from the start of the race to
+                                         * the connection */
+};
+
+void connectstats (
+/* Add up the counters of every thread. If reset is non-zero, start
+ * counting again from zero. parkednow isn't reset.
+ */
+  struct CONNECTSTATS *stats
+, int reset
+);
+
+long long connectstatspercentile (
+/* The value, in microseconds, below which percent (0 to 100) of the
+ * values in histogram fall. -1 if it is empty.
+ */
+  const struct CONNECTSTATSHISTOGRAM *histogram
+, double percent
+);
+
+/* A destination for connectsimulate(): how its handshakes go */
+struct CONNECTSIMADDRESS {
+  int family;       /* AF_INET or AF_INET6 */
+  long long rtt;    /* microseconds a handshake takes */
+  long long jitter; /* each takes rtt plus or minus up to this, evenly */
+  double loss;      /* chance each SYN is lost, 0 to 1. 1 is a blackhole */
+  double refuse;    /* chance an attempt is refused, after one rtt */
+};
+
+struct CONNECTSIMRESULT {
+  unsigned long long races;     /* races run */
+  unsigned long long connected; /* races won */
+  unsigned long long attempts;  /* connect()s started */
+  unsigned long long wasted;    /* attempts still connecting when another
+                                 * won: handshakes the server saw for
+                                 * nothing */
+  struct CONNECTSTATSHISTOGRAM connect; /* time to connect, races won */
+};
+
+int connectsimulate (
+/* Run races connect races to count simulated addresses, in order, as
+ * connectbyaddrinfo() would with options (NULL for the defaults) and
+ * timeout milliseconds, on a virtual clock. No sockets are made. The
+ * outcome of each attempt is drawn at random from seed, so the same
+ * arguments give the same result. Returns 0 or -1 and sets errno.
+ */
+  const struct CONNECTSIMADDRESS *addresses
+, int count /* up to 256 */
+, const struct CONNECTOPTIONS *options
+, long long timeout
+, int races
+, unsigned long long seed
+, struct CONNECTSIMRESULT *result
+);
+
 int connectbyaddrinfo (
 /* given an addrinfo chain from getaddrinfo, connect a stream to any one
  * of the available addresses. Abort if not successful within timeout
@@ -94,7 +476,8 @@ int connectbyaddrinfo (
  * starting each connection attempt after a brief wait for a prior one
  * to complete and then waiting until any one completes or they all fail.
  * The wait before trying the next address scales based on the timeout but
- * is not more than 1 second and not not less than 100ms.
+ * is not more than 1 second and not not less than 100ms unless the
+ * options set other bounds or a fixed wait.
  * Return value: connected socket or -1 and set errno.
  * errno is set to the highest numbered return from connect()
  */
@@ -107,14 +490,17 @@ int connectbyname (
 /* Connect a SOCK_STREAM via any Internet protocol to name:service.
  * Abort if not successful within timeout seconds. 
  * If the name lookup is successful within the timeout, connectbyname will
- * give itself at least 1 second to attempt a connection regardless of the
- * timeout setting.
+ * give itself at least 1 second (or options->connectfloor) to attempt a
+ * connection regardless of the timeout setting.
  * If no options are required, pass NULL.
  * connectbyname parallelizes connection attempts to each address, 
  * starting each connection attempt after a brief wait for a prior one
  * to complete and then waiting until any one completes or they all fail.
+ * Addresses are tried alternating between address families as RFC 8305
+ * recommends unless the options say otherwise.
  * The wait before trying the next address scales based on the timeout but
- * is not more than 1 second and not not less than 100ms.
+ * is not more than 1 second and not not less than 100ms unless the
+ * options set other bounds or a fixed wait.
  * Return value: connected socket or -1 and set errno.
  * errno is set to the highest numbered return from connect() or to
  * EFAULT if the address lookup failed/timed out
@@ -125,14 +511,269 @@ int connectbyname (
 , struct CONNECTOPTIONS *options
 );
 
+struct CONNECTTARGET {
+  const char *name;        /* host to connect to */
+  const char *service;     /* and the service there */
+  int socket;              /* output: connected socket or -1 */
+  int error;               /* output: errno as connectbyname() sets it */
+  int getaddrinfoerror;    /* output: error from the name lookup */
+  struct addrinfo *picked; /* output: address connected to. Free with
+                            * freeaddrinfo() */
+};
+
+int connectbynames (
+/* Connect to many name:service targets at once. All the names are looked
+ * up in one getaddrinfo_a() batch and each target's staggered connect
+ * race starts as soon as its own addresses arrive. Every attempt for every
+ * target is multiplexed on one poller. The timeout applies to each target
+ * as it would to connectbyname().
+ * Return value: the number of targets connected, or -1 and set errno if
+ * the batch couldn't be started. Each target's outcome is in its output
+ * fields.
+ */
+  struct CONNECTTARGET *targets
+, int count
+, long long timeout /* milliseconds */
+);
+
+/* Event loop interface. connectbynamestart() and connectbyaddrinfostart()
+ * begin the same staggered connect race as connectbyname() and
+ * connectbyaddrinfo() but return at once. The caller waits for
+ * connectpollfd() to become readable or for connectdeadline() to pass,
+ * whichever is first, then calls connectstep(). Repeat until connectstep()
+ * returns a socket or fails with an errno other than EINPROGRESS. Then
+ * connectfree(). The options structure, if any, must remain valid until
+ * connectfree() and is filled in the same way as for connectbyname().
+ */
+struct CONNECTSTATE;
+
+struct CONNECTSTATE *connectbynamestart (
+/* Begin connecting to name:service. The name lookup runs in the
+ * background. Returns NULL and sets errno if the race can't be set up.
+ */
+  const char *name
+, const char *service
+, long long timeout /* milliseconds */
+, struct CONNECTOPTIONS *options
+);
+
+struct CONNECTSTATE *connectbyaddrinfostart (
+/* Begin connecting to any one of addresses, which must remain valid until
+ * connectfree(). Returns NULL and sets errno on failure.
+ */
+  const struct addrinfo *addresses
+, long long timeout /* milliseconds */
+, struct CONNECTOPTIONS *options
+);
+
+int connectstep (
+/* Harvest finished connect attempts and start the next one if it is due.
+ * Never blocks. Returns the connected socket, or -1 with errno set to
+ * EINPROGRESS while the race goes on, or -1 with errno set as
+ * connectbyname() would when it is lost. Once the race is over, further
+ * calls return the same result.
+ */
+  struct CONNECTSTATE *state
+);
+
+int connectpollfd (
+/* Descriptor which polls readable when connectstep() has work to do. It
+ * stays the same for the whole race. -1 if select() was requested in the
+ * options, in which case rely on connectdeadline() alone.
+ */
+  struct CONNECTSTATE *state
+);
+
+long long connectdeadline (
+/* Time, on the milliseconds() clock, by which connectstep() must be
+ * called again even if connectpollfd() hasn't become readable. With no
+ * descriptor to poll, at most 10 ms after the last connectstep().
+ */
+  struct CONNECTSTATE *state
+);
+
+void connectfree (
+/* Abandon the race if it is still going and release its resources. The
+ * connected socket, if any, belongs to the caller and stays open.
+ */
+  struct CONNECTSTATE *state
+);
+
+/* Connection pool. connectpoolget() hands out an idle socket already
+ * connected to name:service if the pool has a healthy one, and otherwise
+ * connects with connectbyname(). connectpoolput() gives it back for reuse.
+ */
+struct CONNECTPOOL;
+
+struct CONNECTPOOLOPTIONS {
+  int maxidle;             /* idle sockets kept per name:service. 0 means 8 */
+  int minidle;             /* once a name:service has been used, keep this
+                            * many idle sockets ready, connecting more in a
+                            * background thread. 0 for no background work */
+  int maxperkey;           /* limit on sockets per name:service: idle,
+                            * checked out and connecting. 0 for none */
+  long long idletimeout;   /* milliseconds before an idle socket is closed,
+                            * 0 for never */
+  long long connecttimeout;/* milliseconds for background connects. 0 means
+                            * 10 seconds */
+};
+
+struct CONNECTPOOL *connectpoolcreate (
+/* Make an empty pool. Pass NULL for the defaults.
+ * Returns NULL and sets errno on failure.
+ */
+  const struct CONNECTPOOLOPTIONS *options
+);
+
+int connectpoolget (
+/* Check out a socket connected to name:service. Idle sockets which have
+ * failed, been closed by the other end or have unread data are discarded.
+ * Arguments and return value as for connectbyname(), except that errno is
+ * EAGAIN if name:service is at maxperkey. options is only used when a new
+ * connection is made.
+ */
+  struct CONNECTPOOL *pool
+, const char *name
+, const char *service
+, long long timeout /* milliseconds */
+, struct CONNECTOPTIONS *options
+);
+
+void connectpoolput (
+/* Check a socket from connectpoolget() back in. Only put back sockets with
+ * the previous exchange complete. If the socket is no good, close it and
+ * put back -1 so that the pool knows it is gone.
+ */
+  struct CONNECTPOOL *pool
+, const char *name
+, const char *service
+, int socket
+);
+
+void connectpoolfree (
+/* Stop refilling, close the idle sockets and free the pool. Checked out
+ * sockets belong to the caller.
+ */
+  struct CONNECTPOOL *pool
+);
+
+long long milliseconds (void);
+/* Monotonic time in milliseconds, as used by connectdeadline(). The same
+ * clock as microseconds(), so it doesn't jump when the date is set */
+
+long long microseconds (void);
+/* Monotonic time in microseconds, as used by CONNECTBYNAMEDETAILS */
+
 int listenbyname (
-/* Open listener sockets for all address families supporting *service
- * and return them as a -1 terminated array. Will listen on the wildcard
- * address for all of the protocol famlies.
+/* Open a listener socket for *service and return it. It listens on the
+ * IPv6 wildcard address, which accepts IPv4 connections as well.
  */
   const char *service
 , int socktype  /* SOCK_STREAM or SOCK_SEQPACKET */
 , int backlog
 );
 
+int *listenbyname_sharded (
+/* Open count listeners for *service, like listenbyname(), all sharing the
+ * port through SO_REUSEPORT so that each worker thread can accept from
+ * its own queue. count 0 means one per online CPU. A port of "0" gets
+ * every shard the same ephemeral port. Returns a malloc()ed array of the
+ * sockets, terminated by -1, or NULL and sets errno. Close each and free()
+ * the array when done.
+ */
+  const char *service
+, int socktype  /* SOCK_STREAM or SOCK_SEQPACKET */
+, int backlog   /* for each shard */
+, int count
+, int flags     /* LISTENSHARD_... */
+);
+
+#define LISTENSHARD_CPU 1 /* hand each connection to shard number (CPU it
+                           * arrived on % count). Pin shard i's worker to
+                           * CPU i so that it never leaves that CPU */
+
+/* Accepting through io_uring: one multishot accept keeps taking
+ * connections on a listener and queues the new sockets in the ring, so
+ * a busy server makes no accept() or readiness system calls at all. On
+ * kernels without it (before Linux 5.19) the same calls use poll() and
+ * accept4().
+ */
+struct ACCEPTURING;
+
+struct ACCEPTURING *accepturingstart (
+/* Start accepting on listener, e.g. from listenbyname(). Returns NULL and
+ * sets errno on failure.
+ */
+  int listener
+);
+
+int accepturing (
+/* Next accepted socket, in non-blocking mode with close-on-exec set.
+ * Waits up to timeout milliseconds, forever if negative. Returns -1 and
+ * sets errno, to ETIMEDOUT if nothing arrived in time.
+ */
+  struct ACCEPTURING *acceptor
+, long long timeout
+);
+
+void accepturingfree (
+/* Stop accepting. Connections accepted but not yet handed out are closed.
+ * The listener stays open.
+ */
+  struct ACCEPTURING *acceptor
+);
+
+/* Accept engine. acceptorwait() waits on any number of listeners with
+ * epoll, drains each one that is ready with accept4() and hands the new
+ * sockets out in batches, each with the peer's address formatted from
+ * what accept4() returned, so there's no getpeername() or malloc() per
+ * connection. Use one acceptor per thread.
+ */
+struct ACCEPTOR;
+
+struct ACCEPTED {
+  char *buf;      /* input: where to put the peer's port and IP address as
+                   * text, laid out as getpeernametext() does it. NULL to
+                   * skip formatting. 64 bytes holds any */
+  size_t bytes;   /* input: size of buf */
+  int socket;     /* output: the new connection, in non-blocking mode with
+                   * close-on-exec set */
+  int listener;   /* output: the listener it arrived on */
+  char *address;  /* output: the peer's IP address, inside buf. NULL if
+                   * buf is */
+};
+
+struct ACCEPTOR *acceptorcreate (
+/* Watch listeners, a -1 terminated array such as listenbyname_sharded()
+ * returns, and put them in non-blocking mode. They stay the caller's.
+ * Returns NULL and sets errno on failure.
+ */
+  const int *listeners
+);
+
+int acceptorwait (
+/* Accept up to max connections into accepted[], waiting up to timeout
+ * milliseconds (forever if negative) for the first. Returns how many, 0
+ * if the time ran out, or -1 and sets errno.
+ */
+  struct ACCEPTOR *acceptor
+, struct ACCEPTED *accepted
+, int max
+, long long timeout
+);
+
+int acceptorpollfd (
+/* Descriptor which polls readable when acceptorwait() has connections to
+ * hand out without waiting, for use in an event loop. -1 if there is no
+ * epoll.
+ */
+  struct ACCEPTOR *acceptor
+);
+
+void acceptorfree (
+/* Release the acceptor. The listeners stay open.
+ */
+  struct ACCEPTOR *acceptor
+);
+
 #endif
@@ -11,7 +11,6 @@
 #include <sys/socket.h>
 
 long long milliseconds(void);
-void nbgai_cancelagain (void);
 
 void drainsocket (int socket) {
   int fcntlflags, count;
@@ -60,8 +59,6 @@ int main (int argc, char **argv) {
     } else drainsocket(socket);
   }
 
-  nbgai_cancelagain();
- 
   l = listenbyname("3000",SOCK_STREAM,10); 
   fprintf (stdout,"Listening on port 3000...\n");
   i = accept (l,NULL,NULL);
@@ -77,7 +74,6 @@ int main (int argc, char **argv) {
   shutdown (i,SHUT_RDWR);
   close (i);
   close (l);
-  nbgai_cancelagain();
   return 0;
 }
 